@@ -1,6 +1,10 @@
 #include "agent.h"
 #include "symbols.h"
 
+#include "atomics.h"
+#include "logdict.h"
+#include "threads.h"
+
 // initialize lua context
 // add needet functions for:
 // - listing processes
@@ -22,3 +26,104 @@ int agent_initialize() {
 	lua_close(lua_state);
 	return 0;
 }
+
+/* Log messages from the injected library arrive via shared memory (see
+logshm.c). A thread drains the ring, and passes the messages on to the
+agent's own logging backends. */
+
+static struct {
+	logshm_t *shm;
+	pthread_t thread;
+	bool running;
+	log_dict_reader_t dict;	// the sender's dictionary
+	msgpack_sbuffer sbuf;	// (for re-serializing messages)
+} agent_log;
+
+// logshm_read() callback, handles a single message
+static void agent_log_message(const char *data, size_t size, void *userptr) {
+	msgpack_unpacked msg;
+	msgpack_unpacked_init(&msg);
+	// (the data comes from another process, so don't trust it)
+	if (msgpack_unpack_next(&msg, data, size, NULL) == MSGPACK_UNPACK_SUCCESS
+		&& msg.data.type == MSGPACK_OBJECT_ARRAY
+		&& msg.data.via.array.size > LOG_FIELD_SERIAL
+		&& msg.data.via.array.ptr[LOG_FIELD_LEVEL].type == MSGPACK_OBJECT_POSITIVE_INTEGER
+		&& msg.data.via.array.ptr[LOG_FIELD_LEVEL].via.u64 < LOG_LEVEL_COUNT)
+	{
+		msgpack_object *member = msg.data.via.array.ptr;
+		LOG_LEVEL level = member[LOG_FIELD_LEVEL].via.u64;
+		// interned strings refer to the sender's dictionary, not ours
+		bool interned = member[LOG_FIELD_ORIGIN].type == MSGPACK_OBJECT_POSITIVE_INTEGER
+			|| (msg.data.via.array.size > LOG_FIELD_ARGS
+				&& member[LOG_FIELD_MSG].type == MSGPACK_OBJECT_POSITIVE_INTEGER);
+		log_dict_resolve(&agent_log.dict, &msg.data);
+
+		if (level == LOG_LEVEL_DICTIONARY) {
+			// (consumed by the reader)
+		} else if (interned) {
+			msgpack_packer pk;
+			msgpack_sbuffer_clear(&agent_log.sbuf);
+			msgpack_packer_init(&pk, &agent_log.sbuf, msgpack_sbuffer_write);
+			msgpack_pack_object(&pk, msg.data);
+			log_dispatch(&agent_log.sbuf, level);
+		} else {
+			msgpack_sbuffer sbuf = {
+				.size = size, .data = (char *)data, .alloc = size
+			};
+			log_dispatch(&sbuf, level);
+		}
+	}
+	msgpack_unpacked_destroy(&msg);
+}
+
+static THREAD_FUNC agent_log_thread(void *arg) {
+	while (ATOMIC_LOAD(&agent_log.running)) {
+		if (logshm_wait(agent_log.shm, 100))
+			logshm_read(agent_log.shm, agent_log_message, NULL);
+	}
+	logshm_read(agent_log.shm, agent_log_message, NULL); // (whatever is left)
+	thread_exit(0);
+}
+
+/** Create the shared memory for log messages from the injected library
+(which attaches via log_shm()), and start forwarding them to the agent's
+logging backends.
+@param name the name of the shared memory
+@param capacity the size of the ring buffer, `0` means LOGSHM_SIZE
+@returns the shared memory, or `NULL` on error
+*/
+logshm_t *agent_log_start(const char *name, size_t capacity) {
+	if (agent_log.shm) return NULL; // (already running)
+	agent_log.shm = logshm_create(name, capacity);
+	if (!agent_log.shm) return NULL;
+	log_dict_reader_init(&agent_log.dict);
+	msgpack_sbuffer_init(&agent_log.sbuf);
+	agent_log.running = true;
+	agent_log.thread = thread_start(agent_log_thread, NULL, NULL);
+	if (!agent_log.thread) {
+		error("%s: failed to start log thread", __func__);
+		agent_log.running = false;
+		logshm_close(agent_log.shm);
+		agent_log.shm = NULL;
+		log_dict_reader_done(&agent_log.dict);
+		msgpack_sbuffer_destroy(&agent_log.sbuf);
+	}
+	return agent_log.shm;
+}
+
+/// stop forwarding log messages, and release the shared memory
+void agent_log_stop(void) {
+	if (!agent_log.shm) return;
+	ATOMIC_STORE(&agent_log.running, false);
+	if (thread_wait(agent_log.thread, AGENT_LOG_STOP_MS) != 0) {
+		// The thread is stuck (e.g. in a slow backend). It might still use
+		// the mapping and the dictionary, so leave them alone - another call
+		// can try again.
+		warn("%s: log thread failed to terminate", __func__);
+		return;
+	}
+	logshm_close(agent_log.shm);
+	agent_log.shm = NULL;
+	log_dict_reader_done(&agent_log.dict);
+	msgpack_sbuffer_destroy(&agent_log.sbuf);
+}
@@ -6,9 +6,16 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#include "logshm.h"
 #include "luautils.h"
-#include "process.h"
+#include "processes.h"
 
 int agent_initialize();
 
+/// timeout (ms) for agent_log_stop() to wait for the log thread
+#define AGENT_LOG_STOP_MS	1000
+
+logshm_t *agent_log_start(const char *name, size_t capacity);
+void agent_log_stop(void);
+
 #endif
@@ -0,0 +1,104 @@
+/**
+@file atomics.h
+
+Atomic operations and a simple spinlock.
+
+These are thin wrappers around GCC's `__atomic` builtins (also available
+with MinGW), so we don't depend on C11 `<stdatomic.h>`. Unless noted
+otherwise, operations use sequentially consistent ordering; the `_ACQ`
+and `_REL` variants are meant for the usual "publish / consume" patterns
+(e.g. ring buffer indices).
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#ifndef ATOMICS_H
+#define ATOMICS_H
+
+#include "bool.h"
+
+#if _WINDOWS
+	#include <windows.h>
+	#define ATOMICS_YIELD()		Sleep(0)
+#else
+	#include <sched.h>
+	#define ATOMICS_YIELD()		sched_yield()
+#endif
+
+/// assumed size of a CPU cache line (in bytes)
+#define CACHE_LINE_SIZE		64
+/// attribute that aligns a variable (or struct member) to a cache line
+#define CACHE_ALIGNED		__attribute__((aligned(CACHE_LINE_SIZE)))
+
+/// @name atomic operations
+///@{
+#define ATOMIC_LOAD(ptr)		__atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD_ACQ(ptr)	__atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define ATOMIC_LOAD_RELAXED(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define ATOMIC_STORE(ptr, val)	__atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE_REL(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define ATOMIC_XCHG(ptr, val)	__atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+
+/// atomic increment, returns the *new* value
+#define ATOMIC_INC(ptr)			__atomic_add_fetch(ptr, 1, __ATOMIC_SEQ_CST)
+/// atomic decrement, returns the *new* value
+#define ATOMIC_DEC(ptr)			__atomic_sub_fetch(ptr, 1, __ATOMIC_SEQ_CST)
+/// atomic addition, returns the *previous* value
+#define ATOMIC_ADD(ptr, n)		__atomic_fetch_add(ptr, n, __ATOMIC_SEQ_CST)
+
+/// compare-and-swap: if `*ptr == *expected`, store `desired` and return true.
+/// Otherwise `*expected` receives the current value, and the result is false.
+#define ATOMIC_CAS(ptr, expected, desired) \
+	__atomic_compare_exchange_n(ptr, expected, desired, false, \
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+/// full memory barrier
+#define ATOMIC_FENCE()			__atomic_thread_fence(__ATOMIC_SEQ_CST)
+///@}
+
+/// hint to the CPU that we're in a spin-wait loop
+static inline void cpu_relax(void) {
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/** Back off within a spin-wait loop.
+The caller keeps a counter (initialized to 0) that gets passed on every
+iteration. We start with a few CPU "pause" hints, and give up our time slice
+after a while, to avoid starving other threads (e.g. on single-core systems).
+*/
+static inline void spin_backoff(unsigned int *spins) {
+	if (++*spins < 64)
+		cpu_relax();
+	else
+		ATOMICS_YIELD();
+}
+
+/// @name spinlock
+/// A minimal test-and-test-and-set lock, meant for short critical sections.
+///@{
+typedef volatile int spinlock_t;
+
+/// initial (unlocked) value for a spinlock_t
+#define SPINLOCK_INIT	0
+
+static inline void spin_lock(spinlock_t *lock) {
+	unsigned int spins = 0;
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		do spin_backoff(&spins); while (ATOMIC_LOAD_RELAXED(lock));
+}
+
+static inline bool spin_trylock(spinlock_t *lock) {
+	return __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+///@}
+
+#endif // ATOMICS_H
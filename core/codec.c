@@ -0,0 +1,127 @@
+/**
+@file codec.c
+
+Codecs for embedded resources: which one to use gets decided per resource
+at build time (see objwrap.lua), and is detected from the data.
+
+- gzip: best compression, the default. Decompression uses tinfl, or
+  gzip_stream_open() when the output doesn't have to be in memory at once.
+- lz4: a (much) faster decompression, at the cost of a larger binary. This
+  is the LZ4 block format, after a header with a signature (LZ4_MAGIC) and
+  the uncompressed size.
+
+Both codecs record the uncompressed size (gzip in its trailer), so
+codec_decompress() allocates the output just once.
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "codec.h"
+
+#include "resources.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static bool gzip_detect(const char *data, size_t len) {
+	return len >= 2 && is_gzipped(data);
+}
+
+const codec_t codec_gzip = {
+	"gzip", RESOURCE_GZIP, gzip_detect, gzip_size, gzip_decompress_to
+};
+
+static bool lz4_detect(const char *data, size_t len) {
+	return len >= LZ4_HEADER_SIZE && memcmp(data, LZ4_MAGIC, 4) == 0;
+}
+
+static size_t lz4_size(const char *data, size_t len) {
+	if (!lz4_detect(data, len)) return 0;
+	const uint8_t *size = (const uint8_t *)data + 4;
+	return size[0] | size[1] << 8 | size[2] << 16 | (uint32_t)size[3] << 24;
+}
+
+// read an LZ4 length extension (a sequence of bytes, up to one that isn't 255)
+static inline bool lz4_length(const uint8_t **in, const uint8_t *end, size_t *length) {
+	uint8_t byte;
+	do {
+		if (*in >= end) return false;
+		byte = *(*in)++;
+		*length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+/** Decompress an LZ4 resource into a buffer of (exactly) the uncompressed
+size, see codec_lz4.size(). This checks all bounds, so corrupt data can't
+cause reads or writes outside the buffers.
+@returns `false` on error
+*/
+bool lz4_decompress(const char *data, size_t len, char *output, size_t size) {
+	if (!lz4_detect(data, len) || lz4_size(data, len) != size) return false;
+	const uint8_t *in = (const uint8_t *)data + LZ4_HEADER_SIZE;
+	const uint8_t *in_end = (const uint8_t *)data + len;
+	uint8_t *out = (uint8_t *)output, *out_end = out + size;
+
+	while (in < in_end) {
+		// a sequence: token, literals, match offset and length
+		unsigned int token = *in++;
+		size_t length = token >> 4;
+		if (length == 15 && !lz4_length(&in, in_end, &length)) return false;
+		if (length > (size_t)(in_end - in) || length > (size_t)(out_end - out))
+			return false;
+		memcpy(out, in, length);
+		in += length;
+		out += length;
+		if (in == in_end) break; // (the last sequence has only literals)
+
+		if (in_end - in < 2) return false;
+		size_t offset = in[0] | in[1] << 8;
+		in += 2;
+		length = token & 15;
+		if (length == 15 && !lz4_length(&in, in_end, &length)) return false;
+		length += 4; // (minimum match length)
+		if (offset == 0 || offset > (size_t)(out - (uint8_t *)output)
+			|| length > (size_t)(out_end - out))
+				return false;
+		const uint8_t *match = out - offset;
+		if (offset >= length) {
+			memcpy(out, match, length);
+			out += length;
+		} else
+			while (length--) *out++ = *match++; // (overlapping, i.e. repeating)
+	}
+	return out == out_end;
+}
+
+const codec_t codec_lz4 = {
+	"lz4", RESOURCE_LZ4, lz4_detect, lz4_size, lz4_decompress
+};
+
+static const codec_t *codecs[] = { &codec_gzip, &codec_lz4 };
+
+/// returns the codec that compressed the data, or `NULL` if it isn't compressed
+const codec_t *codec_find(const char *data, size_t len) {
+	size_t i;
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+		if (codecs[i]->detect(data, len)) return codecs[i];
+	return NULL;
+}
+
+/** Decompress data to (heap) memory.
+@returns the output (you have to free() it), with *size set to its length -
+or `NULL` on error
+*/
+char *codec_decompress(const codec_t *codec, const char *data, size_t len,
+		size_t *size)
+{
+	*size = codec->size(data, len);
+	char *output = malloc(*size + 1); // (+1, so an empty output isn't NULL)
+	if (output && codec->decompress(data, len, output, *size))
+		return output;
+	free(output);
+	*size = 0;
+	return NULL;
+}
@@ -0,0 +1,37 @@
+/// @file codec.h
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "bool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// signature of LZ4-compressed resources (followed by the 32-bit size)
+#define LZ4_MAGIC			"\x1BLZ4"
+/// size of the LZ4 resource header (signature and uncompressed size)
+#define LZ4_HEADER_SIZE		8
+
+/// a (de)compression method for embedded resources, see objwrap.lua
+typedef struct {
+	const char *name;	///< the name (as objwrap.lua uses it)
+	uint32_t flag;		///< the corresponding RESOURCE_* flag, see resources.h
+	/// test if data was compressed with this codec
+	bool (*detect)(const char *data, size_t len);
+	/// return the uncompressed size (or 0 if unknown)
+	size_t (*size)(const char *data, size_t len);
+	/// decompress into a buffer of (exactly) the uncompressed size
+	bool (*decompress)(const char *data, size_t len, char *output, size_t size);
+} codec_t;
+
+extern const codec_t codec_gzip;
+extern const codec_t codec_lz4;
+
+const codec_t *codec_find(const char *data, size_t len);
+char *codec_decompress(const codec_t *codec, const char *data, size_t len,
+		size_t *size);
+
+bool lz4_decompress(const char *data, size_t len, char *output, size_t size);
+
+#endif // CODEC_H
@@ -25,19 +25,34 @@ log_stdio("stdout");
 #include "log.h"
 error("foo = %s", "bar");
 @endcode
+
+Normally the backends get invoked synchronously, by the thread that
+creates the log message. For an asynchronous alternative (delivery by a
+dedicated thread), see log_async_start() in logqueue.c.
+
+Logging is safe to use from multiple threads concurrently. The indentation
+level (see LOG_LEVEL_ENTER and LOG_LEVEL_LEAVE) is tracked per thread, and
+the message serial is a process-wide atomic counter. Each message also
+carries the ID of its thread and a per-thread sequence number, so the
+messages of a thread can be told apart (and put in order) even when they
+get interleaved with others. See LOG_FIELD_COUNT for the message format.
+
 [1]: http://msgpack.org
 */
 // TODO: support multiple backend lists?
 // or have an "active" field in the list, plus log_[en|dis]able_backend()
-// TODO: thread safety?
 
 #include "log.h"
 
+#include "atomics.h"
 #include "list.h"
+#include "logdict.h"
+#include "logqueue.h"
 #include "macro.h"
 #include "mpkutils.h"
 #include "processes.h"
 #include "strutils.h"
+#include "threads.h"
 #include "timing.h"
 #include "uthash.h"
 
@@ -50,13 +65,26 @@ typedef struct checkpoint_entry_t {
 	UT_hash_handle hh;	///< uthash handle
 } checkpoint_entry_t;
 
-// "global" (= per process) variables for the logging system
+/// number of checkpoint map "shards" (must be a power of two)
+#define CHECKPOINT_SHARDS	16
 
-static uint32_t indent_level = 0; // current indentation (level)
-static checkpoint_entry_t *checkpoints = NULL; // hashmap tracing checkpoints
-static uint32_t serial = 0; // sequential message number
+// "global" (= per process) variables for the logging system
 
-/* logging threshold.
+static THREAD_LOCAL uint32_t indent_level = 0; // current indentation (per thread)
+static uint32_t serial = 0; // sequential message number (atomic)
+static THREAD_LOCAL uint32_t sequence = 0; // sequential number (per thread)
+
+/* The checkpoints are kept in a sharded hash map: each checkpoint ID is
+assigned to one of several uthash maps (by its hash value), and each map
+has its own lock. Threads passing different checkpoints thus rarely contend
+for the same lock. */
+typedef struct {
+	spinlock_t lock;
+	checkpoint_entry_t *map;
+} checkpoint_shard_t;
+static checkpoint_shard_t checkpoints[CHECKPOINT_SHARDS];
+
+/* global logging threshold.
 Any log message with a LOG_LEVEL below this value will **not** get sent at all.
 
 The default level is LOG_LEVEL_INFO, or LOG_LEVEL_EXTRADEBUG (= all messages)
@@ -64,38 +92,210 @@ in case of DEBUG builds. Use log_set_threshold() to adjust as needed.
 */
 static LOG_LEVEL global_threshold = DEBUG ? LOG_LEVEL_EXTRADEBUG : LOG_LEVEL_INFO;
 
+/** effective logging threshold.
+This combines global_threshold with the individual backend thresholds: A
+message that no backend is interested in doesn't need to get serialized
+either. The value gets updated whenever one of these thresholds changes.
+
+@note This is exported (only) so the logging macros can test it inline,
+see LOG_ENABLED(). Treat it as read-only.
+*/
+LOG_LEVEL log_threshold = DEBUG ? LOG_LEVEL_EXTRADEBUG : LOG_LEVEL_INFO;
+
 // helper function that increments (and returns) a checkpoint's pass count
 static uint32_t checkpoint_pass_count(const char *checkpoint_id) {
 	checkpoint_entry_t *entry;
-	HASH_FIND_STR(checkpoints, checkpoint_id, entry);
+	unsigned int hashv;
+	HASH_VALUE(checkpoint_id, strlen(checkpoint_id), hashv);
+	checkpoint_shard_t *shard = &checkpoints[hashv & (CHECKPOINT_SHARDS - 1)];
+
+	spin_lock(&shard->lock);
+	HASH_FIND_STR(shard->map, checkpoint_id, entry);
 	if (!entry) {
 		// checkpoint ID not in hashmap yet, create a new entry
 		entry = calloc(1, sizeof(checkpoint_entry_t));
 		entry->id = strdup(checkpoint_id);
-		HASH_ADD_KEYPTR(hh, checkpoints, entry->id, strlen(entry->id), entry);
+		HASH_ADD_KEYPTR(hh, shard->map, entry->id, strlen(entry->id), entry);
 	}
-	return ++entry->count;
+	uint32_t result = ++entry->count;
+	spin_unlock(&shard->lock);
+	return result;
 }
 
 // clear all checkpoints (releasing the allocated memory)
 static void clear_checkpoints(void) {
 	checkpoint_entry_t *entry, *tmp;
-	HASH_ITER(hh, checkpoints, entry, tmp) {
-		//printf("freeing up checkpoint ID %s\n", entry->id);
-		free(entry->id);
-		free(entry);
+	size_t i;
+	for (i = 0; i < CHECKPOINT_SHARDS; i++) {
+		spin_lock(&checkpoints[i].lock);
+		HASH_ITER(hh, checkpoints[i].map, entry, tmp) {
+			//printf("freeing up checkpoint ID %s\n", entry->id);
+			HASH_DEL(checkpoints[i].map, entry);
+			free(entry->id);
+			free(entry);
+		}
+		spin_unlock(&checkpoints[i].lock);
 	}
 }
 
-/// the actual list of logging backends
+/* The list of logging backends is protected in a "read-copy-update" (RCU)
+fashion: Modifications of the (linked) list happen under a lock, and then
+"publish" an immutable snapshot (array copy) of it. Message delivery only
+ever reads the current snapshot, and never has to wait for a lock.
+
+Before an old snapshot (or a removed backend) may be released, writers have
+to wait for a "grace period" - until all readers that could still be using
+it are done. For this, readers register with one of two counters, selected
+by the parity of a global epoch. A writer publishes the new snapshot, then
+flips the epoch and waits for the counter of the previous epoch to drop to
+zero - twice, like "sleepable RCU" does. A reader may get delayed between
+reading the epoch and registering, and so end up counted under a parity that
+the first flip already waited for; the second flip catches it. (Any reader
+that registers later is guaranteed to see the new snapshot.)
+
+As a consequence, a backend callback must not (un)register backends itself,
+as that would wait for its own completion. Thread cancellation is deferred
+while a thread is within a read-side section: a backend may well hit a
+cancellation point (e.g. `write()`), and a cancelled reader would never
+leave its section - stalling all writers forever.
+*/
+
+/// an (immutable) array copy of the list of logging backends
+typedef struct {
+	size_t count;
+	backend_list_t entries[];
+} backend_snapshot_t;
+
+/// the actual list of logging backends (modified under backends_lock only)
 static backend_list_t *log_backends = NULL;
+static spinlock_t backends_lock = SPINLOCK_INIT;
+
+// the current snapshot, and RCU reader bookkeeping
+static backend_snapshot_t *backends_current = NULL;
+static unsigned int backends_epoch = 0;
+static int backends_readers[2] = {0, 0};
+
+// state of a reader, see backends_read_lock()
+typedef struct {
+	unsigned int epoch;
+	int cancel_state;
+} backends_reader_t;
+
+// enter RCU read-side section, returns current snapshot (may be NULL)
+static backend_snapshot_t *backends_read_lock(backends_reader_t *reader) {
+#if !_WINDOWS
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &reader->cancel_state);
+#endif
+	reader->epoch = ATOMIC_LOAD(&backends_epoch) & 1;
+	ATOMIC_INC(&backends_readers[reader->epoch]);
+	return ATOMIC_LOAD(&backends_current);
+}
+
+// leave RCU read-side section
+static void backends_read_unlock(backends_reader_t *reader) {
+	ATOMIC_DEC(&backends_readers[reader->epoch]);
+#if !_WINDOWS
+	pthread_setcancelstate(reader->cancel_state, NULL);
+#endif
+}
+
+// wait for a grace period (all readers that might use an old snapshot are
+// done), with backends_lock held
+static void backends_synchronize(void) {
+	unsigned int spins = 0;
+	int i;
+	for (i = 0; i < 2; i++) {
+		unsigned int previous = ATOMIC_ADD(&backends_epoch, 1) & 1;
+		while (ATOMIC_LOAD(&backends_readers[previous]) > 0)
+			spin_backoff(&spins);
+	}
+}
+
+// recalculate log_threshold (with backends_lock held)
+static void update_threshold(void) {
+	backend_list_t *entry;
+	// the lowest threshold of all backends, if there are any
+	LOG_LEVEL threshold = log_backends ? LOG_LEVEL_FATAL : LOG_LEVEL_EXTRADEBUG;
+	LIST_ITERATE(entry, log_backends)
+		if (entry->threshold < threshold) threshold = entry->threshold;
+	// (messages below the global threshold are suppressed regardless)
+	if (threshold < global_threshold) threshold = global_threshold;
+	ATOMIC_STORE(&log_threshold, threshold);
+}
+
+// drop `removed` from a snapshot that no reader uses anymore (matching the
+// copy by its callbacks - identical duplicates are equivalent anyway)
+static void backends_compact(backend_snapshot_t *snapshot,
+		const backend_list_t *removed)
+{
+	size_t i;
+	for (i = 0; i < snapshot->count; i++) {
+		backend_list_t *entry = &snapshot->entries[i];
+		if (entry->callback == removed->callback && entry->notify == removed->notify
+			&& entry->userptr == removed->userptr)
+		{
+			memmove(entry, entry + 1, (--snapshot->count - i) * sizeof(*entry));
+			return;
+		}
+	}
+}
+
+// publish a new snapshot of the backends list (with backends_lock held),
+// and release the old one after a grace period. Returns `false` if there's
+// no memory for the snapshot - the old one then stays in place. A removal
+// (`removed` = the entry that was deleted from the list) must take effect
+// though: in that case the old snapshot gets withdrawn, and republished
+// without the entry after the grace period.
+static bool backends_publish(const backend_list_t *removed) {
+	backend_list_t *entry;
+	size_t count;
+	backend_snapshot_t *snapshot = NULL;
+
+	LIST_COUNT(count, log_backends);
+	if (count > 0) {
+		snapshot = malloc(sizeof(backend_snapshot_t) + count * sizeof(backend_list_t));
+		if (!snapshot) {
+			if (!removed) return false;
+			// (messages dispatched meanwhile get no backends)
+			snapshot = ATOMIC_XCHG(&backends_current, NULL);
+			backends_synchronize();
+			if (snapshot) backends_compact(snapshot, removed);
+			update_threshold();
+			ATOMIC_STORE(&backends_current, snapshot);
+			return true;
+		}
+		snapshot->count = 0;
+		LIST_ITERATE(entry, log_backends)
+			snapshot->entries[snapshot->count++] = *entry;
+	}
+	update_threshold();
+	snapshot = ATOMIC_XCHG(&backends_current, snapshot);
+	backends_synchronize();
+	free(snapshot); // (release the old snapshot)
+	return true;
+}
 
 /// send "command"/notification to a specific backend
 static void log_backend_notify(backend_list_t *entry, LOG_NOTIFY reason) {
 	if (entry->notify) entry->notify(reason, entry->userptr);
 }
 
+/// send "command"/notification to all backends
+static void log_backends_notify(LOG_NOTIFY reason) {
+	backends_reader_t reader;
+	backend_snapshot_t *backends = backends_read_lock(&reader);
+	if (backends) {
+		size_t i;
+		for (i = 0; i < backends->count; i++)
+			log_backend_notify(&backends->entries[i], reason);
+	}
+	backends_read_unlock(&reader);
+}
+
 /** Add a callback function to the list of logging backends.
+This is safe to use at any time, and won't stall threads that are currently
+logging. Initially, the backend will receive all messages that pass the
+global threshold; use log_backend_set_threshold() to change that.
 
 @param callback
 function for actual logging
@@ -106,8 +306,11 @@ function for actual logging
 @param userptr
 arbitrary "user" data (pointer) that will be passed to the callbacks.
 optional, may be `NULL`
+
+@returns the new backend entry, which can be used as a "handle" to it -
+or `NULL` if out of memory
 */
-void log_register_backend(backend_callback_t *callback,
+backend_list_t *log_register_backend(backend_callback_t *callback,
 		backend_command_t *notify, void *userptr)
 {
 	backend_list_t *entry;
@@ -120,10 +323,89 @@ void log_register_backend(backend_callback_t *callback,
 
 	// create new entry and add it to the list
 	entry = malloc(sizeof(backend_list_t));
+	if (!entry) return NULL;
 	entry->callback = callback;
 	entry->notify = notify;
 	entry->userptr = userptr;
+	entry->threshold = LOG_LEVEL_EXTRADEBUG;
+	spin_lock(&backends_lock);
 	LIST_APPEND(entry, log_backends);
+	if (!backends_publish(NULL)) {
+		LIST_DELETE(entry, log_backends);
+		free(entry);
+		entry = NULL;
+	}
+	spin_unlock(&backends_lock);
+	return entry;
+}
+
+/** Set the logging threshold for a specific backend.
+The backend will only receive messages with a level of (at least)
+`threshold`. If all backends have a higher threshold than a message,
+it won't even get serialized. The backend receives a LOG_NOTIFY_SETLEVEL
+notification afterwards.
+
+@note Messages with a level above LOG_LEVEL_FATAL (e.g. scope tracking and
+check points) are always delivered, so the threshold is limited to
+LOG_LEVEL_FATAL.
+
+@param backend
+the backend, as returned by log_register_backend()
+
+@param threshold
+the lowest LOG_LEVEL to deliver to the backend
+
+@returns `false` if `backend` isn't registered (anymore), or out of memory
+*/
+bool log_backend_set_threshold(backend_list_t *backend, LOG_LEVEL threshold) {
+	backend_list_t *entry, notify;
+	if (threshold > LOG_LEVEL_FATAL) threshold = LOG_LEVEL_FATAL;
+
+	spin_lock(&backends_lock);
+	LIST_FIND(entry, log_backends, backend);
+	if (entry) {
+		LOG_LEVEL previous = entry->threshold;
+		entry->threshold = threshold;
+		if (backends_publish(NULL))
+			notify = *entry; // (copy, for notification outside the lock)
+		else {
+			entry->threshold = previous;
+			entry = NULL;
+		}
+	}
+	spin_unlock(&backends_lock);
+	if (!entry) return false;
+
+	log_backend_notify(&notify, LOG_NOTIFY_SETLEVEL);
+	return true;
+}
+
+/** Change the settings of a registered backend.
+This calls `update` with the backend's user pointer, while making sure that
+the backend doesn't get removed (and its state released) meanwhile. The
+function runs with a spinlock held, so it should be brief - and mustn't log.
+
+@param backend the backend, as returned by log_register_backend()
+@param callback the backend's callback function (identifying its type)
+@param update function to change the settings
+@param arg passed to `update`
+
+@returns `false` if `backend` isn't registered (anymore), or it uses a
+different callback
+*/
+bool log_backend_update(backend_list_t *backend, backend_callback_t *callback,
+		backend_update_t *update, void *arg)
+{
+	backend_list_t *entry;
+
+	spin_lock(&backends_lock);
+	LIST_FIND(entry, log_backends, backend);
+	if (entry && entry->callback == callback)
+		update(entry->userptr, arg);
+	else
+		entry = NULL;
+	spin_unlock(&backends_lock);
+	return entry != NULL;
 }
 
 /// Remove a callback function from the list of logging backends.
@@ -131,20 +413,34 @@ void log_register_backend(backend_callback_t *callback,
 void log_unregister_backend(backend_callback_t *callback, void *userptr) {
 	backend_list_t *entry;
 
+	spin_lock(&backends_lock);
 	// try to find callback with matching user data first
 	LIST_MATCH(entry, log_backends,
 		entry->userptr == userptr && entry->callback == callback);
-	if (!entry) {
+	if (!entry)
 		// if that failed, pick ANY matching callback (function pointer)
 		LIST_MATCH(entry, log_backends, entry->callback == callback);
-		if (!entry) return; // no match at all in the list!?
+	if (entry) {
+		LIST_DELETE(entry, log_backends);
+		backends_publish(entry);
 	}
+	spin_unlock(&backends_lock);
+	if (!entry) return; // no match at all in the list!?
 
+	// (after the grace period, nobody else is using the backend anymore)
 	log_backend_notify(entry, LOG_NOTIFY_SHUTDOWN);
-	LIST_DELETE(entry, log_backends);
 	free(entry);
 }
 
+/** Ask all backends to flush any messages they have buffered.
+E.g. batching backends (see log_register_batch_backend()) will deliver their
+pending messages. The asynchronous dispatch thread does this automatically
+whenever the message queue runs empty.
+*/
+void log_flush(void) {
+	log_backends_notify(LOG_NOTIFY_FLUSH);
+}
+
 /** Notify all the logging backends of impending shutdown.
 This is to give backends the opportunity to flush any outstanding messages,
 and to free up resources before the log system terminates.
@@ -152,20 +448,26 @@ and to free up resources before the log system terminates.
 // DONE: unregister / free up log_backends at the same time?
 void log_shutdown(void) {
 	backend_list_t *entry, *next;
-	/*
-	LIST_ITERATE(entry, log_backends)
-		log_backend_notify(entry, LOG_NOTIFY_SHUTDOWN);
-	*/
+	log_async_stop(); // (deliver any pending messages first)
 	clear_checkpoints();
-	for (entry = log_backends; entry; entry = next) {
+
+	// detach the entire list, then notify and release the entries
+	spin_lock(&backends_lock);
+	next = log_backends;
+	log_backends = NULL;
+	backends_publish(NULL); // (can't fail, there's no snapshot to allocate)
+	spin_unlock(&backends_lock);
+	while ((entry = next)) {
 		next = entry->next;
-		log_unregister_backend(entry->callback, entry->userptr);
+		log_backend_notify(entry, LOG_NOTIFY_SHUTDOWN);
+		free(entry);
 	}
 }
 
 /** Reset (internal) log system variables.
-This restores a zero indentation level, and optionally clears the checkpoint
-pass counters (if `with_checkpoints` is set).
+This restores a zero indentation level *for the calling thread* (each thread
+has its own), and optionally clears the checkpoint pass counters (if
+`with_checkpoints` is set).
 */
 void log_reset(bool with_checkpoints) {
 	indent_level = 0;
@@ -177,10 +479,21 @@ void log_reset(bool with_checkpoints) {
 
 /** Adjust the (global) logging threshold.
 Any message will a LOG_LEVEL below `threshold` will get suppressed.
+All backends receive a LOG_NOTIFY_SETLEVEL notification afterwards.
 */
 // (See global_threshold above)
 void log_set_threshold(LOG_LEVEL threshold) {
+	if (threshold > LOG_LEVEL_FATAL) threshold = LOG_LEVEL_FATAL;
+	spin_lock(&backends_lock);
 	global_threshold = threshold;
+	update_threshold();
+	spin_unlock(&backends_lock);
+	log_backends_notify(LOG_NOTIFY_SETLEVEL);
+}
+
+/// retrieve the (global) logging threshold, see log_set_threshold()
+LOG_LEVEL log_get_threshold(void) {
+	return global_threshold;
 }
 
 /* Die Aufteilung der Objekte sollte sich am tatsächlichen stream-Protokoll
@@ -210,33 +523,53 @@ void log_set_threshold(LOG_LEVEL threshold) {
  * Damit ließen sich z.b. die debug-Nachrichten wirkungsvoll unterdrücken
  * (einschließlich Serialsierung).
  */
+/* (Done: attach_log_level() checks log_threshold before serialization, and
+ * the logging macros in log.h test it inline - before evaluating any of their
+ * arguments. LOG_MIN_LEVEL removes lower levels at compile time. Backends
+ * may have individual thresholds, log_threshold respects the lowest one.)
+ */
 
 // basic logging functions (and macro wrappers)
 
-// Private helper function to process ("send") a log message. This is done
-// by passing the message (sbuffer) to each of the available backends.
-static void sbuffer_log_send(msgpack_sbuffer *sbuffer, LOG_LEVEL level) {
-	backend_list_t *entry;
-	LIST_ITERATE(entry, log_backends)
-		entry->callback(sbuffer, level, entry->userptr);
+/** Process ("send") a serialized log message.
+This is done by passing the message (sbuffer) to each of the available
+backends (that accept its level, see log_backend_set_threshold()). Normally
+you won't call this directly, it's used internally by attach_log_level()
+and the asynchronous dispatch thread.
+*/
+void log_dispatch(msgpack_sbuffer *sbuffer, LOG_LEVEL level) {
+	backends_reader_t reader;
+	backend_snapshot_t *backends = backends_read_lock(&reader);
+	if (backends) {
+		size_t i;
+		for (i = 0; i < backends->count; i++)
+			if (level >= backends->entries[i].threshold)
+				backends->entries[i].callback(sbuffer, level,
+											  backends->entries[i].userptr);
+	}
+	backends_read_unlock(&reader);
 }
 
 // Private helper function to transform (= serialize) a log "event"/message to
 // MessagePack format, and write it to the given sbuffer.
-// This is a "low-level" tool for attach_log_level() below.
+// This is a "low-level" tool for attach_log_level() below. Unless `numbered`
+// is set, the message doesn't use up a serial or sequence number (both are 0).
 static void sbuffer_log_level(msgpack_sbuffer *sbuffer, msgpack_object *attachment,
-		LOG_LEVEL level, pid_t pid, const char *origin, const char *msg, int len)
+		LOG_LEVEL level, pid_t pid, const char *origin, uint32_t origin_id,
+		const char *msg, int len, uint32_t msg_id,
+		const log_arg_t *args, size_t nargs, bool numbered)
 {
 	msgpack_packer pk;
 	// serialize values into the buffer using msgpack_sbuffer_write callback function
 	msgpack_packer_init(&pk, sbuffer, msgpack_sbuffer_write);
-	// A log message is represented by a MessagePack array (with 8 elements)
-	msgpack_pack_array(&pk, 8);
+	// A log message is represented by a MessagePack array (with 12 elements,
+	// or LOG_FIELD_COUNT if it has deferred formatting arguments)
+	msgpack_pack_array(&pk, args ? LOG_FIELD_COUNT : LOG_FIELD_ARGS);
 
 	// #1: log level / message type
 	msgpack_pack_int(&pk, level);
 
-	// #2: indentation level, automatically managed ("system wide", i.e. per process)
+	// #2: indentation level, automatically managed (per thread)
 	if (level == LOG_LEVEL_LEAVE && indent_level > 0)
 		indent_level--; // leaving scope = decrease level
 	msgpack_pack_uint32(&pk, indent_level);
@@ -244,7 +577,8 @@ static void sbuffer_log_level(msgpack_sbuffer *sbuffer, msgpack_object *attachme
 		indent_level++; // entered scope = increase level
 
 	// #3: timestamp
-	msgpack_pack_double(&pk, get_timestamp());
+	uint64_t timestamp_ns = get_timestamp_ns();
+	msgpack_pack_double(&pk, timestamp_ns / 1e9);
 
 	// #4: process ID (DWORD may be too narrow / Windows-specific?)
 	if (pid)
@@ -252,12 +586,20 @@ static void sbuffer_log_level(msgpack_sbuffer *sbuffer, msgpack_object *attachme
 	else
 		msgpack_pack_nil(&pk); // pid == 0, indicates "unused"
 
-	// #5: indicates the source, e.g. module name (optional, may be NULL)
-	msgpack_pack_string(&pk, origin);
-
-	// #6: the actual message
-	if (len < 0) len = msg ? strlen(msg) : 0;
-	msgpack_pack_lstring(&pk, msg, len);
+	// #5: indicates the source, e.g. module name (optional, may be NULL),
+	// or its dictionary ID (see logdict.c)
+	if (origin_id)
+		msgpack_pack_uint32(&pk, origin_id);
+	else
+		msgpack_pack_string(&pk, origin);
+
+	// #6: the actual message (or format string), or its dictionary ID
+	if (msg_id)
+		msgpack_pack_uint32(&pk, msg_id);
+	else {
+		if (len < 0) len = msg ? strlen(msg) : 0;
+		msgpack_pack_lstring(&pk, msg, len);
+	}
 
 	// #7: (optional) arbitrary MessagePack object "attachment"
 	msgpack_object info = {.type = MSGPACK_OBJECT_POSITIVE_INTEGER};
@@ -273,7 +615,174 @@ static void sbuffer_log_level(msgpack_sbuffer *sbuffer, msgpack_object *attachme
 		msgpack_pack_nil(&pk);
 
 	// #8: a "serial" (sequential numbering) that allows checking continuity
-	msgpack_pack_uint32(&pk, ++serial);
+	msgpack_pack_uint32(&pk, numbered ? ATOMIC_INC(&serial) : 0);
+
+	// #9: ID of the thread that created the message
+	msgpack_pack_uint32(&pk, thread_id());
+
+	// #10: format version (elements up to here are optional for readers,
+	// messages without a version are LOG_FORMAT_VERSION 1)
+	msgpack_pack_uint32(&pk, LOG_FORMAT_VERSION);
+
+	// #11: sequential number within the thread
+	msgpack_pack_uint32(&pk, numbered ? ++sequence : 0);
+
+	// #12: integer timestamp, nanoseconds since the Epoch (monotonic)
+	msgpack_pack_uint64(&pk, timestamp_ns);
+
+	// #13: (deferred formatting only) the arguments for the format string
+	if (args) {
+		msgpack_pack_array(&pk, nargs);
+		size_t i;
+		for (i = 0; i < nargs; i++)
+			switch (args[i].type) {
+			case LOG_ARG_INT:
+				msgpack_pack_int64(&pk, args[i].i);
+				break;
+			case LOG_ARG_UINT:
+				msgpack_pack_uint64(&pk, args[i].u);
+				break;
+			case LOG_ARG_DOUBLE:
+				msgpack_pack_double(&pk, args[i].d);
+				break;
+			case LOG_ARG_STRING:
+				if (args[i].s)
+					msgpack_pack_string(&pk, args[i].s);
+				else
+					msgpack_pack_nil(&pk);
+				break;
+			}
+	}
+}
+
+/* Per-thread buffers, reused for consecutive log messages. Both the message
+text (for printf-style messages) and the serialization get written to memory
+that is only ever grown, but never freed until the thread terminates. This
+avoids any heap operations for the "steady state" of logging.
+
+The buffers can't be used while a message from the same thread is still
+being processed, e.g. if a (synchronous) backend creates log messages of its
+own. Such nested calls are detected via `depth`, and use temporary memory.
+*/
+typedef struct {
+	int depth;				// nesting level of log message creation
+	bool registered;		// buffer cleanup has been set up for this thread
+	char *text;				// buffer for formatted message text
+	size_t text_size;		// (allocated size of text buffer)
+	msgpack_sbuffer sbuf;	// buffer for serialization
+} log_buffers_t;
+
+static THREAD_LOCAL log_buffers_t buffers; // (zero-initialized = empty)
+
+#define LOG_TEXT_SIZE	256 ///< initial size of the thread's text buffer
+
+/** Release the calling thread's log buffers.
+On POSIX systems, this happens automatically when a thread terminates. On
+Windows, threads that use logging should call this before they exit.
+(It's safe to continue logging afterwards; the buffers will get
+reallocated as necessary.)
+*/
+void log_thread_cleanup(void) {
+	if (buffers.depth > 0) return; // (in use, refuse to do that)
+	free(buffers.text);
+	buffers.text = NULL;
+	buffers.text_size = 0;
+	msgpack_sbuffer_destroy(&buffers.sbuf);
+	msgpack_sbuffer_init(&buffers.sbuf);
+}
+
+#if !_WINDOWS
+static pthread_key_t buffers_key;
+static pthread_once_t buffers_once = PTHREAD_ONCE_INIT;
+
+// thread exit handler (pthread key "destructor"), releases the log buffers
+static void buffers_destructor(void *ptr) {
+	log_thread_cleanup();
+	buffers.registered = false; // (the key value has been reset to NULL)
+}
+
+static void buffers_key_create(void) {
+	pthread_key_create(&buffers_key, buffers_destructor);
+}
+#endif
+
+// return the thread's (reusable) sbuffer, emptied for a new message
+static msgpack_sbuffer *log_buffers_sbuffer(void) {
+	if (!buffers.registered) {
+		buffers.registered = true;
+#if !_WINDOWS
+		// set a (non-NULL) key value, so buffers_destructor() gets called
+		pthread_once(&buffers_once, buffers_key_create);
+		pthread_setspecific(buffers_key, &buffers);
+#endif
+	}
+	msgpack_sbuffer_clear(&buffers.sbuf);
+	return &buffers.sbuf;
+}
+
+// printf-style formatting into the thread's text buffer, returns length
+// (or -1 on failure)
+static int log_buffers_format(const char *fmt, va_list ap) {
+	va_list ap_local;
+	while (true) {
+		va_copy(ap_local, ap);
+		int len = vsnprintf(buffers.text, buffers.text_size, fmt, ap_local);
+		va_end(ap_local);
+		if (len < 0) return -1;
+		if ((size_t)len < buffers.text_size) return len;
+
+		// buffer too small, grow it (to at least len + 1) and retry
+		size_t size = buffers.text_size ? buffers.text_size : LOG_TEXT_SIZE;
+		while (size <= (size_t)len) size *= 2;
+		char *text = realloc(buffers.text, size);
+		if (!text) return -1;
+		buffers.text = text;
+		buffers.text_size = size;
+	}
+}
+
+// serialize a log message, optionally with deferred formatting arguments
+// (`msg` being the format string then, which also gets interned)
+static void log_serialize_args(msgpack_sbuffer *sbuffer, msgpack_object *attachment,
+		LOG_LEVEL level, const char *origin, const char *msg, int len,
+		const log_arg_t *args, size_t nargs, bool numbered)
+{
+	// cached process ID (based on the assumption that it won't change)
+	static pid_t PID = 0;
+	if (!PID) PID = getpid();
+
+	uint32_t origin_id = 0, msg_id = 0;
+	if (log_dict_enabled()) {
+		origin_id = log_dict_intern(origin);
+		if (args) msg_id = log_dict_intern(msg);
+	}
+	sbuffer_log_level(sbuffer, attachment, level, PID, origin, origin_id,
+					  msg, len, msg_id, args, nargs, numbered);
+}
+
+/** (internal) Serialize a log message into `sbuffer`, without processing it.
+With compact encoding (see log_dict_enable()), this interns the `origin`.
+This is meant for records that backends synthesize (e.g. repeating the
+dictionary), which only some of the backends see - so they don't use up
+a serial or sequence number, but have 0 for LOG_FIELD_SERIAL and
+LOG_FIELD_SEQUENCE.
+*/
+void log_serialize(msgpack_sbuffer *sbuffer, msgpack_object *attachment,
+		LOG_LEVEL level, const char *origin, const char *msg, int len)
+{
+	log_serialize_args(sbuffer, attachment, level, origin, msg, len, NULL, 0, false);
+}
+
+// serialize a log message into sbuf, and process it
+static void log_message(msgpack_sbuffer *sbuf, msgpack_object *attachment,
+		LOG_LEVEL level, const char *origin, const char *msg, int len,
+		const log_arg_t *args, size_t nargs)
+{
+	log_serialize_args(sbuf, attachment, level, origin, msg, len, args, nargs, true);
+	//msgpack_dump(sbuf->data, sbuf->size); // dump the msgpack object
+	// process sbuffer: queue it (in asynchronous mode), or pass it to backends
+	if (!log_async_push(sbuf->data, sbuf->size, level))
+		log_dispatch(sbuf, level);
 }
 
 /** Create a simple log message with an attachment.
@@ -299,24 +808,29 @@ You can pass `len < 0`, to use `strlen(msg)` instead.
 void attach_log_level(msgpack_object *attachment, LOG_LEVEL level,
 		const char *origin, const char *msg, int len)
 {
-	if (level < global_threshold) return;
-
-	// cached process ID (based on the assumption that it won't change)
-	static pid_t PID = 0;
-	if (!PID) PID = getpid();
-
-	msgpack_sbuffer sbuf;
-	msgpack_sbuffer_init(&sbuf);
-	sbuffer_log_level(&sbuf, attachment, level, PID, origin, msg, len);
-	//msgpack_dump(sbuf.data, sbuf.size); // dump the msgpack object
-	sbuffer_log_send(&sbuf, level); // process sbuffer (pass it to backends)
-	msgpack_sbuffer_destroy(&sbuf);
+	if (level < log_threshold) return;
+
+	if (buffers.depth > 0) {
+		// nested call (e.g. from a backend), the thread's buffers are in use
+		msgpack_sbuffer sbuf;
+		msgpack_sbuffer_init(&sbuf);
+		log_message(&sbuf, attachment, level, origin, msg, len, NULL, 0);
+		msgpack_sbuffer_destroy(&sbuf);
+		return;
+	}
+	buffers.depth++;
+	log_message(log_buffers_sbuffer(), attachment, level, origin, msg, len, NULL, 0);
+	buffers.depth--;
 }
 
 /**
 printf-style creation of a log message with attachment,
 using format string and a vararg list.
 
+The message text gets formatted into a thread-local buffer, which is reused
+by subsequent log messages (and only grows when necessary). This means that
+in the "steady state" creating a log message won't allocate memory at all.
+
 @param attachment
 pointer to an arbitrary MessagePack object to 'attach'.
 The object gets serialized and transferred along with the log message.
@@ -337,10 +851,21 @@ variable argument list, see `<stdarg.h>`
 void attach_log_level_ap(msgpack_object *attachment, LOG_LEVEL level,
 		const char *origin, const char *fmt, va_list ap)
 {
-	char *msg;
-	int len = vformatmsg_len(&msg, fmt, ap);
-	attach_log_level(attachment, level, origin, msg, len);
-	free(msg);
+	if (level < log_threshold) return; // (avoid formatting the message)
+
+	if (buffers.depth > 0) {
+		// nested call, fall back to temporary (heap) memory
+		char *msg;
+		int len = vformatmsg_len(&msg, fmt, ap);
+		attach_log_level(attachment, level, origin, msg, len);
+		free(msg);
+		return;
+	}
+	buffers.depth++;
+	int len = log_buffers_format(fmt, ap);
+	log_message(log_buffers_sbuffer(), attachment, level, origin,
+				len >= 0 ? buffers.text : NULL, len >= 0 ? len : 0, NULL, 0);
+	buffers.depth--;
 }
 
 /// vararg wrapper for attach_log_level_ap()
@@ -353,6 +878,58 @@ void attach_log_level_fmt(msgpack_object *attachment, LOG_LEVEL level,
 	va_end(ap);
 }
 
+/**
+Create a log message with deferred formatting.
+
+Rather than formatting the text, this serializes the format string and its
+arguments (into LOG_FIELD_MSG and LOG_FIELD_ARGS). This is cheaper for the
+thread creating the message, formatting is left to whoever consumes the
+message - see log_format_args(). With compact encoding (log_dict_enable()),
+the format string also gets replaced by a dictionary ID.
+
+You'd normally use this via the log_level_defer() or attach_log_defer()
+macros, which capture the arguments (see LOG_ARG()).
+
+@param attachment
+pointer to an arbitrary MessagePack object to 'attach'. optional, may be `NULL`
+
+@param level
+the LOG_LEVEL to use for the message
+
+@param origin
+a string indicating the message source (e.g. module name). optional, may be `NULL`
+
+@param args
+the captured arguments, `args[0]` being the (printf-style) format string
+
+@param count
+the number of elements in `args`
+*/
+void attach_log_deferred(msgpack_object *attachment, LOG_LEVEL level,
+		const char *origin, const log_arg_t *args, size_t count)
+{
+	if (level < log_threshold) return;
+
+	const char *fmt = NULL;
+	if (count > 0) {
+		if (args[0].type == LOG_ARG_STRING) fmt = args[0].s;
+		args++;
+		count--;
+	}
+	if (buffers.depth > 0) {
+		// nested call, the thread's buffers are in use
+		msgpack_sbuffer sbuf;
+		msgpack_sbuffer_init(&sbuf);
+		log_message(&sbuf, attachment, level, origin, fmt, -1, args, count);
+		msgpack_sbuffer_destroy(&sbuf);
+		return;
+	}
+	buffers.depth++;
+	log_message(log_buffers_sbuffer(), attachment, level, origin, fmt, -1,
+				args, count);
+	buffers.depth--;
+}
+
 // utilities
 
 /// "scratchpad" message logging a key-value pair
@@ -367,8 +944,21 @@ void log_scratch(const char *origin, const char *key, const char *value) {
 const char *log_level_string(LOG_LEVEL level) {
 	static const char *level_strings[] = {
 		"XBG", "DBG", "VER", "INF", "WRN", "ERR", "FTL",
-		"IN ", "OUT", "PAU", "RES", "SEP", "CLR", "CHK", "PAD"
+		"IN ", "OUT", "PAU", "RES", "SEP", "CLR", "CHK", "PAD", "DIC"
 	};
 	if (level < lengthof(level_strings)) return level_strings[level];
 	return "???";
 }
+
+/** Determine the format version of an (unpacked) log message.
+@returns LOG_FORMAT_VERSION of the message, or `0` if `msg` isn't a valid
+log message at all
+@see LOG_FIELD_VERSION
+*/
+unsigned int log_message_version(const msgpack_object *msg) {
+	if (msg->type != MSGPACK_OBJECT_ARRAY || msg->via.array.size <= LOG_FIELD_SERIAL)
+		return 0;
+	if (msg->via.array.size <= LOG_FIELD_VERSION) return 1;
+	const msgpack_object *version = &msg->via.array.ptr[LOG_FIELD_VERSION];
+	return version->type == MSGPACK_OBJECT_POSITIVE_INTEGER ? version->via.u64 : 0;
+}
@@ -5,6 +5,7 @@
 
 #include "bool.h"
 #include "msgpack.h"
+#include <stdint.h>
 #include <stdio.h>
 
 /// logging levels ("verbosity")
@@ -24,18 +25,55 @@ typedef enum {
 	LOG_LEVEL_CLEAR,		///< may be used (if implemented) to clear a backlog / console
 	LOG_LEVEL_CHECKPOINT,	///< check point, shows ID and an automatic pass count
 	LOG_LEVEL_SCRATCHPAD,	///< arbitrary key-value pairs, presented in a viewer-specific way
+	LOG_LEVEL_DICTIONARY,	///< (internal) dictionary entry for interned strings, see logdict.c
+	LOG_LEVEL_COUNT			///< (number of log levels, not an actual level)
 } LOG_LEVEL;
 
 /// (internal) logging backend notifications
 typedef enum {
-	LOG_NOTIFY_SETLEVEL,	///< notify backends to apply new logging/verbosity level
+	/// the (global or backend) logging threshold has changed. (Backends don't
+	/// need to filter messages themselves, this is purely informational.)
+	LOG_NOTIFY_SETLEVEL,
 	LOG_NOTIFY_SHUTDOWN,	///< inform backends on removal, or log system shutdown
+	LOG_NOTIFY_FLUSH,		///< ask backends to write out buffered messages
 } LOG_NOTIFY;
 
+/** version of the log message format, see LOG_FIELD_VERSION.
+- version 1: LOG_FIELD_LEVEL .. LOG_FIELD_SERIAL (8 elements, no version field)
+- version 2: adds LOG_FIELD_TID .. LOG_FIELD_TIMESTAMP_NS
+- version 3: adds LOG_FIELD_ARGS, which is optional (only present for
+  messages with deferred formatting, see attach_log_deferred())
+
+Later versions only ever append elements, so readers of an older version
+can process newer messages (by ignoring any elements they don't know).
+*/
+#define LOG_FORMAT_VERSION	3
+
+/// indices of the elements of a (serialized) log message, which is a
+/// MessagePack array
+enum {
+	LOG_FIELD_LEVEL,		///< ::LOG_LEVEL
+	LOG_FIELD_INDENT,		///< indentation (nesting) level
+	LOG_FIELD_TIMESTAMP,	///< seconds since the Epoch (UTC)
+	LOG_FIELD_PID,			///< process ID (or nil)
+	LOG_FIELD_ORIGIN,		///< message source, e.g. module name (or dictionary ID)
+	LOG_FIELD_MSG,			///< message text (or format string, or dictionary ID)
+	LOG_FIELD_ATTACHMENT,	///< arbitrary MessagePack object (or nil)
+	LOG_FIELD_SERIAL,		///< sequential number (0 for records a backend adds, see log_serialize())
+	LOG_FIELD_TID,			///< thread ID, see thread_id()
+	LOG_FIELD_VERSION,		///< format version, see LOG_FORMAT_VERSION
+	LOG_FIELD_SEQUENCE,		///< sequential number (per thread, or 0 like LOG_FIELD_SERIAL)
+	LOG_FIELD_TIMESTAMP_NS,	///< nanoseconds since the Epoch (monotonic, integer)
+	LOG_FIELD_ARGS,			///< arguments for a format string (deferred formatting)
+	LOG_FIELD_COUNT			///< (number of elements)
+};
+
 /// prototype for a logging backend callback function
 typedef void backend_callback_t(msgpack_sbuffer *logmsg, LOG_LEVEL level, void *userptr);
 /// prototype for a logging backend "command"/notification function
 typedef void backend_command_t(LOG_NOTIFY reason, void *userptr);
+/// prototype for changing a backend's settings, see log_backend_update()
+typedef void backend_update_t(void *userptr, void *arg);
 
 /// an entry in the list of logging backends
 /// @see log_register_backend()
@@ -47,17 +85,53 @@ typedef struct {
 	/// specific to the backend in question - gets passed along on any callbacks.
 	void *userptr;
 
+	/// lowest LOG_LEVEL the backend wants to receive
+	/// @see log_backend_set_threshold()
+	LOG_LEVEL threshold;
+
 	/// @name (double-linked list management)
 	void *prev, *next;
 } backend_list_t;
 
-void log_register_backend(backend_callback_t *callback,
+backend_list_t *log_register_backend(backend_callback_t *callback,
 		backend_command_t *notify, void *userptr);
 void log_unregister_backend(backend_callback_t *callback, void *userptr);
+bool log_backend_set_threshold(backend_list_t *backend, LOG_LEVEL threshold);
+bool log_backend_update(backend_list_t *backend, backend_callback_t *callback,
+		backend_update_t *update, void *arg);
+
+extern LOG_LEVEL log_threshold;
+
+/** compile-time logging threshold.
+Log calls (via the macros below) with a level lower than this get removed
+entirely from the build. You may (pre)define `LOG_MIN_LEVEL`, e.g. with
+`-DLOG_MIN_LEVEL=LOG_LEVEL_INFO`. The default is to keep all messages.
+*/
+#ifndef LOG_MIN_LEVEL
+# define LOG_MIN_LEVEL	LOG_LEVEL_EXTRADEBUG
+#endif
+
+/** test if a message with the given `level` would get logged.
+For constant levels below LOG_MIN_LEVEL this evaluates to `0` at compile
+time, otherwise it amounts to a single comparison with the (runtime)
+log_threshold.
+*/
+#define LOG_ENABLED(level) \
+	((level) >= LOG_MIN_LEVEL && (level) >= log_threshold)
+
+/** (internal) conditionally call a logging function.
+The arguments won't get evaluated if `level` is suppressed. (Note that
+`level` itself may get evaluated more than once.)
+*/
+#define LOG_IF_ENABLED(level, call) \
+	do { if (LOG_ENABLED(level)) call; } while (0)
 
+void log_flush(void);
 void log_shutdown(void);
 void log_reset(bool with_checkpoints);
 void log_set_threshold(LOG_LEVEL threshold);
+LOG_LEVEL log_get_threshold(void);
+void log_thread_cleanup(void);
 
 /* DEPRECATED
 void log_init(const char* filename);
@@ -66,6 +140,12 @@ void log_level(LOG_LEVEL level, const char* module, const char* fmt, ...);
 */
 
 const char *log_level_string(LOG_LEVEL level);
+unsigned int log_message_version(const msgpack_object *msg);
+
+// (internal) pass a serialized message to all backends
+void log_dispatch(msgpack_sbuffer *logmsg, LOG_LEVEL level);
+void log_serialize(msgpack_sbuffer *sbuffer, msgpack_object *attachment,
+		LOG_LEVEL level, const char *origin, const char *msg, int len);
 
 /// @name 'Core' logging that all other functions/macros use
 ///@{
@@ -77,37 +157,153 @@ void attach_log_level_fmt(msgpack_object *attachment, LOG_LEVEL level,
 		const char *origin, const char *fmt, ...);
 ///@}
 
+/** @name Deferred formatting
+Instead of formatting the message text right away, these capture the format
+string and the arguments as (typed) MessagePack values. Formatting happens
+later, when a backend needs the text - or "offline", e.g. when reading a
+segment file. See log_format_args().
+
+The arguments get captured via `_Generic`, based on their C type: integers,
+floating point numbers, strings (`char *`) and other pointers (which are
+kept as integers). Strings get copied, but anything else that a pointer
+refers to won't be available when formatting. Up to LOG_DEFER_MAX arguments
+are supported.
+
+Define `LOG_DEFERRED` (before including log.h) to have all printf-style log
+macros of a module use deferred formatting.
+*/
+///@{
+
+/// maximum number of arguments for deferred formatting (format string included)
+#define LOG_DEFER_MAX	16
+
+/// a captured argument, see LOG_ARG()
+typedef struct {
+	enum {
+		LOG_ARG_INT,
+		LOG_ARG_UINT,
+		LOG_ARG_DOUBLE,
+		LOG_ARG_STRING,
+	} type;
+	union {
+		int64_t i;
+		uint64_t u;
+		double d;
+		const char *s;
+	};
+} log_arg_t;
+
+static inline log_arg_t log_arg_int(int64_t i) {
+	return (log_arg_t){.type = LOG_ARG_INT, .i = i};
+}
+static inline log_arg_t log_arg_uint(uint64_t u) {
+	return (log_arg_t){.type = LOG_ARG_UINT, .u = u};
+}
+static inline log_arg_t log_arg_double(double d) {
+	return (log_arg_t){.type = LOG_ARG_DOUBLE, .d = d};
+}
+static inline log_arg_t log_arg_string(const char *s) {
+	return (log_arg_t){.type = LOG_ARG_STRING, .s = s};
+}
+static inline log_arg_t log_arg_pointer(const void *p) {
+	return (log_arg_t){.type = LOG_ARG_UINT, .u = (uintptr_t)p};
+}
+
+/// capture a single argument (according to its type)
+#define LOG_ARG(x) _Generic((x), \
+	_Bool: log_arg_int, char: log_arg_int, signed char: log_arg_int, \
+	short: log_arg_int, int: log_arg_int, long: log_arg_int, \
+	long long: log_arg_int, \
+	unsigned char: log_arg_uint, unsigned short: log_arg_uint, \
+	unsigned int: log_arg_uint, unsigned long: log_arg_uint, \
+	unsigned long long: log_arg_uint, \
+	float: log_arg_double, double: log_arg_double, long double: log_arg_double, \
+	char *: log_arg_string, const char *: log_arg_string, \
+	default: log_arg_pointer)(x)
+
+/// (internal) helpers to count and capture the arguments
+#define LOG_NARGS(...) LOG_NARGS_(__VA_ARGS__, \
+	16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1)
+#define LOG_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, \
+	_14, _15, _16, n, ...)	n
+#define LOG_ARGS_1(x)		LOG_ARG(x)
+#define LOG_ARGS_2(x, ...)	LOG_ARG(x), LOG_ARGS_1(__VA_ARGS__)
+#define LOG_ARGS_3(x, ...)	LOG_ARG(x), LOG_ARGS_2(__VA_ARGS__)
+#define LOG_ARGS_4(x, ...)	LOG_ARG(x), LOG_ARGS_3(__VA_ARGS__)
+#define LOG_ARGS_5(x, ...)	LOG_ARG(x), LOG_ARGS_4(__VA_ARGS__)
+#define LOG_ARGS_6(x, ...)	LOG_ARG(x), LOG_ARGS_5(__VA_ARGS__)
+#define LOG_ARGS_7(x, ...)	LOG_ARG(x), LOG_ARGS_6(__VA_ARGS__)
+#define LOG_ARGS_8(x, ...)	LOG_ARG(x), LOG_ARGS_7(__VA_ARGS__)
+#define LOG_ARGS_9(x, ...)	LOG_ARG(x), LOG_ARGS_8(__VA_ARGS__)
+#define LOG_ARGS_10(x, ...)	LOG_ARG(x), LOG_ARGS_9(__VA_ARGS__)
+#define LOG_ARGS_11(x, ...)	LOG_ARG(x), LOG_ARGS_10(__VA_ARGS__)
+#define LOG_ARGS_12(x, ...)	LOG_ARG(x), LOG_ARGS_11(__VA_ARGS__)
+#define LOG_ARGS_13(x, ...)	LOG_ARG(x), LOG_ARGS_12(__VA_ARGS__)
+#define LOG_ARGS_14(x, ...)	LOG_ARG(x), LOG_ARGS_13(__VA_ARGS__)
+#define LOG_ARGS_15(x, ...)	LOG_ARG(x), LOG_ARGS_14(__VA_ARGS__)
+#define LOG_ARGS_16(x, ...)	LOG_ARG(x), LOG_ARGS_15(__VA_ARGS__)
+#define LOG_ARGS_N(n, ...)	LOG_ARGS_N_(n, __VA_ARGS__)
+#define LOG_ARGS_N_(n, ...)	LOG_ARGS_##n(__VA_ARGS__)
+
+/// (internal) capture format string and arguments, as parameters for
+/// attach_log_deferred()
+#define LOG_DEFER_ARGS(...) \
+	(const log_arg_t[]){ LOG_ARGS_N(LOG_NARGS(__VA_ARGS__), __VA_ARGS__) }, \
+	LOG_NARGS(__VA_ARGS__)
+
+void attach_log_deferred(msgpack_object *attachment, LOG_LEVEL level,
+		const char *origin, const log_arg_t *args, size_t count);
+
+#define log_level_defer(level, origin, ...) LOG_IF_ENABLED(level, \
+	attach_log_deferred(NULL, level, origin, LOG_DEFER_ARGS(__VA_ARGS__)))
+#define attach_log_defer(attach, level, origin, ...) LOG_IF_ENABLED(level, \
+	attach_log_deferred(attach, level, origin, LOG_DEFER_ARGS(__VA_ARGS__)))
+///@}
+
 /// @name Log functions not using an attachment
 ///@{
 void log_scratch(const char *origin, const char *key, const char *value);
-#define log_level(level, origin, msg) \
-	attach_log_level(NULL, level, origin, msg, -1)
-#define log_level_ap(level, origin, fmt, ap) \
-	attach_log_level_ap(NULL, level, origin, fmt, ap)
+#define log_level(level, origin, msg) LOG_IF_ENABLED(level, \
+	attach_log_level(NULL, level, origin, msg, -1))
+#define log_level_ap(level, origin, fmt, ap) LOG_IF_ENABLED(level, \
+	attach_log_level_ap(NULL, level, origin, fmt, ap))
+#ifdef LOG_DEFERRED
 #define log_level_fmt(level, origin, ...) \
-	attach_log_level_fmt(NULL, level, origin, __VA_ARGS__)
+	log_level_defer(level, origin, __VA_ARGS__)
+#else
+#define log_level_fmt(level, origin, ...) LOG_IF_ENABLED(level, \
+	attach_log_level_fmt(NULL, level, origin, __VA_ARGS__))
+#endif
 ///@}
 
 /// @name Creating messages with specific log level
 ///@{
+/// (internal) attach_log_level_fmt(), but only if `level` is enabled
+#ifdef LOG_DEFERRED
+#define attach_log_if(attach, level, origin, ...) \
+	attach_log_defer(attach, level, origin, __VA_ARGS__)
+#else
+#define attach_log_if(attach, level, origin, ...) LOG_IF_ENABLED(level, \
+	attach_log_level_fmt(attach, level, origin, __VA_ARGS__))
+#endif
 #define attach_log_extra(attach, origin, ...) \
-	attach_log_level_fmt(attach, LOG_LEVEL_EXTRADEBUG, origin, __VA_ARGS__)
+	attach_log_if(attach, LOG_LEVEL_EXTRADEBUG, origin, __VA_ARGS__)
 #define attach_log_debug(attach, origin, ...) \
-	attach_log_level_fmt(attach, LOG_LEVEL_DEBUG, origin, __VA_ARGS__)
+	attach_log_if(attach, LOG_LEVEL_DEBUG, origin, __VA_ARGS__)
 #define attach_log_verbose(attach, origin, ...) \
-	attach_log_level_fmt(attach, LOG_LEVEL_VERBOSE, origin, __VA_ARGS__)
+	attach_log_if(attach, LOG_LEVEL_VERBOSE, origin, __VA_ARGS__)
 #define attach_log_info(attach, origin, ...) \
-	attach_log_level_fmt(attach, LOG_LEVEL_INFO, origin, __VA_ARGS__)
+	attach_log_if(attach, LOG_LEVEL_INFO, origin, __VA_ARGS__)
 #define attach_log_warn(attach, origin, ...) \
-	attach_log_level_fmt(attach, LOG_LEVEL_WARNING, origin, __VA_ARGS__)
+	attach_log_if(attach, LOG_LEVEL_WARNING, origin, __VA_ARGS__)
 #define attach_log_error(attach, origin, ...) \
-	attach_log_level_fmt(attach, LOG_LEVEL_ERROR, origin, __VA_ARGS__)
+	attach_log_if(attach, LOG_LEVEL_ERROR, origin, __VA_ARGS__)
 #define attach_log_fatal(attach, origin, ...) \
-	attach_log_level_fmt(attach, LOG_LEVEL_FATAL, origin, __VA_ARGS__)
+	attach_log_if(attach, LOG_LEVEL_FATAL, origin, __VA_ARGS__)
 #define attach_log_enter(attach, origin, ...) \
-	attach_log_level_fmt(attach, LOG_LEVEL_ENTER, origin, __VA_ARGS__)
+	attach_log_if(attach, LOG_LEVEL_ENTER, origin, __VA_ARGS__)
 #define attach_log_leave(attach, origin, ...) \
-	attach_log_level_fmt(attach, LOG_LEVEL_LEAVE, origin, __VA_ARGS__)
+	attach_log_if(attach, LOG_LEVEL_LEAVE, origin, __VA_ARGS__)
 
 #define log_extra(origin, ...)	log_level_fmt(LOG_LEVEL_EXTRADEBUG, origin, __VA_ARGS__)
 #define log_debug(origin, ...)	log_level_fmt(LOG_LEVEL_DEBUG, origin, __VA_ARGS__)
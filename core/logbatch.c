@@ -0,0 +1,312 @@
+/**
+@file logbatch.c
+
+Batched delivery of log messages.
+
+A regular logging backend gets called for each individual message. For a
+backend that writes to a file, pipe or socket, this means one system call
+per message. A "batched" backend instead receives a ::log_batch_t, which
+holds many messages in one contiguous buffer - so it can write them out
+all at once (e.g. with a single `write()` or `writev()`).
+
+log_register_batch_backend() sets up a regular backend that accumulates
+the messages, and delivers them to the batch callback when one of these
+triggers fires:
+- the batch reaches a size limit (bytes or number of messages)
+- the oldest message in the batch exceeds a maximum age. This gets checked
+  when new messages arrive, and by a timer thread (that runs while there are
+  batching backends) - so a lone message doesn't stay in the batch, e.g. in
+  case the process hangs afterwards. The timer also passes LOG_NOTIFY_FLUSH
+  on to the backends regularly, so they can retry sending what they hold.
+- a message is important enough, e.g. LOG_LEVEL_ERROR or LOG_LEVEL_FATAL
+- log_flush() gets called, which also happens automatically whenever the
+  asynchronous dispatch thread runs out of messages
+- the backend gets removed (e.g. log_shutdown())
+
+The batch callback runs without holding the lock that protects the batch,
+so other threads can keep adding messages while it does (potentially slow)
+I/O. For this, a backend has two buffers: one collects the messages, while
+the other gets delivered. Only one thread delivers at a time - if another
+thread wants to flush meanwhile, the delivering thread takes care of that
+as well (so the batches stay in order).
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "logbatch.h"
+
+#include "atomics.h"
+#include "threads.h"
+#include "timing.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// the messages of a batch (frame data and index)
+typedef struct {
+	char *data;				// buffer for frame data
+	size_t size, alloc;		// used and allocated size of the buffer
+	log_frame_t *frames;	// frame index
+	size_t count, frames_alloc;
+} logbatch_buffer_t;
+
+// state of a batching backend
+typedef struct logbatch {
+	spinlock_t lock;
+	backend_batch_callback_t *callback;
+	backend_command_t *notify;
+	void *userptr;
+	log_batch_config_t config;
+
+	logbatch_buffer_t buffers[2];
+	logbatch_buffer_t *pending;	// the buffer that collects messages
+	bool delivering;		// a thread is delivering the other buffer
+	bool flush_requested;	// ... and should deliver the pending one, too
+	double first;			// time the first frame was added (see get_elapsed())
+	struct logbatch *next;	// (list of batches, see logbatch_timer)
+} logbatch_t;
+
+// The batch that the current thread is delivering. The batch callback might
+// create log messages itself, which can't be added to the same batch.
+static THREAD_LOCAL logbatch_t *flushing = NULL;
+
+// the timer thread, and the list of batches it checks
+static struct {
+	spinlock_t control;		// starting / stopping the thread
+	spinlock_t lock;		// the list (held while the thread flushes)
+	logbatch_t *batches;
+	bool running;
+	pthread_t thread;
+	thread_event_t wakeup;
+} logbatch_timer = { SPINLOCK_INIT, SPINLOCK_INIT };
+
+/* Deliver the pending frames. This gets called with batch->lock held, but
+releases it while the callback runs (and returns with the lock held again).
+If another thread is delivering, that one will take care of it.
+*/
+static void logbatch_flush(logbatch_t *batch) {
+	if (batch->pending->count == 0) return;
+	if (batch->delivering) {
+		batch->flush_requested = true;
+		return;
+	}
+	batch->delivering = true;
+	do {
+		// swap buffers, the other one is free (nobody else is delivering)
+		logbatch_buffer_t *buffer = batch->pending;
+		batch->pending = &batch->buffers[buffer == &batch->buffers[0]];
+		batch->flush_requested = false;
+		spin_unlock(&batch->lock);
+
+		log_batch_t delivery = {
+			.data = buffer->data, .size = buffer->size,
+			.frames = buffer->frames, .count = buffer->count,
+		};
+		flushing = batch;
+		batch->callback(&delivery, batch->userptr);
+		flushing = NULL;
+		buffer->size = 0;
+		buffer->count = 0;
+
+		spin_lock(&batch->lock);
+	} while (batch->flush_requested && batch->pending->count > 0);
+	batch->delivering = false;
+}
+
+// make sure the pending buffer can take a frame of the given size
+static bool logbatch_reserve(logbatch_buffer_t *buffer, size_t size) {
+	if (buffer->size + size > buffer->alloc) {
+		size_t alloc = buffer->alloc ? buffer->alloc : 4096;
+		while (alloc < buffer->size + size) alloc *= 2;
+		char *data = realloc(buffer->data, alloc);
+		if (!data) return false;
+		buffer->data = data;
+		buffer->alloc = alloc;
+	}
+	if (buffer->count >= buffer->frames_alloc) {
+		size_t alloc = buffer->frames_alloc ? buffer->frames_alloc * 2 : 64;
+		log_frame_t *frames = realloc(buffer->frames, alloc * sizeof(log_frame_t));
+		if (!frames) return false;
+		buffer->frames = frames;
+		buffer->frames_alloc = alloc;
+	}
+	return true;
+}
+
+// flush batches with frames older than their max_delay_ms
+static THREAD_FUNC logbatch_timer_thread(void *arg) {
+	while (ATOMIC_LOAD(&logbatch_timer.running)) {
+		unsigned int interval = LOGBATCH_TIMER_MAX_MS;
+		logbatch_t *batch;
+
+		spin_lock(&logbatch_timer.lock);
+		double now = get_elapsed();
+		for (batch = logbatch_timer.batches; batch; batch = batch->next) {
+			unsigned int delay = batch->config.max_delay_ms;
+			spin_lock(&batch->lock);
+			if (batch->pending->count > 0 && now - batch->first >= delay / 1e3)
+				logbatch_flush(batch);
+			spin_unlock(&batch->lock);
+			// (a backend might hold back data, e.g. for a slow receiver)
+			if (batch->notify) batch->notify(LOG_NOTIFY_FLUSH, batch->userptr);
+			if (delay < interval) interval = delay;
+		}
+		spin_unlock(&logbatch_timer.lock);
+
+		// (check twice per interval, so frames are never much older than that)
+		interval /= 2;
+		if (interval < LOGBATCH_TIMER_MIN_MS) interval = LOGBATCH_TIMER_MIN_MS;
+		thread_event_wait(&logbatch_timer.wakeup, interval);
+	}
+	thread_exit(0);
+}
+
+// add a batch to the timer's list (and start the thread if necessary)
+static void logbatch_timer_add(logbatch_t *batch) {
+	spin_lock(&logbatch_timer.control);
+	spin_lock(&logbatch_timer.lock);
+	batch->next = logbatch_timer.batches;
+	logbatch_timer.batches = batch;
+	spin_unlock(&logbatch_timer.lock);
+	if (!logbatch_timer.running) {
+		thread_event_init(&logbatch_timer.wakeup);
+		ATOMIC_STORE(&logbatch_timer.running, true);
+		logbatch_timer.thread = thread_start(logbatch_timer_thread, NULL, NULL);
+	}
+	spin_unlock(&logbatch_timer.control);
+}
+
+// remove a batch from the timer's list (and stop the thread with the last one)
+static void logbatch_timer_remove(logbatch_t *batch) {
+	logbatch_t **link;
+	spin_lock(&logbatch_timer.control);
+	spin_lock(&logbatch_timer.lock); // (the thread isn't using the batch then)
+	for (link = &logbatch_timer.batches; *link; link = &(*link)->next)
+		if (*link == batch) {
+			*link = batch->next;
+			break;
+		}
+	bool stop = logbatch_timer.batches == NULL;
+	spin_unlock(&logbatch_timer.lock);
+	if (stop && logbatch_timer.running) {
+		ATOMIC_STORE(&logbatch_timer.running, false);
+		thread_event_signal(&logbatch_timer.wakeup);
+		if (thread_wait(logbatch_timer.thread, LOGBATCH_TIMER_STOP_MS) == 0)
+			thread_event_done(&logbatch_timer.wakeup);
+		else // (stuck in a batch callback, leave the event alone)
+			warn("%s: timer thread failed to terminate", __func__);
+	}
+	spin_unlock(&logbatch_timer.control);
+}
+
+// logging backend callback, adds the message to the batch
+static void logbatch_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	logbatch_t *batch = userptr;
+	if (flushing == batch) return; // (message from within our own callback)
+
+	spin_lock(&batch->lock);
+	double now = get_elapsed();
+	if (batch->pending->count > 0
+		&& now - batch->first >= batch->config.max_delay_ms / 1e3)
+			logbatch_flush(batch); // (waited too long, deliver the old frames)
+
+	logbatch_buffer_t *buffer = batch->pending;
+	if (logbatch_reserve(buffer, logmsg->size)) {
+		if (buffer->count == 0) batch->first = now;
+		log_frame_t *frame = &buffer->frames[buffer->count++];
+		frame->offset = buffer->size;
+		frame->size = logmsg->size;
+		frame->level = level;
+		memcpy(buffer->data + buffer->size, logmsg->data, logmsg->size);
+		buffer->size += logmsg->size;
+	}
+	if (buffer->size >= batch->config.max_bytes
+		|| buffer->count >= batch->config.max_frames
+		|| (level >= batch->config.flush_level && level <= LOG_LEVEL_FATAL))
+			logbatch_flush(batch);
+	spin_unlock(&batch->lock);
+}
+
+// backend notification callback
+static void logbatch_notify(LOG_NOTIFY reason, void *userptr) {
+	logbatch_t *batch = userptr;
+	if (reason == LOG_NOTIFY_SHUTDOWN) logbatch_timer_remove(batch);
+	if ((reason == LOG_NOTIFY_FLUSH || reason == LOG_NOTIFY_SHUTDOWN)
+		&& flushing != batch)
+	{
+		// wait for another thread that might be delivering, so everything
+		// is out once this returns
+		unsigned int spins = 0;
+		spin_lock(&batch->lock);
+		while (batch->delivering) {
+			spin_unlock(&batch->lock);
+			spin_backoff(&spins);
+			spin_lock(&batch->lock);
+		}
+		logbatch_flush(batch);
+		spin_unlock(&batch->lock);
+	}
+	// pass the notification on to the actual backend
+	if (batch->notify) batch->notify(reason, batch->userptr);
+
+	if (reason == LOG_NOTIFY_SHUTDOWN) {
+		int i;
+		for (i = 0; i < 2; i++) {
+			free(batch->buffers[i].data);
+			free(batch->buffers[i].frames);
+		}
+		free(batch);
+	}
+}
+
+/** Register a "batched" logging backend.
+Messages will get collected, and then passed to the callback function as
+a ::log_batch_t. The backend may be removed with log_shutdown(), which
+delivers any pending messages first.
+
+@note Log messages that get created from within the batch callback can't be
+delivered to the same backend, and will be ignored by it. The callback may
+run on any thread that logs, or on the timer thread (see max_delay_ms).
+
+@param callback
+function that processes a batch of log messages
+
+@param notify
+(internal) notification function. optional, may be `NULL`
+
+@param userptr
+arbitrary "user" data (pointer) that will be passed to the callbacks.
+optional, may be `NULL`
+
+@param config
+settings that control the batch size, see ::log_batch_config_t.
+optional, `NULL` means LOG_BATCH_DEFAULTS
+
+@returns the backend entry, see log_register_backend()
+*/
+backend_list_t *log_register_batch_backend(backend_batch_callback_t *callback,
+		backend_command_t *notify, void *userptr,
+		const log_batch_config_t *config)
+{
+	static const log_batch_config_t defaults = LOG_BATCH_DEFAULTS;
+	logbatch_t *batch = calloc(1, sizeof(logbatch_t));
+	if (!batch) return NULL;
+
+	batch->lock = SPINLOCK_INIT;
+	batch->callback = callback;
+	batch->notify = notify;
+	batch->userptr = userptr;
+	batch->config = config ? *config : defaults;
+	batch->pending = &batch->buffers[0];
+	logbatch_timer_add(batch);
+	backend_list_t *backend =
+		log_register_backend(logbatch_callback, logbatch_notify, batch);
+	if (!backend) {
+		logbatch_timer_remove(batch);
+		free(batch);
+	}
+	return backend;
+}
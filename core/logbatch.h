@@ -0,0 +1,58 @@
+/// @file logbatch.h
+
+#ifndef LOGBATCH_H
+#define LOGBATCH_H
+
+#include "log.h"
+
+/// an entry in the index of a ::log_batch_t
+typedef struct {
+	size_t offset;		///< start of the frame within log_batch_t.data
+	size_t size;		///< size of the frame in bytes
+	LOG_LEVEL level;	///< log level of the message
+} log_frame_t;
+
+/// A batch of log messages, i.e. serialized MessagePack frames that are
+/// stored back-to-back in a contiguous buffer (plus an index).
+typedef struct {
+	const char *data;			///< concatenated frames
+	size_t size;				///< total size of the data
+	const log_frame_t *frames;	///< index of the individual frames
+	size_t count;				///< number of frames (= messages)
+} log_batch_t;
+
+/// prototype for a "batched" logging backend callback function
+typedef void backend_batch_callback_t(const log_batch_t *batch, void *userptr);
+
+/// settings that control when a batch gets delivered ("flushed")
+typedef struct {
+	size_t max_bytes;			///< flush once the batch reaches this size
+	size_t max_frames;			///< flush once the batch has this many frames
+	/// flush if the oldest frame is this old (checked by a timer thread, at
+	/// least every LOGBATCH_TIMER_MAX_MS / 2)
+	unsigned int max_delay_ms;
+	/// flush immediately on messages with (at least) this level, up to
+	/// LOG_LEVEL_FATAL
+	LOG_LEVEL flush_level;
+} log_batch_config_t;
+
+/// @name timer thread for log_batch_config_t.max_delay_ms (in ms)
+///@{
+#define LOGBATCH_TIMER_MIN_MS	5		///< shortest interval
+#define LOGBATCH_TIMER_MAX_MS	1000	///< longest interval
+#define LOGBATCH_TIMER_STOP_MS	1000	///< timeout for stopping the thread
+///@}
+
+/// default settings for log_register_batch_backend()
+#define LOG_BATCH_DEFAULTS { \
+	.max_bytes = 64 * 1024, \
+	.max_frames = 1024, \
+	.max_delay_ms = 100, \
+	.flush_level = LOG_LEVEL_ERROR, \
+}
+
+backend_list_t *log_register_batch_backend(backend_batch_callback_t *callback,
+		backend_command_t *notify, void *userptr,
+		const log_batch_config_t *config);
+
+#endif // LOGBATCH_H
@@ -0,0 +1,270 @@
+/**
+@file logdict.c
+
+Interning of log message origins, for a more compact message encoding.
+
+By default, each log message carries its origin (see LOG_FIELD_ORIGIN) as
+a string - which for the convenience macros is the source file name, often
+a path of 30 characters or more. With log_dict_enable(), origins instead
+get entered into a process-wide dictionary, and messages carry a small
+integer ID in their place.
+
+The first time an ID is used, a LOG_LEVEL_DICTIONARY record (`msg` = the
+string, attachment = the ID) gets logged before the message itself. That
+happens before any other thread gets to use the ID, so every backend sees
+the dictionary record first: a new entry is "pending" until its record has
+been logged, and meanwhile other threads simply pass the string. (The lock
+that serializes insertions isn't held while logging the record, which might
+involve I/O or waiting for the asynchronous queue.) Readers then resolve IDs:
+- backends within the process may simply use log_dict_string()
+- "offline" readers rebuild the dictionary from the records they come
+  across, see log_dict_resolve(). log_file() repeats the dictionary at the
+  start of each segment file, so segments can be processed individually.
+
+Messages with deferred formatting (see attach_log_deferred()) also get their
+format string interned, as LOG_FIELD_MSG.
+
+Interning works on the string contents, so it's fine to pass temporary
+strings (e.g. from Lua) as origin. The dictionary is limited to
+LOG_DICT_MAX entries, any further origins get passed as strings again.
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "logdict.h"
+
+#include "atomics.h"
+#include "strutils.h"
+#include "threads.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/// number of hash table slots (a power of two, larger than LOG_DICT_MAX)
+#define LOG_DICT_SLOTS	(2 * LOG_DICT_MAX)
+/// size of the per-thread cache that maps string pointers to IDs
+#define LOG_DICT_CACHE	64
+
+// a hash table slot, published by (atomically) setting `id`
+typedef struct {
+	uint32_t hash;
+	uint32_t id;		// 0 = unused
+} log_dict_slot_t;
+
+static bool dict_enabled = false;
+static spinlock_t dict_lock = SPINLOCK_INIT; // (serializes insertions)
+static uint32_t dict_count = 0;
+static msgpack_object_str dict_entries[LOG_DICT_MAX + 1]; // (index = ID)
+static bool dict_ready[LOG_DICT_MAX + 1]; // the entry's record has been logged
+static log_dict_slot_t dict_slots[LOG_DICT_SLOTS];
+
+// the thread is logging a dictionary record
+static THREAD_LOCAL bool interning = false;
+
+// string pointers that the thread has interned recently. Since the strings
+// might be temporary, a "hit" still needs to compare the contents.
+static THREAD_LOCAL struct {
+	const char *str;
+	uint32_t id;
+} dict_cache[LOG_DICT_CACHE];
+
+/// switch compact encoding (= interning of origins) on or off
+void log_dict_enable(bool enable) {
+	ATOMIC_STORE(&dict_enabled, enable);
+}
+
+/// test if compact encoding is active, see log_dict_enable()
+bool log_dict_enabled(void) {
+	return ATOMIC_LOAD_RELAXED(&dict_enabled);
+}
+
+// FNV-1a
+static uint32_t log_dict_hash(const char *str, size_t len) {
+	return hash_str_xorMul(0x811C9DC5, 0x01000193, str, len, 1);
+}
+
+// look up a string in the hash table, returns its ID (or 0 if not found)
+static uint32_t log_dict_find(const char *str, size_t len, uint32_t hash,
+		uint32_t *slot)
+{
+	uint32_t i = hash & (LOG_DICT_SLOTS - 1);
+	while (true) {
+		uint32_t id = ATOMIC_LOAD_ACQ(&dict_slots[i].id);
+		if (!id) break;
+		if (dict_slots[i].hash == hash && dict_entries[id].size == len
+			&& memcmp(dict_entries[id].ptr, str, len) == 0)
+				return id;
+		i = (i + 1) & (LOG_DICT_SLOTS - 1);
+	}
+	if (slot) *slot = i;
+	return 0;
+}
+
+/** Retrieve the dictionary ID for a string, adding it if necessary.
+Adding a new string logs a LOG_LEVEL_DICTIONARY record.
+@returns the ID, or `0` if the string can't be interned (e.g. `NULL` or
+empty string, or the dictionary is full)
+*/
+uint32_t log_dict_intern(const char *str) {
+	if (!str || !*str || interning) return 0;
+
+	// (fast path) the thread has used the same string pointer before
+	size_t index = ((uintptr_t)str >> 3) & (LOG_DICT_CACHE - 1);
+	uint32_t id = dict_cache[index].id;
+	if (id && dict_cache[index].str == str && strcmp(dict_entries[id].ptr, str) == 0)
+		return id;
+
+	size_t len = strlen(str);
+	uint32_t hash = log_dict_hash(str, len), slot;
+	id = log_dict_find(str, len, hash, NULL);
+	if (!id) {
+		bool added = false;
+		spin_lock(&dict_lock);
+		// (check again, another thread might have added it meanwhile)
+		id = log_dict_find(str, len, hash, &slot);
+		if (!id && dict_count < LOG_DICT_MAX) {
+			char *copy = malloc(len + 1);
+			if (copy) {
+				// reserve the ID, the entry is pending until it's logged
+				memcpy(copy, str, len + 1);
+				id = dict_count + 1;
+				dict_entries[id].ptr = copy;
+				dict_entries[id].size = len;
+				ATOMIC_STORE_REL(&dict_count, id);
+				dict_slots[slot].hash = hash;
+				ATOMIC_STORE_REL(&dict_slots[slot].id, id);
+				added = true;
+			}
+		}
+		spin_unlock(&dict_lock);
+		if (!id) return 0;
+
+		if (added) {
+			// log the dictionary record *before* anyone can use the ID
+			msgpack_object attachment = {
+				.type = MSGPACK_OBJECT_POSITIVE_INTEGER, .via.u64 = id
+			};
+			interning = true;
+			attach_log_level(&attachment, LOG_LEVEL_DICTIONARY, NULL,
+							 dict_entries[id].ptr, len);
+			interning = false;
+			ATOMIC_STORE_REL(&dict_ready[id], true);
+		}
+	}
+	// (another thread's entry might still be pending, use the string then)
+	if (!ATOMIC_LOAD_ACQ(&dict_ready[id])) return 0;
+	dict_cache[index].str = str;
+	dict_cache[index].id = id;
+	return id;
+}
+
+/** Retrieve the string for a dictionary ID.
+@param id the dictionary ID
+@param len receives the length of the string. optional, may be `NULL`
+@returns the (NUL-terminated) string, or `NULL` if the ID is invalid
+*/
+const char *log_dict_string(uint32_t id, size_t *len) {
+	if (id == 0 || id > ATOMIC_LOAD_ACQ(&dict_count)) return NULL;
+	if (len) *len = dict_entries[id].size;
+	return dict_entries[id].ptr;
+}
+
+/// return the current number of dictionary entries (= the highest ID)
+uint32_t log_dict_count(void) {
+	return ATOMIC_LOAD_ACQ(&dict_count);
+}
+
+/** Serialize the dictionary record for an ID (without logging it).
+This allows backends to repeat dictionary entries, e.g. log_file() at the
+start of a new segment file.
+*/
+void log_dict_record(msgpack_sbuffer *sbuf, uint32_t id) {
+	size_t len;
+	const char *str = log_dict_string(id, &len);
+	if (!str) return;
+	msgpack_object attachment = {
+		.type = MSGPACK_OBJECT_POSITIVE_INTEGER, .via.u64 = id
+	};
+	log_serialize(sbuf, &attachment, LOG_LEVEL_DICTIONARY, NULL, str, len);
+}
+
+
+/* reader side */
+
+/// initialize an (empty) reader dictionary
+void log_dict_reader_init(log_dict_reader_t *reader) {
+	reader->entries = NULL;
+	reader->alloc = 0;
+}
+
+/// release the reader dictionary
+void log_dict_reader_done(log_dict_reader_t *reader) {
+	uint32_t i;
+	for (i = 0; i < reader->alloc; i++) free((char *)reader->entries[i].ptr);
+	free(reader->entries);
+	log_dict_reader_init(reader);
+}
+
+// store a dictionary entry
+static void log_dict_reader_add(log_dict_reader_t *reader, uint32_t id,
+		const msgpack_object_str *str)
+{
+	if (id == 0 || id > LOG_DICT_MAX) return;
+	if (id >= reader->alloc) {
+		uint32_t alloc = reader->alloc ? reader->alloc : 64;
+		while (alloc <= id) alloc *= 2;
+		msgpack_object_str *entries = realloc(reader->entries,
+				alloc * sizeof(msgpack_object_str));
+		if (!entries) return;
+		memset(entries + reader->alloc, 0,
+				(alloc - reader->alloc) * sizeof(msgpack_object_str));
+		reader->entries = entries;
+		reader->alloc = alloc;
+	}
+	char *copy = malloc(str->size + 1);
+	if (!copy) return;
+	memcpy(copy, str->ptr, str->size);
+	copy[str->size] = '\0';
+	free((char *)reader->entries[id].ptr);
+	reader->entries[id].ptr = copy;
+	reader->entries[id].size = str->size;
+}
+
+// replace an ID with the corresponding string (unknown IDs become "")
+static void log_dict_reader_lookup(log_dict_reader_t *reader, msgpack_object *obj) {
+	if (obj->type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+		uint64_t id = obj->via.u64;
+		obj->type = MSGPACK_OBJECT_STR;
+		if (id < reader->alloc && reader->entries[id].ptr)
+			obj->via.str = reader->entries[id];
+		else {
+			obj->via.str.ptr = "";
+			obj->via.str.size = 0;
+		}
+	}
+}
+
+/** Process an (unpacked) log message on the reader side.
+Dictionary records get added to the reader's dictionary. For any other
+message, an origin ID (or the ID of a format string, for deferred
+formatting) gets replaced with the corresponding string (owned by the
+reader), so the message can be handled like one without interning.
+Unknown IDs become an empty string.
+*/
+void log_dict_resolve(log_dict_reader_t *reader, msgpack_object *msg) {
+	if (msg->type != MSGPACK_OBJECT_ARRAY || msg->via.array.size <= LOG_FIELD_SERIAL)
+		return;
+	msgpack_object *member = msg->via.array.ptr;
+
+	if (member[LOG_FIELD_LEVEL].via.u64 == LOG_LEVEL_DICTIONARY) {
+		if (member[LOG_FIELD_MSG].type == MSGPACK_OBJECT_STR
+			&& member[LOG_FIELD_ATTACHMENT].type == MSGPACK_OBJECT_POSITIVE_INTEGER)
+				log_dict_reader_add(reader, member[LOG_FIELD_ATTACHMENT].via.u64,
+									&member[LOG_FIELD_MSG].via.str);
+		return;
+	}
+	log_dict_reader_lookup(reader, &member[LOG_FIELD_ORIGIN]);
+	if (msg->via.array.size > LOG_FIELD_ARGS)
+		log_dict_reader_lookup(reader, &member[LOG_FIELD_MSG]);
+}
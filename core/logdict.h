@@ -0,0 +1,30 @@
+/// @file logdict.h
+
+#ifndef LOGDICT_H
+#define LOGDICT_H
+
+#include "log.h"
+
+/// maximum number of dictionary entries (further strings don't get interned)
+#define LOG_DICT_MAX	1024
+
+void log_dict_enable(bool enable);
+bool log_dict_enabled(void);
+
+uint32_t log_dict_intern(const char *str);
+const char *log_dict_string(uint32_t id, size_t *len);
+uint32_t log_dict_count(void);
+void log_dict_record(msgpack_sbuffer *sbuf, uint32_t id);
+
+/// dictionary of a reader, rebuilt from LOG_LEVEL_DICTIONARY records
+/// @see log_dict_resolve()
+typedef struct {
+	msgpack_object_str *entries;	///< strings, indexed by ID
+	uint32_t alloc;					///< (allocated number of entries)
+} log_dict_reader_t;
+
+void log_dict_reader_init(log_dict_reader_t *reader);
+void log_dict_reader_done(log_dict_reader_t *reader);
+void log_dict_resolve(log_dict_reader_t *reader, msgpack_object *msg);
+
+#endif // LOGDICT_H
@@ -0,0 +1,356 @@
+/**
+@file logfile.c
+
+Binary logging to memory-mapped segment files.
+
+Unlike logstdio.c, this backend doesn't do any formatting at all: it simply
+appends the serialized (MessagePack) log messages unchanged to a file. The
+file is preallocated and mapped into memory, so writing a message amounts to
+a `memcpy()`. Once a segment file is full, the backend "rotates" to a new
+one. Segment files are named `<basename>.<index>.mpk`, with a sequential
+index (see logfile_segment_name()).
+
+Each segment starts with a ::logfile_header_t, which keeps track of the
+number of bytes used. As the data lives in a shared file mapping, messages
+that were written will survive even if the process crashes.
+
+Use logfile_read() or logfile_replay() to process segment files "offline",
+e.g. to convert them to text with log_text().
+
+@code
+log_file("/tmp/lucciefr", 0, 8); // default segment size, keep 8 segments
+// ... log messages ...
+logfile_replay("/tmp/lucciefr.0000.mpk", stdout);
+@endcode
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "logfile.h"
+
+#include "atomics.h"
+#include "logdict.h"
+#include "logstdio.h"
+#include "utils.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if _WINDOWS
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+// state of a file logging backend
+typedef struct {
+	spinlock_t lock;
+	char *basename;
+	size_t segment_size;		// (default) size of new segments
+	unsigned int max_segments;	// number of segments to keep, 0 = unlimited
+	unsigned int index;			// index of the current segment
+	logfile_header_t *header;	// start of the current segment (mapping)
+	char *data;					// start of the current segment's frame data
+	uint64_t used;				// bytes used (= write offset within data)
+	uint64_t available;			// bytes available for frame data
+	size_t dropped;				// number of messages that couldn't be written
+#if _WINDOWS
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+} logfile_t;
+
+/** Construct the name of a segment file.
+@param buffer receives the name
+@param size size of the buffer
+@param basename base name (path) of the log files
+@param index segment number
+*/
+void logfile_segment_name(char *buffer, size_t size, const char *basename,
+		unsigned int index)
+{
+	snprintf(buffer, size, "%s.%04u.mpk", basename, index);
+}
+
+#if _WINDOWS
+// create and map the segment file, returns the mapped address (or NULL)
+static void *logfile_map(logfile_t *lf, const char *filename, size_t size) {
+	lf->file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE,
+			FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (lf->file == INVALID_HANDLE_VALUE) return NULL;
+	// (creating a mapping with the desired size also extends the file)
+	lf->mapping = CreateFileMappingA(lf->file, NULL, PAGE_READWRITE,
+			(uint64_t)size >> 32, size & 0xFFFFFFFF, NULL);
+	void *result = NULL;
+	if (lf->mapping) {
+		result = MapViewOfFile(lf->mapping, FILE_MAP_WRITE, 0, 0, size);
+		if (!result) CloseHandle(lf->mapping);
+	}
+	if (!result) CloseHandle(lf->file);
+	return result;
+}
+
+// unmap the segment, and truncate its file to the given size
+static bool logfile_unmap(logfile_t *lf, size_t size) {
+	UnmapViewOfFile(lf->header);
+	CloseHandle(lf->mapping);
+	LARGE_INTEGER offset = {.QuadPart = size};
+	bool result = SetFilePointerEx(lf->file, offset, NULL, FILE_BEGIN)
+		&& SetEndOfFile(lf->file);
+	CloseHandle(lf->file);
+	return result;
+}
+
+#else
+// create and map the segment file, returns the mapped address (or NULL)
+static void *logfile_map(logfile_t *lf, const char *filename, size_t size) {
+	lf->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (lf->fd < 0) return NULL;
+	// preallocate the file, so we won't run out of disk space while writing
+	if (posix_fallocate(lf->fd, 0, size) != 0 && ftruncate(lf->fd, size) != 0) {
+		close(lf->fd);
+		return NULL;
+	}
+	void *result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, lf->fd, 0);
+	if (result == MAP_FAILED) {
+		close(lf->fd);
+		return NULL;
+	}
+	return result;
+}
+
+// unmap the segment, and truncate its file to the given size
+static bool logfile_unmap(logfile_t *lf, size_t size) {
+	munmap(lf->header, lf->header->capacity);
+	bool result = ftruncate(lf->fd, size) == 0;
+	close(lf->fd);
+	return result;
+}
+#endif
+
+// finish the current segment (if any)
+static void logfile_close_segment(logfile_t *lf) {
+	if (lf->header) {
+		lf->header->flags |= LOGFILE_CLOSED;
+		// (Failing to truncate is okay, the file just keeps its preallocated
+		// size. Readers rely on the header's "used" field anyway.)
+		logfile_unmap(lf, lf->header->header_size + lf->used);
+		lf->header = NULL;
+		lf->data = NULL;
+	}
+}
+
+// Repeat the dictionary (see logdict.c) at the start of a segment, so the
+// segment can be read on its own. `reserve` bytes are kept available.
+static void logfile_write_dictionary(logfile_t *lf, size_t reserve) {
+	uint32_t id, count = log_dict_count();
+	if (count == 0) return;
+	msgpack_sbuffer sbuf;
+	msgpack_sbuffer_init(&sbuf);
+	for (id = 1; id <= count; id++) {
+		msgpack_sbuffer_clear(&sbuf);
+		log_dict_record(&sbuf, id);
+		if (lf->used + sbuf.size + reserve > lf->available) break;
+		memcpy(lf->data + lf->used, sbuf.data, sbuf.size);
+		lf->used += sbuf.size;
+	}
+	msgpack_sbuffer_destroy(&sbuf);
+	ATOMIC_STORE_REL(&lf->header->used, lf->used);
+}
+
+// create a new segment, able to hold (at least) `size` bytes of frame data
+static bool logfile_open_segment(logfile_t *lf, unsigned int index, size_t size) {
+	char filename[FILENAME_MAX];
+	size_t capacity = lf->segment_size;
+	if (capacity < sizeof(logfile_header_t) + size)
+		capacity = sizeof(logfile_header_t) + size; // (oversized message)
+
+	logfile_segment_name(filename, sizeof(filename), lf->basename, index);
+	logfile_header_t *header = logfile_map(lf, filename, capacity);
+	if (!header) return false;
+
+	memset(header, 0, sizeof(logfile_header_t));
+	strcpy(header->magic, LOGFILE_MAGIC);
+	header->version = LOGFILE_VERSION;
+	header->header_size = sizeof(logfile_header_t);
+	header->capacity = capacity;
+	header->index = index;
+
+	lf->header = header;
+	lf->data = (char *)header + sizeof(logfile_header_t);
+	lf->used = 0;
+	lf->available = capacity - sizeof(logfile_header_t);
+	lf->index = index;
+	logfile_write_dictionary(lf, size);
+
+	// remove segments that exceed the maximum number
+	if (lf->max_segments && index >= lf->max_segments) {
+		logfile_segment_name(filename, sizeof(filename), lf->basename,
+							 index - lf->max_segments);
+		remove(filename);
+	}
+	return true;
+}
+
+// logging backend callback (append message to the segment file)
+// Note: This must not create log messages itself, as it holds the lock.
+static void logfile_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	logfile_t *lf = userptr;
+	spin_lock(&lf->lock);
+	if (lf->used + logmsg->size > lf->available) {
+		// segment is full, rotate to a new one
+		unsigned int next = lf->header ? lf->index + 1 : lf->index;
+		logfile_close_segment(lf);
+		logfile_open_segment(lf, next, logmsg->size);
+	}
+	if (lf->header) {
+		memcpy(lf->data + lf->used, logmsg->data, logmsg->size);
+		lf->used += logmsg->size;
+		// publish the new size (a reader may be watching the file)
+		ATOMIC_STORE_REL(&lf->header->used, lf->used);
+	} else
+		lf->dropped++; // (failed to open segment)
+	spin_unlock(&lf->lock);
+}
+
+// backend notification callback
+static void logfile_notify(LOG_NOTIFY reason, void *userptr) {
+	logfile_t *lf = userptr;
+	if (reason == LOG_NOTIFY_SHUTDOWN) {
+		logfile_close_segment(lf);
+		free(lf->basename);
+		free(lf);
+	}
+}
+
+/** Initialize binary file logging.
+This creates the first segment file, and registers a backend that appends
+all log messages (in their serialized MessagePack form) to it.
+
+@param basename
+The base name for segment files, which will get `.<index>.mpk` appended.
+The function starts with the first index not used by an existing file.
+
+@param segment_size
+The size of each segment file (in bytes). Pass `0` to use the default,
+LOGFILE_SEGMENT_SIZE.
+
+@param max_segments
+The maximum number of segments to keep. Older segment files get removed
+when rotating to a new one. `0` means "unlimited".
+
+@returns the backend entry (see log_register_backend()), or `NULL` if the
+file couldn't be created
+*/
+backend_list_t *log_file(const char *basename, size_t segment_size,
+		unsigned int max_segments)
+{
+	char filename[FILENAME_MAX];
+	logfile_t *lf = calloc(1, sizeof(logfile_t));
+	if (!lf) return NULL;
+
+	lf->lock = SPINLOCK_INIT;
+	lf->basename = strdup(basename);
+	lf->segment_size = segment_size ? segment_size : LOGFILE_SEGMENT_SIZE;
+	lf->max_segments = max_segments;
+	// skip existing segment files, e.g. from a previous session
+	while (true) {
+		logfile_segment_name(filename, sizeof(filename), basename, lf->index);
+		if (!file_exists(filename)) break;
+		lf->index++;
+	}
+
+	if (!lf->basename || !logfile_open_segment(lf, lf->index, 0)) {
+		error("%s: failed to create '%s'", __func__, filename);
+		free(lf->basename);
+		free(lf);
+		return NULL;
+	}
+	return log_register_backend(logfile_callback, logfile_notify, lf);
+}
+
+/** Read the log messages from a segment file.
+This will deserialize each message, and pass it to the callback function.
+Interned origins (see logdict.c) get resolved to strings, the callback also
+receives the LOG_LEVEL_DICTIONARY records themselves.
+
+@param filename
+the name of a segment file (see logfile_segment_name())
+
+@param callback
+a function that gets called for each message (may be `NULL`)
+
+@param userptr
+arbitrary value, passed on to the callback
+
+@returns the number of messages read, or -1 on error (e.g. invalid file)
+*/
+int logfile_read(const char *filename, logfile_read_callback_t *callback,
+		void *userptr)
+{
+	FILE *file = fopen(filename, "rb");
+	if (!file) return -1;
+
+	int result = -1;
+	char *data = NULL;
+	logfile_header_t header;
+	// (the header may be corrupt, so check its sizes against the actual file)
+	long file_size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+	if (file_size >= (long)sizeof(header)
+		&& fseek(file, 0, SEEK_SET) == 0
+		&& fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(header.magic, LOGFILE_MAGIC, sizeof(LOGFILE_MAGIC)) == 0
+		&& header.version == LOGFILE_VERSION
+		&& header.header_size >= sizeof(header)
+		&& header.header_size <= (uint64_t)file_size
+		&& header.header_size <= header.capacity
+		&& header.used <= header.capacity - header.header_size
+		&& header.used <= (uint64_t)file_size - header.header_size
+		&& fseek(file, header.header_size, SEEK_SET) == 0
+		&& (data = malloc(header.used + 1))
+		&& fread(data, 1, header.used, file) == header.used)
+	{
+		msgpack_unpacked msg;
+		msgpack_unpacked_init(&msg);
+		log_dict_reader_t dict;
+		log_dict_reader_init(&dict);
+		size_t offset = 0;
+		result = 0;
+		while (msgpack_unpack_next(&msg, data, header.used, &offset)
+				== MSGPACK_UNPACK_SUCCESS) {
+			if (msg.data.type == MSGPACK_OBJECT_ARRAY
+				&& msg.data.via.array.size >= 8 && callback)
+			{
+				log_dict_resolve(&dict, &msg.data);
+				callback(&msg.data, userptr);
+			}
+			result++;
+		}
+		log_dict_reader_done(&dict);
+		msgpack_unpacked_destroy(&msg);
+	}
+	free(data);
+	fclose(file);
+	return result;
+}
+
+// callback for logfile_replay()
+static void logfile_replay_callback(msgpack_object *msg, void *userptr) {
+	log_text(userptr, msg);
+}
+
+/** Replay a segment file in text form.
+The log messages get written to `stream`, using log_text().
+@returns the number of messages, or -1 on error
+*/
+int logfile_replay(const char *filename, FILE *stream) {
+	return logfile_read(filename, logfile_replay_callback, stream);
+}
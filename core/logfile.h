@@ -0,0 +1,47 @@
+/// @file logfile.h
+
+#ifndef LOGFILE_H
+#define LOGFILE_H
+
+#include "log.h"
+
+#include <stdint.h>
+
+/// "magic" signature at the start of each segment file
+#define LOGFILE_MAGIC		"LCFRLOG"
+/// version of the segment file format
+#define LOGFILE_VERSION		1
+/// default segment size (bytes) for log_file()
+#define LOGFILE_SEGMENT_SIZE	(4 * 1024 * 1024)
+
+/// segment header flag: the segment was closed properly
+#define LOGFILE_CLOSED		1
+
+/** The header of a log segment file.
+It's followed by the raw MessagePack frames (log messages), exactly as they
+were passed to the backend. The file gets preallocated to `capacity` bytes,
+and `used` tells how many bytes of frame data (after the header) are valid.
+*/
+typedef struct {
+	char magic[8];			///< LOGFILE_MAGIC (NUL-terminated)
+	uint32_t version;		///< LOGFILE_VERSION
+	uint32_t header_size;	///< offset of the first frame within the file
+	uint64_t capacity;		///< (preallocated) size of the segment file
+	uint64_t used;			///< number of bytes used by frames
+	uint32_t index;			///< sequential number of the segment
+	uint32_t flags;			///< e.g. LOGFILE_CLOSED
+} logfile_header_t;
+
+/// prototype for a callback that receives log messages read from a segment
+typedef void logfile_read_callback_t(msgpack_object *msg, void *userptr);
+
+backend_list_t *log_file(const char *basename, size_t segment_size,
+		unsigned int max_segments);
+
+void logfile_segment_name(char *buffer, size_t size, const char *basename,
+		unsigned int index);
+int logfile_read(const char *filename, logfile_read_callback_t *callback,
+		void *userptr);
+int logfile_replay(const char *filename, FILE *stream);
+
+#endif // LOGFILE_H
@@ -0,0 +1,304 @@
+/**
+@file logformat.c
+
+Formatting of log messages that were created with deferred formatting (see
+attach_log_deferred()). Such messages carry a printf-style format string in
+place of the message text, and the arguments as MessagePack values (see
+LOG_FIELD_ARGS).
+
+log_format_args() interprets the format string the way `printf()` would,
+but takes each argument from the MessagePack data - integers as 64-bit
+values, floating point numbers as `double`, strings with an explicit length.
+Length modifiers in the format string are therefore irrelevant, and get
+ignored. An argument whose type doesn't fit the conversion gets converted
+where possible (e.g. a float for `%d`), or printed as it is (a string for
+`%d`). Conversions without a corresponding argument are copied to the
+output verbatim, and `%n` never writes anything.
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "logformat.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// (digits beyond this limit for field width or precision get ignored)
+#define LOG_FORMAT_WIDTH_MAX	100000
+
+// output state, with snprintf() semantics
+typedef struct {
+	char *buf;
+	size_t size;
+	size_t len;		// (total length, may exceed size)
+} fmt_out_t;
+
+static void out_append(fmt_out_t *out, const char *str, size_t len) {
+	if (out->len < out->size) {
+		size_t avail = out->size - out->len - 1; // (reserve NUL)
+		memcpy(out->buf + out->len, str, len < avail ? len : avail);
+	}
+	out->len += len;
+}
+
+static void out_printf(fmt_out_t *out, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	int len = out->len < out->size
+		? vsnprintf(out->buf + out->len, out->size - out->len, fmt, ap)
+		: vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len > 0) out->len += len;
+}
+
+/** Set up arguments from an (unpacked) LOG_FIELD_ARGS element.
+@returns `false` if the object isn't an array
+*/
+bool log_args_from_object(log_args_t *args, const msgpack_object *array) {
+	args->count = 0;
+	if (array->type != MSGPACK_OBJECT_ARRAY) return false;
+	args->objects = array->via.array.ptr;
+	args->count = array->via.array.size;
+	return true;
+}
+
+/** Set up arguments from serialized data, with `cursor` positioned at the
+LOG_FIELD_ARGS element. The cursor advances past the element.
+@returns `false` if the data isn't an array, or is malformed
+*/
+bool log_args_from_cursor(log_args_t *args, msgpack_cursor_t *cursor) {
+	msgpack_object array;
+	args->objects = NULL;
+	args->count = 0;
+	args->cursor = *cursor;
+	if (!msgpack_read_item(&args->cursor, &array)
+		|| array.type != MSGPACK_OBJECT_ARRAY
+		|| !msgpack_skip_item(cursor))
+			return false;
+	args->count = array.via.array.size;
+	return true;
+}
+
+// retrieve the next argument, returns `false` if there is none
+static bool log_args_next(log_args_t *args, msgpack_object *arg) {
+	if (args->count == 0) return false;
+	args->count--;
+	if (args->objects) {
+		*arg = *args->objects++;
+		return true;
+	}
+	msgpack_cursor_t start = args->cursor;
+	if (!msgpack_read_item(&args->cursor, arg)) {
+		args->count = 0;
+		return false;
+	}
+	if (arg->type == MSGPACK_OBJECT_ARRAY || arg->type == MSGPACK_OBJECT_MAP) {
+		// (not a valid argument, skip its contents)
+		args->cursor = start;
+		if (!msgpack_skip_item(&args->cursor)) args->count = 0;
+		arg->type = MSGPACK_OBJECT_NIL;
+	}
+	return true;
+}
+
+// numeric value of an argument (for conversions that expect an integer)
+static int64_t arg_int(const msgpack_object *arg) {
+	switch (arg->type) {
+	case MSGPACK_OBJECT_POSITIVE_INTEGER:
+	case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+		return arg->via.i64;
+	case MSGPACK_OBJECT_FLOAT:
+		return (int64_t)arg->via.f64;
+	case MSGPACK_OBJECT_BOOLEAN:
+		return arg->via.boolean;
+	default:
+		return 0;
+	}
+}
+
+// a field width or precision argument (limited to a sensible range)
+static int arg_clamp(const msgpack_object *arg) {
+	int64_t value = arg_int(arg);
+	if (value > LOG_FORMAT_WIDTH_MAX) return LOG_FORMAT_WIDTH_MAX;
+	if (value < -LOG_FORMAT_WIDTH_MAX) return -LOG_FORMAT_WIDTH_MAX;
+	return value;
+}
+
+// numeric value of an argument (for floating point conversions)
+static double arg_double(const msgpack_object *arg) {
+	switch (arg->type) {
+	case MSGPACK_OBJECT_POSITIVE_INTEGER:
+		return arg->via.u64;
+	case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+		return arg->via.i64;
+	case MSGPACK_OBJECT_FLOAT:
+		return arg->via.f64;
+	case MSGPACK_OBJECT_BOOLEAN:
+		return arg->via.boolean;
+	default:
+		return 0;
+	}
+}
+
+/** Format a message with deferred formatting.
+@param buf output buffer (may be `NULL` if `size` is 0)
+@param size size of the output buffer
+@param fmt the printf-style format string (LOG_FIELD_MSG)
+@param fmt_len the length of the format string
+@param args the arguments, see log_args_from_object() and log_args_from_cursor()
+@returns the length of the formatted text (excluding the terminating NUL).
+Like with `snprintf()`, a result `>= size` means that the output got
+truncated.
+*/
+int log_format_args(char *buf, size_t size,
+		const char *fmt, size_t fmt_len, log_args_t args)
+{
+	fmt_out_t out = { .buf = buf, .size = size, .len = 0 };
+	const char *end = fmt + fmt_len;
+	msgpack_object arg;
+
+	while (fmt < end) {
+		const char *percent = memchr(fmt, '%', end - fmt);
+		if (!percent) percent = end;
+		out_append(&out, fmt, percent - fmt);
+		if (percent == end) break;
+
+		// parse the conversion specification
+		const char *p = percent + 1;
+		char spec[48] = "%";
+		size_t n = 1;
+		while (p < end && *p && strchr("-+ #0'", *p)) {
+			if (n < 8) spec[n++] = *p;
+			p++;
+		}
+		if (p < end && *p == '*') {
+			p++;
+			int width = log_args_next(&args, &arg) ? arg_clamp(&arg) : 0;
+			if (width != 0)
+				n += snprintf(spec + n, sizeof(spec) - n, "%d", width);
+		} else {
+			int width = 0;
+			while (p < end && *p >= '0' && *p <= '9')
+				if (width < LOG_FORMAT_WIDTH_MAX) width = width * 10 + (*p++ - '0');
+				else p++;
+			if (width > 0)
+				n += snprintf(spec + n, sizeof(spec) - n, "%d", width);
+		}
+		int precision = -1;
+		if (p < end && *p == '.') {
+			p++;
+			if (p < end && *p == '*') {
+				p++;
+				if (log_args_next(&args, &arg)) precision = arg_clamp(&arg);
+			} else {
+				precision = 0;
+				while (p < end && *p >= '0' && *p <= '9')
+					if (precision < LOG_FORMAT_WIDTH_MAX)
+						precision = precision * 10 + (*p++ - '0');
+					else p++;
+			}
+		}
+		while (p < end && *p && strchr("hljztLq", *p)) p++; // (ignore length modifiers)
+		if (p == end) { // incomplete specification
+			out_append(&out, percent, end - percent);
+			break;
+		}
+		char conversion = *p++;
+		fmt = p;
+		if (conversion == '%') {
+			out_append(&out, "%", 1);
+			continue;
+		}
+		if (!conversion || !strchr("diouxXcsaAeEfFgGpn", conversion)) { // unknown conversion
+			out_append(&out, percent, p - percent);
+			continue;
+		}
+		if (!log_args_next(&args, &arg)) { // missing argument
+			out_append(&out, percent, p - percent);
+			continue;
+		}
+		if (conversion == 'n') continue;
+
+		// strings (and nil) get printed as such, regardless of the conversion
+		if (arg.type == MSGPACK_OBJECT_STR || arg.type == MSGPACK_OBJECT_NIL) {
+			const char *str = arg.type == MSGPACK_OBJECT_STR ? arg.via.str.ptr : "(null)";
+			int len = arg.type == MSGPACK_OBJECT_STR ? (int)arg.via.str.size : 6;
+			if (conversion == 's' && precision >= 0 && precision < len)
+				len = precision;
+			strcpy(spec + n, ".*s");
+			out_printf(&out, spec, len, str);
+			continue;
+		}
+		if (precision >= 0)
+			n += snprintf(spec + n, sizeof(spec) - n, ".%d", precision);
+
+		switch (conversion) {
+		case 'd':
+		case 'i':
+			strcpy(spec + n, PRId64);
+			out_printf(&out, spec, arg_int(&arg));
+			break;
+		case 'o':
+			strcpy(spec + n, PRIo64);
+			out_printf(&out, spec, (uint64_t)arg_int(&arg));
+			break;
+		case 'u':
+			strcpy(spec + n, PRIu64);
+			out_printf(&out, spec, (uint64_t)arg_int(&arg));
+			break;
+		case 'x':
+			strcpy(spec + n, PRIx64);
+			out_printf(&out, spec, (uint64_t)arg_int(&arg));
+			break;
+		case 'X':
+			strcpy(spec + n, PRIX64);
+			out_printf(&out, spec, (uint64_t)arg_int(&arg));
+			break;
+		case 'c':
+			strcpy(spec + n, "c");
+			out_printf(&out, spec, (int)arg_int(&arg));
+			break;
+		case 'p':
+			strcpy(spec + n, "p");
+			out_printf(&out, spec, (void *)(uintptr_t)arg_int(&arg));
+			break;
+		case 's': // (a number, print it the way %g or %d would)
+			if (arg.type == MSGPACK_OBJECT_FLOAT) {
+				strcpy(spec + n, "g");
+				out_printf(&out, spec, arg.via.f64);
+			} else if (arg.type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+				strcpy(spec + n, PRIu64);
+				out_printf(&out, spec, arg.via.u64);
+			} else {
+				strcpy(spec + n, PRId64);
+				out_printf(&out, spec, arg_int(&arg));
+			}
+			break;
+		default: // floating point
+			spec[n] = conversion;
+			spec[n + 1] = '\0';
+			out_printf(&out, spec, arg_double(&arg));
+		}
+	}
+	if (size > 0)
+		buf[out.len < size ? out.len : size - 1] = '\0';
+	return out.len;
+}
+
+/** Format a message with deferred formatting into `buf` if it fits there,
+or into heap memory otherwise.
+@returns `buf` or the heap memory (which the caller has to `free()`), or
+`NULL` if out of memory. `len` receives the length of the text.
+*/
+char *log_format_buffer(char *buf, size_t size,
+		const char *fmt, size_t fmt_len, log_args_t args, size_t *len)
+{
+	*len = log_format_args(buf, size, fmt, fmt_len, args);
+	if (*len < size) return buf;
+	char *result = malloc(*len + 1);
+	if (result) log_format_args(result, *len + 1, fmt, fmt_len, args);
+	return result;
+}
@@ -0,0 +1,25 @@
+/// @file logformat.h
+
+#ifndef LOGFORMAT_H
+#define LOGFORMAT_H
+
+#include "log.h"
+#include "mpkutils.h"
+
+/// arguments of a message with deferred formatting (LOG_FIELD_ARGS),
+/// either unpacked or still serialized
+typedef struct {
+	const msgpack_object *objects;	///< unpacked arguments (or `NULL` to use `cursor`)
+	msgpack_cursor_t cursor;		///< serialized arguments (following the array header)
+	uint32_t count;					///< the number of arguments
+} log_args_t;
+
+bool log_args_from_object(log_args_t *args, const msgpack_object *array);
+bool log_args_from_cursor(log_args_t *args, msgpack_cursor_t *cursor);
+
+int log_format_args(char *buf, size_t size,
+		const char *fmt, size_t fmt_len, log_args_t args);
+char *log_format_buffer(char *buf, size_t size,
+		const char *fmt, size_t fmt_len, log_args_t args, size_t *len);
+
+#endif // LOGFORMAT_H
@@ -0,0 +1,329 @@
+/**
+@file logqueue.c
+
+Asynchronous logging: a lock-free message queue and a dispatch thread.
+
+By default, log.c delivers each message synchronously, i.e. the thread that
+creates a log message also has to wait for all the backends to process it.
+With log_async_start() this changes: the producer thread still serializes
+the message, but then simply hands over the resulting msgpack "frame" to a
+bounded queue. A single dispatch thread (see thread_start()) takes frames
+from the queue, and passes them on to the registered logging backends.
+
+The queue is a fixed-size array of cells, with a power-of-two capacity.
+It supports multiple concurrent producers and a single consumer, without
+any locks: Each cell carries a sequence number that tells whether it's
+free for writing (by the producer that claimed the position) or ready for
+reading (by the consumer). This is Dmitry Vyukov's well-known bounded MPMC
+queue design, simplified for the single consumer case.
+
+@code
+log_async_start(4096, LOG_OVERFLOW_DROP_LOWER);
+// ... log messages from any thread ...
+log_async_stop(); // drains the queue (also done by log_shutdown)
+@endcode
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "logqueue.h"
+
+#include "threads.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// the dispatch thread sleeps (at most) this long when the queue is empty
+#define LOG_ASYNC_IDLE_MS		100
+/// log_async_stop() waits (at most) this long for the dispatch thread to finish
+#define LOG_ASYNC_STOP_MS		5000
+
+/** "constructor", prepare a logqueue_t before usage.
+@param queue the queue to initialize
+@param capacity the maximum number of entries, will be rounded up to a power of two
+@returns `false` if memory allocation failed
+*/
+bool logqueue_init(logqueue_t *queue, size_t capacity) {
+	size_t size = 2;
+	while (size < capacity) size <<= 1;
+
+	queue->enqueue_pos = 0;
+	queue->dequeue_pos = 0;
+	queue->mask = 0;
+	queue->cells = calloc(size, sizeof(logqueue_cell_t));
+	if (!queue->cells) return false;
+
+	size_t i;
+	for (i = 0; i < size; i++)
+		queue->cells[i].sequence = i; // cell i is ready for enqueueing at pos == i
+	queue->mask = size - 1;
+	return true;
+}
+
+/// "destructor", discards any remaining entries and frees up the queue's memory
+void logqueue_done(logqueue_t *queue) {
+	logqueue_cell_t cell;
+	if (queue->cells) {
+		while (logqueue_pop(queue, &cell)) free(cell.data);
+		free(queue->cells);
+		queue->cells = NULL;
+	}
+}
+
+/** Enqueue a frame (safe to call from multiple threads concurrently).
+On success, the queue takes ownership of the `data` pointer.
+@returns `false` if the queue is full
+*/
+bool logqueue_push(logqueue_t *queue, char *data, size_t size, LOG_LEVEL level) {
+	logqueue_cell_t *cell;
+	size_t pos = ATOMIC_LOAD_RELAXED(&queue->enqueue_pos);
+	while (true) {
+		cell = &queue->cells[pos & queue->mask];
+		size_t seq = ATOMIC_LOAD_ACQ(&cell->sequence);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			// the cell is free, try to claim the position
+			if (ATOMIC_CAS(&queue->enqueue_pos, &pos, pos + 1)) break;
+			// (CAS failure has updated pos, retry with that)
+		} else if (diff < 0)
+			return false; // the cell still holds an entry from the previous "lap"
+		else
+			pos = ATOMIC_LOAD_RELAXED(&queue->enqueue_pos); // lost a race, reload
+	}
+	cell->data = data;
+	cell->size = size;
+	cell->level = level;
+	// publish the cell to the consumer
+	ATOMIC_STORE_REL(&cell->sequence, pos + 1);
+	return true;
+}
+
+/** Dequeue the oldest frame (consumer only, **not** for concurrent use).
+The `result` receives a copy of the cell, and the caller takes ownership
+of its `data` (and is responsible for calling `free()` on it).
+@returns `false` if the queue is empty
+*/
+bool logqueue_pop(logqueue_t *queue, logqueue_cell_t *result) {
+	size_t pos = queue->dequeue_pos;
+	logqueue_cell_t *cell = &queue->cells[pos & queue->mask];
+	size_t seq = ATOMIC_LOAD_ACQ(&cell->sequence);
+	if ((intptr_t)seq - (intptr_t)(pos + 1) < 0)
+		return false; // not published yet, queue is empty (at this position)
+
+	*result = *cell;
+	// release the cell, making it available for the next "lap" of producers
+	ATOMIC_STORE_REL(&cell->sequence, pos + queue->mask + 1);
+	ATOMIC_STORE(&queue->dequeue_pos, pos + 1);
+	return true;
+}
+
+/// return the (approximate) number of entries in the queue
+size_t logqueue_count(logqueue_t *queue) {
+	size_t tail = ATOMIC_LOAD(&queue->dequeue_pos);
+	size_t head = ATOMIC_LOAD(&queue->enqueue_pos);
+	return head - tail;
+}
+
+
+// state of the asynchronous logging mode
+static struct {
+	logqueue_t queue;
+	LOG_OVERFLOW policy;
+	size_t high_water;		// queue fill that triggers LOG_OVERFLOW_DROP_LOWER
+	bool active;			// producers may use the queue
+	bool running;			// the dispatch thread should keep going
+	bool consumer_idle;		// dispatch thread is (about to be) waiting for wakeup
+	int producers;			// number of threads currently inside log_async_push()
+	thread_event_t wakeup;
+	pthread_t thread;
+	log_async_stats_t stats;
+} async;
+
+// flags the dispatch thread, which must never block on the queue itself
+static THREAD_LOCAL bool is_dispatcher = false;
+
+// pass a frame on to the backends, and release it
+static void log_async_deliver(logqueue_cell_t *cell) {
+	msgpack_sbuffer sbuf = {
+		.size = cell->size, .data = cell->data, .alloc = cell->size
+	};
+	log_dispatch(&sbuf, cell->level);
+	free(cell->data);
+	ATOMIC_INC(&async.stats.delivered);
+}
+
+// the dispatch thread: fan out queued messages to the backends
+static THREAD_FUNC log_async_thread(void *arg) {
+	logqueue_cell_t cell;
+	is_dispatcher = true;
+	while (true) {
+		if (logqueue_pop(&async.queue, &cell)) {
+			log_async_deliver(&cell);
+			continue;
+		}
+		log_flush(); // (the queue is empty, so this is a good time to flush)
+		if (!ATOMIC_LOAD(&async.running))
+			break; // queue has been drained, and we're asked to stop
+		// Announce that we're going to sleep, then check the queue again. A
+		// producer that pushed in between will see the flag and signal us.
+		ATOMIC_STORE(&async.consumer_idle, true);
+		if (logqueue_count(&async.queue) == 0 && ATOMIC_LOAD(&async.running))
+			thread_event_wait(&async.wakeup, LOG_ASYNC_IDLE_MS);
+		ATOMIC_STORE(&async.consumer_idle, false);
+	}
+	thread_exit(0);
+}
+
+// count a dropped message
+static void log_async_drop(LOG_LEVEL level) {
+	ATOMIC_INC(&async.stats.dropped);
+	if (level < LOG_LEVEL_COUNT)
+		ATOMIC_INC(&async.stats.dropped_level[level]);
+}
+
+// Try to enqueue a frame, respecting the overflow policy.
+static bool log_async_enqueue(char *data, size_t size, LOG_LEVEL level) {
+	// (dictionary records must never get lost, see logdict.c)
+	bool essential = level == LOG_LEVEL_DICTIONARY;
+	if (async.policy == LOG_OVERFLOW_DROP_LOWER && !essential
+		&& (level < LOG_LEVEL_WARNING || level > LOG_LEVEL_FATAL)
+		&& logqueue_count(&async.queue) >= async.high_water)
+			return false; // not important enough, leave room for others
+
+	unsigned int spins = 0;
+	bool blocked = false;
+	while (!logqueue_push(&async.queue, data, size, level)) {
+		// queue is full
+		if ((async.policy != LOG_OVERFLOW_BLOCK && !essential) || is_dispatcher)
+			return false;
+		if (!blocked) {
+			blocked = true;
+			ATOMIC_INC(&async.stats.blocked);
+		}
+		thread_event_signal(&async.wakeup); // make sure the consumer is busy
+		spin_backoff(&spins);
+	}
+	ATOMIC_INC(&async.stats.enqueued);
+	if (ATOMIC_LOAD(&async.consumer_idle))
+		thread_event_signal(&async.wakeup);
+	return true;
+}
+
+/** (internal) Hand over a serialized message to the dispatch thread.
+This is called by attach_log_level(). If asynchronous logging is active,
+the function queues a copy of the message `data` and returns `true` -
+regardless of whether the message was actually queued or dropped.
+Otherwise the result is `false`, and the caller is expected to dispatch
+the message itself. (This is also the case for a dictionary record that the
+dispatch thread creates while the queue is full.)
+*/
+bool log_async_push(const char *data, size_t size, LOG_LEVEL level) {
+	if (!ATOMIC_LOAD_RELAXED(&async.active)) return false; // (fast path)
+
+	// Register as a producer before (re)checking the "active" flag, so
+	// log_async_stop() can wait for us to finish.
+	ATOMIC_INC(&async.producers);
+	if (!ATOMIC_LOAD(&async.active)) {
+		ATOMIC_DEC(&async.producers);
+		return false;
+	}
+	// (the caller reuses its buffer, so the queue needs a copy)
+	char *frame = malloc(size);
+	bool queued = frame && log_async_enqueue(memcpy(frame, data, size), size, level);
+	if (!queued) {
+		free(frame);
+		// The dispatch thread (i.e. a backend logging something) can't wait
+		// for a full queue. Dictionary records must never get lost, so it
+		// delivers them right away - the caller dispatches them itself.
+		if (is_dispatcher && level == LOG_LEVEL_DICTIONARY) {
+			ATOMIC_DEC(&async.producers);
+			return false;
+		}
+		log_async_drop(level);
+	}
+	ATOMIC_DEC(&async.producers);
+	return true;
+}
+
+/** Start asynchronous logging.
+This sets up the message queue and starts the dispatch thread. From then on,
+log messages get delivered to the backends by that thread (in the order they
+were queued), instead of the thread that created them.
+
+@note This function and log_async_stop() should be called from a single
+"controlling" thread (e.g. during startup and shutdown).
+
+@param capacity
+The maximum number of messages that can be queued. This will be rounded up
+to a power of two.
+
+@param policy
+What to do if the queue is full, see ::LOG_OVERFLOW.
+
+@returns `true` on success
+*/
+bool log_async_start(size_t capacity, LOG_OVERFLOW policy) {
+	if (async.active) return false; // (already running)
+
+	if (!logqueue_init(&async.queue, capacity)) return false;
+	memset(&async.stats, 0, sizeof(async.stats));
+	async.stats.capacity = async.queue.mask + 1;
+	async.policy = policy;
+	async.high_water = async.stats.capacity - async.stats.capacity / 4;
+	async.consumer_idle = false;
+	async.producers = 0;
+	thread_event_init(&async.wakeup);
+
+	ATOMIC_STORE(&async.running, true);
+	async.thread = thread_start(log_async_thread, NULL, NULL);
+	if (!async.thread) {
+		thread_event_done(&async.wakeup);
+		logqueue_done(&async.queue);
+		return false;
+	}
+	ATOMIC_STORE(&async.active, true);
+	return true;
+}
+
+/** Stop asynchronous logging.
+Any messages that are still queued will be delivered before the dispatch
+thread terminates. Afterwards, logging continues in synchronous mode.
+*/
+void log_async_stop(void) {
+	if (!ATOMIC_XCHG(&async.active, false)) return; // (wasn't active)
+
+	// wait for producers that are currently pushing messages
+	unsigned int spins = 0;
+	while (ATOMIC_LOAD(&async.producers) > 0) spin_backoff(&spins);
+
+	ATOMIC_STORE(&async.running, false);
+	thread_event_signal(&async.wakeup);
+	if (thread_wait(async.thread, LOG_ASYNC_STOP_MS) != 0) {
+		// The thread is stuck (e.g. in a backend). We can't safely release
+		// the queue while it might still access it, so leave it alone.
+		warn("%s: dispatch thread failed to terminate", __func__);
+		return;
+	}
+	thread_event_done(&async.wakeup);
+	logqueue_done(&async.queue);
+}
+
+/// test if asynchronous logging is currently active
+bool log_async_active(void) {
+	return ATOMIC_LOAD(&async.active);
+}
+
+/// retrieve statistics for asynchronous logging (e.g. drop counters)
+void log_async_get_stats(log_async_stats_t *stats) {
+	size_t i;
+	stats->capacity = async.stats.capacity;
+	stats->pending = async.queue.cells ? logqueue_count(&async.queue) : 0;
+	stats->enqueued = ATOMIC_LOAD(&async.stats.enqueued);
+	stats->delivered = ATOMIC_LOAD(&async.stats.delivered);
+	stats->blocked = ATOMIC_LOAD(&async.stats.blocked);
+	stats->dropped = ATOMIC_LOAD(&async.stats.dropped);
+	for (i = 0; i < LOG_LEVEL_COUNT; i++)
+		stats->dropped_level[i] = ATOMIC_LOAD(&async.stats.dropped_level[i]);
+}
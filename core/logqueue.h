@@ -0,0 +1,64 @@
+/// @file logqueue.h
+
+#ifndef LOGQUEUE_H
+#define LOGQUEUE_H
+
+#include "atomics.h"
+#include "log.h"
+
+/// an entry ("cell") of the log queue, holding one serialized message
+typedef struct {
+	size_t sequence;	///< (internal) sequence number, controls cell ownership
+	char *data;			///< msgpack frame (malloc'ed, owned by the queue)
+	size_t size;		///< size of the frame in bytes
+	LOG_LEVEL level;	///< log level of the message
+} logqueue_cell_t;
+
+/// A bounded, lock-free multi-producer / single-consumer queue of log frames.
+/// @see logqueue.c
+typedef struct {
+	logqueue_cell_t *cells;	///< array of (capacity) cells
+	size_t mask;			///< capacity - 1 (capacity is a power of two)
+	/// next position to enqueue (shared by all producers)
+	size_t enqueue_pos CACHE_ALIGNED;
+	/// next position to dequeue (consumer only)
+	size_t dequeue_pos CACHE_ALIGNED;
+} logqueue_t;
+
+bool logqueue_init(logqueue_t *queue, size_t capacity);
+void logqueue_done(logqueue_t *queue);
+bool logqueue_push(logqueue_t *queue, char *data, size_t size, LOG_LEVEL level);
+bool logqueue_pop(logqueue_t *queue, logqueue_cell_t *result);
+size_t logqueue_count(logqueue_t *queue);
+
+/// overflow policies for asynchronous logging (what to do if the queue is full)
+typedef enum {
+	LOG_OVERFLOW_DROP,			///< drop the new message
+	LOG_OVERFLOW_BLOCK,			///< make the producer wait until there is room
+	/// Drop messages below LOG_LEVEL_WARNING once the queue is 3/4 full,
+	/// keeping the remaining room for warnings and errors (which will only
+	/// get dropped if the queue is completely full)
+	LOG_OVERFLOW_DROP_LOWER,
+} LOG_OVERFLOW;
+
+/// statistics for the asynchronous logging mode
+/// @see log_async_get_stats()
+typedef struct {
+	size_t capacity;	///< queue capacity (number of messages)
+	size_t pending;		///< number of messages currently queued
+	size_t enqueued;	///< number of messages accepted into the queue
+	size_t delivered;	///< number of messages dispatched to the backends
+	size_t blocked;		///< number of times a producer had to wait for room
+	size_t dropped;		///< total number of dropped messages
+	size_t dropped_level[LOG_LEVEL_COUNT]; ///< dropped messages, by LOG_LEVEL
+} log_async_stats_t;
+
+bool log_async_start(size_t capacity, LOG_OVERFLOW policy);
+void log_async_stop(void);
+bool log_async_active(void);
+void log_async_get_stats(log_async_stats_t *stats);
+
+// (internal) hand over a serialized message to the dispatch thread
+bool log_async_push(const char *data, size_t size, LOG_LEVEL level);
+
+#endif // LOGQUEUE_H
@@ -0,0 +1,462 @@
+/**
+@file logrecorder.c
+
+A "flight recorder" logging backend.
+
+The recorder keeps the most recent log messages in memory - in their
+serialized form, without any formatting or I/O. This makes it cheap enough
+to capture everything (down to LOG_LEVEL_EXTRADEBUG) all the time, and only
+produce output when something goes wrong: The recorded messages can be
+dumped in text form to a file (see logrecorder_dump()), or passed on to
+another backend (see logrecorder_replay()).
+
+Automatic dumps (to the file name passed to log_recorder()) happen
+- whenever a LOG_LEVEL_FATAL message gets recorded
+- after receiving a signal, see logrecorder_dump_on_signal()
+
+To capture messages that other backends aren't interested in, lower the
+global threshold (log_set_threshold()), and raise the thresholds of those
+backends instead (log_backend_set_threshold()).
+
+The recorder is a single, global instance that copies the messages into a
+::bytering_t, i.e. a fixed memory region - recording a message doesn't involve
+any memory allocation. It's limited by a maximum number of messages, and by
+the size of that region. The oldest messages get discarded first.
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "logrecorder.h"
+
+#include "atomics.h"
+#include "logstdio.h"
+#include "luautils.h"
+#include "ringbuffer.h"
+#include "threads.h"
+
+#include "lauxlib.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+// a recorded message (bytering_t record)
+typedef struct {
+	LOG_LEVEL level;
+	char data[];
+} recorder_frame_t;
+
+// memory to use per message, if log_recorder() doesn't specify a byte limit
+#define RECORDER_MESSAGE_SIZE	256
+
+// state of the flight recorder
+static struct {
+	spinlock_t lock;
+	bytering_t frames;		// recorded messages (recorder_frame_t records)
+	size_t max_messages;
+	char *dump_filename;	// target for automatic dumps (may be NULL)
+	bool dump_requested;	// (set by the signal handler)
+	bytering_t dump_frames;	// copy of `frames` for automatic dumps
+	bool dumping;			// an automatic dump is in progress
+	backend_list_t *backend;
+} recorder;
+
+// The recorder ignores messages from a thread that is currently dumping
+// or replaying with the lock held.
+static THREAD_LOCAL bool dumping = false;
+
+// open an output stream, recognizing "stdout" and "stderr" (like log_stdio)
+static FILE *logrecorder_open(const char *filename) {
+	if (strcasecmp(filename, "stdout") == 0) return stdout;
+	if (strcasecmp(filename, "stderr") == 0) return stderr;
+	return fopen(filename, "a");
+}
+
+static void logrecorder_close(FILE *stream) {
+	if (stream == stdout || stream == stderr)
+		fflush(stream);
+	else
+		fclose(stream);
+}
+
+// write a recorded message to a stream in text form
+static void logrecorder_text(FILE *stream, recorder_frame_t *frame,
+		size_t size)
+{
+	msgpack_unpacked msg;
+	msgpack_unpacked_init(&msg);
+	if (msgpack_unpack_next(&msg, frame->data,
+			size - sizeof(recorder_frame_t), NULL)
+			== MSGPACK_UNPACK_SUCCESS)
+		log_text(stream, &msg.data);
+	msgpack_unpacked_destroy(&msg);
+}
+
+// dump messages (recorder_frame_t records), returns the number of messages
+static int logrecorder_dump_frames(bytering_t *frames, const char *filename) {
+	FILE *stream = logrecorder_open(filename);
+	if (!stream) return -1;
+
+	recorder_frame_t *frame = NULL;
+	size_t size;
+	while ((frame = bytering_next(frames, frame, &size)))
+		logrecorder_text(stream, frame, size);
+	logrecorder_close(stream);
+	return frames->count;
+}
+
+/* Prepare an automatic dump (with lock held), returns `true` if the caller
+should do it (see logrecorder_dump_auto). The messages get copied into the
+preallocated dump_frames, so the file I/O and formatting can happen without
+the lock - logging threads don't have to wait for it. If another dump is in
+progress, this one gets postponed (as if requested by a signal). */
+static bool logrecorder_dump_prepare(void) {
+	if (!recorder.dump_filename) return false;
+	if (recorder.dumping) {
+		ATOMIC_STORE(&recorder.dump_requested, true);
+		return false;
+	}
+	bytering_copy(&recorder.dump_frames, &recorder.frames);
+	recorder.dumping = true;
+	return true;
+}
+
+// do an automatic dump (without the lock), after logrecorder_dump_prepare()
+static void logrecorder_dump_auto(void) {
+	// (dump_filename only gets released by LOG_NOTIFY_SHUTDOWN, when no
+	// callback or notification is running anymore)
+	logrecorder_dump_frames(&recorder.dump_frames, recorder.dump_filename);
+	spin_lock(&recorder.lock);
+	recorder.dumping = false;
+	spin_unlock(&recorder.lock);
+}
+
+// logging backend callback (record the message)
+static void logrecorder_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	if (dumping) return;
+
+	spin_lock(&recorder.lock);
+	// (this discards the oldest messages as needed to make room)
+	recorder_frame_t *frame = bytering_push(&recorder.frames, NULL,
+			sizeof(recorder_frame_t) + logmsg->size);
+	if (frame) {
+		frame->level = level;
+		memcpy(frame->data, logmsg->data, logmsg->size);
+		while (recorder.frames.count > recorder.max_messages)
+			bytering_pop(&recorder.frames);
+	}
+
+	bool dump = (level == LOG_LEVEL_FATAL
+				 || ATOMIC_XCHG(&recorder.dump_requested, false))
+				&& logrecorder_dump_prepare();
+	spin_unlock(&recorder.lock);
+	if (dump) logrecorder_dump_auto();
+}
+
+// backend notification callback
+static void logrecorder_notify(LOG_NOTIFY reason, void *userptr) {
+	switch (reason) {
+	case LOG_NOTIFY_FLUSH:
+		// (the asynchronous dispatch thread is idle, handle pending requests)
+		if (ATOMIC_LOAD(&recorder.dump_requested)) {
+			spin_lock(&recorder.lock);
+			bool dump = ATOMIC_XCHG(&recorder.dump_requested, false)
+						&& logrecorder_dump_prepare();
+			spin_unlock(&recorder.lock);
+			if (dump) logrecorder_dump_auto();
+		}
+		break;
+
+	case LOG_NOTIFY_SHUTDOWN:
+		spin_lock(&recorder.lock);
+		bytering_done(&recorder.frames);
+		bytering_done(&recorder.dump_frames);
+		free(recorder.dump_filename);
+		recorder.dump_filename = NULL;
+		recorder.backend = NULL;
+		spin_unlock(&recorder.lock);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/** Start the flight recorder.
+This registers the recorder as a logging backend.
+
+@param max_messages
+the (maximum) number of messages to keep
+
+@param max_bytes
+the size of the memory used to store messages (in bytes), gets rounded up to
+a power of two. Each message needs a few bytes more than its serialized
+size. `0` picks a default based on `max_messages`
+
+@param dump_filename
+If set, the recorder automatically dumps its messages to this file when it
+receives a LOG_LEVEL_FATAL message (or a signal, see
+logrecorder_dump_on_signal()). Accepts `"stdout"` and `"stderr"`.
+optional, may be `NULL`
+
+@returns the backend entry (see log_register_backend()), or `NULL` if the
+recorder is already running (or memory allocation failed)
+*/
+backend_list_t *log_recorder(size_t max_messages, size_t max_bytes,
+		const char *dump_filename)
+{
+	if (max_messages == 0) return NULL;
+	spin_lock(&recorder.lock);
+	if (recorder.backend) {
+		spin_unlock(&recorder.lock);
+		return NULL; // (already running)
+	}
+	if (max_bytes == 0) max_bytes = max_messages * RECORDER_MESSAGE_SIZE;
+	if (!bytering_init(&recorder.frames, max_bytes)) {
+		spin_unlock(&recorder.lock);
+		return NULL;
+	}
+	recorder.dump_filename = NULL;
+	recorder.dump_frames.data = NULL;
+	if (dump_filename) {
+		// (automatic dumps need a copy of the messages, allocate it upfront)
+		recorder.dump_filename = strdup(dump_filename);
+		if (!recorder.dump_filename
+			|| !bytering_init(&recorder.dump_frames, max_bytes))
+		{
+			free(recorder.dump_filename);
+			recorder.dump_filename = NULL;
+			bytering_done(&recorder.frames);
+			spin_unlock(&recorder.lock);
+			return NULL;
+		}
+	}
+	recorder.max_messages = max_messages;
+	recorder.dump_requested = false;
+	recorder.dumping = false;
+	// (mark as "running", so nobody else gets here)
+	recorder.backend = (backend_list_t *)&recorder;
+	spin_unlock(&recorder.lock);
+
+	backend_list_t *backend = log_register_backend(logrecorder_callback,
+			logrecorder_notify, NULL);
+	if (!backend) {
+		// (the backend never ran, release its resources directly)
+		logrecorder_notify(LOG_NOTIFY_SHUTDOWN, NULL);
+		return NULL;
+	}
+	ATOMIC_STORE(&recorder.backend, backend);
+	return backend;
+}
+
+/// stop the flight recorder (discarding all recorded messages)
+void logrecorder_stop(void) {
+	if (ATOMIC_LOAD(&recorder.backend))
+		log_unregister_backend(logrecorder_callback, NULL);
+}
+
+/** Retrieve the number of recorded messages.
+@param bytes receives the total size of the messages. optional, may be `NULL`
+*/
+size_t logrecorder_count(size_t *bytes) {
+	spin_lock(&recorder.lock);
+	size_t result = recorder.frames.count;
+	if (bytes) {
+		void *frame = NULL;
+		size_t size;
+		*bytes = 0;
+		while ((frame = bytering_next(&recorder.frames, frame, &size)))
+			*bytes += size - sizeof(recorder_frame_t);
+	}
+	spin_unlock(&recorder.lock);
+	return result;
+}
+
+/// discard all recorded messages
+void logrecorder_clear(void) {
+	spin_lock(&recorder.lock);
+	bytering_clear(&recorder.frames);
+	spin_unlock(&recorder.lock);
+}
+
+/** Dump the recorded messages in text form (see log_text()).
+The messages will be kept, i.e. you may dump them multiple times.
+
+@param filename
+The output file. Messages get appended to it, and the function recognizes
+`"stdout"` and `"stderr"`.
+
+@returns the number of messages, or -1 if the file couldn't be opened
+*/
+int logrecorder_dump(const char *filename) {
+	spin_lock(&recorder.lock);
+	dumping = true;
+	int result = logrecorder_dump_frames(&recorder.frames, filename);
+	dumping = false;
+	spin_unlock(&recorder.lock);
+	return result;
+}
+
+/** Pass the recorded messages on to another logging backend.
+
+@note The callback must not create log messages itself.
+
+@param callback
+the backend function that receives the messages
+
+@param userptr
+arbitrary "user" data, passed on to the callback
+
+@returns the number of messages
+*/
+int logrecorder_replay(backend_callback_t *callback, void *userptr) {
+	recorder_frame_t *frame = NULL;
+	size_t size;
+	int i = 0;
+	spin_lock(&recorder.lock);
+	dumping = true;
+	while ((frame = bytering_next(&recorder.frames, frame, &size))) {
+		size -= sizeof(recorder_frame_t);
+		msgpack_sbuffer sbuf = {
+			.size = size, .data = frame->data, .alloc = size
+		};
+		callback(&sbuf, frame->level, userptr);
+		i++;
+	}
+	dumping = false;
+	spin_unlock(&recorder.lock);
+	return i;
+}
+
+// signal handler, requests a dump (to be done by the next log activity)
+static void logrecorder_signal(int signum) {
+	ATOMIC_STORE(&recorder.dump_requested, true);
+}
+
+/** Dump recorded messages upon receiving a signal (e.g. `SIGUSR1`).
+The dump goes to the file that was passed to log_recorder(). As it's not
+safe to do this from within a signal handler, the dump gets delayed until
+the next log message - or until the asynchronous dispatch thread is idle
+(see log_async_start()).
+
+@returns `false` if the signal handler couldn't be installed
+*/
+bool logrecorder_dump_on_signal(int signum) {
+	return signal(signum, logrecorder_signal) != SIG_ERR;
+}
+
+
+// Lua bindings
+
+/// `log_recorder_C(max_messages [, max_bytes [, dump_filename]])`, returns boolean
+LUA_CFUNC(log_recorder_C) {
+	size_t max_messages = luaL_checkinteger(L, 1);
+	size_t max_bytes = luaL_optinteger(L, 2, 0);
+	const char *dump_filename = luaL_optstring(L, 3, NULL);
+	lua_pushboolean(L, log_recorder(max_messages, max_bytes, dump_filename) != NULL);
+	return 1;
+}
+
+/// `logrecorder_stop_C()`
+LUA_CFUNC(logrecorder_stop_C) {
+	logrecorder_stop();
+	return 0;
+}
+
+/// `logrecorder_count_C()`, returns number of messages and their total size
+LUA_CFUNC(logrecorder_count_C) {
+	size_t bytes;
+	lua_pushinteger(L, logrecorder_count(&bytes));
+	lua_pushinteger(L, bytes);
+	return 2;
+}
+
+/// `logrecorder_clear_C()`
+LUA_CFUNC(logrecorder_clear_C) {
+	logrecorder_clear();
+	return 0;
+}
+
+/// `logrecorder_dump_C([filename])`, defaults to "stderr".
+/// returns the number of messages, or `nil` and an error message
+LUA_CFUNC(logrecorder_dump_C) {
+	const char *filename = luaL_optstring(L, 1, "stderr");
+	int result = logrecorder_dump(filename);
+	if (result < 0) {
+		lua_pushnil(L);
+		luautils_push_syserror(L, "%s(%s)", __func__, filename);
+		return 2;
+	}
+	lua_pushinteger(L, result);
+	return 1;
+}
+
+/// `logrecorder_messages_C([n])`, returns a table with (the last `n`)
+/// recorded messages in text form
+LUA_CFUNC(logrecorder_messages_C) {
+	size_t i, first = 0, count, size;
+	recorder_frame_t *frame;
+	size_t limit = luaL_optinteger(L, 1, 0); // (0 = all messages)
+	long *offsets;
+	FILE *text = tmpfile();
+	if (!text) {
+		lua_pushnil(L);
+		luautils_push_syserror(L, "%s tmpfile()", __func__);
+		return 2;
+	}
+
+	// format the messages (with the lock held, but without using Lua)
+	spin_lock(&recorder.lock);
+	dumping = true;
+	count = recorder.frames.count;
+	if (limit > 0 && limit < count) first = count - limit;
+	offsets = malloc((count - first + 1) * sizeof(long));
+	if (offsets) {
+		frame = bytering_element(&recorder.frames, first, &size);
+		for (i = first; i < count; i++) {
+			offsets[i - first] = ftell(text);
+			logrecorder_text(text, frame, size);
+			frame = bytering_next(&recorder.frames, frame, &size);
+		}
+		offsets[count - first] = ftell(text);
+	}
+	dumping = false;
+	spin_unlock(&recorder.lock);
+
+	// now build the result table
+	lua_newtable(L);
+	if (offsets) {
+		rewind(text);
+		for (i = 0; i < count - first; i++) {
+			size_t len = offsets[i + 1] - offsets[i];
+			luaL_Buffer b;
+			luaL_buffinit(L, &b);
+			while (len > 0) {
+				char *p = luaL_prepbuffer(&b);
+				size_t n = fread(p, 1, len < LUAL_BUFFERSIZE ? len : LUAL_BUFFERSIZE, text);
+				if (n == 0) break;
+				luaL_addsize(&b, n);
+				len -= n;
+			}
+			luaL_pushresult(&b);
+			lua_rawseti(L, -2, i + 1);
+		}
+		free(offsets);
+	}
+	fclose(text);
+	return 1;
+}
+
+/// register the Lua bindings
+LUA_CFUNC(luaopen_logrecorder) {
+	LREG(L, log_recorder_C);
+	LREG(L, logrecorder_stop_C);
+	LREG(L, logrecorder_count_C);
+	LREG(L, logrecorder_clear_C);
+	LREG(L, logrecorder_dump_C);
+	LREG(L, logrecorder_messages_C);
+	return 0;
+}
@@ -0,0 +1,22 @@
+/// @file logrecorder.h
+
+#ifndef LOGRECORDER_H
+#define LOGRECORDER_H
+
+#include "log.h"
+#include "lua.h"
+#include "luahelpers.h"
+
+backend_list_t *log_recorder(size_t max_messages, size_t max_bytes,
+		const char *dump_filename);
+void logrecorder_stop(void);
+
+size_t logrecorder_count(size_t *bytes);
+void logrecorder_clear(void);
+int logrecorder_dump(const char *filename);
+int logrecorder_replay(backend_callback_t *callback, void *userptr);
+bool logrecorder_dump_on_signal(int signum);
+
+LUA_CFUNC(luaopen_logrecorder); // Lua bindings
+
+#endif // LOGRECORDER_H
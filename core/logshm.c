@@ -0,0 +1,397 @@
+/**
+@file logshm.c
+
+A shared memory transport for log messages, e.g. from the injected library
+to the agent process.
+
+The shared memory holds a ring buffer of variable-sized records (the
+serialized MessagePack frames), with a ::logshm_header_t in front. The
+consumer (normally the agent) creates it with logshm_create(); producers
+attach to it by name, via logshm_open() or the log_shm() backend.
+
+Any number of producer threads (and processes) may write concurrently:
+- a producer reserves space by atomically advancing `head`, then copies
+  the frame and marks the record "committed". Records are contiguous, a
+  record that doesn't fit at the end of the ring gets preceded by padding.
+- if the ring is full, the message gets dropped (and counted), producers
+  never wait for the consumer.
+- the consumer reads committed records in order, then clears their memory
+  and advances `tail`, which makes the space available again.
+
+So in the steady state, writing a message doesn't involve any system
+calls. The exception is waking up the consumer, when it's blocked in
+logshm_wait() - which uses a futex on Linux, and a named event on Windows.
+(Other platforms fall back to polling.)
+
+Since readers only ever see complete records, a producer that crashes
+after reserving space would block the consumer at that point. Messages
+are also the only thing that gets shared - interned strings (see
+logdict.c) need the LOG_LEVEL_DICTIONARY records, which log_shm() sends
+again when one got dropped.
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "logshm.h"
+
+#include "logdict.h"
+#include "timing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if _WINDOWS
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#if _LINUX
+		#include <linux/futex.h>
+		#include <sys/syscall.h>
+		#include <time.h>
+	#endif
+#endif
+
+/// a record (message) within the ring, followed by the frame data
+typedef struct {
+	uint32_t size;			///< size of the data (excluding this header)
+	uint32_t flags;			///< LOGSHM_COMMITTED, LOGSHM_PADDING
+} logshm_record_t;
+
+/// the record is complete (and may be read)
+#define LOGSHM_COMMITTED	1
+/// the record is unused space at the end of the ring
+#define LOGSHM_PADDING		2
+
+/// records start at multiples of this
+#define LOGSHM_ALIGN		8
+
+struct logshm {
+	logshm_header_t *header;
+	char *data;				// the ring (follows the header)
+	uint64_t mask;			// capacity - 1
+	size_t map_size;
+	bool owner;				// created by logshm_create()
+	bool dict_lost;			// (log_shm) a dictionary record was dropped
+	char name[64];
+#if _WINDOWS
+	HANDLE mapping;
+	HANDLE event;			// wakes up the consumer
+#endif
+};
+
+// the size that a record for `size` bytes of data occupies
+static inline uint64_t logshm_record_size(size_t size) {
+	return (sizeof(logshm_record_t) + size + LOGSHM_ALIGN - 1) & ~(uint64_t)(LOGSHM_ALIGN - 1);
+}
+
+static inline logshm_record_t *logshm_record(logshm_t *shm, uint64_t pos) {
+	return (logshm_record_t *)(shm->data + (pos & shm->mask));
+}
+
+// set up the process-specific part (after mapping the memory)
+static logshm_t *logshm_mapped(logshm_t *shm, void *memory) {
+	shm->header = memory;
+	shm->data = (char *)memory + shm->header->header_size;
+	shm->mask = shm->header->capacity - 1;
+	return shm;
+}
+
+// create a name suitable for shm_open() and the Windows API
+static void logshm_name(logshm_t *shm, const char *name) {
+#if _WINDOWS
+	snprintf(shm->name, sizeof(shm->name), "%s", name);
+#else
+	snprintf(shm->name, sizeof(shm->name), "%s%s", *name == '/' ? "" : "/", name);
+#endif
+}
+
+/** Create the shared memory (the consumer side).
+@param name a name that identifies the shared memory (and that producers
+pass to logshm_open() or log_shm())
+@param capacity the size of the ring in bytes, gets rounded up to a power
+of two. `0` means LOGSHM_SIZE.
+@returns the mapping, or `NULL` on error (e.g. the name is in use already)
+*/
+logshm_t *logshm_create(const char *name, size_t capacity) {
+	uint64_t size = 4096;
+	while (size < capacity || (capacity == 0 && size < LOGSHM_SIZE)) size *= 2;
+	logshm_t *shm = calloc(1, sizeof(logshm_t));
+	if (!shm) return NULL;
+	logshm_name(shm, name);
+	shm->owner = true;
+	shm->map_size = sizeof(logshm_header_t) + size;
+	void *memory;
+
+#if _WINDOWS
+	char event_name[80];
+	shm->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+			(DWORD)((uint64_t)shm->map_size >> 32), (DWORD)shm->map_size, shm->name);
+	if (!shm->mapping || GetLastError() == ERROR_ALREADY_EXISTS) {
+		if (shm->mapping) CloseHandle(shm->mapping);
+		free(shm);
+		return NULL;
+	}
+	snprintf(event_name, sizeof(event_name), "%s.wake", shm->name);
+	shm->event = CreateEventA(NULL, FALSE, FALSE, event_name);
+	memory = MapViewOfFile(shm->mapping, FILE_MAP_ALL_ACCESS, 0, 0, shm->map_size);
+	if (!memory || !shm->event) {
+		logshm_close(shm);
+		return NULL;
+	}
+#else
+	int fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		free(shm);
+		return NULL;
+	}
+	memory = MAP_FAILED;
+	if (ftruncate(fd, shm->map_size) == 0)
+		memory = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (memory == MAP_FAILED) {
+		shm_unlink(shm->name);
+		free(shm);
+		return NULL;
+	}
+#endif
+	// (the memory is zero-initialized, i.e. there are no records)
+	logshm_header_t *header = memory;
+	header->version = LOGSHM_VERSION;
+	header->header_size = sizeof(logshm_header_t);
+	header->capacity = size;
+	// publishing the "magic" makes the memory valid for logshm_open()
+	ATOMIC_FENCE();
+	memcpy(header->magic, LOGSHM_MAGIC, sizeof(header->magic));
+	return logshm_mapped(shm, memory);
+}
+
+/** Attach to shared memory that was created with logshm_create() (the
+producer side).
+@returns the mapping, or `NULL` on error (e.g. no such memory)
+*/
+logshm_t *logshm_open(const char *name) {
+	logshm_t *shm = calloc(1, sizeof(logshm_t));
+	if (!shm) return NULL;
+	logshm_name(shm, name);
+	void *memory = NULL;
+
+#if _WINDOWS
+	char event_name[80];
+	shm->mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, shm->name);
+	snprintf(event_name, sizeof(event_name), "%s.wake", shm->name);
+	shm->event = OpenEventA(EVENT_MODIFY_STATE, FALSE, event_name);
+	if (shm->mapping && shm->event) {
+		memory = MapViewOfFile(shm->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+		MEMORY_BASIC_INFORMATION info;
+		if (memory && VirtualQuery(memory, &info, sizeof(info)))
+			shm->map_size = info.RegionSize;
+	}
+#else
+	struct stat st;
+	int fd = shm_open(shm->name, O_RDWR, 0);
+	if (fd >= 0) {
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(logshm_header_t)) {
+			shm->map_size = st.st_size;
+			memory = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (memory == MAP_FAILED) memory = NULL;
+		}
+		close(fd);
+	}
+#endif
+	if (memory) {
+		shm->header = memory;
+		logshm_header_t *header = memory;
+		uint64_t capacity = header->capacity;
+		if (memcmp(header->magic, LOGSHM_MAGIC, sizeof(header->magic)) == 0
+			&& header->version == LOGSHM_VERSION
+			&& capacity >= 4096 && (capacity & (capacity - 1)) == 0
+			&& header->header_size + capacity <= shm->map_size)
+				return logshm_mapped(shm, memory);
+	}
+	logshm_close(shm);
+	return NULL;
+}
+
+/// release the mapping (if it was created by logshm_create(), this also
+/// removes the name)
+void logshm_close(logshm_t *shm) {
+	if (!shm) return;
+#if _WINDOWS
+	if (shm->header) UnmapViewOfFile(shm->header);
+	if (shm->mapping) CloseHandle(shm->mapping);
+	if (shm->event) CloseHandle(shm->event);
+#else
+	if (shm->header) munmap(shm->header, shm->map_size);
+	if (shm->owner) shm_unlink(shm->name);
+#endif
+	free(shm);
+}
+
+// wake up the consumer, if it's waiting (only the first producer to see
+// the flag does, so the consumer gets a single system call per wait)
+static void logshm_wake(logshm_t *shm) {
+	if (!ATOMIC_LOAD(&shm->header->waiting)
+		|| !ATOMIC_XCHG(&shm->header->waiting, 0))
+			return;
+	ATOMIC_INC(&shm->header->wakeups);
+#if _WINDOWS
+	SetEvent(shm->event);
+#elif _LINUX
+	// (not FUTEX_PRIVATE, the futex is shared between processes)
+	syscall(SYS_futex, &shm->header->wakeups, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+/** Write a message to the ring. This never blocks.
+@returns `false` if there's not enough space (the message gets dropped)
+*/
+bool logshm_write(logshm_t *shm, const char *data, size_t size) {
+	logshm_header_t *header = shm->header;
+	uint64_t capacity = header->capacity;
+	uint64_t record_size = logshm_record_size(size);
+	uint64_t head = ATOMIC_LOAD_RELAXED(&header->head);
+	uint64_t padding;
+
+	// reserve space
+	do {
+		uint64_t pos = head & shm->mask;
+		padding = pos + record_size > capacity ? capacity - pos : 0;
+		if (head + padding + record_size - ATOMIC_LOAD_ACQ(&header->tail) > capacity) {
+			ATOMIC_INC(&header->dropped);
+			return false;
+		}
+	} while (!ATOMIC_CAS(&header->head, &head, head + padding + record_size));
+
+	if (padding) {
+		logshm_record_t *pad = logshm_record(shm, head);
+		pad->size = padding - sizeof(logshm_record_t);
+		ATOMIC_STORE_REL(&pad->flags, LOGSHM_COMMITTED | LOGSHM_PADDING);
+		head += padding;
+	}
+	logshm_record_t *record = logshm_record(shm, head);
+	record->size = size;
+	memcpy(record + 1, data, size);
+	ATOMIC_STORE(&record->flags, LOGSHM_COMMITTED);
+	logshm_wake(shm);
+	return true;
+}
+
+// the record at `tail`, if it has been committed (or `NULL`)
+static logshm_record_t *logshm_next(logshm_t *shm) {
+	logshm_record_t *record = logshm_record(shm, ATOMIC_LOAD_RELAXED(&shm->header->tail));
+	return ATOMIC_LOAD(&record->flags) & LOGSHM_COMMITTED ? record : NULL;
+}
+
+/** Read all (currently) available messages from the ring, and pass each of
+them to the callback. The memory gets reused after the callback returns.
+@returns the number of messages
+*/
+size_t logshm_read(logshm_t *shm, logshm_read_callback_t *callback, void *userptr) {
+	logshm_header_t *header = shm->header;
+	logshm_record_t *record;
+	size_t count = 0;
+	while ((record = logshm_next(shm))) {
+		uint32_t flags = record->flags;
+		uint64_t record_size = logshm_record_size(record->size);
+		if (!(flags & LOGSHM_PADDING)) {
+			callback((const char *)(record + 1), record->size, userptr);
+			count++;
+		}
+		// clear the memory, so producers can rely on zero "flags"
+		memset(record, 0, record_size);
+		ATOMIC_STORE_REL(&header->tail, header->tail + record_size);
+	}
+	return count;
+}
+
+/** Wait for messages to arrive.
+@returns `true` if there are messages to read, `false` on timeout
+*/
+bool logshm_wait(logshm_t *shm, unsigned int timeout_ms) {
+	logshm_header_t *header = shm->header;
+	if (logshm_next(shm)) return true;
+
+#if _WINDOWS || _LINUX
+	uint32_t wakeups = ATOMIC_LOAD(&header->wakeups);
+	ATOMIC_STORE(&header->waiting, 1);
+	if (!logshm_next(shm)) { // (check again, now that producers will wake us)
+	#if _WINDOWS
+		WaitForSingleObject(shm->event, timeout_ms);
+	#else
+		struct timespec timeout = {
+			.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L
+		};
+		syscall(SYS_futex, &header->wakeups, FUTEX_WAIT, wakeups, &timeout, NULL, 0);
+	#endif
+	}
+	ATOMIC_STORE(&header->waiting, 0);
+#else
+	// (no futex, poll)
+	double end = get_elapsed_ms() + timeout_ms;
+	while (!logshm_next(shm) && get_elapsed_ms() < end) Sleep(1);
+#endif
+	return logshm_next(shm) != NULL;
+}
+
+/// the number of messages that producers had to drop (so far)
+uint64_t logshm_dropped(logshm_t *shm) {
+	return ATOMIC_LOAD(&shm->header->dropped);
+}
+
+
+/* log backend */
+
+// write the dictionary (see logdict.c), returns `false` if it didn't fit
+static bool logshm_write_dictionary(logshm_t *shm) {
+	uint32_t id, count = log_dict_count();
+	bool result = true;
+	msgpack_sbuffer sbuf;
+	msgpack_sbuffer_init(&sbuf);
+	for (id = 1; id <= count && result; id++) {
+		msgpack_sbuffer_clear(&sbuf);
+		log_dict_record(&sbuf, id);
+		result = logshm_write(shm, sbuf.data, sbuf.size);
+	}
+	msgpack_sbuffer_destroy(&sbuf);
+	return result;
+}
+
+// logging backend callback, writes the message to the ring
+static void logshm_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level, void *userptr) {
+	logshm_t *shm = userptr;
+	// (the consumer needs all dictionary records, resend them after a loss)
+	if (ATOMIC_LOAD_RELAXED(&shm->dict_lost)
+		&& ATOMIC_XCHG(&shm->dict_lost, false)
+		&& !logshm_write_dictionary(shm))
+			ATOMIC_STORE(&shm->dict_lost, true);
+	if (!logshm_write(shm, logmsg->data, logmsg->size)
+		&& level == LOG_LEVEL_DICTIONARY)
+			ATOMIC_STORE(&shm->dict_lost, true);
+}
+
+// backend notification callback
+static void logshm_notify(LOG_NOTIFY reason, void *userptr) {
+	if (reason == LOG_NOTIFY_SHUTDOWN) logshm_close(userptr);
+}
+
+/** Start writing log messages to shared memory, which the consumer (e.g.
+the agent) has to have created with logshm_create().
+
+@param name the name of the shared memory
+@returns the backend entry (see log_register_backend()), or `NULL` if the
+shared memory couldn't be opened
+*/
+backend_list_t *log_shm(const char *name) {
+	logshm_t *shm = logshm_open(name);
+	if (!shm) return NULL;
+	// (the consumer might not have seen the dictionary yet)
+	if (!logshm_write_dictionary(shm)) shm->dict_lost = true;
+	backend_list_t *backend = log_register_backend(logshm_callback, logshm_notify, shm);
+	if (!backend) logshm_close(shm);
+	return backend;
+}
@@ -0,0 +1,58 @@
+/// @file logshm.h
+
+#ifndef LOGSHM_H
+#define LOGSHM_H
+
+#include "atomics.h"
+#include "log.h"
+
+#include <stdint.h>
+
+/// "magic" signature at the start of the shared memory
+#define LOGSHM_MAGIC		"LCFRSHM"
+/// version of the shared memory layout
+#define LOGSHM_VERSION		1
+/// default ring size (bytes) for logshm_create()
+#define LOGSHM_SIZE			(4 * 1024 * 1024)
+
+/** The header of the shared memory, followed by the ring buffer data.
+All members have fixed sizes, so processes with different "bitness" can
+share the memory. Producers and consumer work on separate cache lines.
+*/
+typedef struct {
+	char magic[8];			///< LOGSHM_MAGIC (NUL-terminated)
+	uint32_t version;		///< LOGSHM_VERSION
+	uint32_t header_size;	///< offset of the ring data
+	uint64_t capacity;		///< size of the ring data (a power of two)
+
+	/// next write position (producers reserve space by advancing it)
+	uint64_t head CACHE_ALIGNED;
+	uint64_t dropped;		///< number of messages that didn't fit
+
+	/// next read position (only modified by the consumer)
+	uint64_t tail CACHE_ALIGNED;
+	uint32_t waiting;		///< the consumer is (about to be) blocked in logshm_wait()
+	uint32_t wakeups;		///< counter for wakeups (the futex word)
+} logshm_header_t;
+
+/// a mapping of the shared memory (process-specific)
+typedef struct logshm logshm_t;
+
+/// prototype for a callback that receives the messages from logshm_read()
+typedef void logshm_read_callback_t(const char *data, size_t size, void *userptr);
+
+logshm_t *logshm_create(const char *name, size_t capacity);
+logshm_t *logshm_open(const char *name);
+void logshm_close(logshm_t *shm);
+
+// producers (any number of threads and processes)
+bool logshm_write(logshm_t *shm, const char *data, size_t size);
+
+// consumer
+size_t logshm_read(logshm_t *shm, logshm_read_callback_t *callback, void *userptr);
+bool logshm_wait(logshm_t *shm, unsigned int timeout_ms);
+uint64_t logshm_dropped(logshm_t *shm);
+
+backend_list_t *log_shm(const char *name);
+
+#endif // LOGSHM_H
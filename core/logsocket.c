@@ -0,0 +1,316 @@
+/**
+@file logsocket.c
+
+Streaming log messages to another process, e.g. a log viewer.
+
+log_socket() registers a (batched, see logbatch.c) backend that connects
+to a receiver listening on a Unix domain socket - or a named pipe under
+Windows - and sends it the serialized MessagePack frames back-to-back, the
+same way log_file() stores them. The receiver can then process them with a
+streaming unpacker, and render them e.g. via log_text().
+
+Since this code normally runs within a target process, logging must never
+wait for a slow (or stalled) receiver:
+- the connection is non-blocking. Whatever the receiver doesn't accept
+  right away stays in a send queue, and gets sent along with subsequent
+  batches (or on log_flush(), which the timer of logbatch.c also issues
+  regularly - so nothing stays behind for long, even if logging stops).
+- the queue is bounded. Once it's full, further messages get dropped (but
+  never LOG_LEVEL_DICTIONARY records), and the receiver gets a
+  LOG_LEVEL_WARNING message with the number of dropped messages later.
+- while there's no connection, messages get queued as well. The backend
+  (re)connects on demand, at most once per LOGSOCKET_RETRY_MS. On a new
+  connection it sends the current dictionary (see logdict.c) first, so
+  the receiver can resolve interned strings.
+- if the connection breaks, anything still queued is discarded (the
+  receiver can't resume in the middle of a message anyway).
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "logsocket.h"
+
+#include "atomics.h"
+#include "logbatch.h"
+#include "logdict.h"
+#include "timing.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if _WINDOWS
+	#include <windows.h>
+	typedef HANDLE logsocket_handle_t;
+	#define LOGSOCKET_INVALID	INVALID_HANDLE_VALUE
+#else
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <sys/socket.h>
+	#include <sys/uio.h>
+	#include <sys/un.h>
+	#include <unistd.h>
+	typedef int logsocket_handle_t;
+	#define LOGSOCKET_INVALID	-1
+	#ifndef MSG_NOSIGNAL // (e.g. Darwin, uses SO_NOSIGPIPE instead)
+		#define MSG_NOSIGNAL	0
+	#endif
+#endif
+
+// state of a socket backend
+typedef struct {
+	spinlock_t lock;
+	char *path;
+	logsocket_handle_t handle;
+	bool attempted;			// there was a connection attempt
+	uint64_t last_attempt;	// time of the last attempt (ms, see get_elapsed_ns())
+
+	char *queue;			// data waiting to be sent
+	size_t queued, alloc;	// used and allocated size of the queue
+	size_t limit;			// maximum size of the queue
+	size_t dropped;			// messages dropped (and not reported yet)
+} logsocket_t;
+
+// make room for `size` more bytes in the queue
+static bool logsocket_reserve(logsocket_t *s, size_t size) {
+	if (s->queued + size > s->alloc) {
+		size_t alloc = s->alloc ? s->alloc : 4096;
+		while (alloc < s->queued + size) alloc *= 2;
+		char *queue = realloc(s->queue, alloc);
+		if (!queue) return false;
+		s->queue = queue;
+		s->alloc = alloc;
+	}
+	return true;
+}
+
+// insert data into the queue, at the given position
+static bool logsocket_insert(logsocket_t *s, size_t pos, const char *data, size_t size) {
+	if (!logsocket_reserve(s, size)) return false;
+	memmove(s->queue + pos + size, s->queue + pos, s->queued - pos);
+	memcpy(s->queue + pos, data, size);
+	s->queued += size;
+	return true;
+}
+
+static void logsocket_close(logsocket_t *s) {
+	if (s->handle == LOGSOCKET_INVALID) return;
+#if _WINDOWS
+	CloseHandle(s->handle);
+#else
+	close(s->handle);
+#endif
+	s->handle = LOGSOCKET_INVALID;
+}
+
+// queue the dictionary records (ahead of any messages that might use them)
+static void logsocket_queue_dictionary(logsocket_t *s) {
+	uint32_t id, count = log_dict_count();
+	if (count == 0) return;
+	msgpack_sbuffer sbuf;
+	msgpack_sbuffer_init(&sbuf);
+	for (id = 1; id <= count; id++)
+		log_dict_record(&sbuf, id);
+	logsocket_insert(s, 0, sbuf.data, sbuf.size);
+	msgpack_sbuffer_destroy(&sbuf);
+}
+
+// queue a message that tells the receiver about dropped messages (once the
+// receiver has caught up somewhat)
+static void logsocket_queue_dropped(logsocket_t *s) {
+	if (s->dropped == 0 || s->queued > s->limit / 2) return;
+	char text[64];
+	snprintf(text, sizeof(text), "logsocket: %zu message(s) dropped", s->dropped);
+	msgpack_sbuffer sbuf;
+	msgpack_sbuffer_init(&sbuf);
+	// (no origin - interning one could create a dictionary record, i.e.
+	// another log message, which isn't possible while holding the lock)
+	log_serialize(&sbuf, NULL, LOG_LEVEL_WARNING, NULL, text, -1);
+	if (logsocket_insert(s, s->queued, sbuf.data, sbuf.size))
+		s->dropped = 0;
+	msgpack_sbuffer_destroy(&sbuf);
+}
+
+// try to establish the connection (if needed), returns `true` if connected
+static bool logsocket_connect(logsocket_t *s) {
+	if (s->handle != LOGSOCKET_INVALID) return true;
+	uint64_t now = get_elapsed_ns() / 1000000;
+	if (s->attempted && now - s->last_attempt < LOGSOCKET_RETRY_MS) return false;
+	s->attempted = true;
+	s->last_attempt = now;
+
+#if _WINDOWS
+	HANDLE pipe = CreateFileA(s->path, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (pipe == INVALID_HANDLE_VALUE) return false;
+	// non-blocking mode, WriteFile() only writes what fits into the pipe
+	DWORD mode = PIPE_READMODE_BYTE | PIPE_NOWAIT;
+	if (!SetNamedPipeHandleState(pipe, &mode, NULL, NULL)) {
+		CloseHandle(pipe);
+		return false;
+	}
+	s->handle = pipe;
+#else
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, s->path, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return false;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+	#endif
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0
+		|| connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return false;
+	}
+	s->handle = fd;
+#endif
+	logsocket_queue_dictionary(s);
+	return true;
+}
+
+/* Write the queue, followed by `data`, as far as possible without blocking.
+Returns the number of bytes written from `data` (the queue is written first),
+or 0 if the connection broke - which closes it, and discards the queue.
+*/
+static size_t logsocket_write(logsocket_t *s, const char *data, size_t size) {
+	size_t written = 0;
+#if _WINDOWS
+	const char *buffers[2] = { s->queue, data };
+	size_t sizes[2] = { s->queued, size };
+	int i;
+	for (i = 0; i < 2; i++) {
+		DWORD count = 0;
+		if (sizes[i] == 0) continue;
+		if (!WriteFile(s->handle, buffers[i], sizes[i], &count, NULL)) {
+			logsocket_close(s);
+			s->queued = 0;
+			return 0;
+		}
+		written += count;
+		if (count < sizes[i]) break; // (pipe is full)
+	}
+#else
+	struct iovec iov[2] = {
+		{ .iov_base = s->queue, .iov_len = s->queued },
+		{ .iov_base = (void *)data, .iov_len = size },
+	};
+	struct msghdr header = { .msg_iov = iov, .msg_iovlen = 2 };
+	ssize_t count = sendmsg(s->handle, &header, MSG_NOSIGNAL); // (= writev)
+	if (count < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			logsocket_close(s);
+			s->queued = 0;
+		}
+		return 0;
+	}
+	written = count;
+#endif
+	if (written < s->queued) {
+		memmove(s->queue, s->queue + written, s->queued - written);
+		s->queued -= written;
+		return 0;
+	}
+	written -= s->queued;
+	s->queued = 0;
+	return written;
+}
+
+// batch callback, sends the messages (or queues them)
+static void logsocket_callback(const log_batch_t *batch, void *userptr) {
+	logsocket_t *s = userptr;
+	size_t i, sent = 0;
+
+	spin_lock(&s->lock);
+	if (logsocket_connect(s)) {
+		logsocket_queue_dropped(s);
+		sent = logsocket_write(s, batch->data, batch->size);
+	}
+	for (i = 0; i < batch->count; i++) {
+		const log_frame_t *frame = &batch->frames[i];
+		size_t end = frame->offset + frame->size;
+		if (end <= sent) continue;
+		if (frame->offset < sent) {
+			// the rest of a partially sent frame always has to follow
+			if (!logsocket_insert(s, s->queued, batch->data + sent, end - sent)) {
+				logsocket_close(s); // (the stream can't continue)
+				s->queued = 0;
+				s->dropped++;
+			}
+			continue;
+		}
+		if ((s->queued + frame->size > s->limit && frame->level != LOG_LEVEL_DICTIONARY)
+			|| !logsocket_insert(s, s->queued, batch->data + frame->offset, frame->size))
+				s->dropped++;
+	}
+	spin_unlock(&s->lock);
+}
+
+// backend notification callback
+static void logsocket_notify(LOG_NOTIFY reason, void *userptr) {
+	logsocket_t *s = userptr;
+	switch (reason) {
+	case LOG_NOTIFY_FLUSH:
+		// (logbatch.c already delivered any pending messages, send the queue)
+		spin_lock(&s->lock);
+		if ((s->queued > 0 || s->dropped > 0) && logsocket_connect(s)) {
+			logsocket_queue_dropped(s);
+			logsocket_write(s, NULL, 0);
+		}
+		spin_unlock(&s->lock);
+		break;
+
+	case LOG_NOTIFY_SHUTDOWN:
+		// a last attempt to get the remaining messages out
+		if (s->queued > 0 && s->handle != LOGSOCKET_INVALID)
+			logsocket_write(s, NULL, 0);
+		logsocket_close(s);
+		free(s->queue);
+		free(s->path);
+		free(s);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/** Start streaming log messages to a receiver, e.g. a log viewer.
+
+@param path
+Under Windows, the name of a named pipe (e.g. `"\\\\.\\pipe\\lucciefr"`).
+Otherwise the path of a Unix domain socket. The receiver has to create it
+(i.e. listen for connections), but may do so at any time.
+
+@param queue_size
+the maximum number of bytes to hold for sending, `0` means LOGSOCKET_QUEUE_SIZE
+
+@returns the backend entry (see log_register_backend()), or `NULL` on error
+(e.g. an invalid path)
+*/
+backend_list_t *log_socket(const char *path, size_t queue_size) {
+#if !_WINDOWS
+	if (strlen(path) >= sizeof(((struct sockaddr_un *)NULL)->sun_path))
+		return NULL;
+#endif
+	logsocket_t *s = calloc(1, sizeof(logsocket_t));
+	if (!s) return NULL;
+	s->path = strdup(path);
+	if (!s->path) {
+		free(s);
+		return NULL;
+	}
+	s->lock = SPINLOCK_INIT;
+	s->handle = LOGSOCKET_INVALID;
+	s->limit = queue_size ? queue_size : LOGSOCKET_QUEUE_SIZE;
+	logsocket_connect(s);
+
+	backend_list_t *backend =
+		log_register_batch_backend(logsocket_callback, logsocket_notify, s, NULL);
+	if (!backend) logsocket_notify(LOG_NOTIFY_SHUTDOWN, s);
+	return backend;
+}
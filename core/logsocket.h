@@ -0,0 +1,15 @@
+/// @file logsocket.h
+
+#ifndef LOGSOCKET_H
+#define LOGSOCKET_H
+
+#include "log.h"
+
+/// default limit (bytes) for messages that wait to be sent, see log_socket()
+#define LOGSOCKET_QUEUE_SIZE	(1024 * 1024)
+/// minimum interval (ms) between connection attempts
+#define LOGSOCKET_RETRY_MS		500
+
+backend_list_t *log_socket(const char *path, size_t queue_size);
+
+#endif // LOGSOCKET_H
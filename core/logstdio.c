@@ -6,25 +6,72 @@ stdio logging in "text" form (human readable output).
 This file implements logging backends that write human-readable output to
 standard streams, including `stdout` and `stderr`.
 Use log_stdio() to register a new logger.
+
+The backend doesn't unpack the messages it receives. Instead it walks the
+serialized MessagePack data directly (see msgpack_read_item()), renders
+each message into a single line buffer, and writes that with one `fwrite()`.
+When to flush the stream is configurable, see log_stdio_set_flush().
+Timestamps get formatted with a (per-thread) ::timestamp_cache_t.
 */
 
 #include "logstdio.h"
 
+#include "atomics.h"
 #include "log.h"
+#include "logdict.h"
+#include "logformat.h"
 #include "mpkutils.h"
+#include "threads.h"
 #include "timing.h"
 
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// initial size of the buffer that a line of text gets rendered into
+#define LOG_LINE_SIZE		512
+/// default flush interval (ms) for log files, see log_stdio_set_flush()
+#define LOG_FLUSH_INTERVAL_MS	1000
+
+// format a log timestamp (local time, with milliseconds), using a per-thread cache
+static const char *log_timestamp(double timestamp, size_t *length) {
+	static THREAD_LOCAL timestamp_cache_t cache;
+	if (!cache.format) timestamp_cache_init(&cache, "%H:%M:%S.qqq ", true);
+	return timestamp_cache_update(&cache, timestamp, length);
+}
+
+// resolve an interned origin or format string (a dictionary ID, see
+// logdict.c) to its string
+static void log_resolve(msgpack_object *obj) {
+	if (obj->type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+		size_t len = 0;
+		const char *str = log_dict_string(obj->via.u64, &len);
+		obj->type = MSGPACK_OBJECT_STR;
+		obj->via.str.ptr = str ? str : "";
+		obj->via.str.size = len;
+	}
+}
 
 /// output MessagePack object to stream in text format
 void log_text(FILE *stream, msgpack_object *msg) {
 	// helper macro to access a specific array element
 	#define MEMBER(n)	msg->via.array.ptr[n]
 
+	LOG_LEVEL level = MEMBER(0).via.u64;
+	if (level == LOG_LEVEL_DICTIONARY) return; // (no text representation)
+
 	//msgpack_object_print(stream, *msg); // (print msgpack array, DEBUG only)
 
 	// process ID
-	if (MEMBER(3).type != MSGPACK_OBJECT_NIL)
-		fprintf(stream, "PID 0x%X ", (unsigned int)MEMBER(3).via.u64);
+	unsigned int pid = 0;
+	if (MEMBER(3).type != MSGPACK_OBJECT_NIL) {
+		pid = MEMBER(3).via.u64;
+		fprintf(stream, "PID 0x%X ", pid);
+	}
+	// thread ID (only if it differs, i.e. not for the main thread on Linux)
+	if (log_message_version(msg) >= 2 && MEMBER(LOG_FIELD_TID).via.u64 != pid)
+		fprintf(stream, "TID 0x%X ", (unsigned int)MEMBER(LOG_FIELD_TID).via.u64);
 
 	// indentation (DEBUG only)
 	//fprintf(stream, "@%u ", (unsigned int)MEMBER(1).via.u64);
@@ -32,20 +79,18 @@ void log_text(FILE *stream, msgpack_object *msg) {
 	//fprintf(stream, "#%u ", (uint32_t)MEMBER(7).via.u64);
 
 	// log level
-	LOG_LEVEL level = MEMBER(0).via.u64;
 	putc('[', stream);
 	fputs(log_level_string(level), stream);
 	fputs("] ", stream);
 
 	double timestamp = MEMBER(2).via.f64;
-	if (timestamp > 0) { // log timestamp (UTC seconds since the Epoch)
-		char time_str[16];
-		format_timestamp(time_str, sizeof(time_str), "%H:%M:%S.qqq ", timestamp, true);
-		fputs(time_str, stream);
-	}
+	if (timestamp > 0) // log timestamp (UTC seconds since the Epoch)
+		fputs(log_timestamp(timestamp, NULL), stream);
 
 	// message origin (e.g. module)
-	if (msgpack_object_str_fwrite(MEMBER(4).via.str, stream))
+	msgpack_object origin = MEMBER(4);
+	log_resolve(&origin);
+	if (msgpack_object_str_fwrite(origin.via.str, stream))
 		fputs(": ", stream);
 
 	switch (level) {
@@ -67,7 +112,23 @@ void log_text(FILE *stream, msgpack_object *msg) {
 		break;
 
 	default:
-		msgpack_object_str_fwrite(MEMBER(5).via.str, stream); // the actual message
+		if (msg->via.array.size > LOG_FIELD_ARGS && log_message_version(msg) >= 3) {
+			// deferred formatting, MSG is the format string
+			msgpack_object fmt = MEMBER(5);
+			log_args_t args;
+			log_resolve(&fmt);
+			if (fmt.type == MSGPACK_OBJECT_STR
+				&& log_args_from_object(&args, &MEMBER(LOG_FIELD_ARGS)))
+			{
+				char buffer[LOG_LINE_SIZE];
+				size_t len;
+				char *text = log_format_buffer(buffer, sizeof(buffer),
+						fmt.via.str.ptr, fmt.via.str.size, args, &len);
+				if (text) fwrite(text, 1, len, stream);
+				if (text != buffer) free(text);
+			}
+		} else
+			msgpack_object_str_fwrite(MEMBER(5).via.str, stream); // the actual message
 		// optional attachment (arbitrary MessagePack object)
 		if (MEMBER(6).type != MSGPACK_OBJECT_NIL) {
 			fputs("\n\t", stream); // new line and TAB
@@ -77,65 +138,384 @@ void log_text(FILE *stream, msgpack_object *msg) {
 
 	putc('\n', stream);
 	fflush(stream);
+	#undef MEMBER
+}
+
+
+/* streaming formatter, renders serialized messages into a line buffer */
+
+// a line of text (that may grow beyond its initial fixed-size buffer)
+typedef struct {
+	char *data;
+	size_t size, alloc;
+	char fixed[LOG_LINE_SIZE];
+} log_line_t;
+
+// make room for `len` more chars, returns `false` if out of memory
+static bool line_reserve(log_line_t *line, size_t len) {
+	if (line->size + len < line->alloc) return true;
+	size_t alloc = line->alloc * 2;
+	while (alloc <= line->size + len) alloc *= 2;
+	char *data = malloc(alloc);
+	if (!data) return false;
+	memcpy(data, line->data, line->size);
+	if (line->data != line->fixed) free(line->data);
+	line->data = data;
+	line->alloc = alloc;
+	return true;
+}
+
+static void line_append(log_line_t *line, const char *str, size_t len) {
+	if (len > 0 && line_reserve(line, len)) {
+		memcpy(line->data + line->size, str, len);
+		line->size += len;
+	}
+}
+
+/// append a (constant) string literal
+#define line_literal(line, s)	line_append(line, "" s, sizeof(s)-1)
+
+static void line_printf(log_line_t *line, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	size_t avail = line->alloc - line->size;
+	int len = vsnprintf(line->data + line->size, avail, fmt, ap);
+	va_end(ap);
+	if (len < 0) return;
+	if ((size_t)len >= avail) { // (didn't fit, make room and try again)
+		if (!line_reserve(line, len)) return;
+		va_start(ap, fmt);
+		vsnprintf(line->data + line->size, len + 1, fmt, ap);
+		va_end(ap);
+	}
+	line->size += len;
+}
+
+static void line_str(log_line_t *line, msgpack_object *item) {
+	if (item->type == MSGPACK_OBJECT_STR)
+		line_append(line, item->via.str.ptr, item->via.str.size);
+}
+
+// append the text of a message with deferred formatting
+static void line_format_args(log_line_t *line, msgpack_object *fmt, log_args_t args) {
+	if (fmt->type != MSGPACK_OBJECT_STR) return;
+	size_t avail = line->alloc - line->size;
+	int len = log_format_args(line->data + line->size, avail,
+							  fmt->via.str.ptr, fmt->via.str.size, args);
+	if ((size_t)len >= avail) { // (didn't fit, make room and try again)
+		if (!line_reserve(line, len)) return;
+		log_format_args(line->data + line->size, len + 1,
+						fmt->via.str.ptr, fmt->via.str.size, args);
+	}
+	line->size += len;
+}
+
+// render the next item like msgpack_object_print() would,
+// returns `false` if the data is malformed
+static bool line_print_item(log_line_t *line, msgpack_cursor_t *cursor) {
+	msgpack_object item;
+	uint32_t i;
+	if (!msgpack_read_item(cursor, &item)) return false;
+
+	switch (item.type) {
+	case MSGPACK_OBJECT_NIL:
+		line_literal(line, "nil");
+		break;
+	case MSGPACK_OBJECT_BOOLEAN:
+		if (item.via.boolean)
+			line_literal(line, "true");
+		else
+			line_literal(line, "false");
+		break;
+	case MSGPACK_OBJECT_POSITIVE_INTEGER:
+		line_printf(line, "%" PRIu64, item.via.u64);
+		break;
+	case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+		line_printf(line, "%" PRIi64, item.via.i64);
+		break;
+	case MSGPACK_OBJECT_FLOAT:
+		line_printf(line, "%f", item.via.f64);
+		break;
+	case MSGPACK_OBJECT_EXT:
+		line_printf(line, "(ext: %d)\"", (int)item.via.ext.type);
+		line_append(line, item.via.ext.ptr, item.via.ext.size);
+		line_literal(line, "\"");
+		break;
+	case MSGPACK_OBJECT_STR:
+	case MSGPACK_OBJECT_BIN:
+		line_literal(line, "\"");
+		line_append(line, item.via.str.ptr, item.via.str.size);
+		line_literal(line, "\"");
+		break;
+	case MSGPACK_OBJECT_ARRAY:
+		line_literal(line, "[");
+		for (i = 0; i < item.via.array.size; i++) {
+			if (i > 0) line_literal(line, ", ");
+			if (!line_print_item(line, cursor)) return false;
+		}
+		line_literal(line, "]");
+		break;
+	case MSGPACK_OBJECT_MAP:
+		line_literal(line, "{");
+		for (i = 0; i < item.via.map.size; i++) {
+			if (i > 0) line_literal(line, ", ");
+			if (!line_print_item(line, cursor)) return false;
+			line_literal(line, "=>");
+			if (!line_print_item(line, cursor)) return false;
+		}
+		line_literal(line, "}");
+		break;
+	}
+	return true;
+}
+
+// render a serialized log message (the same way as log_text() does)
+static bool line_format(log_line_t *line, const char *data, size_t size) {
+	msgpack_cursor_t cursor = { .pos = data, .end = data + size };
+	msgpack_object msg, member[6];
+	int i;
+
+	if (!msgpack_read_item(&cursor, &msg)
+		|| msg.type != MSGPACK_OBJECT_ARRAY || msg.via.array.size < 8)
+			return false;
+	// level, indentation, timestamp, PID, origin, message text
+	for (i = 0; i < 6; i++)
+		if (!msgpack_read_item(&cursor, &member[i])
+			|| member[i].type == MSGPACK_OBJECT_ARRAY
+			|| member[i].type == MSGPACK_OBJECT_MAP)
+				return false;
+	LOG_LEVEL level = member[0].via.u64;
+	if (level == LOG_LEVEL_DICTIONARY) return true; // (no text representation)
+	log_resolve(&member[4]);
+	log_resolve(&member[5]);
+
+	// the attachment is rendered directly from the data (when needed)
+	msgpack_cursor_t attachment = cursor;
+	msgpack_object peek, serial, tid, version;
+	if (!msgpack_read_item(&cursor, &peek)) return false;
+	// (version 2 messages) serial, thread ID and format version
+	tid.type = version.type = MSGPACK_OBJECT_NIL;
+	if (msg.via.array.size > LOG_FIELD_VERSION) {
+		cursor = attachment;
+		if (!msgpack_skip_item(&cursor)
+			|| !msgpack_read_item(&cursor, &serial)
+			|| !msgpack_read_item(&cursor, &tid)
+			|| !msgpack_read_item(&cursor, &version))
+				return false;
+		if (version.type != MSGPACK_OBJECT_POSITIVE_INTEGER || version.via.u64 < 2)
+			tid.type = MSGPACK_OBJECT_NIL;
+	}
+	// (version 3 messages) arguments for deferred formatting
+	log_args_t args;
+	bool deferred = false;
+	if (msg.via.array.size > LOG_FIELD_ARGS
+		&& version.type == MSGPACK_OBJECT_POSITIVE_INTEGER && version.via.u64 >= 3)
+	{
+		if (!msgpack_skip_item(&cursor) // sequence
+			|| !msgpack_skip_item(&cursor) // timestamp (ns)
+			|| !log_args_from_cursor(&args, &cursor))
+				return false;
+		deferred = true;
+	}
+
+	// process ID
+	unsigned int pid = 0;
+	if (member[3].type != MSGPACK_OBJECT_NIL) {
+		pid = member[3].via.u64;
+		line_printf(line, "PID 0x%X ", pid);
+	}
+	// thread ID (only if it differs, i.e. not for the main thread on Linux)
+	if (tid.type != MSGPACK_OBJECT_NIL && tid.via.u64 != pid)
+		line_printf(line, "TID 0x%X ", (unsigned int)tid.via.u64);
+
+	// log level
+	line_literal(line, "[");
+	const char *level_str = log_level_string(level);
+	line_append(line, level_str, strlen(level_str));
+	line_literal(line, "] ");
+
+	if (member[2].type == MSGPACK_OBJECT_FLOAT && member[2].via.f64 > 0) {
+		// log timestamp (UTC seconds since the Epoch)
+		size_t len;
+		const char *time_str = log_timestamp(member[2].via.f64, &len);
+		line_append(line, time_str, len);
+	}
+
+	// message origin (e.g. module)
+	if (member[4].type == MSGPACK_OBJECT_STR && member[4].via.str.size > 0) {
+		line_str(line, &member[4]);
+		line_literal(line, ": ");
+	}
+
+	switch (level) {
+	case LOG_LEVEL_SEPARATOR: // no message text, no attachment
+		line_literal(line, "----------------------------------------");
+		break;
+
+	case LOG_LEVEL_CHECKPOINT:
+		line_literal(line, "Check point '");
+		line_str(line, &member[5]); // msg = ID/name
+		line_literal(line, "' #");
+		line_print_item(line, &attachment); // attachment = pass count
+		break;
+
+	case LOG_LEVEL_SCRATCHPAD:
+		line_str(line, &member[5]); // msg = key
+		line_literal(line, " <- ");
+		line_str(line, &peek); // attachment = value
+		break;
+
+	default:
+		if (deferred)
+			line_format_args(line, &member[5], args); // format string
+		else
+			line_str(line, &member[5]); // the actual message
+		// optional attachment (arbitrary MessagePack object)
+		if (peek.type != MSGPACK_OBJECT_NIL) {
+			line_literal(line, "\n\t"); // new line and TAB
+			line_print_item(line, &attachment);
+		}
+	}
+	line_literal(line, "\n");
+	return true;
 }
 
-/// output MessagePack sbuffer to stream in text format
-static void log_text_sbuffer(FILE *stream, msgpack_sbuffer *msg) {
-	// deserialize sbuffer to object
-	msgpack_zone mempool;
-	msgpack_zone_init(&mempool, 1024);
-	msgpack_object deserialized;
-	msgpack_unpack(msg->data, msg->size, NULL, &mempool, &deserialized);
-	// now output the message object
-	log_text(stream, &deserialized);
-	// and free up memory
-	msgpack_zone_destroy(&mempool);
+/** Output a serialized log message (a MessagePack "frame") to a stream in
+text format. This produces the same output as log_text(), but doesn't need
+to unpack the message - and writes it with a single `fwrite()`. It doesn't
+flush the stream.
+
+@returns `false` if the message is malformed (nothing gets written then)
+*/
+bool log_text_raw(FILE *stream, const char *data, size_t size) {
+	log_line_t line = { .size = 0, .alloc = LOG_LINE_SIZE };
+	line.data = line.fixed;
+	bool result = line_format(&line, data, size);
+	if (result) fwrite(line.data, 1, line.size, stream);
+	if (line.data != line.fixed) free(line.data);
+	return result;
 }
 
-// logging backend callback (log sbuffer to FILE *userptr)
+
+/* stdio backend */
+
+// state of a stdio backend
+typedef struct {
+	FILE *stream;
+	LOG_FLUSH flush;
+	unsigned int interval_ms;
+	uint64_t last_flush;	// time of the last flush (ms, see get_elapsed_ns())
+} log_stdio_t;
+
+// logging backend callback (log sbuffer to the stream)
 static void log_stdio_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
 							   void *userptr)
 {
-	if (userptr) {
-/*
-		FILE *output = userptr;
-		if (!output) {
-			LOG_LEVEL level = deserialized.via.array.ptr[0].via.u64;
-			output = (level == LOG_LEVEL_ERROR || level == LOG_LEVEL_FATAL)
-				? stderr : stdout;
+	log_stdio_t *out = userptr;
+	log_text_raw(out->stream, logmsg->data, logmsg->size);
+
+	// important messages always get flushed (also in LOG_FLUSH_INTERVAL mode)
+	LOG_FLUSH mode = ATOMIC_LOAD_RELAXED(&out->flush);
+	bool flush = mode == LOG_FLUSH_LINE
+		|| (level >= LOG_LEVEL_WARNING && level <= LOG_LEVEL_FATAL);
+	if (mode == LOG_FLUSH_INTERVAL) {
+		uint64_t now = get_elapsed_ns() / 1000000;
+		if (flush || now - ATOMIC_LOAD_RELAXED(&out->last_flush)
+				>= ATOMIC_LOAD_RELAXED(&out->interval_ms))
+		{
+			ATOMIC_STORE_REL(&out->last_flush, now);
+			flush = true;
 		}
-*/
-		//log_text_sbuffer(output, logmsg); // log MessagePack object in text form
-		log_text_sbuffer(userptr, logmsg); // log MessagePack object in text form
 	}
+	if (flush) fflush(out->stream);
 }
 
 // backend notification callback
 static void log_stdio_notify(LOG_NOTIFY reason, void *userptr) {
-	if (reason == LOG_NOTIFY_SHUTDOWN) {
+	log_stdio_t *out = userptr;
+	switch (reason) {
+	case LOG_NOTIFY_FLUSH:
+		fflush(out->stream);
+		break;
+
+	case LOG_NOTIFY_SHUTDOWN:
 		//fprintf(stdout, "received shutdown notification (%p)\n", userptr);
-		if (userptr && userptr != stdout && userptr != stderr)
-			fclose(userptr); // close file
+		if (out->stream != stdout && out->stream != stderr)
+			fclose(out->stream); // close file
+		else
+			fflush(out->stream);
+		free(out);
+		break;
+
+	default:
+		break;
 	}
 }
 
 /** Initialize stdio logging.
 This opens the specified log file, and starts writing text log messages to it.
 
+By default, output to `stdout` and `stderr` gets flushed after each message
+(LOG_FLUSH_LINE), while log files use LOG_FLUSH_INTERVAL. See
+log_stdio_set_flush().
+
 @param filename
 The file name to use. **The function recognizes `"stdout"` and `"stderr"` and
 will respect their special meaning.** For other names, the corresponding log
 file will be opened for appending (or a new file created, in case it doesn't
 exist already).
+
+@returns the backend entry (see log_register_backend()), or `NULL` if the
+file couldn't be opened
 */
-void log_stdio(const char *filename) {
-	FILE *stream;
+backend_list_t *log_stdio(const char *filename) {
+	log_stdio_t *out = calloc(1, sizeof(log_stdio_t));
+	if (!out) return NULL;
+	out->flush = LOG_FLUSH_LINE;
 	if (strcasecmp(filename, "stdout") == 0)
-		stream = stdout;
+		out->stream = stdout;
 	else if (strcasecmp(filename, "stderr") == 0)
-		stream = stderr;
-	else
-		stream = fopen(filename, "a"); // TODO: does cygwin use/require "b" here?
-	// register callbacks, using the FILE* as user pointer
-	log_register_backend(log_stdio_callback, log_stdio_notify, stream);
+		out->stream = stderr;
+	else {
+		out->stream = fopen(filename, "a"); // TODO: does cygwin use/require "b" here?
+		out->flush = LOG_FLUSH_INTERVAL;
+		out->interval_ms = LOG_FLUSH_INTERVAL_MS;
+	}
+	if (!out->stream) {
+		free(out);
+		return NULL;
+	}
+	out->last_flush = get_elapsed_ns() / 1000000;
+	// register callbacks, using our state as user pointer
+	return log_register_backend(log_stdio_callback, log_stdio_notify, out);
+}
+
+// (log_backend_update() function for log_stdio_set_flush)
+static void log_stdio_update(void *userptr, void *arg) {
+	log_stdio_t *out = userptr, *settings = arg;
+	ATOMIC_STORE(&out->interval_ms, settings->interval_ms);
+	ATOMIC_STORE(&out->flush, settings->flush);
+}
+
+/** Change when a stdio backend flushes its output stream.
+Regardless of the mode, the stream also gets flushed when the backend
+receives a LOG_NOTIFY_FLUSH notification (see log_flush()), and when it
+gets removed.
+
+@note There's no timer: with LOG_FLUSH_INTERVAL, the interval only gets
+checked when the next message arrives. If logging stops for a while, the
+last messages may remain buffered until then - use log_flush() if they
+should be written out (e.g. before the process idles or waits).
+
+@param backend the backend entry, as returned by log_stdio()
+@param mode see ::LOG_FLUSH
+@param interval_ms the flush interval for LOG_FLUSH_INTERVAL (milliseconds)
+@returns `false` if `backend` isn't a (registered) stdio backend
+*/
+bool log_stdio_set_flush(backend_list_t *backend, LOG_FLUSH mode,
+		unsigned int interval_ms)
+{
+	log_stdio_t settings = { .flush = mode, .interval_ms = interval_ms };
+	return log_backend_update(backend, log_stdio_callback,
+							  log_stdio_update, &settings);
 }
@@ -3,10 +3,25 @@
 #ifndef LOGSTDIO_H
 #define LOGSTDIO_H
 
+#include "log.h"
 #include "msgpack.h"
 #include <stdio.h>
 
+/// when a stdio backend flushes its output, see log_stdio_set_flush()
+typedef enum {
+	LOG_FLUSH_LINE,		///< after each message
+	/// at most every `interval_ms` (checked only when messages arrive, there's
+	/// no timer), and on messages with level LOG_LEVEL_WARNING to LOG_LEVEL_FATAL
+	LOG_FLUSH_INTERVAL,
+	/// only on messages with level LOG_LEVEL_WARNING to LOG_LEVEL_FATAL
+	LOG_FLUSH_LEVEL,
+} LOG_FLUSH;
+
 void log_text(FILE *stream, msgpack_object *msg);
-void log_stdio(const char *filename);
+bool log_text_raw(FILE *stream, const char *data, size_t size);
+
+backend_list_t *log_stdio(const char *filename);
+bool log_stdio_set_flush(backend_list_t *backend, LOG_FLUSH mode,
+		unsigned int interval_ms);
 
 #endif // LOGSTDIO_H
@@ -0,0 +1,255 @@
+/**
+@file logtrace.c
+
+Export log messages in the Chrome [Trace Event Format][1], e.g. to view a
+session with `chrome://tracing` or the [Perfetto UI][2].
+
+Each thread (see LOG_FIELD_TID) gets a track of its own:
+- LOG_LEVEL_ENTER and LOG_LEVEL_LEAVE become "begin" and "end" events,
+  i.e. nested duration slices
+- LOG_LEVEL_CHECKPOINT becomes an "instant" event (with the pass count)
+- regular messages (up to LOG_LEVEL_FATAL) become instant events, too. Use
+  log_backend_set_threshold() to limit them.
+
+log_trace() is a logging backend that streams the events to a JSON file
+while logging. logtrace_convert() does the same "offline", for a segment
+file written by log_file().
+
+[1]: https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+[2]: https://ui.perfetto.dev
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "logtrace.h"
+
+#include "atomics.h"
+#include "logdict.h"
+#include "logfile.h"
+#include "logformat.h"
+#include "mpkutils.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+// state of a trace backend (or conversion)
+typedef struct {
+	spinlock_t lock;
+	FILE *stream;
+	bool first;			// no event written yet
+} logtrace_t;
+
+// resolve an interned string (a dictionary ID, see logdict.c)
+static void trace_resolve(msgpack_object *obj) {
+	if (obj->type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+		size_t len = 0;
+		obj->via.str.ptr = log_dict_string(obj->via.u64, &len);
+		obj->via.str.size = len;
+		obj->type = obj->via.str.ptr ? MSGPACK_OBJECT_STR : MSGPACK_OBJECT_NIL;
+	}
+}
+
+// write a string in JSON notation (quoted and escaped), `NULL` is ""
+static void trace_string(FILE *stream, const msgpack_object *str) {
+	uint32_t i;
+	putc('"', stream);
+	if (str && str->type == MSGPACK_OBJECT_STR)
+		for (i = 0; i < str->via.str.size; i++) {
+			unsigned char c = str->via.str.ptr[i];
+			switch (c) {
+			case '"':  fputs("\\\"", stream); break;
+			case '\\': fputs("\\\\", stream); break;
+			case '\n': fputs("\\n", stream); break;
+			case '\r': fputs("\\r", stream); break;
+			case '\t': fputs("\\t", stream); break;
+			default:
+				if (c < 0x20)
+					fprintf(stream, "\\u%04x", c);
+				else
+					putc(c, stream);
+			}
+		}
+	putc('"', stream);
+}
+
+// write a trace event for a log message, `member` are the message elements
+// (and `args` the arguments of a message with deferred formatting, or NULL)
+static void trace_event(logtrace_t *trace, const msgpack_object *member,
+		size_t count, const log_args_t *args)
+{
+	LOG_LEVEL level = member[LOG_FIELD_LEVEL].via.u64;
+	const char *phase;
+	switch (level) {
+	case LOG_LEVEL_ENTER:
+		phase = "B";
+		break;
+	case LOG_LEVEL_LEAVE:
+		phase = "E";
+		break;
+	case LOG_LEVEL_CHECKPOINT:
+		phase = "i";
+		break;
+	default:
+		if (level > LOG_LEVEL_FATAL) return; // (no event for other types)
+		phase = "i";
+	}
+
+	// (timestamps are in microseconds)
+	uint64_t timestamp_ns = 0;
+	if (count > LOG_FIELD_TIMESTAMP_NS
+		&& member[LOG_FIELD_TIMESTAMP_NS].type == MSGPACK_OBJECT_POSITIVE_INTEGER)
+			timestamp_ns = member[LOG_FIELD_TIMESTAMP_NS].via.u64;
+	else if (member[LOG_FIELD_TIMESTAMP].type == MSGPACK_OBJECT_FLOAT)
+		timestamp_ns = member[LOG_FIELD_TIMESTAMP].via.f64 * 1e9;
+	unsigned int pid = member[LOG_FIELD_PID].type == MSGPACK_OBJECT_POSITIVE_INTEGER
+		? member[LOG_FIELD_PID].via.u64 : 0;
+	unsigned int tid = pid; // (messages from older versions lack the TID)
+	if (count > LOG_FIELD_TID
+		&& member[LOG_FIELD_TID].type == MSGPACK_OBJECT_POSITIVE_INTEGER)
+			tid = member[LOG_FIELD_TID].via.u64;
+
+	FILE *stream = trace->stream;
+	if (!trace->first) fputs(",\n", stream);
+	trace->first = false;
+	fprintf(stream, "{\"ph\":\"%s\",\"ts\":%" PRIu64 ".%03u,\"pid\":%u,\"tid\":%u,\"name\":",
+			phase, timestamp_ns / 1000, (unsigned int)(timestamp_ns % 1000), pid, tid);
+	msgpack_object name = member[LOG_FIELD_MSG];
+	if (args) {
+		// deferred formatting, the message is a format string
+		char buffer[256], *text = NULL;
+		trace_resolve(&name);
+		if (name.type == MSGPACK_OBJECT_STR) {
+			size_t len;
+			text = log_format_buffer(buffer, sizeof(buffer),
+					name.via.str.ptr, name.via.str.size, *args, &len);
+			name.via.str.ptr = text;
+			name.via.str.size = len;
+		}
+		trace_string(stream, text ? &name : NULL);
+		if (text != buffer) free(text);
+	} else
+		trace_string(stream, &name);
+	msgpack_object origin = member[LOG_FIELD_ORIGIN];
+	trace_resolve(&origin);
+	if (origin.type == MSGPACK_OBJECT_STR) {
+		fputs(",\"cat\":", stream);
+		trace_string(stream, &origin);
+	}
+	if (*phase == 'i') // (instant events are "thread" scoped)
+		fputs(",\"s\":\"t\"", stream);
+	if (level == LOG_LEVEL_CHECKPOINT
+		&& member[LOG_FIELD_ATTACHMENT].type == MSGPACK_OBJECT_POSITIVE_INTEGER)
+			fprintf(stream, ",\"args\":{\"pass\":%u}",
+					(unsigned int)member[LOG_FIELD_ATTACHMENT].via.u64);
+	else if (level <= LOG_LEVEL_FATAL)
+		fprintf(stream, ",\"args\":{\"level\":\"%s\"}", log_level_string(level));
+	putc('}', stream);
+}
+
+// logging backend callback, reads the message elements without unpacking it
+static void logtrace_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	msgpack_cursor_t cursor = { .pos = logmsg->data, .end = logmsg->data + logmsg->size };
+	msgpack_object msg, member[LOG_FIELD_COUNT];
+	log_args_t args;
+	bool deferred = false;
+	size_t i, count;
+
+	if (!msgpack_read_item(&cursor, &msg) || msg.type != MSGPACK_OBJECT_ARRAY
+		|| msg.via.array.size <= LOG_FIELD_SERIAL)
+			return;
+	count = msg.via.array.size < LOG_FIELD_COUNT ? msg.via.array.size : LOG_FIELD_COUNT;
+	for (i = 0; i < count; i++) {
+		msgpack_cursor_t start = cursor;
+		if (!msgpack_read_item(&cursor, &member[i])) return;
+		if (i == LOG_FIELD_ARGS) {
+			// (keep the arguments serialized, they only get formatted)
+			cursor = start;
+			if (!log_args_from_cursor(&args, &cursor)) return;
+			member[i].type = MSGPACK_OBJECT_NIL;
+			deferred = true;
+		}
+		else if (member[i].type == MSGPACK_OBJECT_ARRAY
+			|| member[i].type == MSGPACK_OBJECT_MAP)
+		{
+			// (we're not interested in the contents, e.g. of an attachment)
+			cursor = start;
+			if (!msgpack_skip_item(&cursor)) return;
+			member[i].type = MSGPACK_OBJECT_NIL;
+		}
+	}
+
+	logtrace_t *trace = userptr;
+	spin_lock(&trace->lock);
+	trace_event(trace, member, count, deferred ? &args : NULL);
+	spin_unlock(&trace->lock);
+}
+
+// backend notification callback
+static void logtrace_notify(LOG_NOTIFY reason, void *userptr) {
+	logtrace_t *trace = userptr;
+	switch (reason) {
+	case LOG_NOTIFY_FLUSH:
+		spin_lock(&trace->lock);
+		fflush(trace->stream);
+		spin_unlock(&trace->lock);
+		break;
+
+	case LOG_NOTIFY_SHUTDOWN:
+		fputs("\n]\n", trace->stream);
+		fclose(trace->stream);
+		free(trace);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/** Start writing a trace file (in Chrome's JSON Trace Event Format).
+The file gets overwritten, and it's a complete JSON document once the backend
+has been removed (e.g. by log_shutdown()). Trace viewers also accept files
+that lack the closing bracket, e.g. after a crash.
+
+@returns the backend entry (see log_register_backend()), or `NULL` if the
+file couldn't be created
+*/
+backend_list_t *log_trace(const char *filename) {
+	logtrace_t *trace = calloc(1, sizeof(logtrace_t));
+	if (!trace) return NULL;
+	trace->stream = fopen(filename, "w");
+	if (!trace->stream) {
+		free(trace);
+		return NULL;
+	}
+	trace->lock = SPINLOCK_INIT;
+	trace->first = true;
+	fputs("[\n", trace->stream);
+	return log_register_backend(logtrace_callback, logtrace_notify, trace);
+}
+
+// callback for logtrace_convert()
+static void logtrace_convert_callback(msgpack_object *msg, void *userptr) {
+	size_t count = msg->via.array.size;
+	log_args_t args;
+	bool deferred = count > LOG_FIELD_ARGS
+		&& log_args_from_object(&args, &msg->via.array.ptr[LOG_FIELD_ARGS]);
+	trace_event(userptr, msg->via.array.ptr,
+			count < LOG_FIELD_COUNT ? count : LOG_FIELD_COUNT,
+			deferred ? &args : NULL);
+}
+
+/** Convert a segment file (see log_file()) to a trace.
+@param segment_filename the segment file
+@param stream output for the trace (a complete JSON document)
+@returns the number of messages, or -1 on error
+*/
+int logtrace_convert(const char *segment_filename, FILE *stream) {
+	logtrace_t trace = { .stream = stream, .first = true };
+	fputs("[\n", stream);
+	int result = logfile_read(segment_filename, logtrace_convert_callback, &trace);
+	fputs("\n]\n", stream);
+	return result;
+}
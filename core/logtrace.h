@@ -0,0 +1,13 @@
+/// @file logtrace.h
+
+#ifndef LOGTRACE_H
+#define LOGTRACE_H
+
+#include "log.h"
+
+#include <stdio.h>
+
+backend_list_t *log_trace(const char *filename);
+int logtrace_convert(const char *segment_filename, FILE *stream);
+
+#endif // LOGTRACE_H
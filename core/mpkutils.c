@@ -41,3 +41,167 @@ size_t msgpack_object_str_fwrite(msgpack_object_str str, FILE *stream) {
 	if (str.size > 0) return fwrite(str.ptr, 1, str.size, stream);
 	return 0;
 }
+
+// helper to decode a big-endian unsigned integer of `n` bytes
+static inline uint64_t msgpack_read_be(const unsigned char *p, int n) {
+	uint64_t result = 0;
+	while (n-- > 0) result = result << 8 | *p++;
+	return result;
+}
+
+/** Read a single item from raw MessagePack data, and advance the cursor.
+Scalar values and strings / binary data (`via.str.ptr` etc. point into the
+data) get stored to `item`. For arrays and maps, this only reads the header:
+`via.array.size` (or `via.map.size`) receives the number of elements, and
+`via.array.ptr` is `NULL` - the elements follow as individual items (two per
+map entry, key and value).
+
+@returns `false` if the data is malformed or truncated
+*/
+bool msgpack_read_item(msgpack_cursor_t *cursor, msgpack_object *item) {
+	const unsigned char *p = (const unsigned char *)cursor->pos;
+	const unsigned char *end = (const unsigned char *)cursor->end;
+	#define NEED(n)	if (end - p < (ptrdiff_t)(n)) return false
+
+	NEED(1);
+	unsigned char c = *p++;
+	int size = 0;			// size of a length / value field following c
+	uint32_t length = 0;	// length of string, binary or extension data
+
+	if (c <= 0x7F || c >= 0xE0) { // positive / negative fixint
+		item->type = c <= 0x7F
+			? MSGPACK_OBJECT_POSITIVE_INTEGER : MSGPACK_OBJECT_NEGATIVE_INTEGER;
+		item->via.i64 = (int8_t)c;
+		if (c <= 0x7F) item->via.u64 = c;
+	}
+	else if (c <= 0x8F || (c >= 0x90 && c <= 0x9F)) { // fixmap, fixarray
+		item->type = c <= 0x8F ? MSGPACK_OBJECT_MAP : MSGPACK_OBJECT_ARRAY;
+		item->via.array.size = c & 0x0F;
+		item->via.array.ptr = NULL;
+	}
+	else if (c <= 0xBF) { // fixstr
+		item->type = MSGPACK_OBJECT_STR;
+		length = c & 0x1F;
+	}
+	else switch (c) {
+	case 0xC0:
+		item->type = MSGPACK_OBJECT_NIL;
+		break;
+	case 0xC2:
+	case 0xC3:
+		item->type = MSGPACK_OBJECT_BOOLEAN;
+		item->via.boolean = c == 0xC3;
+		break;
+
+	case 0xC4: case 0xC5: case 0xC6: // bin 8/16/32
+		item->type = MSGPACK_OBJECT_BIN;
+		size = 1 << (c - 0xC4);
+		NEED(size);
+		length = msgpack_read_be(p, size);
+		p += size;
+		break;
+	case 0xD9: case 0xDA: case 0xDB: // str 8/16/32
+		item->type = MSGPACK_OBJECT_STR;
+		size = 1 << (c - 0xD9);
+		NEED(size);
+		length = msgpack_read_be(p, size);
+		p += size;
+		break;
+	case 0xC7: case 0xC8: case 0xC9: // ext 8/16/32
+		item->type = MSGPACK_OBJECT_EXT;
+		size = 1 << (c - 0xC7);
+		NEED(size + 1);
+		length = msgpack_read_be(p, size);
+		p += size;
+		item->via.ext.type = (int8_t)*p++;
+		break;
+	case 0xD4: case 0xD5: case 0xD6: case 0xD7: case 0xD8: // fixext 1-16
+		item->type = MSGPACK_OBJECT_EXT;
+		NEED(1);
+		length = 1 << (c - 0xD4);
+		item->via.ext.type = (int8_t)*p++;
+		break;
+
+	case 0xCA: { // float 32
+		NEED(4);
+		union { uint32_t u; float f; } value = { .u = msgpack_read_be(p, 4) };
+		item->type = MSGPACK_OBJECT_FLOAT;
+		item->via.f64 = value.f;
+		p += 4;
+		break;
+	}
+	case 0xCB: { // float 64
+		NEED(8);
+		union { uint64_t u; double f; } value = { .u = msgpack_read_be(p, 8) };
+		item->type = MSGPACK_OBJECT_FLOAT;
+		item->via.f64 = value.f;
+		p += 8;
+		break;
+	}
+	case 0xCC: case 0xCD: case 0xCE: case 0xCF: // uint 8/16/32/64
+		size = 1 << (c - 0xCC);
+		NEED(size);
+		item->type = MSGPACK_OBJECT_POSITIVE_INTEGER;
+		item->via.u64 = msgpack_read_be(p, size);
+		p += size;
+		break;
+	case 0xD0: case 0xD1: case 0xD2: case 0xD3: // int 8/16/32/64
+		size = 1 << (c - 0xD0);
+		NEED(size);
+		item->via.i64 = msgpack_read_be(p, size);
+		if (size < 8) // (sign extension)
+			item->via.i64 = (item->via.i64 ^ (1ULL << (size * 8 - 1)))
+				- (1LL << (size * 8 - 1));
+		item->type = item->via.i64 < 0
+			? MSGPACK_OBJECT_NEGATIVE_INTEGER : MSGPACK_OBJECT_POSITIVE_INTEGER;
+		p += size;
+		break;
+
+	case 0xDC: case 0xDD: // array 16/32
+	case 0xDE: case 0xDF: // map 16/32
+		item->type = c <= 0xDD ? MSGPACK_OBJECT_ARRAY : MSGPACK_OBJECT_MAP;
+		size = c & 1 ? 4 : 2;
+		NEED(size);
+		item->via.array.size = msgpack_read_be(p, size);
+		item->via.array.ptr = NULL;
+		p += size;
+		break;
+
+	default: // (0xC1 is "never used")
+		return false;
+	}
+
+	if (item->type == MSGPACK_OBJECT_STR || item->type == MSGPACK_OBJECT_BIN
+		|| item->type == MSGPACK_OBJECT_EXT)
+	{
+		NEED(length);
+		// (str, bin and ext share the layout of size and ptr)
+		if (item->type == MSGPACK_OBJECT_EXT) {
+			item->via.ext.size = length;
+			item->via.ext.ptr = (const char *)p;
+		} else {
+			item->via.str.size = length;
+			item->via.str.ptr = (const char *)p;
+		}
+		p += length;
+	}
+	cursor->pos = (const char *)p;
+	return true;
+	#undef NEED
+}
+
+/// skip a complete item (including all elements of an array or map)
+/// @returns `false` if the data is malformed or truncated
+bool msgpack_skip_item(msgpack_cursor_t *cursor) {
+	msgpack_object item;
+	size_t pending = 1; // number of items still to skip
+	while (pending > 0) {
+		if (!msgpack_read_item(cursor, &item)) return false;
+		pending--;
+		if (item.type == MSGPACK_OBJECT_ARRAY)
+			pending += item.via.array.size;
+		else if (item.type == MSGPACK_OBJECT_MAP)
+			pending += 2 * (size_t)item.via.map.size;
+	}
+	return true;
+}
@@ -30,4 +30,15 @@ void msgpack_object_from_lstring(msgpack_object *object, const char *str, size_t
 // write msgpack_object_str to a stream
 size_t msgpack_object_str_fwrite(msgpack_object_str str, FILE *stream);
 
+/** A cursor for reading raw (serialized) MessagePack data item by item,
+without unpacking it into objects first. See msgpack_read_item().
+*/
+typedef struct {
+	const char *pos;	///< current read position
+	const char *end;	///< end of the data
+} msgpack_cursor_t;
+
+bool msgpack_read_item(msgpack_cursor_t *cursor, msgpack_object *item);
+bool msgpack_skip_item(msgpack_cursor_t *cursor);
+
 #endif // MPKUTILS_H
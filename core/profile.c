@@ -0,0 +1,408 @@
+/**
+@file profile.c
+
+Lightweight profiling of code sections ("zones").
+
+LOG_LEVEL_ENTER and LOG_LEVEL_LEAVE messages can show nested scopes, but
+they don't measure anything - and creating a log message for every call of
+a frequently used function (e.g. a hook handler) would be way too costly.
+The profiler instead collects durations: profile_begin() and profile_end()
+(or the PROFILE_SCOPE() macro) take nanosecond timestamps, see
+get_elapsed_ns(), and record them along with the zone ID in a per-thread
+buffer. That buffer gets merged into the global per-zone statistics (call
+count, total / min / max duration and a histogram) when it's full, or at
+least every 100 ms.
+
+With profile_configure(), the profiler periodically emits a summary: a log
+message that carries the statistics of all active zones as its attachment
+(an array of maps). You may also request one with profile_summary().
+
+Zones are static descriptors, see ::profile_zone_t. They get a numeric ID
+when used for the first time, which is the only time we need to take a lock
+(besides merging a thread's buffer).
+
+Scopes that ended recently may still sit in a thread's buffer. It gets
+merged when the thread exits (by a pthread key destructor).
+
+@note Under Windows, the library does that on DLL_THREAD_DETACH (see
+dllmain-win.c). Elsewhere (e.g. linked statically), a thread should call
+profile_flush() before it exits.
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "profile.h"
+
+#include "atomics.h"
+#include "mpkutils.h"
+#include "threads.h"
+#include "timing.h"
+
+#include "lauxlib.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/// number of events that a thread can buffer
+#define PROFILE_BUFFER_SIZE	256
+/// a thread merges its buffer (at least) this often, in nanoseconds
+#define PROFILE_FLUSH_NS	100000000ULL
+/// origin for summary messages
+#define PROFILE_ORIGIN		"profile"
+
+// a completed scope
+typedef struct {
+	uint32_t id;
+	uint64_t start, end;
+} profile_event_t;
+
+// per-thread event buffer
+static THREAD_LOCAL struct {
+	size_t count;
+	uint64_t flushed;		// time of the last flush
+	bool registered;		// for the thread exit handler (see buffer_register())
+	profile_event_t events[PROFILE_BUFFER_SIZE];
+} buffer;
+
+// global profiler state
+static struct {
+	spinlock_t lock;
+	uint32_t count;			// number of registered zones
+	profile_zone_t *zones[PROFILE_MAX_ZONES];
+	profile_stats_t stats[PROFILE_MAX_ZONES];
+	unsigned int interval_ms; // automatic summaries, 0 = disabled
+	LOG_LEVEL level;		// log level for summaries
+	uint64_t last_summary;	// time of the last automatic summary
+} profile = { .lock = SPINLOCK_INIT, .level = LOG_LEVEL_INFO };
+
+/** Retrieve the ID of a zone, registering it if necessary.
+@returns the zone ID, or 0 if there are too many zones (see PROFILE_MAX_ZONES)
+*/
+uint32_t profile_zone_id(profile_zone_t *zone) {
+	uint32_t id = ATOMIC_LOAD_ACQ(&zone->id);
+	if (id) return id;
+
+	spin_lock(&profile.lock);
+	id = zone->id; // (check again, now that we hold the lock)
+	if (!id && profile.count < PROFILE_MAX_ZONES) {
+		id = profile.count + 1;
+		profile.zones[id - 1] = zone;
+		memset(&profile.stats[id - 1], 0, sizeof(profile_stats_t));
+		ATOMIC_STORE_REL(&profile.count, id);
+		ATOMIC_STORE_REL(&zone->id, id);
+	}
+	spin_unlock(&profile.lock);
+	return id;
+}
+
+/// begin a profiling scope, to be ended with profile_end()
+profile_scope_t profile_begin(profile_zone_t *zone) {
+	profile_scope_t scope = { profile_zone_id(zone), get_elapsed_ns() };
+	return scope;
+}
+
+/// end a profiling scope (that was started with profile_begin())
+void profile_end(profile_scope_t *scope) {
+	if (scope->id) profile_record(scope->id, scope->start, get_elapsed_ns());
+}
+
+// merge an event into the statistics (with lock held)
+static void profile_add(profile_stats_t *stats, uint64_t duration) {
+	if (stats->count == 0 || duration < stats->min_ns) stats->min_ns = duration;
+	if (duration > stats->max_ns) stats->max_ns = duration;
+	stats->count++;
+	stats->total_ns += duration;
+	int bucket = duration ? 63 - __builtin_clzll(duration) : 0;
+	if (bucket >= PROFILE_BUCKETS) bucket = PROFILE_BUCKETS - 1;
+	stats->histogram[bucket]++;
+}
+
+// merge the thread's buffer into the global statistics
+static void profile_merge(uint64_t now) {
+	size_t i;
+	if (buffer.count > 0) {
+		spin_lock(&profile.lock);
+		for (i = 0; i < buffer.count; i++) {
+			profile_event_t *event = &buffer.events[i];
+			profile_add(&profile.stats[event->id - 1], event->end - event->start);
+		}
+		spin_unlock(&profile.lock);
+		buffer.count = 0;
+	}
+	buffer.flushed = now;
+}
+
+#if !_WINDOWS
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+
+// thread exit handler (pthread key "destructor"), merges the buffered events
+static void buffer_destructor(void *ptr) {
+	profile_merge(get_elapsed_ns());
+	buffer.registered = false; // (the key value has been reset to NULL)
+}
+
+static void buffer_key_create(void) {
+	pthread_key_create(&buffer_key, buffer_destructor);
+}
+#endif
+
+// make sure the thread's buffer gets merged when the thread exits
+static void buffer_register(void) {
+	buffer.registered = true;
+#if !_WINDOWS
+	// set a (non-NULL) key value, so buffer_destructor() gets called
+	pthread_once(&buffer_once, buffer_key_create);
+	pthread_setspecific(buffer_key, &buffer);
+#endif
+}
+
+/** Record a completed scope (with given begin and end time).
+This is the low-level function behind profile_end(), e.g. for timestamps
+that were taken elsewhere (see get_elapsed_ns()).
+*/
+void profile_record(uint32_t id, uint64_t start, uint64_t end) {
+	if (id == 0 || id > ATOMIC_LOAD_ACQ(&profile.count)) return;
+	if (!buffer.registered) buffer_register();
+	profile_event_t *event = &buffer.events[buffer.count++];
+	event->id = id;
+	event->start = start;
+	event->end = end;
+	if (buffer.count < PROFILE_BUFFER_SIZE && end - buffer.flushed < PROFILE_FLUSH_NS)
+		return;
+	profile_merge(end);
+
+	// time for an automatic summary?
+	uint64_t interval = ATOMIC_LOAD_RELAXED(&profile.interval_ms) * 1000000ULL;
+	if (interval) {
+		uint64_t last = ATOMIC_LOAD_RELAXED(&profile.last_summary);
+		if (end - last >= interval && ATOMIC_CAS(&profile.last_summary, &last, end))
+			profile_summary(true);
+	}
+}
+
+/// merge the current thread's buffered events into the global statistics
+void profile_flush(void) {
+	profile_merge(get_elapsed_ns());
+}
+
+/** Set up automatic summaries.
+@param interval_ms emit a summary (at most) this often, `0` disables them
+@param level the log level for summary messages
+*/
+void profile_configure(unsigned int interval_ms, LOG_LEVEL level) {
+	ATOMIC_STORE(&profile.level, level);
+	ATOMIC_STORE(&profile.last_summary, get_elapsed_ns());
+	ATOMIC_STORE(&profile.interval_ms, interval_ms);
+}
+
+// create a MessagePack map entry (with an unsigned integer value)
+static void profile_kv(msgpack_object_kv *kv, const char *key, uint64_t value) {
+	msgpack_object_from_string(&kv->key, key);
+	kv->val.type = MSGPACK_OBJECT_POSITIVE_INTEGER;
+	kv->val.via.u64 = value;
+}
+
+/** Emit a summary of all zones that have been active (since the last reset).
+The summary is a log message, with an array of maps as its attachment:
+`{zone = name, count = n, total_ns = ..., min_ns = ..., max_ns = ...,
+histogram = {...}}`, where the histogram has the number of durations in
+[2^i, 2^(i+1)) nanoseconds at index `i` (and omits trailing zeros).
+
+@param reset reset the statistics afterwards
+@returns the number of zones in the summary
+*/
+int profile_summary(bool reset) {
+	profile_flush();
+
+	// take a snapshot of the statistics, so we don't hold the lock while logging
+	profile_stats_t *stats = malloc(PROFILE_MAX_ZONES * sizeof(profile_stats_t));
+	const char **names = malloc(PROFILE_MAX_ZONES * sizeof(char *));
+	uint32_t i, count = 0;
+	if (!stats || !names) {
+		free(stats);
+		free(names);
+		return -1;
+	}
+	spin_lock(&profile.lock);
+	for (i = 0; i < profile.count; i++) {
+		if (profile.stats[i].count == 0) continue;
+		names[count] = profile.zones[i]->name;
+		stats[count++] = profile.stats[i];
+		if (reset) memset(&profile.stats[i], 0, sizeof(profile_stats_t));
+	}
+	spin_unlock(&profile.lock);
+
+	msgpack_zone mz;
+	msgpack_zone_init(&mz, 4096);
+	msgpack_object attachment = {.type = MSGPACK_OBJECT_ARRAY};
+	attachment.via.array.size = count;
+	attachment.via.array.ptr = msgpack_zone_malloc(&mz, count * sizeof(msgpack_object));
+	if (!attachment.via.array.ptr) attachment.via.array.size = count = 0;
+	for (i = 0; i < count && attachment.via.array.ptr; i++) {
+		msgpack_object *zone = &attachment.via.array.ptr[i];
+		msgpack_object_kv *kv = msgpack_zone_malloc(&mz, 6 * sizeof(msgpack_object_kv));
+		uint32_t buckets = PROFILE_BUCKETS, b;
+		while (buckets > 0 && stats[i].histogram[buckets - 1] == 0) buckets--;
+		msgpack_object *histogram = msgpack_zone_malloc(&mz,
+				buckets * sizeof(msgpack_object) + 1);
+		if (!kv || !histogram) {
+			attachment.via.array.size = i;
+			break;
+		}
+		zone->type = MSGPACK_OBJECT_MAP;
+		zone->via.map.size = 6;
+		zone->via.map.ptr = kv;
+		msgpack_object_from_literal(&kv[0].key, "zone");
+		msgpack_object_from_string(&kv[0].val, names[i]);
+		profile_kv(&kv[1], "count", stats[i].count);
+		profile_kv(&kv[2], "total_ns", stats[i].total_ns);
+		profile_kv(&kv[3], "min_ns", stats[i].min_ns);
+		profile_kv(&kv[4], "max_ns", stats[i].max_ns);
+		msgpack_object_from_literal(&kv[5].key, "histogram");
+		kv[5].val.type = MSGPACK_OBJECT_ARRAY;
+		kv[5].val.via.array.size = buckets;
+		kv[5].val.via.array.ptr = histogram;
+		for (b = 0; b < buckets; b++) {
+			histogram[b].type = MSGPACK_OBJECT_POSITIVE_INTEGER;
+			histogram[b].via.u64 = stats[i].histogram[b];
+		}
+	}
+	attach_log_level_fmt(&attachment, ATOMIC_LOAD_RELAXED(&profile.level),
+			PROFILE_ORIGIN, "profile summary, %u zone(s)", count);
+
+	msgpack_zone_destroy(&mz);
+	free(stats);
+	free(names);
+	return count;
+}
+
+/** Retrieve the statistics for a zone.
+If multiple zones have the same name, their statistics get combined.
+The current thread's buffered events are included (see profile_flush()).
+@returns `false` if there's no zone with that name
+*/
+bool profile_get_stats(const char *name, profile_stats_t *stats) {
+	uint32_t i, b;
+	bool found = false;
+	profile_flush();
+	memset(stats, 0, sizeof(profile_stats_t));
+	spin_lock(&profile.lock);
+	for (i = 0; i < profile.count; i++) {
+		profile_stats_t *zone = &profile.stats[i];
+		if (strcmp(profile.zones[i]->name, name) != 0) continue;
+		found = true;
+		if (zone->count == 0) continue;
+		if (stats->count == 0 || zone->min_ns < stats->min_ns)
+			stats->min_ns = zone->min_ns;
+		if (zone->max_ns > stats->max_ns) stats->max_ns = zone->max_ns;
+		stats->count += zone->count;
+		stats->total_ns += zone->total_ns;
+		for (b = 0; b < PROFILE_BUCKETS; b++)
+			stats->histogram[b] += zone->histogram[b];
+	}
+	spin_unlock(&profile.lock);
+	return found;
+}
+
+/// reset the statistics of all zones
+void profile_reset(void) {
+	buffer.count = 0;
+	spin_lock(&profile.lock);
+	memset(profile.stats, 0, sizeof(profile.stats));
+	spin_unlock(&profile.lock);
+}
+
+
+// Lua bindings
+
+/// `profile_zone_C(name)`, returns a zone ID (or `nil` if there are too many)
+LUA_CFUNC(profile_zone_C) {
+	const char *name = luaL_checkstring(L, 1);
+	uint32_t i, id = 0;
+
+	// Lua zones get looked up by name, and are created as needed
+	spin_lock(&profile.lock);
+	for (i = 0; i < profile.count && !id; i++)
+		if (strcmp(profile.zones[i]->name, name) == 0) id = i + 1;
+	spin_unlock(&profile.lock);
+	if (!id) {
+		profile_zone_t *zone = malloc(sizeof(profile_zone_t));
+		char *copy = strdup(name);
+		if (zone && copy) {
+			zone->name = copy;
+			zone->id = 0;
+			id = profile_zone_id(zone);
+		}
+		if (!id) { // (never registered)
+			free(zone);
+			free(copy);
+		}
+	}
+	if (!id) return 0;
+	lua_pushinteger(L, id);
+	return 1;
+}
+
+/// `profile_begin_C()`, returns a timestamp to pass to profile_end_C()
+LUA_CFUNC(profile_begin_C) {
+	lua_pushnumber(L, get_elapsed_ns());
+	return 1;
+}
+
+/// `profile_end_C(id, start)`, record a completed scope
+LUA_CFUNC(profile_end_C) {
+	uint64_t end = get_elapsed_ns();
+	uint32_t id = luaL_checkinteger(L, 1);
+	profile_record(id, luaL_checknumber(L, 2), end);
+	return 0;
+}
+
+/// `profile_summary_C([reset])`, returns the number of zones
+LUA_CFUNC(profile_summary_C) {
+	lua_pushinteger(L, profile_summary(lua_toboolean(L, 1)));
+	return 1;
+}
+
+/// `profile_configure_C(interval_ms [, level])`
+LUA_CFUNC(profile_configure_C) {
+	profile_configure(luaL_checkinteger(L, 1),
+			luaL_optinteger(L, 2, LOG_LEVEL_INFO));
+	return 0;
+}
+
+/// `profile_stats_C(name)`, returns a table with the zone's statistics
+/// (see ::profile_stats_t), or `nil` if there's no such zone
+LUA_CFUNC(profile_stats_C) {
+	profile_stats_t stats;
+	int i;
+	if (!profile_get_stats(luaL_checkstring(L, 1), &stats)) return 0;
+	lua_createtable(L, 0, 5);
+	lua_pushnumber(L, stats.count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, stats.total_ns);
+	lua_setfield(L, -2, "total_ns");
+	lua_pushnumber(L, stats.min_ns);
+	lua_setfield(L, -2, "min_ns");
+	lua_pushnumber(L, stats.max_ns);
+	lua_setfield(L, -2, "max_ns");
+	lua_createtable(L, PROFILE_BUCKETS, 0);
+	for (i = 0; i < PROFILE_BUCKETS; i++) {
+		lua_pushnumber(L, stats.histogram[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "histogram");
+	return 1;
+}
+
+/// register the Lua bindings
+LUA_CFUNC(luaopen_profile) {
+	LREG(L, profile_zone_C);
+	LREG(L, profile_begin_C);
+	LREG(L, profile_end_C);
+	LREG(L, profile_summary_C);
+	LREG(L, profile_configure_C);
+	LREG(L, profile_stats_C);
+	return 0;
+}
@@ -0,0 +1,92 @@
+/// @file profile.h
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "log.h"
+#include "lua.h"
+#include "luahelpers.h"
+
+#include <stdint.h>
+
+/// maximum number of distinct profiling zones
+#define PROFILE_MAX_ZONES	256
+/// number of histogram buckets, bucket `i` counts durations of [2^i, 2^(i+1)) ns
+#define PROFILE_BUCKETS		32
+
+/// A profiling zone, i.e. a static descriptor of a code section (scope).
+/// Use PROFILE_ZONE_INIT() to initialize it.
+typedef struct {
+	const char *name;	///< zone name
+	uint32_t id;		///< (internal) index + 1, assigned on first use
+} profile_zone_t;
+
+/// static initializer for a ::profile_zone_t
+#define PROFILE_ZONE_INIT(name)	{ name, 0 }
+
+/// an "open" scope, see profile_begin()
+typedef struct {
+	uint32_t id;		///< zone ID (0 = invalid)
+	uint64_t start;		///< begin of the scope (see get_elapsed_ns())
+} profile_scope_t;
+
+/// aggregated statistics for a zone
+typedef struct {
+	uint64_t count;		///< number of completed scopes
+	uint64_t total_ns;	///< total duration
+	uint64_t min_ns;	///< shortest duration
+	uint64_t max_ns;	///< longest duration
+	uint64_t histogram[PROFILE_BUCKETS]; ///< durations, by power of two
+} profile_stats_t;
+
+uint32_t profile_zone_id(profile_zone_t *zone);
+profile_scope_t profile_begin(profile_zone_t *zone);
+void profile_end(profile_scope_t *scope);
+void profile_record(uint32_t id, uint64_t start, uint64_t end);
+
+void profile_flush(void);
+void profile_configure(unsigned int interval_ms, LOG_LEVEL level);
+int profile_summary(bool reset);
+bool profile_get_stats(const char *name, profile_stats_t *stats);
+void profile_reset(void);
+
+LUA_CFUNC(luaopen_profile); // Lua bindings
+
+/** @name Profiling macros
+You may (pre)define `PROFILE_DISABLE` to compile them out entirely.
+@code
+void hook_handler(void) {
+	PROFILE_SCOPE("hook_handler"); // ends automatically with the C scope
+	...
+	PROFILE_BEGIN(lookup, "hook_handler/lookup");
+	...
+	PROFILE_END(lookup);
+}
+@endcode
+*/
+///@{
+#define PROFILE_CONCAT_(a, b)	a##b
+#define PROFILE_CONCAT(a, b)	PROFILE_CONCAT_(a, b)
+
+#ifndef PROFILE_DISABLE
+/// profile the remainder of the enclosing C scope (uses GCC's `cleanup` attribute)
+# define PROFILE_SCOPE(name) \
+	static profile_zone_t PROFILE_CONCAT(profile_zone_, __LINE__) = \
+		PROFILE_ZONE_INIT(name); \
+	profile_scope_t PROFILE_CONCAT(profile_scope_, __LINE__) \
+		__attribute__((cleanup(profile_end))) = \
+		profile_begin(&PROFILE_CONCAT(profile_zone_, __LINE__))
+/// begin a named scope, to be ended with PROFILE_END(var)
+# define PROFILE_BEGIN(var, name) \
+	static profile_zone_t var##_zone = PROFILE_ZONE_INIT(name); \
+	profile_scope_t var = profile_begin(&var##_zone)
+/// end a scope that was started with PROFILE_BEGIN(var, ...)
+# define PROFILE_END(var)		profile_end(&var)
+#else
+# define PROFILE_SCOPE(name)		do {} while (0)
+# define PROFILE_BEGIN(var, name)	do {} while (0)
+# define PROFILE_END(var)		do {} while (0)
+#endif
+///@}
+
+#endif // PROFILE_H
@@ -0,0 +1,201 @@
+/**
+@file rescache.c
+
+A process-wide cache for compiled-in script resources (see symbols.c).
+
+Loading a resource normally means inflating it (gzip_decompress()) and
+having Lua parse the source - again for every `dofile` or `require`, and in
+every Lua state. Instead, rescache_store() keeps the LuaJIT bytecode of a
+loaded chunk (via lua_dump(), including debug information), and
+rescache_load() can then create the function from that directly.
+
+Entries are keyed by the resource's address (i.e. its `_start` symbol),
+which is unique and stays valid for the lifetime of the process. The cache
+is shared by all threads (and Lua states); the least recently used entries
+get evicted once the total size exceeds a limit (RESCACHE_LIMIT, see
+rescache_set_limit()).
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "rescache.h"
+
+#include "atomics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// a cached chunk (bytecode)
+typedef struct rescache_entry {
+	struct rescache_entry *prev, *next;	// LRU list, most recent first
+	const void *key;
+	unsigned int refs;		// loads in progress, see rescache_acquire()
+	bool evicted;			// (free it when the last reference goes away)
+	size_t size;
+	char data[];
+} rescache_entry_t;
+
+static struct {
+	spinlock_t lock;		// protects everything below
+	rescache_entry_t *first, *last;
+	rescache_stats_t stats;
+} cache = { .lock = SPINLOCK_INIT, .stats.limit = RESCACHE_LIMIT };
+
+static void rescache_unlink(rescache_entry_t *entry) {
+	if (entry->prev) entry->prev->next = entry->next;
+	else cache.first = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
+	else cache.last = entry->prev;
+	entry->prev = entry->next = NULL;
+	cache.stats.entries--;
+	cache.stats.bytes -= entry->size;
+}
+
+static void rescache_push_front(rescache_entry_t *entry) {
+	entry->prev = NULL;
+	entry->next = cache.first;
+	if (cache.first) cache.first->prev = entry;
+	else cache.last = entry;
+	cache.first = entry;
+	cache.stats.entries++;
+	cache.stats.bytes += entry->size;
+}
+
+// remove an entry (the memory stays valid while it's in use)
+static void rescache_remove(rescache_entry_t *entry) {
+	rescache_unlink(entry);
+	if (entry->refs) entry->evicted = true;
+	else free(entry);
+}
+
+// evict least recently used entries, until the cache is within its limit
+static void rescache_trim(void) {
+	while (cache.last && cache.stats.bytes > cache.stats.limit) {
+		rescache_remove(cache.last);
+		cache.stats.evictions++;
+	}
+}
+
+static rescache_entry_t *rescache_find(const void *key) {
+	rescache_entry_t *entry;
+	for (entry = cache.first; entry; entry = entry->next)
+		if (entry->key == key) return entry;
+	return NULL;
+}
+
+// look up an entry, and mark it as in use (and most recently used)
+static rescache_entry_t *rescache_acquire(const void *key) {
+	spin_lock(&cache.lock);
+	rescache_entry_t *entry = rescache_find(key);
+	if (entry) {
+		rescache_unlink(entry);
+		rescache_push_front(entry);
+		entry->refs++;
+		cache.stats.hits++;
+	} else
+		cache.stats.misses++;
+	spin_unlock(&cache.lock);
+	return entry;
+}
+
+static void rescache_release(rescache_entry_t *entry) {
+	spin_lock(&cache.lock);
+	bool unused = --entry->refs == 0 && entry->evicted;
+	spin_unlock(&cache.lock);
+	if (unused) free(entry);
+}
+
+/** Load a chunk from the cache.
+If successful, the function gets pushed onto the Lua stack (like
+luaL_loadbuffer() would do).
+@param L the Lua state
+@param key identifies the resource (its data address)
+@param chunkname the chunk name, for error messages (and debug info)
+@returns `true` if the chunk was found (and loaded), `false` otherwise
+*/
+bool rescache_load(lua_State *L, const void *key, const char *chunkname) {
+	rescache_entry_t *entry = rescache_acquire(key);
+	if (!entry) return false;
+	// (loading bytecode we dumped ourselves isn't expected to fail)
+	int result = luaL_loadbuffer(L, entry->data, entry->size, chunkname);
+	rescache_release(entry);
+	if (result == 0) return true;
+	lua_pop(L, 1); // (error message)
+	return false;
+}
+
+// lua_Writer that collects the output of lua_dump() in a growing buffer
+typedef struct {
+	char *data;
+	size_t size, alloc;
+} rescache_buffer_t;
+
+static int rescache_writer(lua_State *L, const void *p, size_t size, void *ud) {
+	rescache_buffer_t *buffer = ud;
+	if (buffer->size + size > buffer->alloc) {
+		size_t alloc = buffer->alloc ? buffer->alloc : 4096;
+		while (alloc < buffer->size + size) alloc *= 2;
+		char *data = realloc(buffer->data, alloc);
+		if (!data) return 1;
+		buffer->data = data;
+		buffer->alloc = alloc;
+	}
+	memcpy(buffer->data + buffer->size, p, size);
+	buffer->size += size;
+	return 0;
+}
+
+/** Store a chunk in the cache.
+@param L the Lua state, with the chunk (the function created by
+luaL_loadbuffer()) at the top of the stack. The stack is left unchanged.
+@param key identifies the resource, see rescache_load()
+*/
+void rescache_store(lua_State *L, const void *key) {
+	rescache_buffer_t buffer = { NULL, 0, 0 };
+	if (lua_dump(L, rescache_writer, &buffer) == 0 && buffer.size > 0
+		&& buffer.size <= ATOMIC_LOAD_RELAXED(&cache.stats.limit))
+	{
+		rescache_entry_t *entry = malloc(sizeof(rescache_entry_t) + buffer.size);
+		if (entry) {
+			memset(entry, 0, sizeof(rescache_entry_t));
+			entry->key = key;
+			entry->size = buffer.size;
+			memcpy(entry->data, buffer.data, buffer.size);
+
+			spin_lock(&cache.lock);
+			// (another thread might have stored the same resource meanwhile)
+			rescache_entry_t *existing = rescache_find(key);
+			if (existing) rescache_remove(existing);
+			rescache_push_front(entry);
+			rescache_trim();
+			spin_unlock(&cache.lock);
+		}
+	}
+	free(buffer.data);
+}
+
+/// set the size limit (in bytes) for the cache, `0` disables it
+void rescache_set_limit(size_t limit) {
+	spin_lock(&cache.lock);
+	cache.stats.limit = limit;
+	rescache_trim();
+	spin_unlock(&cache.lock);
+}
+
+/// retrieve the cache statistics
+void rescache_get_stats(rescache_stats_t *stats) {
+	spin_lock(&cache.lock);
+	*stats = cache.stats;
+	spin_unlock(&cache.lock);
+}
+
+/// remove all entries (and reset the statistics, except for the limit)
+void rescache_clear(void) {
+	spin_lock(&cache.lock);
+	while (cache.first) rescache_remove(cache.first);
+	size_t limit = cache.stats.limit;
+	memset(&cache.stats, 0, sizeof(cache.stats));
+	cache.stats.limit = limit;
+	spin_unlock(&cache.lock);
+}
@@ -0,0 +1,30 @@
+/// @file rescache.h
+
+#ifndef RESCACHE_H
+#define RESCACHE_H
+
+#include "luautils.h"
+
+#include <stdint.h>
+
+/// default size limit (bytes) of the resource cache
+#define RESCACHE_LIMIT	(4 * 1024 * 1024)
+
+/// resource cache statistics, see rescache_get_stats()
+typedef struct {
+	uint64_t hits;		///< chunks loaded from the cache
+	uint64_t misses;	///< lookups that didn't find a chunk
+	uint64_t evictions;	///< entries removed to stay within the limit
+	size_t entries;		///< number of cached chunks
+	size_t bytes;		///< total size of the cached chunks
+	size_t limit;		///< size limit, see rescache_set_limit()
+} rescache_stats_t;
+
+bool rescache_load(lua_State *L, const void *key, const char *chunkname);
+void rescache_store(lua_State *L, const void *key);
+
+void rescache_set_limit(size_t limit);
+void rescache_get_stats(rescache_stats_t *stats);
+void rescache_clear(void);
+
+#endif // RESCACHE_H
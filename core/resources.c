@@ -0,0 +1,83 @@
+/**
+@file resources.c
+
+Lookup of embedded resources (compiled-in .lua scripts).
+
+The build wraps each script into an object file (see objwrap.lua), and
+also generates an index of all of them - `resindex.c`, a table of
+::resource_t entries sorted by their key. So finding a resource is a
+binary search, instead of looking up its symbols with dlsym() or
+GetProcAddress() each time.
+
+The key is the resource's pathname, relative to the library directory,
+with non-alphanumeric characters replaced by '_' - like the symbol names
+have always been constructed. (This makes "core/process.lua" and
+"core\process.lua" equivalent.)
+
+Binaries that don't link the generated index get an empty one, and
+getBinarySymbol() then falls back to looking up symbols.
+*/
+/* ---------------------------------------------------------------------------
+Copyright 2016 by the Lucciefr team
+*/
+
+#include "resources.h"
+
+#include <string.h>
+
+/// an empty index, for binaries that don't link the generated one
+__attribute__((weak)) const resource_index_t lcfr_resource_index = { 0, NULL };
+
+/// convert a (relative) pathname to a resource key
+void resource_key(char *key, size_t size, const char *path) {
+	if (size == 0) return;
+	size_t i;
+	for (i = 0; path[i] && i < size - 1; i++) {
+		char c = path[i];
+		key[i] = (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z')
+				|| ('0' <= c && c <= '9')) ? c : '_';
+	}
+	key[i] = '\0';
+}
+
+/** Find a resource by its (relative) pathname, within an index.
+@returns the resource, or `NULL` if there's no such resource
+*/
+const resource_t *resource_lookup(const resource_index_t *index, const char *path) {
+	const resource_t *resources = index->resources;
+	size_t low = 0, high = index->count;
+	if (high == 0) return NULL;
+
+	char key[256];
+	if (strlen(path) >= sizeof(key)) return NULL; // (no resource has a key that long)
+	resource_key(key, sizeof(key), path);
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		int cmp = strcmp(key, resources[mid].key);
+		if (cmp == 0) return &resources[mid];
+		if (cmp < 0) high = mid;
+		else low = mid + 1;
+	}
+	return NULL;
+}
+
+/// find a resource of this binary, see resource_lookup()
+const resource_t *resource_find(const char *path) {
+	return resource_lookup(&lcfr_resource_index, path);
+}
+
+/// calculate a (32-bit FNV-1a) checksum, the same way objwrap.lua does
+uint32_t resource_checksum(const char *data, size_t size) {
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < size; i++) {
+		hash ^= (uint8_t)data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/// check the data of a resource against its checksum
+bool resource_verify(const resource_t *res) {
+	return resource_checksum(res->data, res->size) == res->checksum;
+}
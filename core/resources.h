@@ -0,0 +1,42 @@
+/// @file resources.h
+
+#ifndef RESOURCES_H
+#define RESOURCES_H
+
+#include "bool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// @name resource flags
+///@{
+#define RESOURCE_GZIP		1	///< the data is gzip-compressed
+#define RESOURCE_BYTECODE	2	///< (precompiled) LuaJIT bytecode
+#define RESOURCE_LZ4		4	///< the data is LZ4-compressed, see codec.c
+///@}
+
+/// an embedded resource (a compiled-in .lua script), see objwrap.lua
+typedef struct {
+	const char *name;		///< original pathname, e.g. "core/process.lua"
+	const char *key;		///< the name as used in symbols (sort key)
+	const char *data;		///< the resource data (its _start symbol)
+	size_t size;			///< size of the data
+	uint32_t flags;			///< RESOURCE_GZIP, RESOURCE_BYTECODE
+	uint32_t checksum;		///< FNV-1a hash of the data, see resource_checksum()
+} resource_t;
+
+/// the table of all resources, sorted by key (generated at build time)
+typedef struct {
+	size_t count;
+	const resource_t *resources;
+} resource_index_t;
+
+extern const resource_index_t lcfr_resource_index;
+
+void resource_key(char *key, size_t size, const char *path);
+const resource_t *resource_lookup(const resource_index_t *index, const char *path);
+const resource_t *resource_find(const char *path);
+uint32_t resource_checksum(const char *data, size_t size);
+bool resource_verify(const resource_t *res);
+
+#endif // RESOURCES_H
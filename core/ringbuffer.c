@@ -24,6 +24,35 @@ elements and their associated pointers, as long as the element count doesn't
 exceed the capacity (maximum count = "size" of the buffer). As mentioned
 above, pushing a new element to a buffer that's full will overwrite the
 current "tail" (i.e. drop the oldest entry).
+
+The second type, ::bytering_t, is meant for variable-sized records (e.g.
+serialized log messages). Instead of keeping pointers to individually
+allocated elements, it copies the records into a single memory region
+(of a power-of-two size). Each record is prefixed with its length, and
+records are kept contiguous: If a record doesn't fit at the end of the
+region, the remaining space gets padded and the record is stored at the
+start. Pushing a record discards as many of the oldest records as needed to
+make room. There's no per-record `malloc()` or `free()` involved.
+
+Neither of these is thread-safe. To pass elements from one thread to another,
+use ::spscring_t: It's a fixed-size (power-of-two) array of element pointers
+for a single producer and a single consumer, that works without locks. Unlike
+the others, it never overwrites elements - pushing to a full buffer fails.
+Both sides may transfer many elements at once (with a single update of the
+shared indices), and the consumer can wait for data with spscring_wait():
+That spins for a short while, and then blocks on a ::thread_event_t. The
+producer only signals the event if the consumer is actually waiting.
+
+@code
+// producer thread
+while (!spscring_push(&rb, element)) ...; // (full, retry or drop)
+// consumer thread
+void *batch[64];
+while (spscring_wait(&rb, 100)) {
+	size_t i, n = spscring_pop_batch(&rb, batch, 64);
+	for (i = 0; i < n; i++) process(batch[i]);
+}
+@endcode
 */
 /* ---------------------------------------------------------------------------
 Copyright 2015 by the Lucciefr team
@@ -31,10 +60,10 @@ Copyright 2015 by the Lucciefr team
 2015-08-11 [BNO] initial version
 */
 
-// TODO: multithreading / thread safety
-
 #include "ringbuffer.h"
 
+#include "timing.h"
+
 #include <stdlib.h>
 #include <string.h>
 
@@ -180,3 +209,344 @@ inline void *ringbuffer_tail(ringbuffer_t *rb) {
 inline void *ringbuffer_head(ringbuffer_t *rb) {
 	return ringbuffer_element(rb, rb->count - 1);
 }
+
+
+/* byte ring buffer */
+
+// header of a bytering_t record
+typedef struct {
+	uint32_t size;		// size of the record data, or BYTERING_PAD
+	uint32_t reserved;	// (keeps the record data 8-byte aligned)
+} bytering_header_t;
+
+// marks padding at the end of the memory region
+#define BYTERING_PAD	UINT32_MAX
+
+// space that a record with `size` bytes occupies (including the header)
+#define BYTERING_SPACE(size) \
+	(((size) + sizeof(bytering_header_t) + 7) & ~(size_t)7)
+
+// private function to access the record header at a given position
+static inline bytering_header_t *bytering_header(bytering_t *rb, size_t pos) {
+	return (bytering_header_t *)(rb->data + (pos & (rb->capacity - 1)));
+}
+
+// private function to skip any padding, returns the position of a record
+static size_t bytering_skip(bytering_t *rb, size_t pos) {
+	if (pos != rb->head && bytering_header(rb, pos)->size == BYTERING_PAD)
+		pos += rb->capacity - (pos & (rb->capacity - 1)); // (wrap to start)
+	return pos;
+}
+
+// private function to retrieve the record (data) at a given position
+static void *bytering_record(bytering_t *rb, size_t pos, size_t *size) {
+	bytering_header_t *header = bytering_header(rb, pos);
+	if (size) *size = header->size;
+	return header + 1;
+}
+
+/** "constructor", prepare a bytering_t before usage
+@param rb the ring buffer to use
+@param capacity size of the memory region (bytes), gets rounded up to a power of two
+@returns `false` if memory allocation failed
+*/
+bool bytering_init(bytering_t *rb, size_t capacity) {
+	size_t size = 64;
+	while (size < capacity) size <<= 1;
+	rb->tail = rb->head = rb->last = 0;
+	rb->count = 0;
+	rb->capacity = 0;
+	rb->data = malloc(size);
+	if (!rb->data) return false;
+	rb->capacity = size;
+	return true;
+}
+
+/// "destructor", free up a bytering_t's resources after you're done
+void bytering_done(bytering_t *rb) {
+	bytering_clear(rb);
+	rb->capacity = 0;
+	free(rb->data);
+	rb->data = NULL;
+}
+
+/** push (a copy of) a record to the ring buffer (new "head" entry).
+If necessary, the oldest records get discarded to make room.
+
+@param rb the ring buffer to use
+@param buffer the record data. If `NULL`, the space only gets reserved,
+and the caller is expected to fill it in.
+@param size size of the record (bytes)
+@returns a pointer to the record's data within the ring buffer, or `NULL`
+if the record is too large (to ever fit into the buffer)
+*/
+void *bytering_push(bytering_t *rb, const void *buffer, size_t size) {
+	size_t space = BYTERING_SPACE(size);
+	if (space > rb->capacity || size >= BYTERING_PAD) return NULL;
+
+	size_t offset, padding;
+	while (true) {
+		offset = rb->head & (rb->capacity - 1);
+		padding = offset + space > rb->capacity ? rb->capacity - offset : 0;
+		if (rb->head + padding + space - rb->tail <= rb->capacity) break;
+		bytering_pop(rb); // not enough room, discard the oldest record
+	}
+	if (padding) {
+		bytering_header(rb, rb->head)->size = BYTERING_PAD;
+		rb->head += padding;
+	}
+	bytering_header_t *header = bytering_header(rb, rb->head);
+	header->size = size;
+	if (buffer) memcpy(header + 1, buffer, size);
+	rb->last = rb->head;
+	rb->head += space;
+	rb->count++;
+	return header + 1;
+}
+
+/// discard the oldest record ("tail" element) from the buffer
+void bytering_pop(bytering_t *rb) {
+	if (rb->count > 0) {
+		rb->tail = bytering_skip(rb, rb->tail);
+		rb->tail += BYTERING_SPACE(bytering_header(rb, rb->tail)->size);
+		if (--rb->count == 0)
+			rb->tail = rb->head = rb->last = 0; // (empty, start over)
+	}
+}
+
+/// remove all records from the buffer
+void bytering_clear(bytering_t *rb) {
+	rb->tail = rb->head = rb->last = 0;
+	rb->count = 0;
+}
+
+/** Replace the records of one ring buffer with (a copy of) another's.
+This copies the memory region as a whole, so it doesn't involve any
+allocation - but the capacities have to match.
+@returns `false` if they don't
+*/
+bool bytering_copy(bytering_t *dest, const bytering_t *src) {
+	if (dest->capacity != src->capacity) return false;
+	if (src->count > 0) memcpy(dest->data, src->data, src->capacity);
+	dest->tail = src->tail;
+	dest->head = src->head;
+	dest->last = src->last;
+	dest->count = src->count;
+	return true;
+}
+
+/** Retrieve the n-th record from the ring buffer.
+Like ringbuffer_element(), `index` is relative to the "tail" (oldest record),
+and an invalid index results in `NULL`. Note that this has to walk the
+records, use bytering_next() to iterate them efficiently.
+
+@param rb the ring buffer to use
+@param index record number
+@param size receives the size of the record. optional, may be `NULL`
+*/
+void *bytering_element(bytering_t *rb, size_t index, size_t *size) {
+	if (index >= rb->count) return NULL;
+	size_t pos = bytering_skip(rb, rb->tail);
+	while (index-- > 0) {
+		pos += BYTERING_SPACE(bytering_header(rb, pos)->size);
+		pos = bytering_skip(rb, pos);
+	}
+	return bytering_record(rb, pos, size);
+}
+
+/// retrieve "tail" record (the oldest one)
+void *bytering_tail(bytering_t *rb, size_t *size) {
+	if (rb->count == 0) return NULL;
+	return bytering_record(rb, bytering_skip(rb, rb->tail), size);
+}
+
+/// retrieve "head" record (the most recent one)
+void *bytering_head(bytering_t *rb, size_t *size) {
+	if (rb->count == 0) return NULL;
+	return bytering_record(rb, rb->last, size);
+}
+
+/** Iterate the records, from "tail" to "head".
+@code{.c}
+void *record = NULL; size_t size;
+while ((record = bytering_next(rb, record, &size))) { ... }
+@endcode
+@param rb the ring buffer to use
+@param element the previous record, `NULL` to start with the "tail"
+@param size receives the size of the record. optional, may be `NULL`
+@returns the next record, or `NULL` after the "head"
+*/
+void *bytering_next(bytering_t *rb, void *element, size_t *size) {
+	if (!element) return bytering_tail(rb, size);
+
+	bytering_header_t *header = (bytering_header_t *)element - 1;
+	size_t offset = (char *)header - rb->data;
+	if (offset == (rb->last & (rb->capacity - 1)))
+		return NULL; // (that was the "head" record)
+	// (we're not at the "head", so there's either a record or padding)
+	offset += BYTERING_SPACE(header->size);
+	if (bytering_header(rb, offset)->size == BYTERING_PAD)
+		offset = 0;
+	return bytering_record(rb, offset, size);
+}
+
+
+/* single-producer / single-consumer ring buffer */
+
+/// number of iterations that spscring_wait() spins before blocking
+#define SPSCRING_SPINS	1000
+
+/** "constructor", prepare a spscring_t before usage
+@param rb the ring buffer to use
+@param capacity maximum number of elements, gets rounded up to a power of two
+@param free_func
+free function to use on remaining elements in spscring_done(). optional,
+may be `NULL`
+@returns `false` if memory allocation failed
+*/
+bool spscring_init(spscring_t *rb, size_t capacity, free_func_t free_func) {
+	size_t size = 2;
+	while (size < capacity) size <<= 1;
+	rb->head = rb->tail_cache = 0;
+	rb->tail = rb->head_cache = 0;
+	rb->mask = 0;
+	rb->free = free_func;
+	rb->waiting = false;
+	rb->entries = malloc(size * sizeof(void*));
+	if (!rb->entries) return false;
+	rb->mask = size - 1;
+	thread_event_init(&rb->event);
+	return true;
+}
+
+/// "destructor", releases remaining elements and the buffer's resources.
+/// Both threads have to be done with the buffer at this point.
+void spscring_done(spscring_t *rb) {
+	if (!rb->entries) return;
+	if (rb->free) {
+		void *element;
+		while ((element = spscring_pop(rb))) rb->free(element);
+	}
+	free(rb->entries);
+	rb->entries = NULL;
+	thread_event_done(&rb->event);
+}
+
+// private function, returns the number of free slots (producer side)
+static size_t spscring_space(spscring_t *rb, size_t wanted) {
+	size_t capacity = rb->mask + 1;
+	size_t head = rb->head; // (only we modify it)
+	if (capacity - (head - rb->tail_cache) < wanted)
+		rb->tail_cache = ATOMIC_LOAD_ACQ(&rb->tail);
+	return capacity - (head - rb->tail_cache);
+}
+
+// private function, returns the number of available elements (consumer side)
+static size_t spscring_available(spscring_t *rb, size_t wanted) {
+	size_t tail = rb->tail; // (only we modify it)
+	if (rb->head_cache - tail < wanted)
+		rb->head_cache = ATOMIC_LOAD_ACQ(&rb->head);
+	return rb->head_cache - tail;
+}
+
+// private function to publish new elements, waking up the consumer if needed
+static void spscring_publish(spscring_t *rb, size_t head) {
+	ATOMIC_STORE_REL(&rb->head, head);
+	// (a full barrier, so that we can't miss the consumer starting to wait)
+	ATOMIC_FENCE();
+	if (ATOMIC_LOAD_RELAXED(&rb->waiting) && ATOMIC_XCHG(&rb->waiting, false))
+		thread_event_signal(&rb->event);
+}
+
+/** Add an element (producer thread only).
+@param rb the ring buffer to use
+@param element the element pointer, must not be `NULL`
+@returns `false` if the buffer is full
+*/
+bool spscring_push(spscring_t *rb, void *element) {
+	if (spscring_space(rb, 1) == 0) return false;
+	rb->entries[rb->head & rb->mask] = element;
+	spscring_publish(rb, rb->head + 1);
+	return true;
+}
+
+/** Add multiple elements (producer thread only).
+@param rb the ring buffer to use
+@param elements the element pointers, none of them may be `NULL`
+@param count number of elements
+@returns the number of elements actually added (limited by the free space)
+*/
+size_t spscring_push_batch(spscring_t *rb, void **elements, size_t count) {
+	size_t i, space = spscring_space(rb, count);
+	if (count > space) count = space;
+	if (count == 0) return 0;
+	for (i = 0; i < count; i++)
+		rb->entries[(rb->head + i) & rb->mask] = elements[i];
+	spscring_publish(rb, rb->head + count);
+	return count;
+}
+
+/// Remove the oldest element (consumer thread only).
+/// @returns the element, or `NULL` if the buffer is empty
+void *spscring_pop(spscring_t *rb) {
+	if (spscring_available(rb, 1) == 0) return NULL;
+	void *element = rb->entries[rb->tail & rb->mask];
+	ATOMIC_STORE_REL(&rb->tail, rb->tail + 1);
+	return element;
+}
+
+/** Remove multiple elements (consumer thread only).
+@param rb the ring buffer to use
+@param elements array that receives the element pointers (oldest first)
+@param count maximum number of elements to remove
+@returns the number of elements actually removed
+*/
+size_t spscring_pop_batch(spscring_t *rb, void **elements, size_t count) {
+	size_t i, available = spscring_available(rb, count);
+	if (count > available) count = available;
+	if (count == 0) return 0;
+	for (i = 0; i < count; i++)
+		elements[i] = rb->entries[(rb->tail + i) & rb->mask];
+	ATOMIC_STORE_REL(&rb->tail, rb->tail + count);
+	return count;
+}
+
+/** Wait for the buffer to have (at least one) element (consumer thread only).
+This spins for a while first, and then blocks until the producer signals us.
+@param rb the ring buffer to use
+@param timeout_ms maximum time to wait (in milliseconds)
+@returns `false` if the buffer is still empty (timeout)
+*/
+bool spscring_wait(spscring_t *rb, unsigned int timeout_ms) {
+	unsigned int spins = 0;
+	while (spscring_available(rb, 1) == 0) {
+		if (spins < SPSCRING_SPINS) {
+			spin_backoff(&spins);
+			continue;
+		}
+		double deadline = get_elapsed_ms() + timeout_ms;
+		while (true) {
+			ATOMIC_STORE(&rb->waiting, true);
+			ATOMIC_FENCE();
+			// (check again, the producer might have missed our flag)
+			if (spscring_available(rb, 1) > 0) {
+				ATOMIC_STORE(&rb->waiting, false);
+				return true;
+			}
+			double remaining = deadline - get_elapsed_ms();
+			if (remaining <= 0) break;
+			thread_event_wait(&rb->event, remaining + 1);
+			// (a "stale" signal may wake us up early, so we loop)
+			if (spscring_available(rb, 1) > 0) break;
+		}
+		ATOMIC_STORE(&rb->waiting, false);
+		return spscring_available(rb, 1) > 0;
+	}
+	return true;
+}
+
+/// retrieve the number of elements in the buffer (a snapshot, only exact
+/// when called from the producer or consumer thread while the other is idle)
+size_t spscring_count(spscring_t *rb) {
+	return ATOMIC_LOAD_ACQ(&rb->head) - ATOMIC_LOAD_ACQ(&rb->tail);
+}
@@ -3,7 +3,11 @@
 #ifndef RINGBUFFER_H
 #define RINGBUFFER_H
 
+#include "atomics.h"
+#include "bool.h"
+#include "threads.h"
 #include <stddef.h> // size_t
+#include <stdint.h>
 
 /// prototype for a "free" function (used as ringbuffer_t member)
 typedef void free_func_t(void *ptr);
@@ -30,4 +34,65 @@ void *ringbuffer_element(ringbuffer_t *rb, size_t index);
 void *ringbuffer_tail(ringbuffer_t *rb);
 void *ringbuffer_head(ringbuffer_t *rb);
 
+/** Ring buffer of variable-sized records, stored in a contiguous byte region.
+Each record has a small header (its length), and occupies a contiguous part
+of the memory. A record that doesn't fit at the end of the region gets moved
+to the start, padding the remaining space.
+@see ringbuffer.c
+*/
+typedef struct {
+	char *data;			///< the memory region
+	size_t capacity;	///< size of the region in bytes (a power of two)
+	size_t tail;		///< position of the oldest record
+	size_t head;		///< position after the newest record (next write)
+	size_t last;		///< position of the newest record
+	size_t count;		///< the number of records in the buffer
+} bytering_t;
+
+bool bytering_init(bytering_t *rb, size_t capacity);
+void bytering_done(bytering_t *rb);
+
+void *bytering_push(bytering_t *rb, const void *buffer, size_t size);
+void bytering_pop(bytering_t *rb);
+void bytering_clear(bytering_t *rb);
+bool bytering_copy(bytering_t *dest, const bytering_t *src);
+void *bytering_element(bytering_t *rb, size_t index, size_t *size);
+void *bytering_tail(bytering_t *rb, size_t *size);
+void *bytering_head(bytering_t *rb, size_t *size);
+void *bytering_next(bytering_t *rb, void *element, size_t *size);
+
+/** Lock-free ring buffer of element pointers, for exactly one producer
+thread and one consumer thread.
+The producer and consumer indices live on separate cache lines, to avoid
+"false sharing" between the two threads.
+@see ringbuffer.c
+*/
+typedef struct {
+	/// next write position (only modified by the producer)
+	size_t head CACHE_ALIGNED;
+	size_t tail_cache;	///< producer's copy of `tail` (avoids reading it every time)
+	/// next read position (only modified by the consumer)
+	size_t tail CACHE_ALIGNED;
+	size_t head_cache;	///< consumer's copy of `head`
+	void* *entries CACHE_ALIGNED; ///< array of element pointers
+	size_t mask;		///< capacity - 1 (capacity is a power of two)
+	free_func_t *free;	///< (optional) function to release remaining elements
+	int waiting;		///< the consumer is (about to be) blocked in spscring_wait()
+	thread_event_t event; ///< wakes up the consumer
+} spscring_t;
+
+bool spscring_init(spscring_t *rb, size_t capacity, free_func_t free_func);
+void spscring_done(spscring_t *rb);
+
+// producer
+bool spscring_push(spscring_t *rb, void *element);
+size_t spscring_push_batch(spscring_t *rb, void **elements, size_t count);
+
+// consumer
+void *spscring_pop(spscring_t *rb);
+size_t spscring_pop_batch(spscring_t *rb, void **elements, size_t count);
+bool spscring_wait(spscring_t *rb, unsigned int timeout_ms);
+
+size_t spscring_count(spscring_t *rb);
+
 #endif // RINGBUFFER_H
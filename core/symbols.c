@@ -6,8 +6,11 @@ us to retrieve 'compiled-in' `.lua` scripts. See dll_symbolLoader_C().
 */
 #include "symbols.h"
 
+#include "codec.h"
 #include "globals.h"
 #include "log.h"
+#include "rescache.h"
+#include "resources.h"
 #include "strutils.h"
 #include "utils.h"
 
@@ -155,32 +158,36 @@ const char *strip_pwd(const char *pathname) {
 // Try to find a binary symbol (statically linked resource) within the library.
 // (This is used to retrieve the compiled-in versions of .lua script files.) If
 // found, data and *len get set accordingly, otherwise they'll be (NULL, 0).
-// Caution: The matching depends on some naming conventions, and so far has only
-// been tested for MinGW. Also: have a look at objwrap.lua and its comments.
+// Normally this is a lookup in the resource index (see resources.c). Without
+// one, it falls back to searching the exported symbols - the matching then
+// depends on some naming conventions, and so far has only been tested for
+// MinGW. Also: have a look at objwrap.lua and its comments.
 char *getBinarySymbol(const char *path, size_t *len, char *buffer, size_t size) {
 	if (!len) {
 		error("%s(): you must pass a 'len' pointer!", __func__);
 		return NULL;
 	}
 	*len = 0;
+
+	if (lcfr_resource_index.count > 0) {
+		const resource_t *res = resource_find(strip_pwd(path));
+		if (!res) return NULL;
+		if (buffer && size)
+			snprintf(buffer, size, "%s", res->name);
+		*len = res->size;
+		return (*len > 0) ? (char *)res->data : NULL;
+	}
+
 	char *data = NULL;	// _start symbol (beginning of data resource)
 	char *end = NULL;	// _end symbol (end of data resource)
 
 	// pattern is the search string (slightly modified pathname)
 	// that we'll be looking for in our binary's symbols
+	// (our symbol name prefix convention simply replaces any
+	// non-alphanumerical chars with '_')
 	char pattern[PATH_MAX];
+	resource_key(pattern, sizeof(pattern), strip_pwd(path));
 
-	strncpy(pattern, strip_pwd(path), sizeof(pattern));
-
-	// convert pattern to our symbol name prefix convention
-	// (which simply replaces any non-alphanumerical chars with '_')
-	unsigned int i = strlen(pattern);
-	while (i-- > 0) {
-		if ('a' <= pattern[i] && pattern[i] <= 'z') continue;
-		if ('A' <= pattern[i] && pattern[i] <= 'Z') continue;
-		if ('0' <= pattern[i] && pattern[i] <= '9') continue;
-		pattern[i] = '_';
-	}
 #ifdef RELAXED_NAME_CHECKING
 	// append "binary" to the pattern, and allow partial matching later (ignore path)
 	//strcat(pattern, "_binary_");
@@ -245,27 +252,57 @@ LUA_CFUNC(dll_getBinarySymbol_C) {
 	size_t len;
 	char *data = getBinarySymbol(name, &len, NULL, 0);
 	if (data) {
-		if (!is_gzipped(data)) {
+		const codec_t *codec = codec_find(data, len);
+		if (!codec) {
 			// this should be plain text, push to Lua 'as-is'
 			lua_pushlstring(L, data, len);
 			return 1;
 		}
-		// gzipped data, we'll decompress it on the fly! :D
-		size_t decompressed_size;
-		char *decompressed = gzip_decompress(data, len, &decompressed_size);
-		if (decompressed) {
-			// we have successfully decompressed the resource and can transfer it to Lua
-			lua_pushlstring(L, decompressed, decompressed_size);
-			free(decompressed);
+		if (codec != &codec_gzip) {
+			// other codecs (see codec.c) decompress in one go
+			size_t size;
+			char *output = codec_decompress(codec, data, len, &size);
+			if (!output)
+				return luaL_error(L, "dll_getBinarySymbol_C(): decompression of %s resource FAILED",
+								  codec->name);
+			lua_pushlstring(L, output, size);
+			free(output);
 			return 1;
 		}
+		// gzipped data, we'll decompress it on the fly! :D
+		// (streaming it into a Lua string, without another copy on the heap)
+		gzip_stream_t *stream = gzip_stream_open(data, len);
+		if (stream) {
+			luaL_Buffer buffer;
+			const char *chunk;
+			size_t size;
+			luaL_buffinit(L, &buffer);
+			while ((chunk = gzip_stream_read(stream, &size)))
+				luaL_addlstring(&buffer, chunk, size);
+			bool done = gzip_stream_done(stream);
+			gzip_stream_close(stream);
+			if (done) {
+				// we have successfully decompressed the resource
+				luaL_pushresult(&buffer);
+				return 1;
+			}
+		}
 		return luaL_error(L, "dll_getBinarySymbol_C(): decompression of gzipped resource FAILED");
 	}
 	return 0;
 }
 
+// lua_Reader for load_decompressed_buffer(), returns the decompressed data
+// piece by piece
+static const char *gzip_reader(lua_State *L, void *stream, size_t *size) {
+	return gzip_stream_read(stream, size);
+}
+
 // Load a Lua "chunk" from a binary resource (for execution). Similar to
-// luaL_loadbuffer(), but this function knows how to handle (gzip-)decompression.
+// luaL_loadbuffer(), but this function knows how to handle decompression (codec.c).
+// Compiled chunks get cached (by resource address), so loading the same
+// resource again - e.g. in another Lua state - won't need to inflate and
+// parse it. See rescache.c
 int load_decompressed_buffer(lua_State *L, const char *data, size_t len,
 		const char *name)
 {
@@ -274,19 +311,45 @@ int load_decompressed_buffer(lua_State *L, const char *data, size_t len,
 	// (see e.g. http://lua.2524044.n2.nabble.com/Error-reporting-the-chunk-name-td4034634.html)
 	snprintf(chunkname, sizeof(chunkname), "=%s", strip_pwd(name)); // (but strip PWD first)
 
-	if (!is_gzipped(data)) {
+	// uncompressed bytecode (see objwrap.lua) is as good as it gets, load it directly
+	if (is_lua_bytecode(data, len)) return luaL_loadbuffer(L, data, len, chunkname);
+
+	if (rescache_load(L, data, chunkname)) return 0;
+
+	int result;
+	const codec_t *codec = codec_find(data, len);
+	if (!codec) {
 		// this should be a plain(text) buffer, so we pass it to luaL_loadbuffer() directly
-		return luaL_loadbuffer(L, data, len, chunkname);
+		// (which has Lua read it in place)
+		result = luaL_loadbuffer(L, data, len, chunkname);
+		if (result == 0) rescache_store(L, data);
+		return result;
 	}
-	// gzipped data, use decompressor before loading it
-	size_t decompressed_size;
-	char *decompressed = gzip_decompress(data, len, &decompressed_size);
-	if (decompressed) {
-		// decompression successful, continue with loading
-		int result = luaL_loadbuffer(L, decompressed, decompressed_size, chunkname);
-		free(decompressed);
+	if (codec != &codec_gzip) {
+		// other codecs (see codec.c) decompress into a single, exact allocation
+		size_t size;
+		char *output = codec_decompress(codec, data, len, &size);
+		if (!output)
+			return luaL_error(L, "%s(%s): decompression of %s resource FAILED",
+							  __func__, name, codec->name);
+		result = luaL_loadbuffer(L, output, size, chunkname);
+		free(output);
+		if (result == 0) rescache_store(L, data);
 		return result;
 	}
+	// gzipped data, Lua reads it (source or bytecode) while it's decompressed,
+	// through a sliding window - the output never has to fit into memory at once
+	gzip_stream_t *stream = gzip_stream_open(data, len);
+	if (stream) {
+		result = lua_load(L, gzip_reader, stream, chunkname);
+		bool done = gzip_stream_done(stream);
+		gzip_stream_close(stream);
+		if (done) {
+			if (result == 0) rescache_store(L, data);
+			return result;
+		}
+		lua_pop(L, 1); // (discard the chunk or error message, this is incomplete)
+	}
 	return luaL_error(L, "%s(%s): decompression of gzipped resource FAILED",
 					  __func__, name);
 }
@@ -367,6 +430,47 @@ LUA_CFUNC(dll_symbolLoader_C) {
 	return 1;
 }
 
+// iterator function for dll_resources_C(), the upvalue is the table index
+static int resources_iterator(lua_State *L) {
+	lua_Integer index = lua_tointeger(L, lua_upvalueindex(1));
+	if ((size_t)index >= lcfr_resource_index.count) return 0;
+	lua_pushinteger(L, index + 1);
+	lua_replace(L, lua_upvalueindex(1));
+
+	const resource_t *res = &lcfr_resource_index.resources[index];
+	lua_pushstring(L, res->name);
+	lua_createtable(L, 0, 6);
+	lua_table_kv_str_int(L, "size", res->size);
+	lua_table_kv_str_bool(L, "gzip", res->flags & RESOURCE_GZIP);
+	lua_table_kv_str_bool(L, "lz4", res->flags & RESOURCE_LZ4);
+	lua_table_kv_str_bool(L, "bytecode", res->flags & RESOURCE_BYTECODE);
+	lua_table_kv_str_float(L, "checksum", res->checksum);
+	lua_table_kv_str_bool(L, "valid", resource_verify(res));
+	return 2;
+}
+
+// Lua iterator over all embedded resources (see resources.c), e.g.
+// "for name, info in dll_resources_C() do print(name, info.size) end"
+LUA_CFUNC(dll_resources_C) {
+	lua_pushinteger(L, 0);
+	lua_pushcclosure(L, resources_iterator, 1);
+	return 1;
+}
+
+// returns a table with the statistics of the resource cache (see rescache.c)
+LUA_CFUNC(dll_getResourceCacheStats_C) {
+	rescache_stats_t stats;
+	rescache_get_stats(&stats);
+	lua_createtable(L, 0, 6);
+	lua_table_kv_str_int(L, "hits", stats.hits);
+	lua_table_kv_str_int(L, "misses", stats.misses);
+	lua_table_kv_str_int(L, "evictions", stats.evictions);
+	lua_table_kv_str_int(L, "entries", stats.entries);
+	lua_table_kv_str_int(L, "bytes", stats.bytes);
+	lua_table_kv_str_int(L, "limit", stats.limit);
+	return 1;
+}
+
 /*
 // dynamicBase_C(module) helper to detect relocatable code (flag from PE header)
 // module defaults to the target process
@@ -454,6 +558,8 @@ LUA_CFUNC(luaopen_symbols) {
 	LREG(L, dll_getSymbol_C);
 	*/
 	LREG(L, dll_getBinarySymbol_C);
+	LREG(L, dll_getResourceCacheStats_C);
+	LREG(L, dll_resources_C);
 	//LREG(L, symbol_dofile_C); // kind of redundant, as it gets set as "dofile"!
 	/*
 	LREG(L, dynamicBase_C);
@@ -55,6 +55,10 @@ void *getExportedSymbolByName(HMODULE module, const char *name);
  */
 char *getBinarySymbol(const char *path, size_t *len, char *buffer, size_t size);
 
+// load a (possibly gzipped) resource as a Lua chunk, see rescache.c
+int load_decompressed_buffer(lua_State *L, const char *data, size_t len,
+		const char *name);
+
 // our "dofile" variant that knows about compiled-in scripts
 LUA_CFUNC(symbol_dofile_C);
 
@@ -1,3 +1,13 @@
+/**
+@file threads.c
+
+Thread management, and a simple "event" to wake up waiting threads.
+
+An event is auto-resetting: thread_event_signal() sets it, and a single
+thread_event_wait() will consume the signal. A signal that happens while
+nobody is waiting stays pending, so there are no "lost" wakeups.
+*/
+
 #include "threads.h"
 
 #include "log.h"
@@ -25,14 +35,58 @@ int thread_wait(pthread_t thread, unsigned int timeout_ms) {
 	return WaitForSingleObject(thread, timeout_ms);
 }
 
+/// initialize an event (initially not signaled)
+void thread_event_init(thread_event_t *event) {
+	*event = CreateEvent(NULL, FALSE, FALSE, NULL); // auto-reset
+}
+
+/// release an event's resources
+void thread_event_done(thread_event_t *event) {
+	CloseHandle(*event);
+	*event = NULL;
+}
+
+/// signal an event, waking up (at most) one waiting thread
+void thread_event_signal(thread_event_t *event) {
+	SetEvent(*event);
+}
+
+/// wait for an event to be signaled, returns `false` on timeout
+bool thread_event_wait(thread_event_t *event, unsigned int timeout_ms) {
+	return WaitForSingleObject(*event, timeout_ms) == WAIT_OBJECT_0;
+}
+
+/// return the ID of the calling thread
+unsigned int thread_id(void) {
+	return GetCurrentThreadId();
+}
+
 #else
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// helper to compute an absolute deadline, timeout_ms from now on a given clock
+static void deadline_after(struct timespec *ts, clockid_t clock,
+		unsigned int timeout_ms)
+{
+	clock_gettime(clock, ts);
+	ts->tv_sec += timeout_ms / 1000;
+	ts->tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
 pthread_t thread_start(THREAD_FUNC(*start_routine)(void *), void *attr,
 		void *arg)
 {
 	pthread_t result;
 	int err = pthread_create(&result, attr, start_routine, arg);
 	if (err) {
-		error("pthread_create(%p, %p, %p): %s", strerror(err));
+		error("pthread_create(%p, %p, %p): %s",
+			start_routine, attr, arg, strerror(err));
 		return 0;
 	}
 	return result;
@@ -43,11 +97,74 @@ int thread_stop(pthread_t thread, unsigned int exit_code) {
 }
 
 int thread_wait(pthread_t thread, unsigned int timeout_ms) {
-	double seconds, timeout = get_elapsed_ms() + timeout_ms;
-	timeout /= 1000;
-	timeout = modf(timeout, &seconds);
-	struct timespec ts = { .tv_sec = seconds, .tv_nsec = timeout * 1e6 };
+	struct timespec ts;
+#ifdef __GLIBC_PREREQ
+// (ThreadSanitizer doesn't intercept pthread_clockjoin_np, and would report
+// false positives for anything that happens after joining the thread)
+#if __GLIBC_PREREQ(2, 31) && !defined(__SANITIZE_THREAD__)
+	#define HAVE_CLOCKJOIN
+#endif
+#endif
+#ifdef HAVE_CLOCKJOIN
+	// use a monotonic deadline, so a change of the system time doesn't matter
+	deadline_after(&ts, CLOCK_MONOTONIC, timeout_ms);
+	return pthread_clockjoin_np(thread, NULL, CLOCK_MONOTONIC, &ts);
+#else
+	// (pthread_timedjoin_np expects an absolute CLOCK_REALTIME deadline)
+	deadline_after(&ts, CLOCK_REALTIME, timeout_ms);
 	return pthread_timedjoin_np(thread, NULL, &ts);
+#endif
+}
+
+/// return the (kernel) ID of the calling thread, e.g. as shown by `top -H`
+unsigned int thread_id(void) {
+	static THREAD_LOCAL unsigned int tid = 0; // (cached, it's a system call)
+#ifdef SYS_gettid
+	if (!tid) tid = syscall(SYS_gettid);
+#else
+	if (!tid) tid = (uintptr_t)pthread_self(); // (no kernel IDs available)
+#endif
+	return tid;
+}
+
+/// initialize an event (initially not signaled)
+void thread_event_init(thread_event_t *event) {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // immune to clock steps
+	pthread_cond_init(&event->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&event->mutex, NULL);
+	event->signaled = false;
+}
+
+/// release an event's resources
+void thread_event_done(thread_event_t *event) {
+	pthread_cond_destroy(&event->cond);
+	pthread_mutex_destroy(&event->mutex);
+}
+
+/// signal an event, waking up (at most) one waiting thread
+void thread_event_signal(thread_event_t *event) {
+	pthread_mutex_lock(&event->mutex);
+	event->signaled = true;
+	pthread_cond_signal(&event->cond);
+	pthread_mutex_unlock(&event->mutex);
+}
+
+/// wait for an event to be signaled, returns `false` on timeout
+bool thread_event_wait(thread_event_t *event, unsigned int timeout_ms) {
+	struct timespec ts;
+	deadline_after(&ts, CLOCK_MONOTONIC, timeout_ms);
+
+	pthread_mutex_lock(&event->mutex);
+	while (!event->signaled)
+		if (pthread_cond_timedwait(&event->cond, &event->mutex, &ts))
+			break; // (timeout or error)
+	bool result = event->signaled;
+	event->signaled = false; // auto-reset
+	pthread_mutex_unlock(&event->mutex);
+	return result;
 }
 
 #endif
@@ -1,5 +1,10 @@
 /// @file threads.h
 
+#ifndef THREADS_H
+#define THREADS_H
+
+#include "bool.h"
+
 #if _WINDOWS
 	#include <process.h>
 	#include <windows.h>
@@ -8,6 +13,9 @@
 	#define pthread_t		HANDLE
 	#define thread_exit		ExitThread
 
+	/// an auto-reset event (see thread_event_init())
+	typedef HANDLE thread_event_t;
+
 #else
 	// assume POSIX threads
 	#include <math.h>
@@ -17,8 +25,29 @@
 	#define THREAD_FUNC		void*
 	#define thread_exit		pthread_exit
 
+	/// an auto-reset event (see thread_event_init())
+	typedef struct {
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		bool signaled;
+	} thread_event_t;
+
 #endif
 
+/// storage class specifier for thread-local variables
+#define THREAD_LOCAL	__thread
+
 pthread_t thread_start(THREAD_FUNC(*start_routine)(void *), void *attr, void *arg);
 int thread_stop(pthread_t thread, unsigned int exit_code);
 int thread_wait(pthread_t thread, unsigned int timeout_ms);
+unsigned int thread_id(void);
+
+/// @name events (simple wakeup notification between threads)
+///@{
+void thread_event_init(thread_event_t *event);
+void thread_event_done(thread_event_t *event);
+void thread_event_signal(thread_event_t *event);
+bool thread_event_wait(thread_event_t *event, unsigned int timeout_ms);
+///@}
+
+#endif // THREADS_H
@@ -2,66 +2,110 @@
 @file timing.c
 
 Timer / timestamp functions.
-For Windows, these are based on `QueryPerformanceCounter`.
+For Windows, these are based on `QueryPerformanceCounter`, other platforms
+use `clock_gettime(CLOCK_MONOTONIC)`. Log timestamps are derived from that,
+using a wall clock reading (UTC) taken once as the "anchor".
 see [MSDN: Acquiring high-resolution time stamps]
 (https://msdn.microsoft.com/de-de/library/windows/desktop/dn553408%28v=vs.85%29.aspx)
+
+Formatting many timestamps (e.g. one per line of log output) with
+format_timestamp() is expensive, as it has to go through `localtime()` and
+`strftime()` every time. A ::timestamp_cache_t avoids that: It keeps the
+formatted text for the current second, and only patches in the milliseconds
+- see timestamp_cache_update().
 */
 
 #include "timing.h"
 
+#include "atomics.h"
+
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
 
 // timer related constants, will be initialized once by timing_init()
-static double start_timestamp = 0; // 0 indicates "not initialized"
+static int timing_state = 0; // 0 = not initialized, 1 = in progress, 2 = done
+static uint64_t start_ns; // monotonic clock reading at initialization
+static uint64_t start_timestamp_ns; // wall clock (UTC) at the same time
 
 #if _WINDOWS
 	#include <windows.h>
 	static LARGE_INTEGER frequency;
-	static LARGE_INTEGER start_offset;
 #endif
 
+// read the monotonic clock (nanoseconds, arbitrary starting point)
+static inline uint64_t monotonic_ns(void) {
+#if _WINDOWS
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	uint64_t ticks = now.QuadPart, freq = frequency.QuadPart;
+	// (split up to avoid overflowing the multiplication)
+	return ticks / freq * 1000000000ULL + ticks % freq * 1000000000ULL / freq;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
 // TODO: gettimeofday() is a *NIXism provided by cygwin/mingw,
 // might have to check and/or replace it for other toolchains
-// Note that the start_timestamp represents UTC, not local time!
+// Note that the start_timestamp_ns represents UTC, not local time!
 static void timing_init(void) {
-	if (start_timestamp == 0) {
-		struct timeval tv;
+	int state = 0;
+	if (ATOMIC_CAS(&timing_state, &state, 1)) {
 #if _WINDOWS
+		struct timeval tv;
 		QueryPerformanceFrequency(&frequency);
-		QueryPerformanceCounter(&start_offset); // inital value for elapsed time calculation
-#endif
+		start_ns = monotonic_ns(); // inital value for elapsed time calculation
 		gettimeofday(&tv, NULL);
-		start_timestamp = tv.tv_sec + (double)tv.tv_usec / 1e6;
+		start_timestamp_ns = tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#else
+		struct timespec ts;
+		start_ns = monotonic_ns(); // inital value for elapsed time calculation
+		clock_gettime(CLOCK_REALTIME, &ts);
+		start_timestamp_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+		ATOMIC_STORE_REL(&timing_state, 2);
 	}
+	else // (another thread is initializing)
+		while (ATOMIC_LOAD_ACQ(&timing_state) != 2) cpu_relax();
+}
+
+/** return elapsed time in nanoseconds.
+This is the "raw" clock that the other functions are based upon. It's
+monotonic, i.e. not affected by changes to the system time (e.g. NTP
+adjustments), and avoids floating point math - use it for instrumentation
+in "hot" code paths.
+*/
+uint64_t get_elapsed_ns(void) {
+	if (ATOMIC_LOAD_ACQ(&timing_state) != 2) timing_init();
+	return monotonic_ns() - start_ns;
 }
 
 /// return elapsed time in seconds (with a "high-resolution" fractional part!)
 double get_elapsed(void) {
-	if (start_timestamp == 0) timing_init();
-#if _WINDOWS
-	LARGE_INTEGER now;
-	QueryPerformanceCounter(&now);
-	register double result = now.QuadPart;
-	result -= start_offset.QuadPart;
-	result /= frequency.QuadPart;
-#else
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	register double result = tv.tv_usec;
-	result /= 1e6;
-	result += tv.tv_sec;
-	result -= start_timestamp;
-#endif
-	return result;
+	return get_elapsed_ns() / 1e9;
 }
 
 /// return elapsed time in milliseconds (`= 1000.0 * get_elapsed()`)
 inline double get_elapsed_ms(void) {
-	return 1e3 * get_elapsed();
+	return get_elapsed_ns() / 1e6;
+}
+
+/** return high-resolution timestamp in nanoseconds since the Epoch
+(1970-01-01 00:00:00 UTC).
+
+The wall clock only gets read once (at initialization), after that the
+timestamps advance with the monotonic clock. This way they never jump
+(or go backwards) within a process, even if the system time gets stepped.
+*/
+uint64_t get_timestamp_ns(void) {
+	uint64_t elapsed = get_elapsed_ns(); // may have side effects / set start_timestamp_ns!
+	return elapsed + start_timestamp_ns;
 }
 
 /** return high-resolution timestamp in seconds since the Epoch (1970-01-01 00:00:00 UTC)
@@ -69,10 +113,35 @@ inline double get_elapsed_ms(void) {
 @note There's no "timezone" / `localtime()` involved here, you'd have to
 adjust for that yourself. (This is desired, so our timestamps are UTC-based
 and _not_ affected by local time zone or daylight savings transitions!)
+@see get_timestamp_ns()
 */
 inline double get_timestamp(void) {
-	double elapsed = get_elapsed(); // may have side effects / set start_timestamp!
-	return elapsed + start_timestamp;
+	uint64_t elapsed = get_elapsed_ns(); // may have side effects / set start_timestamp_ns!
+	return start_timestamp_ns / 1e9 + elapsed / 1e9;
+}
+
+// helper to retrieve the broken-down time for a timestamp
+static void timing_tm(double timestamp, bool local, struct tm *tm) {
+	time_t t = floor(timestamp);
+#if _WINDOWS
+	// (the MSVCRT functions use thread-local storage for the result)
+	*tm = local ? *localtime(&t) : *gmtime(&t);
+#else
+	if (local) // convert to local time?
+		localtime_r(&t, tm);
+	else
+		gmtime_r(&t, tm);
+#endif
+}
+
+// helper to store the milliseconds part of a timestamp as three digits
+static inline void timing_millis(char *digits, double timestamp) {
+	// (rounded, but without carrying over to the seconds)
+	unsigned int ms = (timestamp - floor(timestamp)) * 1e3 + 0.5;
+	if (ms > 999) ms = 999;
+	digits[0] = '0' + ms / 100;
+	digits[1] = '0' + ms / 10 % 10;
+	digits[2] = '0' + ms % 10;
 }
 
 /** convert timestamp to string with a given format
@@ -86,18 +155,72 @@ conversion specification.
 size_t format_timestamp(char *buffer, size_t len, const char *format,
 		double timestamp, bool local)
 {
-	struct tm *tm;
-	time_t t = timestamp;
-	if (local) // convert to local time?
-		tm = localtime(&t);
-	else
-		tm = gmtime(&t);
-	size_t result = strftime(buffer, len, format, tm);
+	struct tm tm;
+	timing_tm(timestamp, local, &tm);
+	size_t result = strftime(buffer, len, format, &tm);
 	char *qfmt = strstr(buffer, ".qqq");
-	if (qfmt) {
-		char msecs[6]; // "0.", plus three decimals, plus terminating NUL
-		snprintf(msecs, sizeof(msecs), "%.3f", fmod(timestamp, 1.));
-		strncpy(qfmt, msecs + 1, 4); // copy decimals to output (buffer)
-	}
+	if (qfmt && result > 0)
+		timing_millis(qfmt + 1, timestamp); // (keeps the '.')
 	return result;
 }
+
+/** prepare a timestamp cache before usage
+@param cache the cache to initialize
+@param format the `strftime()` format, may contain ".qqq" (see format_timestamp()).
+The cache doesn't copy the string, so it has to stay valid.
+@param local use local time (instead of UTC)
+*/
+void timestamp_cache_init(timestamp_cache_t *cache, const char *format,
+		bool local)
+{
+	cache->format = format;
+	cache->local = local;
+	cache->second = 0;
+	cache->length = 0;
+	cache->millis = 0;
+	cache->valid = false;
+}
+
+/** Format a timestamp using the cache, and return the resulting text.
+`localtime()` / `strftime()` only get called when the second changes, for
+other timestamps the function just updates the ".qqq" digits.
+
+@param cache the cache to use (not thread-safe, use one per thread)
+@param timestamp seconds since the Epoch (see get_timestamp())
+@param length receives the length of the text. optional, may be `NULL`
+@returns pointer to the (NUL-terminated) text within the cache
+*/
+const char *timestamp_cache_update(timestamp_cache_t *cache, double timestamp,
+		size_t *length)
+{
+	time_t second = floor(timestamp);
+	if (!cache->valid || second != cache->second) {
+		timing_tm(timestamp, cache->local, &cache->tm);
+		cache->length = strftime(cache->text, sizeof(cache->text),
+				cache->format, &cache->tm);
+		cache->text[cache->length] = '\0'; // (0 length on failure)
+		char *qfmt = strstr(cache->text, ".qqq");
+		cache->millis = qfmt ? qfmt + 1 - cache->text : 0;
+		cache->second = second;
+		cache->valid = true;
+	}
+	if (cache->millis) timing_millis(cache->text + cache->millis, timestamp);
+	if (length) *length = cache->length;
+	return cache->text;
+}
+
+/** Format a timestamp using the cache (see timestamp_cache_update()), and
+copy the text to a buffer.
+@returns the number of characters (without the terminating NUL), or 0 if
+the result doesn't fit into the buffer
+*/
+size_t timestamp_cache_format(timestamp_cache_t *cache, char *buffer,
+		size_t len, double timestamp)
+{
+	size_t length;
+	const char *text = timestamp_cache_update(cache, timestamp, &length);
+	if (length >= len) return 0;
+	memcpy(buffer, text, length + 1);
+	return length;
+}
+
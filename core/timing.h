@@ -4,7 +4,12 @@
 #define TIMING_H
 
 #include "bool.h"
+#include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
+
+uint64_t get_elapsed_ns(void);
+uint64_t get_timestamp_ns(void);
 
 double get_elapsed(void);
 double get_elapsed_ms(void);
@@ -13,6 +18,26 @@ double get_timestamp(void);
 size_t format_timestamp(char *buffer, size_t len, const char *format,
 		double timestamp, bool local);
 
+/// A cache for formatting timestamps at high rates.
+/// @see timing.c, timestamp_cache_update()
+typedef struct {
+	const char *format;	///< `strftime()` format, may contain ".qqq"
+	bool local;			///< use local time (instead of UTC)
+	bool valid;			///< `text` has been formatted for `second`
+	time_t second;		///< the second that `tm` and `text` correspond to
+	struct tm tm;		///< broken-down time
+	size_t length;		///< length of `text`
+	size_t millis;		///< position of the milliseconds digits in `text` (0 = none)
+	char text[64];		///< formatted timestamp
+} timestamp_cache_t;
+
+void timestamp_cache_init(timestamp_cache_t *cache, const char *format,
+		bool local);
+const char *timestamp_cache_update(timestamp_cache_t *cache, double timestamp,
+		size_t *length);
+size_t timestamp_cache_format(timestamp_cache_t *cache, char *buffer,
+		size_t len, double timestamp);
+
 // If we're not on Windows, provide a substitute for the Sleep() function
 #if !_WINDOWS
 	#include <unistd.h>
@@ -0,0 +1,65 @@
+/**
+@file timing_lua.c
+
+Lua bindings for the timing functions (see timing.c).
+
+These live in a translation unit of their own: timing.c gets linked into
+everything that logs, which shouldn't pull in the Lua runtime.
+*/
+
+#include "timing_lua.h"
+
+#include "threads.h"
+#include "timing.h"
+
+#include "lauxlib.h"
+
+#include <string.h>
+
+/// `get_elapsed_C()`, returns elapsed time in seconds
+LUA_CFUNC(get_elapsed_C) {
+	lua_pushnumber(L, get_elapsed());
+	return 1;
+}
+
+/// `get_timestamp_C()`, returns seconds since the Epoch (UTC)
+LUA_CFUNC(get_timestamp_C) {
+	lua_pushnumber(L, get_timestamp());
+	return 1;
+}
+
+/// `format_timestamp_C([timestamp [, format [, utc]]])`, returns a string.
+/// Defaults to the current time, "%Y-%m-%d %H:%M:%S.qqq" and local time.
+LUA_CFUNC(format_timestamp_C) {
+	// (a per-thread cache, reused as long as format and time zone match)
+	static THREAD_LOCAL timestamp_cache_t cache;
+	static THREAD_LOCAL char format[sizeof(cache.text)];
+
+	double timestamp = luaL_optnumber(L, 1, 0);
+	size_t len;
+	const char *fmt = luaL_optlstring(L, 2, "%Y-%m-%d %H:%M:%S.qqq", &len);
+	bool local = !lua_toboolean(L, 3);
+	if (timestamp <= 0) timestamp = get_timestamp();
+
+	if (len >= sizeof(format)) { // (won't fit the cache)
+		char buffer[256];
+		len = format_timestamp(buffer, sizeof(buffer), fmt, timestamp, local);
+		lua_pushlstring(L, buffer, len);
+		return 1;
+	}
+	if (cache.format != format || cache.local != local || strcmp(format, fmt)) {
+		memcpy(format, fmt, len + 1);
+		timestamp_cache_init(&cache, format, local);
+	}
+	const char *text = timestamp_cache_update(&cache, timestamp, &len);
+	lua_pushlstring(L, text, len);
+	return 1;
+}
+
+/// register the Lua bindings
+LUA_CFUNC(luaopen_timing) {
+	LREG(L, get_elapsed_C);
+	LREG(L, get_timestamp_C);
+	LREG(L, format_timestamp_C);
+	return 0;
+}
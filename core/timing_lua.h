@@ -0,0 +1,11 @@
+/// @file timing_lua.h
+
+#ifndef TIMING_LUA_H
+#define TIMING_LUA_H
+
+#include "lua.h"
+#include "luahelpers.h"
+
+LUA_CFUNC(luaopen_timing); // Lua bindings, see timing_lua.c
+
+#endif // TIMING_LUA_H
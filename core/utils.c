@@ -45,36 +45,34 @@ inline bool is_gzipped(const char *data) {
 	return (data && data[0] == 31 && data[1] == -117); // 0x1F, 0x8B = gzip signature
 }
 
-// Gzip-decompression from an input buffer to (heap) memory.
-// This function expects the data to start with a gzip-compatible header, and
-// uses tinfl_decompress_mem_to_heap() for the actual decompression. In case of
-// any error, it will return NULL. When successful, you will receive a (malloc)
-// pointer to the decompressed data, and *decompressed_size will be set to the
-// number of output bytes.
-// Note: You are responsible for calling free() on the result later!
-void *gzip_decompress(const char *data, size_t len, size_t *decompressed_size) {
-	if (!decompressed_size) {
-		error("%s(): you must pass a pointer to a decompressed_size variable!",
-			  __func__);
-		return NULL;
-	}
-	*decompressed_size = 0;
+/// Test if `len` bytes of data are (precompiled) LuaJIT bytecode.
+/// This checks for the signature bytes "\x1BLJ" (see lj_bcdump.h).
+inline bool is_lua_bytecode(const char *data, size_t len) {
+	return (data && len >= 3 && data[0] == 0x1B && data[1] == 'L' && data[2] == 'J');
+}
 
+// Check the gzip header (see RFC 1952), and return the offset of the
+// compressed data - or 0 if the header isn't valid (or supported).
+static size_t gzip_header_size(const char *data, size_t len, const char *func) {
+	if (len < 18) { // (header and trailer)
+		error("%s(): data at %p is too short for gzip", func, data);
+		return 0;
+	}
 	if (!is_gzipped(data)) {
-		error("%s(): data at %p has no gzip signature!", __func__, data);
-		return NULL;
+		error("%s(): data at %p has no gzip signature!", func, data);
+		return 0;
 	}
 	// let's check some header fields (see RFC 1952)
 	if (data[2] != 8) {
 		error("%s(): suspicious compression method (expected 8, got %d)",
-			  __func__, data[2]);
-		return NULL;
+			  func, data[2]);
+		return 0;
 	}
 	if (data[3] & (~0x09)) {
 		// bit 0 indicates text/binary and can be safely ignored
 		// bit 3 is the only other flag we recognize and respect, it indicates presence of the original filename
-		error("%s(): unsupported header flags 0x%.2X", __func__, data[3]);
-		return NULL;
+		error("%s(): unsupported header flags 0x%.2X", func, data[3]);
+		return 0;
 	}
 
 	size_t offset = 10; // minimum header size, offset to actual start of compressed data
@@ -82,16 +80,67 @@ void *gzip_decompress(const char *data, size_t len, size_t *decompressed_size) {
 		// original filename present (directly after the basic gzip header), get string length
 		int len_name = strlen(data + offset);
 		if (len_name <= 0) {
-			error("%s(): invalid length %d for original filename", __func__, len_name);
-			return NULL;
+			error("%s(): invalid length %d for original filename", func, len_name);
+			return 0;
 		}
-		//debug("%s(): original filename was '%s'", __func__, data + offset);
+		//debug("%s(): original filename was '%s'", func, data + offset);
 		offset += len_name + 1; // (skip filename and trailing NUL)
 	}
+	return offset < len ? offset : 0;
+}
+
+/// Return the uncompressed size of gzipped data, from the "ISIZE" field at its
+/// end (RFC 1952). This requires `len` to be exact, and the size below 4 GB.
+size_t gzip_size(const char *data, size_t len) {
+	if (len < 18 || !is_gzipped(data)) return 0;
+	const uint8_t *isize = (const uint8_t *)data + len - 4;
+	return isize[0] | isize[1] << 8 | isize[2] << 16 | (uint32_t)isize[3] << 24;
+}
+
+/// Decompress gzipped data into a buffer of (exactly) the uncompressed size,
+/// see gzip_size(). Returns `false` on error.
+bool gzip_decompress_to(const char *data, size_t len, char *output, size_t size) {
+	size_t offset = gzip_header_size(data, len, __func__);
+	if (offset == 0) return false;
+	return tinfl_decompress_mem_to_mem(output, size, data + offset, len - offset, 0)
+		== size;
+}
+
+// Gzip-decompression from an input buffer to (heap) memory.
+// This function expects the data to start with a gzip-compatible header. The
+// output gets allocated once, with the size from the gzip trailer - only if
+// that's unavailable, tinfl_decompress_mem_to_heap() grows it as needed. In case
+// of any error, it will return NULL. When successful, you will receive a (malloc)
+// pointer to the decompressed data, and *decompressed_size will be set to the
+// number of output bytes.
+// Note: You are responsible for calling free() on the result later!
+// (To avoid holding all of the output in memory, see gzip_stream_open().)
+void *gzip_decompress(const char *data, size_t len, size_t *decompressed_size) {
+	if (!decompressed_size) {
+		error("%s(): you must pass a pointer to a decompressed_size variable!",
+			  __func__);
+		return NULL;
+	}
+	*decompressed_size = 0;
 
-	// a bit of pointer arithmetic (taking care of the header's length), and we're good to go!
-	len -= offset;
-	char *result = tinfl_decompress_mem_to_heap(data + offset, len, decompressed_size, 0);
+	size_t offset = gzip_header_size(data, len, __func__);
+	if (offset == 0) return NULL;
+
+	char *result;
+	size_t size = gzip_size(data, len);
+	if (size > 0) {
+		result = malloc(size);
+		if (result && gzip_decompress_to(data, len, result, size))
+			*decompressed_size = size;
+		else {
+			free(result);
+			result = NULL;
+		}
+	} else {
+		// a bit of pointer arithmetic (taking care of the header's length), and we're good to go!
+		len -= offset;
+		result = tinfl_decompress_mem_to_heap(data + offset, len, decompressed_size, 0);
+	}
 
 	if (!result)
 		error("%s(): gzip decompression FAILED!", __func__);
@@ -104,6 +153,73 @@ void *gzip_decompress(const char *data, size_t len, size_t *decompressed_size) {
 	return result;
 }
 
+/// state of a streaming decompression, see gzip_stream_open()
+struct gzip_stream {
+	tinfl_decompressor decomp;
+	tinfl_status status;
+	const uint8_t *input;
+	size_t input_len, input_ofs;
+	size_t window_ofs;
+	uint8_t window[TINFL_LZ_DICT_SIZE];	// (the output wraps around)
+};
+
+/** Start a streaming gzip decompression.
+Unlike gzip_decompress(), this only needs a fixed amount of memory (for a
+sliding window of TINFL_LZ_DICT_SIZE bytes), no matter how large the output
+is. Retrieve the output with gzip_stream_read().
+@returns the stream, or `NULL` on error (e.g. no valid gzip header).
+You have to gzip_stream_close() it later.
+*/
+gzip_stream_t *gzip_stream_open(const char *data, size_t len) {
+	size_t offset = gzip_header_size(data, len, __func__);
+	if (offset == 0) return NULL;
+	gzip_stream_t *stream = malloc(sizeof(gzip_stream_t));
+	if (!stream) return NULL;
+	tinfl_init(&stream->decomp);
+	stream->status = TINFL_STATUS_HAS_MORE_OUTPUT;
+	stream->input = (const uint8_t *)data + offset;
+	stream->input_len = len - offset;
+	stream->input_ofs = 0;
+	stream->window_ofs = 0;
+	return stream;
+}
+
+/** Decompress the next part of the stream.
+@returns a pointer to the output, with *size set to the number of bytes.
+This stays valid until the next call. At the end of the stream (or on
+error), the result is `NULL` - see gzip_stream_done().
+*/
+const char *gzip_stream_read(gzip_stream_t *stream, size_t *size) {
+	*size = 0;
+	while (stream->status == TINFL_STATUS_HAS_MORE_OUTPUT) {
+		size_t input_size = stream->input_len - stream->input_ofs;
+		uint8_t *output = stream->window + stream->window_ofs;
+		*size = TINFL_LZ_DICT_SIZE - stream->window_ofs;
+		// (we always pass all of the input. But with "more input", tinfl
+		// reports truncated data - instead of decompressing zeros after it)
+		stream->status = tinfl_decompress(&stream->decomp,
+				stream->input + stream->input_ofs, &input_size,
+				stream->window, output, size, TINFL_FLAG_HAS_MORE_INPUT);
+		stream->input_ofs += input_size;
+		if (stream->status == TINFL_STATUS_NEEDS_MORE_INPUT)
+			stream->status = TINFL_STATUS_FAILED;
+		stream->window_ofs = (stream->window_ofs + *size) & (TINFL_LZ_DICT_SIZE - 1);
+		if (*size > 0) return (const char *)output;
+	}
+	return NULL;
+}
+
+/// returns `true` if the stream has been decompressed completely (and
+/// successfully), `false` if there's more output - or there was an error
+bool gzip_stream_done(gzip_stream_t *stream) {
+	return stream->status == TINFL_STATUS_DONE;
+}
+
+/// end a streaming decompression (and free its memory)
+void gzip_stream_close(gzip_stream_t *stream) {
+	free(stream);
+}
+
 /// return the full path to the dynamic library (dir + filename + extension)
 inline const char *get_dll_path(void) {
 	return lcfr_globals.dllpath;
@@ -16,6 +16,17 @@ void *get_dll_image_base(void);
 // gzip (de)compression
 bool is_gzipped(const char *data);
 void *gzip_decompress(const char *data, size_t len, size_t *decompressed_size);
+size_t gzip_size(const char *data, size_t len);
+bool gzip_decompress_to(const char *data, size_t len, char *output, size_t size);
+
+// streaming gzip decompression
+typedef struct gzip_stream gzip_stream_t;
+gzip_stream_t *gzip_stream_open(const char *data, size_t len);
+const char *gzip_stream_read(gzip_stream_t *stream, size_t *size);
+bool gzip_stream_done(gzip_stream_t *stream);
+void gzip_stream_close(gzip_stream_t *stream);
+
+bool is_lua_bytecode(const char *data, size_t len);
 
 bool file_exists(const char *filename);
 
@@ -5,6 +5,7 @@ Windows implementation of library_startup() and library_shutdown()
 
 #include "logstdio.h"
 #include "log.h"
+#include "profile.h"
 //#include "utils.h"
 
 #include <windows.h>
@@ -58,6 +59,10 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD dwReason, LPVOID lpReserved) {
 		extra("DLL_PROCESS_DETACH(%p,%u,%p)", hModule, dwReason, lpReserved);
 		library_shutdown(lpReserved);
 		break;
+	case DLL_THREAD_DETACH:
+		profile_flush(); // merge buffered profiling events
+		log_thread_cleanup(); // release per-thread log buffers
+		break;
 	}
 	return TRUE;
 }
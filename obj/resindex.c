@@ -0,0 +1,14 @@
+// resource index, generated by objwrap.lua - DO NOT EDIT
+
+#include "resources.h"
+
+extern const char core_banner_lua_binary_obj_data_start[];
+extern const char core_process_lua_binary_obj_data_start[];
+
+static const resource_t resources[] = {
+	{ "core/banner.lua", "core_banner_lua", core_banner_lua_binary_obj_data_start, 158, 1, 0xa3cd18fe },
+	{ "core/process.lua", "core_process_lua", core_process_lua_binary_obj_data_start, 226, 1, 0x39915dcf },
+	{ NULL }
+};
+
+const resource_index_t lcfr_resource_index = { 2, resources };
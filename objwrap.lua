@@ -21,6 +21,32 @@
 	help with large string resources like e.g. extensive ffi.cdef declarations.
 	Such ".h" wrappers might compress nicely with gzip, but don't really
 	benefit from luajit -b (as large strings essentially remain unchanged).
+
+	That said, once scripts grow, parsing them becomes the dominant cost of
+	loading. So there's an optional "bytecode" mode (the Makefile uses it
+	with "make LUA_BYTECODE=1"), that embeds stripped LuaJIT bytecode - gzip-
+	compressed, unless that doesn't make it smaller. load_decompressed_buffer()
+	detects the bytecode signature and loads it directly. Note that stripped
+	bytecode has no line information, so error messages will be less helpful.
+	The precedence of on-disk files over compiled-in resources is unaffected.
+
+	The compression method ("codec") can be chosen as well. gzip is the
+	default, and compresses best. lz4 (the LZ4 block format, see codec.c)
+	produces larger resources, but decompresses a lot faster - use it with
+	"make LUA_CODEC=lz4" when load times matter more than the binary size.
+	(Run "make bench" to compare them for the actual scripts.)
+
+	usage: luajit objwrap.lua <objcopy cmd> <infile> <outfile> [source|bytecode] [gzip|lz4]
+
+	With "-" for the objcopy command, <outfile> just receives the compressed
+	data (that's what the benchmarks use).
+
+	Along with each <outfile>, we write a small description of the resource
+	(<outfile>.idx). A final invocation then combines these into a C source
+	file with a table of all resources, sorted by their symbol prefix - so
+	the library can find them with a binary search (see resources.c):
+
+	usage: luajit objwrap.lua --index <C file> <outfiles...>
 ]]
 
 -- helper function: execute a (system) command, and make sure it succeeds
@@ -33,6 +59,133 @@ local function checked_execute(cmd)
 	end
 end
 
+-- helper function: return the size of a file (in bytes)
+local function filesize(filename)
+	local f = assert(io.open(filename, "rb"))
+	local size = f:seek("end")
+	f:close()
+	return size
+end
+
+-- helper function: 32-bit FNV-1a hash of a file's contents
+-- (this has to match resource_checksum(), see resources.c)
+local function checksum(filename)
+	local f = assert(io.open(filename, "rb"))
+	local data = f:read("*a")
+	f:close()
+	local hash = 0x811C9DC5
+	for i = 1, #data do
+		hash = bit.bxor(hash, data:byte(i))
+		-- hash * 16777619 (= 2^24 + 403), without exceeding double precision
+		hash = bit.tobit(bit.lshift(hash, 24) + hash * 403)
+	end
+	return hash
+end
+
+-- helper function: little-endian 32-bit value, as a string
+local function uint32_le(value)
+	return string.char(bit.band(value, 255), bit.band(bit.rshift(value, 8), 255),
+		bit.band(bit.rshift(value, 16), 255), bit.rshift(value, 24))
+end
+
+-- LZ4 block compression (greedy, with a hash of the most recent position for
+-- each 4-byte sequence). The result starts with a header, see lz4_decompress().
+local function lz4_compress(data)
+	local n = #data
+	local out = {"\27LZ4", uint32_le(n)}
+	-- (LZ4 lengths: 4 bits in the token, then extension bytes if it's >= 15)
+	local function length(len)
+		len = len - 15
+		while len >= 255 do
+			table.insert(out, "\255")
+			len = len - 255
+		end
+		table.insert(out, string.char(len))
+	end
+	local function literals(first, last, match_len)
+		local len = last - first + 1
+		local token = bit.lshift(math.min(len, 15), 4)
+		if match_len then token = token + math.min(match_len - 4, 15) end
+		table.insert(out, string.char(token))
+		if len >= 15 then length(len) end
+		table.insert(out, data:sub(first, last))
+	end
+
+	-- (the format requires the last match to start at least 12 bytes before
+	-- the end of the block, and the last 5 bytes to be literals)
+	local recent = {}
+	local anchor, i = 1, 1
+	while i <= n - 11 do
+		local key = data:sub(i, i + 3)
+		local candidate = recent[key]
+		recent[key] = i
+		if candidate and i - candidate <= 65535 then
+			local len, max_len = 4, n - 4 - i
+			while len < max_len and data:byte(candidate + len) == data:byte(i + len) do
+				len = len + 1
+			end
+			literals(anchor, i - 1, len)
+			table.insert(out, string.char(bit.band(i - candidate, 255), bit.rshift(i - candidate, 8)))
+			if len - 4 >= 15 then length(len - 4) end
+			for j = i + 1, math.min(i + len - 1, n - 11) do
+				recent[data:sub(j, j + 3)] = j
+			end
+			i = i + len
+			anchor = i
+		else
+			i = i + 1
+		end
+	end
+	literals(anchor, n) -- (this may be empty)
+	return table.concat(out)
+end
+
+-- compress a file with the given codec
+local function compress(codec, infile, outfile)
+	if codec == "lz4" then
+		local f = assert(io.open(infile, "rb"))
+		local data = f:read("*a")
+		f:close()
+		f = assert(io.open(outfile, "wb"))
+		f:write(lz4_compress(data))
+		f:close()
+	else
+		checked_execute(string.format('gzip -n9c "%s" > "%s"', infile, outfile))
+	end
+end
+
+-- create the resource index, from the .idx files of all resources
+local function write_index(filename, resources)
+	table.sort(resources, function(a, b) return a.key < b.key end)
+	local f = assert(io.open(filename, "w"))
+	f:write("// resource index, generated by objwrap.lua - DO NOT EDIT\n\n")
+	f:write('#include "resources.h"\n\n')
+	for _, res in ipairs(resources) do
+		f:write(string.format("extern const char %s_binary_obj_data_start[];\n", res.key))
+	end
+	f:write("\nstatic const resource_t resources[] = {\n")
+	for _, res in ipairs(resources) do
+		f:write(string.format('\t{ "%s", "%s", %s_binary_obj_data_start, %d, %d, 0x%s },\n',
+			res.name, res.key, res.key, res.size, res.flags, bit.tohex(res.checksum)))
+	end
+	f:write("\t{ NULL }\n};\n\n")
+	f:write(string.format("const resource_index_t lcfr_resource_index = { %d, resources };\n",
+		#resources))
+	f:close()
+end
+
+
+if arg[1] == "--index" then
+	local dst = arg[2] or error("missing <C file> filename")
+	local resources = {}
+	for i = 3, #arg do
+		table.insert(resources, dofile(arg[i] .. ".idx"))
+	end
+	print(string.format("RESINDEX %s (%d resources)", dst, #resources))
+	write_index(dst, resources)
+	os.exit(0)
+end
+
 
 --[[ main ]]--
 
@@ -42,10 +195,17 @@ local objcopy = arg[1] or error("missing <objcopy> command")
 -- filename arguments
 local src = arg[2] or error("missing <source> filename")
 local dst = arg[3] or error("missing <destination> filename")
+-- (optional) mode
+local mode = arg[4] or "source"
+if mode ~= "source" and mode ~= "bytecode" then error("invalid mode: " .. mode) end
+-- (optional) codec, and the corresponding RESOURCE_* flag
+local codec = arg[5] or "gzip"
+local codec_flags = {gzip = 1, lz4 = 4}
+if not codec_flags[codec] then error("invalid codec: " .. codec) end
 
 -- provide some short console echo
 -- (this is useful if the Makefile suppresses the invocation string, which tends to be rather long)
-print(string.format("BINWRAP %s %s", src, dst))
+print(string.format("BINWRAP %s %s (%s%s)", src, dst, codec, mode == "bytecode" and ", bytecode" or ""))
 
 -- We want objcopy to produce short symbols (and not to include any
 -- unnecessary or misleading information based on the filename). To
@@ -56,11 +216,44 @@ temp = dst:sub(1, dst:find("[^\\/]*$") - 1) .. temp -- (dir is taken from dst)
 
 
 -- First, we'll copy from the source to the temporary file. To save space
--- on the resulting binary, this is normally done using (gzip) compression.
+-- on the resulting binary, this is done using (gzip or lz4) compression.
 -- If you don't want that, replace with a simply copy: cmd = string.format('cp "%s" "%s"', src, temp)
 
-local cmd = string.format('gzip -n9c "%s" > "%s"', src, temp)
-checked_execute(cmd)
+local cmd
+local flags = codec_flags[codec]
+if mode == "bytecode" then
+	-- Compile the script to stripped bytecode (using the LuaJIT that's running
+	-- this script, i.e. the one we link with), and compress it if that helps.
+	local chunk, err = loadfile(src)
+	if not chunk then
+		print(err)
+		os.exit(1)
+	end
+	local bytecode = temp .. ".bc"
+	local f = assert(io.open(bytecode, "wb"))
+	f:write(string.dump(chunk, true))
+	f:close()
+	compress(codec, bytecode, temp)
+	if filesize(temp) < filesize(bytecode) then
+		os.remove(bytecode)
+		flags = flags + 2 -- | RESOURCE_BYTECODE
+	else
+		flags = 2 -- RESOURCE_BYTECODE
+		os.remove(temp)
+		local result, err = os.rename(bytecode, temp)
+		if not result then error(err); end
+	end
+else
+	compress(codec, src, temp)
+end
+
+if objcopy == "-" then
+	-- just the (compressed) data
+	os.remove(dst)
+	local result, err = os.rename(temp, dst)
+	if not result then error(err); end
+	os.exit(0)
+end
 
 
 -- Now we build an objcopy command that identifies the source file via a
@@ -88,6 +281,12 @@ checked_execute(cmd)
 -- by converting any non-alphanumeric characters to an underscore
 local prefix = src:gsub("%W", "_")
 
+-- describe the resource for the index (before objcopy converts the data)
+local f = assert(io.open(dst .. ".idx", "w"))
+f:write(string.format('return { name = %q, key = %q, size = %d, flags = %d, checksum = %d }\n',
+	src, prefix, filesize(temp), flags, checksum(temp)))
+f:close()
+
 -- build and execute the actual objcopy command (to work on the temporary filename)
 --cmd = objcopy .. string.format(' --change-leading-char --prefix-symbols=%s "%s"', prefix, temp)
 cmd = objcopy .. string.format(' --prefix-symbols=%s "%s"', prefix, temp)
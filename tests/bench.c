@@ -0,0 +1,55 @@
+/*
+ * bench.c
+ * microbenchmarks (build and run with "make bench")
+ *
+ * The executable gets linked with "--wrap" options for the heap functions,
+ * so benchmarks can count the memory allocations that happen (within our
+ * own code and the static libraries) while they run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "log.h"
+
+/// @name heap allocation counters (see the __wrap_ functions below)
+///@{
+static size_t bench_mallocs = 0;
+static bool bench_counting = false;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	if (bench_counting) __atomic_add_fetch(&bench_mallocs, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	if (bench_counting) __atomic_add_fetch(&bench_mallocs, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+void *__wrap_realloc(void *ptr, size_t size) {
+	if (bench_counting) __atomic_add_fetch(&bench_mallocs, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+///@}
+
+#include "bench_log.c"
+#include "bench_resources.c"
+
+int main(int argc, char **argv) {
+	printf(PROJECT_NAME " benchmarks " VERSION_STRING " %d-bit\n", BITS);
+	int result = 0;
+
+	result |= bench_log();
+	result |= bench_log_backends();
+	result |= bench_log_compact();
+	result |= bench_log_deferred();
+	result |= bench_log_shm();
+	result |= bench_resources(argc, argv);
+
+	log_shutdown();
+	return result;
+}
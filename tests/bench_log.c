@@ -0,0 +1,205 @@
+/*
+ * bench_log.c
+ * logging core benchmark: cost (and heap usage) of creating log messages,
+ * and throughput of the logging backends
+ */
+
+#include "logdict.h"
+#include "logfile.h"
+#include "logshm.h"
+#include "logstdio.h"
+#include "threads.h"
+#include "timing.h"
+
+#include <inttypes.h>
+
+#define BENCH_LOG_WARMUP	1000
+#define BENCH_LOG_MESSAGES	1000000
+
+// a logging backend that discards everything
+static void bench_null_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	++*(size_t *)userptr;
+}
+
+// a logging backend that sums up the message sizes
+static void bench_size_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	*(size_t *)userptr += logmsg->size;
+}
+
+// run a number of log calls, return the average time per message in ns
+static double bench_log_messages(int count) {
+	double start = get_elapsed();
+	int i;
+	for (i = 0; i < count; i++) {
+		log_info("bench", "message #%d, some text %s, and a float %f",
+				i, "to be formatted", i * 0.5);
+		log_level(LOG_LEVEL_INFO, "bench", "a plain (unformatted) message");
+	}
+	return (get_elapsed() - start) * 1e9 / (count * 2);
+}
+
+// returns non-zero if the benchmark failed
+int bench_log(void) {
+	size_t count = 0;
+	log_shutdown();
+	log_set_threshold(LOG_LEVEL_INFO);
+	log_register_backend(bench_null_callback, NULL, &count);
+
+	// let the per-thread buffers reach their "steady state"
+	bench_log_messages(BENCH_LOG_WARMUP);
+
+	bench_mallocs = 0;
+	bench_counting = true;
+	double ns = bench_log_messages(BENCH_LOG_MESSAGES);
+	bench_counting = false;
+
+	log_shutdown();
+	printf("log messages: %zu delivered, %.1f ns/message, %zu heap allocations\n",
+			count, ns, bench_mallocs);
+	if (bench_mallocs) {
+		printf("FAILED: steady-state logging should not allocate memory\n");
+		return 1;
+	}
+	return 0;
+}
+
+// compare backends: text output (to a null device) vs. binary segment files
+int bench_log_backends(void) {
+	char filename[FILENAME_MAX];
+	unsigned int index;
+	double ns;
+
+	log_shutdown();
+#if _WINDOWS
+	log_stdio("NUL");
+#else
+	log_stdio("/dev/null");
+#endif
+	ns = bench_log_messages(BENCH_LOG_MESSAGES / 10);
+	log_shutdown();
+	printf("log_stdio(): %.1f ns/message\n", ns);
+
+	if (!log_file("bench_logfile", 0, 4)) {
+		printf("FAILED: log_file()\n");
+		return 1;
+	}
+	ns = bench_log_messages(BENCH_LOG_MESSAGES);
+	log_shutdown();
+	printf("log_file(): %.1f ns/message\n", ns);
+
+	for (index = 0; index < 100; index++) {
+		logfile_segment_name(filename, sizeof(filename), "bench_logfile", index);
+		remove(filename);
+	}
+	return 0;
+}
+
+// message size with regular vs. compact encoding (interned origins)
+int bench_log_compact(void) {
+	size_t bytes = 0;
+	int count = BENCH_LOG_MESSAGES / 10;
+	log_shutdown();
+	log_register_backend(bench_size_callback, NULL, &bytes);
+	bench_log_messages(count);
+	double regular = (double)bytes / (count * 2);
+
+	bytes = 0;
+	log_dict_enable(true);
+	bench_log_messages(count);
+	log_dict_enable(false);
+	log_shutdown();
+	printf("message size: %.1f bytes, %.1f bytes with compact encoding\n",
+			regular, (double)bytes / (count * 2));
+	return 0;
+}
+
+// like bench_log_messages(), with deferred formatting
+static double bench_log_deferred_messages(int count) {
+	double start = get_elapsed();
+	int i;
+	for (i = 0; i < count; i++) {
+		log_level_defer(LOG_LEVEL_INFO, "bench",
+				"message #%d, some text %s, and a float %f",
+				i, "to be formatted", i * 0.5);
+		log_level(LOG_LEVEL_INFO, "bench", "a plain (unformatted) message");
+	}
+	return (get_elapsed() - start) * 1e9 / (count * 2);
+}
+
+// cost of creating messages: formatting right away vs. deferred formatting
+int bench_log_deferred(void) {
+	size_t count = 0;
+	log_shutdown();
+	log_register_backend(bench_null_callback, NULL, &count);
+	bench_log_messages(BENCH_LOG_WARMUP);
+	bench_log_deferred_messages(BENCH_LOG_WARMUP);
+
+	double immediate = bench_log_messages(BENCH_LOG_MESSAGES);
+	bench_mallocs = 0;
+	bench_counting = true;
+	double deferred = bench_log_deferred_messages(BENCH_LOG_MESSAGES);
+	bench_counting = false;
+	log_shutdown();
+	printf("immediate formatting: %.1f ns/message, deferred: %.1f ns/message"
+			" (%zu heap allocations)\n", immediate, deferred, bench_mallocs);
+	if (bench_mallocs) {
+		printf("FAILED: steady-state deferred logging should not allocate memory\n");
+		return 1;
+	}
+	return 0;
+}
+
+// consumer side of bench_log_shm(), drains the ring
+typedef struct {
+	logshm_t *shm;
+	bool stop;
+	size_t received;
+} bench_shm_consumer_t;
+
+static void bench_shm_callback(const char *data, size_t size, void *userptr) {
+	((bench_shm_consumer_t *)userptr)->received++;
+}
+
+static THREAD_FUNC bench_shm_thread(void *arg) {
+	bench_shm_consumer_t *consumer = arg;
+	while (!ATOMIC_LOAD(&consumer->stop))
+		if (logshm_wait(consumer->shm, 10))
+			logshm_read(consumer->shm, bench_shm_callback, consumer);
+	logshm_read(consumer->shm, bench_shm_callback, consumer);
+	return 0;
+}
+
+// shared memory transport, with the consumer running in another thread
+int bench_log_shm(void) {
+	bench_shm_consumer_t consumer = { .shm = logshm_create("lcfr_bench_logshm", 0) };
+	if (!consumer.shm) {
+		printf("FAILED: can't create shared memory\n");
+		return 1;
+	}
+	pthread_t thread = thread_start(bench_shm_thread, NULL, &consumer);
+	log_shutdown();
+	log_shm("lcfr_bench_logshm");
+	bench_log_messages(BENCH_LOG_WARMUP);
+
+	bench_mallocs = 0;
+	bench_counting = true;
+	double ns = bench_log_messages(BENCH_LOG_MESSAGES);
+	bench_counting = false;
+	log_shutdown();
+	ATOMIC_STORE(&consumer.stop, true);
+	thread_wait(thread, 1000);
+
+	uint64_t dropped = logshm_dropped(consumer.shm);
+	printf("shared memory: %zu received, %" PRIu64 " dropped, %.1f ns/message,"
+			" %zu heap allocations\n", consumer.received, dropped, ns, bench_mallocs);
+	logshm_close(consumer.shm);
+	if (bench_mallocs) {
+		printf("FAILED: writing to shared memory should not allocate memory\n");
+		return 1;
+	}
+	return 0;
+}
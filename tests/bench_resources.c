@@ -0,0 +1,135 @@
+/*
+ * bench_resources.c
+ * decompression of embedded resources: size and speed of each codec (see
+ * codec.c), for the .lua files that "make bench" compresses with objwrap.lua
+ */
+
+#include "codec.h"
+#include "timing.h"
+#include "utils.h"
+
+#define TINFL_HEADER_FILE_ONLY
+#include "tinfl.c"
+
+#include <string.h>
+
+// amount of output to produce per file and method (to get stable timings)
+#define BENCH_RESOURCES_BYTES	(64 * 1024 * 1024)
+
+// the ways to decompress a resource
+typedef enum {
+	BENCH_TINFL_HEAP,	// tinfl_decompress_mem_to_heap() (growing the output)
+	BENCH_GZIP_EXACT,	// codec_decompress(), with gzip
+	BENCH_GZIP_STREAM,	// gzip_stream_t, the way Lua loads gzipped scripts
+	BENCH_LZ4_EXACT,	// codec_decompress(), with lz4
+	BENCH_METHODS
+} bench_method_t;
+
+static const char *bench_method_names[BENCH_METHODS] = {
+	"gzip (tinfl heap)", "gzip (exact size)", "gzip (stream)", "lz4 (exact size)"
+};
+
+typedef struct {
+	size_t files, compressed, original;
+	double seconds;
+	size_t mallocs, calls;
+} bench_totals_t;
+
+// decompress once, returns the size of the output (0 on error)
+static size_t bench_decompress(bench_method_t method, const char *data, size_t len) {
+	size_t size = 0, chunk_size;
+	char *output = NULL;
+	switch (method) {
+	case BENCH_TINFL_HEAP:
+		// (objwrap.lua uses "gzip -n", so the header has no optional fields)
+		output = tinfl_decompress_mem_to_heap(data + 10, len - 10, &size, 0);
+		break;
+	case BENCH_GZIP_EXACT:
+	case BENCH_LZ4_EXACT:
+		output = codec_decompress(codec_find(data, len), data, len, &size);
+		break;
+	case BENCH_GZIP_STREAM: {
+		gzip_stream_t *stream = gzip_stream_open(data, len);
+		if (!stream) return 0;
+		while (gzip_stream_read(stream, &chunk_size)) size += chunk_size;
+		if (!gzip_stream_done(stream)) size = 0;
+		gzip_stream_close(stream);
+		return size;
+	}
+	default:
+		break;
+	}
+	free(output);
+	return output ? size : 0;
+}
+
+static char *bench_read_file(const char *filename, size_t *len) {
+	FILE *f = fopen(filename, "rb");
+	if (!f) return NULL;
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	rewind(f);
+	char *data = malloc(*len);
+	if (data && fread(data, 1, *len, f) != *len) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	return data;
+}
+
+// the files to use are given on the command line (*.gzip and *.lz4)
+int bench_resources(int argc, char **argv) {
+	bench_totals_t totals[BENCH_METHODS];
+	int i, result = 0;
+	bench_method_t method;
+
+	memset(totals, 0, sizeof(totals));
+	for (i = 1; i < argc; i++) {
+		size_t len;
+		char *data = bench_read_file(argv[i], &len);
+		const codec_t *codec = data ? codec_find(data, len) : NULL;
+		if (!codec) {
+			printf("FAILED: %s isn't a compressed resource\n", argv[i]);
+			free(data);
+			return 1;
+		}
+		size_t original = codec->size(data, len);
+		for (method = 0; method < BENCH_METHODS; method++) {
+			if ((method == BENCH_LZ4_EXACT) != (codec == &codec_lz4)) continue;
+			bench_totals_t *t = &totals[method];
+			size_t n, count = BENCH_RESOURCES_BYTES / (original + 1) + 1;
+			bench_mallocs = 0;
+			bench_counting = true;
+			double start = get_elapsed();
+			for (n = 0; n < count; n++)
+				if (bench_decompress(method, data, len) != original) {
+					printf("FAILED: %s, %s\n", bench_method_names[method], argv[i]);
+					result = 1;
+					break;
+				}
+			t->seconds += (get_elapsed() - start) / count;
+			bench_counting = false;
+			t->mallocs += bench_mallocs;
+			t->calls += count;
+			t->files++;
+			t->compressed += len;
+			t->original += original;
+		}
+		free(data);
+	}
+	if (totals[BENCH_GZIP_EXACT].files == 0) {
+		printf("resources: no files (run this with \"make bench\")\n");
+		return result;
+	}
+	// (seconds are scaled to the time for decompressing each file once)
+	for (method = 0; method < BENCH_METHODS; method++) {
+		bench_totals_t *t = &totals[method];
+		if (t->files == 0) continue;
+		printf("resources %-18s: %zu files, %zu -> %zu bytes (%.1f%%), %.1f us,"
+				" %.2f heap allocations/file\n", bench_method_names[method],
+				t->files, t->original, t->compressed, t->compressed * 100.0 / t->original,
+				t->seconds * 1e6, (double)t->mallocs / t->calls);
+	}
+	return result;
+}
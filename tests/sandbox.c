@@ -7,7 +7,22 @@
 #include "processes.h"
 
 #include "test_core.c"
+#include "test_ringbuffer.c"
+#include "test_log.c"
+#include "test_logfile.c"
+#include "test_logstdio.c"
+#include "test_logbatch.c"
+#include "test_logrecorder.c"
+#include "test_profile.c"
+#include "test_logtrace.c"
+#include "test_logdict.c"
+#include "test_logdefer.c"
+#include "test_logsocket.c"
+#include "test_logshm.c"
+#include "test_agent.c"
 #include "test_lua.c"
+#include "test_rescache.c"
+#include "test_resources.c"
 #include "test_lib.c"
 #include "test_loop.c"
 
@@ -17,6 +32,7 @@ int main(int argc, char **argv) {
 	static const struct option long_options[] = {
 		{"interactive", no_argument, &loop_timeout, -1},
 		{"loop", optional_argument, NULL, 'l'},
+		{"viewer", required_argument, NULL, 'v'},
 		{NULL, 0, NULL, 0},
 	};
 
@@ -32,6 +48,8 @@ int main(int argc, char **argv) {
 				loop_timeout = 5;
 			loop_timeout *= 1000; // time in milliseconds
 		}
+		if (c == 'v') // "--viewer=<path>", display messages from log_socket()
+			return logsocket_viewer(optarg);
 	} while (c != -1);
 
 	printf(PROJECT_NAME " sandbox " VERSION_STRING " %d-bit", BITS);
@@ -46,7 +64,25 @@ int main(int argc, char **argv) {
 
 	test_core_bits();
 	test_core_time();
+	test_ringbuffer();
+	test_spscring();
 	test_core_log();
+	test_log_async();
+	test_log_threads();
+	test_log_nested();
+	test_log_threshold();
+	test_log_backend_threshold();
+	test_logfile();
+	test_logstdio();
+	test_logbatch();
+	test_logrecorder();
+	test_profile();
+	test_logtrace();
+	test_logdict();
+	test_logdefer();
+	test_logsocket();
+	test_logshm();
+	test_agent();
 
 #if _WINDOWS
 	test_win_utils();
@@ -77,6 +113,8 @@ int main(int argc, char **argv) {
 	// subsequently created Lua states should resolve scripts properly - after
 	// you do a luaopen_symbols(L);
 	test_lua();
+	test_rescache();
+	test_resources();
 	int failures = run_unit_tests();
 
 	if (loop_timeout)
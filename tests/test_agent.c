@@ -0,0 +1,76 @@
+/*
+ * test_agent.c
+ * tests for the agent (agent.c), forwarding log messages via shared memory
+ */
+
+#include "agent.h"
+#include "logdict.h"
+
+#if !_WINDOWS
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define AGENT_TEST_NAME		"lcfr_test_agent"
+#define AGENT_TEST_MESSAGES	1000
+
+// backend that counts the messages forwarded by the agent
+static void agent_test_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+								void *userptr)
+{
+	size_t *count = userptr;
+	msgpack_unpacked msg;
+	msgpack_unpacked_init(&msg);
+	if (level == LOG_LEVEL_INFO
+		&& msgpack_unpack_next(&msg, logmsg->data, logmsg->size, NULL)
+			== MSGPACK_UNPACK_SUCCESS
+		&& msg.data.type == MSGPACK_OBJECT_ARRAY
+		&& msg.data.via.array.size > LOG_FIELD_MSG
+		// (interned strings must have been resolved)
+		&& msg.data.via.array.ptr[LOG_FIELD_ORIGIN].type == MSGPACK_OBJECT_STR)
+			ATOMIC_INC(count);
+	msgpack_unpacked_destroy(&msg);
+}
+
+void test_agent(void) {
+#if _WINDOWS
+	/* The sender has to be another process: within the same process the
+	 * agent would pass the messages back to log_shm(). Windows has no fork(),
+	 * so skip this for now. */
+	info("test_agent: skipped");
+#else
+	size_t count = 0;
+	unsigned int i;
+
+	logshm_t *shm = agent_log_start(AGENT_TEST_NAME, 0);
+	assert(shm != NULL);
+	assert(agent_log_start(AGENT_TEST_NAME, 0) == NULL); // (already running)
+	log_shutdown();
+	log_register_backend(agent_test_callback, NULL, &count);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		// the "injected library": log via the shared memory only
+		log_shutdown();
+		log_dict_enable(true);
+		if (!log_shm(AGENT_TEST_NAME)) _exit(1);
+		for (i = 0; i < AGENT_TEST_MESSAGES; i++)
+			log_info("agent", "message #%u", i);
+		log_shutdown();
+		_exit(0);
+	}
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	// (the agent's thread might still be busy with the last messages)
+	for (i = 0; i < 500 && ATOMIC_LOAD(&count) < AGENT_TEST_MESSAGES; i++)
+		Sleep(10);
+	agent_log_stop();
+	log_shutdown();
+	log_stdio("stdout");
+	assert(count == AGENT_TEST_MESSAGES);
+	info("test_agent: %zu messages forwarded", count);
+#endif
+}
@@ -1,6 +1,11 @@
 #include "log.h"
+#include "luautils.h"
 #include "mpkutils.h"
 #include "timing.h"
+#include "timing_lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
 
 void test_core_bits(void) {
 	assert(BITS >> 3 == sizeof(void*));
@@ -8,8 +13,17 @@ void test_core_bits(void) {
 
 void test_core_time(void) {
 	printf("%.3f\n", get_timestamp());
+	uint64_t ns = get_elapsed_ns(), timestamp_ns = get_timestamp_ns();
 	Sleep(666);
 	printf("%.3f\n", get_timestamp());
+	// integer nanoseconds (monotonic), consistent with the "double" functions
+	ns = get_elapsed_ns() - ns;
+	assert(ns >= 600000000 && ns < 5000000000ULL);
+	timestamp_ns = get_timestamp_ns() - timestamp_ns;
+	assert(timestamp_ns + 1000000 > ns && timestamp_ns < ns + 1000000);
+	double delta = get_timestamp() - get_timestamp_ns() / 1e9;
+	assert(delta > -1e-3 && delta < 1e-3);
+	assert(get_elapsed_ns() <= get_elapsed_ns());
 
 	char buffer[40];
 	double test = 123.45; // test fractional seconds, ~2 minutes past the Epoch
@@ -23,6 +37,40 @@ void test_core_time(void) {
 	// current time ("now")
 	format_timestamp(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S.qqq", get_timestamp(), true);
 	printf("%s\n", buffer);
+
+	// the timestamp cache produces the same results as format_timestamp()
+	char cached[40];
+	timestamp_cache_t cache;
+	timestamp_cache_init(&cache, "%Y-%m-%d %H:%M:%S.qqq", false);
+	static const double timestamps[] = {
+		123.45, 123.999, 124.0, 14674e5 + 0.001, 14674e5 + 0.5, 14674e5 + 86400.25
+	};
+	size_t i, len;
+	for (i = 0; i < sizeof(timestamps) / sizeof(double); i++) {
+		format_timestamp(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S.qqq",
+				timestamps[i], false);
+		len = timestamp_cache_format(&cache, cached, sizeof(cached), timestamps[i]);
+		assert(len == strlen(buffer) && strcmp(buffer, cached) == 0);
+	}
+	assert(strcmp(cached, "2016-07-02 19:06:40.250") == 0);
+	len = timestamp_cache_format(&cache, cached, 10, 0); // (buffer too small)
+	assert(len == 0);
+	timestamp_cache_init(&cache, "%H:%M:%S", true); // (no milliseconds)
+	timestamp_cache_update(&cache, 14674e5 + 0.5, &len);
+	assert(len == 8);
+
+	// Lua bindings
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	luaopen_timing(L);
+	bool ok = luautils_dostring(L,
+		"assert(get_elapsed_C() > 0 and get_timestamp_C() > 14674e5)\n"
+		"assert(format_timestamp_C(123.45, '%H:%M:%S.qqq', true) == '00:02:03.450')\n"
+		"assert(format_timestamp_C(123.999, '%H:%M:%S.qqq', true) == '00:02:03.999')\n"
+		"assert(format_timestamp_C(14674e5, '%Y-%m-%d', true) == '2016-07-01')\n"
+		"assert(#format_timestamp_C() == 23)\n");
+	assert(ok);
+	lua_close(L);
 }
 
 static void logtest_setup_buffer(msgpack_sbuffer *sbuf) {
@@ -0,0 +1,306 @@
+/*
+ * test_log.c
+ * tests for the logging core (asynchronous mode, concurrent producers,
+ * nested messages, global and per-backend thresholds)
+ */
+
+#include "atomics.h"
+#include "logqueue.h"
+#include "macro.h"
+#include "threads.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define LOGTEST_THREADS		4
+#define LOGTEST_MESSAGES	10000
+#define LOGTEST_SCOPES		1000
+
+// a logging backend that simply counts the messages it receives
+static void logtest_count_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	ATOMIC_INC((size_t *)userptr);
+}
+
+static THREAD_FUNC logtest_producer(void *arg) {
+	int i;
+	for (i = 0; i < LOGTEST_MESSAGES; i++)
+		info("producer %p, message #%d", arg, i);
+	thread_exit(0);
+}
+
+static void logtest_producers(void) {
+	pthread_t threads[LOGTEST_THREADS];
+	int i;
+	for (i = 0; i < LOGTEST_THREADS; i++)
+		threads[i] = thread_start(logtest_producer, NULL, threads + i);
+	for (i = 0; i < LOGTEST_THREADS; i++)
+		thread_wait(threads[i], 10000);
+}
+
+void test_log_async(void) {
+	size_t count = 0;
+	log_async_stats_t stats;
+
+	// temporarily replace the stdout logger with our counting backend
+	log_shutdown();
+	log_register_backend(logtest_count_callback, NULL, &count);
+
+	// with LOG_OVERFLOW_BLOCK, no message may get lost
+	log_async_start(256, LOG_OVERFLOW_BLOCK);
+	assert(log_async_active());
+	logtest_producers();
+	log_async_stop();
+	log_async_get_stats(&stats);
+	assert(!log_async_active());
+	assert(stats.capacity == 256);
+	assert(stats.dropped == 0);
+	assert(stats.delivered == LOGTEST_THREADS * LOGTEST_MESSAGES);
+	assert(count == LOGTEST_THREADS * LOGTEST_MESSAGES);
+
+	// with a small queue and LOG_OVERFLOW_DROP, every message is accounted for
+	count = 0;
+	log_async_start(16, LOG_OVERFLOW_DROP);
+	assert(log_async_active());
+	logtest_producers();
+	log_async_stop();
+	log_async_get_stats(&stats);
+	assert(stats.enqueued == stats.delivered);
+	assert(stats.delivered + stats.dropped == LOGTEST_THREADS * LOGTEST_MESSAGES);
+	assert(stats.dropped == stats.dropped_level[LOG_LEVEL_INFO]);
+	assert(count == stats.delivered);
+
+	log_shutdown();
+	log_stdio("stdout");
+	info("%s: %zu delivered, %zu dropped", __func__, stats.delivered, stats.dropped);
+}
+
+// a logging backend that records serials and checks indentation levels
+typedef struct {
+	size_t count;
+	size_t bad_indent;
+	size_t bad_thread;		// wrong format version, thread ID or sequence
+	uint64_t checkpoint;
+	uint32_t serials[LOGTEST_THREADS * LOGTEST_SCOPES * 3];
+} logtest_record_t;
+
+static void logtest_record_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	logtest_record_t *record = userptr;
+	msgpack_unpacked msg;
+	msgpack_unpacked_init(&msg);
+	if (msgpack_unpack_next(&msg, logmsg->data, logmsg->size, NULL)
+			== MSGPACK_UNPACK_SUCCESS) {
+		msgpack_object *fields = msg.data.via.array.ptr;
+		size_t i = ATOMIC_ADD(&record->count, 1);
+		if (i < lengthof(record->serials))
+			record->serials[i] = fields[7].via.u64;
+		// each thread only ever enters a single scope
+		if (fields[1].via.u64 > (level == LOG_LEVEL_CHECKPOINT ? 1 : 0))
+			ATOMIC_INC(&record->bad_indent);
+		if (level == LOG_LEVEL_CHECKPOINT)
+			ATOMIC_STORE(&record->checkpoint, fields[6].via.u64);
+		// (synchronous backend, the callback runs on the logging thread)
+		static THREAD_LOCAL uint32_t sequence = 0;
+		double timestamp = fields[LOG_FIELD_TIMESTAMP_NS].via.u64 / 1e9;
+		if (log_message_version(&msg.data) != LOG_FORMAT_VERSION
+			|| fields[LOG_FIELD_TID].via.u64 != thread_id()
+			|| fields[LOG_FIELD_SEQUENCE].via.u64 != ++sequence
+			|| fabs(timestamp - fields[LOG_FIELD_TIMESTAMP].via.f64) > 1e-6)
+				ATOMIC_INC(&record->bad_thread);
+	}
+	msgpack_unpacked_destroy(&msg);
+}
+
+static int logtest_compare_serials(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static THREAD_FUNC logtest_scopes(void *arg) {
+	int i;
+	for (i = 0; i < LOGTEST_SCOPES; i++) {
+		enter("scope");
+		check("logtest");
+		leave("scope");
+	}
+	thread_exit(0);
+}
+
+void test_log_threads(void) {
+	static logtest_record_t record;
+	pthread_t threads[LOGTEST_THREADS];
+	size_t i;
+
+	log_shutdown();
+	log_register_backend(logtest_record_callback, NULL, &record);
+	for (i = 0; i < LOGTEST_THREADS; i++)
+		threads[i] = thread_start(logtest_scopes, NULL, NULL);
+	for (i = 0; i < LOGTEST_THREADS; i++)
+		thread_wait(threads[i], 10000);
+
+	// serials must be unique, indentation levels must not "leak" between threads
+	assert(record.count == lengthof(record.serials));
+	assert(record.bad_indent == 0);
+	assert(record.bad_thread == 0);
+	qsort(record.serials, record.count, sizeof(uint32_t), logtest_compare_serials);
+	for (i = 1; i < record.count; i++)
+		assert(record.serials[i] == record.serials[i - 1] + 1);
+	// no checkpoint pass got lost
+	check("logtest");
+	assert(record.checkpoint == LOGTEST_THREADS * LOGTEST_SCOPES + 1);
+
+	log_shutdown();
+	log_stdio("stdout");
+	info("%s: %zu messages from %u threads", __func__, record.count, LOGTEST_THREADS);
+}
+
+// a logging backend that creates (nested) log messages of its own
+typedef struct {
+	size_t count;
+	size_t clobbered;
+	char last[400];
+} logtest_nested_t;
+
+// retrieve the message text of a log message
+static void logtest_message_text(msgpack_sbuffer *logmsg, char *buffer, size_t size) {
+	msgpack_unpacked msg;
+	msgpack_unpacked_init(&msg);
+	*buffer = '\0';
+	if (msgpack_unpack_next(&msg, logmsg->data, logmsg->size, NULL)
+			== MSGPACK_UNPACK_SUCCESS) {
+		msgpack_object_str *text = &msg.data.via.array.ptr[5].via.str;
+		snprintf(buffer, size, "%.*s", (int)text->size, text->ptr);
+	}
+	msgpack_unpacked_destroy(&msg);
+}
+
+static void logtest_nested_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	logtest_nested_t *nested = userptr;
+	char text[sizeof(nested->last)];
+
+	logtest_message_text(logmsg, text, sizeof(text));
+	if (nested->count++ % 2 == 0) {
+		// echo the message, this must not clobber the one being processed
+		info("echo %zu", nested->count);
+		logtest_message_text(logmsg, nested->last, sizeof(nested->last));
+		if (strcmp(text, nested->last) != 0)
+			nested->clobbered++;
+	}
+}
+
+void test_log_nested(void) {
+	logtest_nested_t nested = {0};
+
+	log_shutdown();
+	log_register_backend(logtest_nested_callback, NULL, &nested);
+	info("first %s", "message");
+	assert(nested.count == 2);
+	assert(strcmp(nested.last, "first message") == 0);
+	// (a long text forces the thread's message buffers to grow)
+	warn("message with a long text: %0300d", 42);
+	log_level(LOG_LEVEL_INFO, NULL, "unformatted message");
+	assert(nested.count == 6);
+	assert(nested.clobbered == 0);
+	assert(strcmp(nested.last, "unformatted message") == 0);
+
+	log_shutdown();
+	log_stdio("stdout");
+	info("%s: %zu messages", __func__, nested.count);
+}
+
+// a function with a side effect, to test if log arguments get evaluated
+static int logtest_evaluated = 0;
+static int logtest_argument(void) {
+	return ++logtest_evaluated;
+}
+
+void test_log_threshold(void) {
+	size_t count = 0;
+	LOG_LEVEL saved = log_get_threshold();
+
+	log_shutdown();
+	log_register_backend(logtest_count_callback, NULL, &count);
+	log_set_threshold(LOG_LEVEL_WARNING);
+	assert(!LOG_ENABLED(LOG_LEVEL_DEBUG));
+	assert(LOG_ENABLED(LOG_LEVEL_ERROR));
+
+	// suppressed messages must not evaluate their arguments
+	extra("%d", logtest_argument());
+	debug("%d", logtest_argument());
+	info("%d", logtest_argument());
+	attach_debug(NULL, "%d", logtest_argument());
+	assert(logtest_evaluated == 0);
+	assert(count == 0);
+
+	// (the macros have to work as single statements)
+	if (logtest_evaluated == 0)
+		warn("%d", logtest_argument());
+	else
+		error("%d", logtest_argument());
+	assert(logtest_evaluated == 1);
+	assert(count == 1);
+
+	// non-message levels are unaffected by the threshold
+	enter("scope");
+	leave("scope");
+	assert(count == 3);
+
+	log_shutdown();
+	log_set_threshold(saved);
+	log_stdio("stdout");
+}
+
+// count SETLEVEL notifications
+static void logtest_count_notify(LOG_NOTIFY reason, void *userptr) {
+	if (reason == LOG_NOTIFY_SETLEVEL)
+		ATOMIC_INC((size_t *)userptr + 1);
+}
+
+void test_log_backend_threshold(void) {
+	// (counters for messages and notifications)
+	size_t all[2] = {0, 0}, important[2] = {0, 0};
+	LOG_LEVEL saved = log_get_threshold();
+
+	log_shutdown();
+	log_set_threshold(LOG_LEVEL_EXTRADEBUG);
+	backend_list_t *backend =
+		log_register_backend(logtest_count_callback, logtest_count_notify, important);
+	bool ok = log_backend_set_threshold(backend, LOG_LEVEL_WARNING);
+	assert(ok);
+	assert(important[1] == 1);
+	// with a single backend, its threshold is the effective one
+	assert(log_threshold == LOG_LEVEL_WARNING);
+	debug("%d", logtest_argument());
+	assert(logtest_evaluated == 1); // (from test_log_threshold)
+	warn("warning");
+	check("backend threshold"); // (always passes)
+	assert(important[0] == 2);
+
+	// adding a backend that wants everything lowers the effective threshold
+	log_register_backend(logtest_count_callback, logtest_count_notify, all);
+	assert(log_threshold == LOG_LEVEL_EXTRADEBUG);
+	debug("debug");
+	warn("warning");
+	assert(all[0] == 2);
+	assert(important[0] == 3);
+
+	// the global threshold still applies, and gets broadcast
+	log_set_threshold(LOG_LEVEL_ERROR);
+	assert(log_threshold == LOG_LEVEL_ERROR);
+	assert(all[1] == 1 && important[1] == 2);
+	warn("warning");
+	assert(all[0] == 2 && important[0] == 3);
+
+	log_unregister_backend(logtest_count_callback, important);
+	ok = log_backend_set_threshold(backend, LOG_LEVEL_INFO);
+	assert(!ok); // (not registered anymore)
+
+	log_shutdown();
+	log_set_threshold(saved);
+	log_stdio("stdout");
+}
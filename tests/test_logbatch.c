@@ -0,0 +1,102 @@
+/*
+ * test_logbatch.c
+ * tests for batched delivery of log messages
+ */
+
+#include "logbatch.h"
+#include "logqueue.h"
+
+// statistics collected by the batch callback
+typedef struct {
+	size_t batches;
+	size_t frames;
+	size_t last_count;
+	size_t bad_frames;
+	size_t shutdown;
+} batchtest_t;
+
+static void batchtest_callback(const log_batch_t *batch, void *userptr) {
+	batchtest_t *test = userptr;
+	size_t i, offset = 0;
+
+	// frames must be contiguous, and each one a valid log message
+	for (i = 0; i < batch->count; i++) {
+		const log_frame_t *frame = &batch->frames[i];
+		msgpack_unpacked msg;
+		msgpack_unpacked_init(&msg);
+		size_t ofs = 0;
+		if (frame->offset != offset
+			|| msgpack_unpack_next(&msg, batch->data + frame->offset, frame->size,
+					&ofs) != MSGPACK_UNPACK_SUCCESS
+			|| ofs != frame->size
+			|| msg.data.via.array.ptr[0].via.u64 != frame->level)
+				test->bad_frames++;
+		msgpack_unpacked_destroy(&msg);
+		offset += frame->size;
+	}
+	if (offset != batch->size) test->bad_frames++;
+
+	test->batches++;
+	ATOMIC_ADD(&test->frames, batch->count); // (the timer test polls this)
+	test->last_count = batch->count;
+}
+
+static void batchtest_notify(LOG_NOTIFY reason, void *userptr) {
+	if (reason == LOG_NOTIFY_SHUTDOWN)
+		((batchtest_t *)userptr)->shutdown++;
+}
+
+void test_logbatch(void) {
+	batchtest_t test = {0};
+	log_batch_config_t config = LOG_BATCH_DEFAULTS;
+	int i;
+
+	config.max_frames = 10;
+	config.max_delay_ms = 60000; // (no time-based flushing here)
+	log_shutdown();
+	backend_list_t *backend = log_register_batch_backend(
+			batchtest_callback, batchtest_notify, &test, &config);
+	assert(backend != NULL);
+
+	// size trigger
+	for (i = 0; i < 25; i++)
+		info("batched message #%d", i);
+	assert(test.batches == 2 && test.frames == 20);
+	// level trigger, also delivers the pending messages
+	error("an error gets delivered immediately");
+	assert(test.batches == 3 && test.last_count == 6);
+	// explicit flush
+	info("pending");
+	assert(test.batches == 3);
+	log_flush();
+	assert(test.batches == 4 && test.last_count == 1);
+	log_flush(); // (nothing to do)
+	assert(test.batches == 4);
+
+	// asynchronous mode: the dispatch thread flushes when the queue is empty
+	log_async_start(1024, LOG_OVERFLOW_BLOCK);
+	for (i = 0; i < 1000; i++)
+		info("async message #%d", i);
+	log_async_stop();
+	assert(test.frames == 27 + 1000);
+
+	// shutdown delivers the remaining messages, and notifies the backend
+	info("last message");
+	log_shutdown();
+	assert(test.frames == 27 + 1001);
+	assert(test.shutdown == 1);
+	assert(test.bad_frames == 0);
+
+	// the timer thread delivers messages that have been waiting too long
+	batchtest_t timed = {0};
+	config.max_delay_ms = 20;
+	log_register_batch_backend(batchtest_callback, batchtest_notify, &timed, &config);
+	info("a lone message");
+	for (i = 0; i < 500 && ATOMIC_LOAD(&timed.frames) == 0; i++) Sleep(10);
+	log_shutdown();
+	assert(timed.frames == 1 && timed.batches == 1);
+	assert(timed.shutdown == 1 && timed.bad_frames == 0);
+
+	log_stdio("stdout");
+	info("%s: %zu messages in %zu batches", __func__, test.frames, test.batches);
+}
@@ -0,0 +1,225 @@
+/*
+ * test_logdefer.c
+ * tests for deferred formatting (log messages with raw arguments)
+ */
+
+#include "logdict.h"
+#include "logfile.h"
+#include "logformat.h"
+
+#define LOGDEFER_TEST_BASENAME	"test_logdefer"
+
+// formats the messages a backend receives, from the serialized data and
+// from the unpacked message (which have to match)
+typedef struct {
+	char text[256];
+	msgpack_object_type types[LOG_DEFER_MAX];
+	uint32_t count;				// number of arguments
+	uint64_t version;
+	size_t size;
+	bool deferred;
+} logdefer_test_t;
+
+static void logdefer_test_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	logdefer_test_t *test = userptr;
+	msgpack_unpacked msg;
+	uint32_t i;
+
+	if (level == LOG_LEVEL_DICTIONARY) return;
+	test->size = logmsg->size;
+	msgpack_unpacked_init(&msg);
+	if (msgpack_unpack_next(&msg, logmsg->data, logmsg->size, NULL)
+			== MSGPACK_UNPACK_SUCCESS) {
+		msgpack_object *member = msg.data.via.array.ptr;
+		test->version = log_message_version(&msg.data);
+		test->deferred = msg.data.via.array.size > LOG_FIELD_ARGS;
+		if (test->deferred) {
+			msgpack_object fmt = member[LOG_FIELD_MSG];
+			if (fmt.type == MSGPACK_OBJECT_POSITIVE_INTEGER) { // (interned)
+				size_t len;
+				fmt.via.str.ptr = log_dict_string(fmt.via.u64, &len);
+				fmt.via.str.size = len;
+				assert(fmt.via.str.ptr != NULL);
+			}
+			log_args_t args;
+			bool ok = log_args_from_object(&args, &member[LOG_FIELD_ARGS]);
+			assert(ok);
+			test->count = args.count;
+			for (i = 0; i < args.count && i < LOG_DEFER_MAX; i++)
+				test->types[i] = args.objects[i].type;
+			int len = log_format_args(test->text, sizeof(test->text),
+									  fmt.via.str.ptr, fmt.via.str.size, args);
+			assert(len >= 0 && (size_t)len < sizeof(test->text));
+
+			// the same from the serialized data
+			char text[sizeof(test->text)];
+			msgpack_cursor_t cursor = { .pos = logmsg->data, .end = logmsg->data + logmsg->size };
+			msgpack_object item;
+			ok = msgpack_read_item(&cursor, &item);
+			for (i = 0; ok && i < LOG_FIELD_ARGS; i++)
+				ok = msgpack_skip_item(&cursor);
+			assert(ok);
+			ok = log_args_from_cursor(&args, &cursor);
+			assert(ok && cursor.pos == cursor.end);
+			log_format_args(text, sizeof(text), fmt.via.str.ptr, fmt.via.str.size, args);
+			assert(strcmp(text, test->text) == 0);
+		}
+	}
+	msgpack_unpacked_destroy(&msg);
+}
+
+// log a deferred message, and compare its text to snprintf()
+#define LOGDEFER_CHECK(test, ...) do { \
+	char expected[256]; \
+	snprintf(expected, sizeof(expected), __VA_ARGS__); \
+	log_level_defer(LOG_LEVEL_INFO, "defer", __VA_ARGS__); \
+	assert((test)->deferred); \
+	if (strcmp((test)->text, expected) != 0) { \
+		printf("deferred \"%s\" != \"%s\"\n", (test)->text, expected); \
+		assert(false); \
+	} \
+} while (0)
+
+// read the text of the next message from a file (starting at the origin)
+static void logdefer_test_line(FILE *file, char *line, size_t size) {
+	assert(fgets(line, size, file) != NULL);
+	char *text = strstr(line, "defer: ");
+	assert(text != NULL);
+	memmove(line, text, strlen(text) + 1);
+}
+
+// checks messages read from a segment file
+static void logdefer_file_callback(msgpack_object *msg, void *userptr) {
+	unsigned int *count = userptr;
+	msgpack_object *member = msg->via.array.ptr;
+	if (member[LOG_FIELD_LEVEL].via.u64 == LOG_LEVEL_DICTIONARY) return;
+	assert(msg->via.array.size > LOG_FIELD_ARGS);
+	assert(member[LOG_FIELD_MSG].type == MSGPACK_OBJECT_STR); // (resolved)
+
+	char text[64], expected[64];
+	log_args_t args;
+	log_args_from_object(&args, &member[LOG_FIELD_ARGS]);
+	log_format_args(text, sizeof(text), member[LOG_FIELD_MSG].via.str.ptr,
+					member[LOG_FIELD_MSG].via.str.size, args);
+	snprintf(expected, sizeof(expected), "deferred #%u (%s)", *count, "file");
+	assert(strcmp(text, expected) == 0);
+	(*count)++;
+}
+
+void test_logdefer(void) {
+	logdefer_test_t test = {0};
+	int x = 42;
+	unsigned int i;
+
+	log_shutdown();
+	log_register_backend(logdefer_test_callback, NULL, &test);
+
+	// argument capture
+	log_level_defer(LOG_LEVEL_INFO, "defer", "%d %u %s %f %p %c",
+					-5, 7u, "str", 1.5, (void *)&x, 'x');
+	assert(test.deferred && test.version >= 3 && test.count == 6);
+	assert(test.types[0] == MSGPACK_OBJECT_NEGATIVE_INTEGER);
+	assert(test.types[1] == MSGPACK_OBJECT_POSITIVE_INTEGER);
+	assert(test.types[2] == MSGPACK_OBJECT_STR);
+	assert(test.types[3] == MSGPACK_OBJECT_FLOAT);
+	assert(test.types[4] == MSGPACK_OBJECT_POSITIVE_INTEGER);
+	assert(test.types[5] == MSGPACK_OBJECT_POSITIVE_INTEGER);
+	log_level_defer(LOG_LEVEL_INFO, "defer", "no arguments");
+	assert(test.deferred && test.count == 0);
+	assert(strcmp(test.text, "no arguments") == 0);
+	log_info("defer", "immediate");
+	assert(!test.deferred);
+
+	// formatting equals printf()
+	LOGDEFER_CHECK(&test, "int %d, negative %i, unsigned %u", 1, -2, 3u);
+	LOGDEFER_CHECK(&test, "[%5d|%-5d|%05d|%+d|% d]", 42, 42, 42, 42, 42);
+	LOGDEFER_CHECK(&test, "hex %x %X %#x %08x, octal %o %#o", 255, 255, 255, 0xBEEF, 8, 8);
+	LOGDEFER_CHECK(&test, "long %ld %lu %lld %llu", -1L, 2UL, -9223372036854775807LL - 1,
+				   18446744073709551615ULL);
+	LOGDEFER_CHECK(&test, "size %zu, ptrdiff %td", sizeof(test), &x - &x);
+	LOGDEFER_CHECK(&test, "float %f %.2f %8.3f %-8.1f| %e %E %g %G", 3.14159, 2.5, -1.0,
+				   0.25, 12345.678, 0.000123, 1e-10, 1e20);
+	LOGDEFER_CHECK(&test, "float %f (from a float)", 0.5f);
+	LOGDEFER_CHECK(&test, "string '%s' '%10s' '%-10s' '%.3s'", "abc", "right", "left",
+				   "truncated");
+	LOGDEFER_CHECK(&test, "char %c%c%c", 'a', 'b', 'c');
+	LOGDEFER_CHECK(&test, "pointer %p, null %p", (void *)&x, (void *)NULL);
+	LOGDEFER_CHECK(&test, "star [%*d] [%-*d] [%.*f] [%.*s]", 6, 1, 6, 2, 3, 1.0, 2, "xyz");
+	LOGDEFER_CHECK(&test, "percent %% and %d%%", 100);
+	LOGDEFER_CHECK(&test, "%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d",
+				   1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+	// missing arguments and unknown conversions get copied verbatim
+	log_level_defer(LOG_LEVEL_INFO, "defer", "%d %s %y");
+	assert(strcmp(test.text, "%d %s %y") == 0);
+	const char *null_str = NULL;
+	log_level_defer(LOG_LEVEL_INFO, "defer", "%s", null_str);
+	assert(strcmp(test.text, "(null)") == 0);
+	// mismatched types are printed anyway
+	log_level_defer(LOG_LEVEL_INFO, "defer", "%d %s %f", "str", 42, 7);
+	assert(strcmp(test.text, "str 42 7.000000") == 0);
+
+	// snprintf() semantics
+	char buf[8];
+	const msgpack_object arg = {
+		.type = MSGPACK_OBJECT_POSITIVE_INTEGER, .via.u64 = 123456789
+	};
+	log_args_t args = { .objects = &arg, .count = 1 };
+	int len = log_format_args(buf, sizeof(buf), "value %d", 8, args);
+	assert(len == 15 && strcmp(buf, "value 1") == 0);
+	assert(log_format_args(NULL, 0, "value %d", 8, args) == 15);
+	size_t size;
+	char *text = log_format_buffer(buf, sizeof(buf), "value %d", 8, args, &size);
+	assert(text != buf && size == 15 && strcmp(text, "value 123456789") == 0);
+	free(text);
+
+	// compact encoding also interns the format string
+	log_level_defer(LOG_LEVEL_INFO, "defer", "compact %s #%d", "message", 1);
+	size = test.size;
+	log_dict_enable(true);
+	log_level_defer(LOG_LEVEL_INFO, "defer", "compact %s #%d", "message", 1);
+	assert(strcmp(test.text, "compact message #1") == 0);
+	assert(test.size + 10 < size);
+	log_dict_enable(false);
+	log_shutdown();
+
+	// text output is the same as for regular messages
+	FILE *raw = tmpfile(), *unpacked = tmpfile();
+	char expected[128], line[128];
+	logstdio_test_t stdio_test = { .raw = raw, .unpacked = unpacked };
+	log_register_backend(logstdio_test_callback, NULL, &stdio_test);
+	log_info("defer", "text %d %s %.2f", 1, "two", 3.0);
+	log_level_defer(LOG_LEVEL_INFO, "defer", "text %d %s %.2f", 1, "two", 3.0);
+	log_shutdown();
+	rewind(raw);
+	rewind(unpacked);
+	logdefer_test_line(raw, expected, sizeof(expected));
+	assert(strcmp(expected, "defer: text 1 two 3.00\n") == 0);
+	logdefer_test_line(raw, line, sizeof(line));
+	assert(strcmp(line, expected) == 0);
+	for (i = 0; i < 2; i++) {
+		logdefer_test_line(unpacked, line, sizeof(line));
+		assert(strcmp(line, expected) == 0);
+	}
+	fclose(raw);
+	fclose(unpacked);
+
+	// "offline" formatting of a segment file (with compact encoding)
+	char filename[FILENAME_MAX];
+	logfile_segment_name(filename, sizeof(filename), LOGDEFER_TEST_BASENAME, 0);
+	remove(filename);
+	log_dict_enable(true);
+	log_file(LOGDEFER_TEST_BASENAME, 0, 0);
+	for (i = 0; i < 100; i++)
+		log_level_defer(LOG_LEVEL_INFO, "defer", "deferred #%u (%s)", i, "file");
+	log_shutdown();
+	log_dict_enable(false);
+	log_stdio("stdout");
+
+	unsigned int count = 0;
+	assert(logfile_read(filename, logdefer_file_callback, &count) > 0);
+	assert(count == 100);
+	remove(filename);
+}
@@ -0,0 +1,191 @@
+/*
+ * test_logdict.c
+ * tests for interned origins (compact message encoding)
+ */
+
+#include "logdict.h"
+#include "logfile.h"
+
+#define LOGDICT_TEST_ORIGIN		"a/rather/long/path/to/some/module/test_logdict.c"
+#define LOGDICT_TEST_BASENAME	"test_logdict"
+
+// records the origins of the messages a backend receives
+typedef struct {
+	size_t messages, records;
+	size_t strings;			// messages with a string origin
+	uint32_t last_record;	// ID of the last dictionary record
+	bool unknown_id;		// a message used an ID before its record
+	size_t size;			// size of the last message
+} logdict_test_t;
+
+static void logdict_test_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	logdict_test_t *test = userptr;
+	msgpack_unpacked msg;
+	msgpack_unpacked_init(&msg);
+	if (msgpack_unpack_next(&msg, logmsg->data, logmsg->size, NULL)
+			== MSGPACK_UNPACK_SUCCESS) {
+		msgpack_object *member = msg.data.via.array.ptr;
+		if (level == LOG_LEVEL_DICTIONARY) {
+			test->records++;
+			test->last_record = member[LOG_FIELD_ATTACHMENT].via.u64;
+		} else {
+			test->messages++;
+			if (member[LOG_FIELD_ORIGIN].type == MSGPACK_OBJECT_STR)
+				test->strings++;
+			else if (member[LOG_FIELD_ORIGIN].via.u64 > test->last_record)
+				test->unknown_id = true;
+			test->size = logmsg->size;
+		}
+	}
+	msgpack_unpacked_destroy(&msg);
+}
+
+// checks messages read from a segment file
+typedef struct {
+	size_t messages, records;
+	bool resolved;
+} logdict_file_test_t;
+
+static void logdict_file_callback(msgpack_object *msg, void *userptr) {
+	logdict_file_test_t *test = userptr;
+	msgpack_object *member = msg->via.array.ptr;
+	if (member[LOG_FIELD_LEVEL].via.u64 == LOG_LEVEL_DICTIONARY) {
+		test->records++;
+		return;
+	}
+	test->messages++;
+	msgpack_object_str *origin = &member[LOG_FIELD_ORIGIN].via.str;
+	if (member[LOG_FIELD_ORIGIN].type != MSGPACK_OBJECT_STR
+		|| origin->size != strlen(LOGDICT_TEST_ORIGIN)
+		|| memcmp(origin->ptr, LOGDICT_TEST_ORIGIN, origin->size) != 0)
+			test->resolved = false;
+}
+
+// a backend that logs (from the dispatch thread, in asynchronous mode) with
+// new origins, once - i.e. it creates dictionary records
+static void logdict_logging_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	bool *state = userptr; // (started, done)
+	char origin[64];
+	int i;
+	if (level == LOG_LEVEL_DICTIONARY || state[0]) return;
+	state[0] = true;
+	for (i = 0; i < 16; i++) {
+		snprintf(origin, sizeof(origin), "logged by a backend #%d", i);
+		log_info(origin, "this may get dropped, but its origin mustn't");
+	}
+	ATOMIC_STORE(&state[1], true);
+}
+
+void test_logdict(void) {
+	logdict_test_t test = {0};
+	char origin[64];
+
+	log_shutdown();
+	log_register_backend(logdict_test_callback, NULL, &test);
+	log_info(LOGDICT_TEST_ORIGIN, "uncompressed");
+	size_t size = test.size;
+	assert(test.strings == 1);
+
+	// the first use of an origin logs a dictionary record
+	log_dict_enable(true);
+	assert(log_dict_enabled());
+	log_info(LOGDICT_TEST_ORIGIN, "uncompressed");
+	assert(test.records == 1 && test.messages == 2 && test.strings == 1);
+	assert(test.size + 40 < size); // (an ID instead of the string)
+	uint32_t id = test.last_record;
+	size_t len;
+	const char *str = log_dict_string(id, &len);
+	assert(str && strcmp(str, LOGDICT_TEST_ORIGIN) == 0);
+	assert(len == strlen(LOGDICT_TEST_ORIGIN));
+	assert(log_dict_string(0, NULL) == NULL);
+	assert(log_dict_string(log_dict_count() + 1, NULL) == NULL);
+
+	// interning is based on the contents (not the pointer)
+	strcpy(origin, LOGDICT_TEST_ORIGIN);
+	log_info(origin, "same origin, different pointer");
+	assert(test.records == 1);
+	assert(log_dict_intern(origin) == id);
+	strcpy(origin, "another origin");
+	log_info(origin, "new origin");
+	assert(test.records == 2 && test.last_record == id + 1);
+	assert(log_dict_intern("another origin") == id + 1);
+	log_level(LOG_LEVEL_INFO, NULL, "no origin");
+	assert(test.records == 2 && test.strings == 2);
+	assert(!test.unknown_id);
+
+	// text output resolves the IDs
+	log_shutdown();
+	FILE *file = tmpfile();
+	msgpack_sbuffer sbuf;
+	msgpack_sbuffer_init(&sbuf);
+	log_serialize(&sbuf, NULL, LOG_LEVEL_INFO, LOGDICT_TEST_ORIGIN, "text", -1);
+	bool ok = log_text_raw(file, sbuf.data, sbuf.size);
+	assert(ok);
+	msgpack_sbuffer_clear(&sbuf);
+	log_dict_record(&sbuf, id);
+	ok = log_text_raw(file, sbuf.data, sbuf.size); // (no text representation)
+	assert(ok);
+	// (a repeated record doesn't use up serial or sequence numbers)
+	msgpack_unpacked record;
+	msgpack_unpacked_init(&record);
+	ok = msgpack_unpack_next(&record, sbuf.data, sbuf.size, NULL) == MSGPACK_UNPACK_SUCCESS;
+	assert(ok && record.data.via.array.size > LOG_FIELD_SEQUENCE);
+	assert(record.data.via.array.ptr[LOG_FIELD_SERIAL].via.u64 == 0);
+	assert(record.data.via.array.ptr[LOG_FIELD_SEQUENCE].via.u64 == 0);
+	msgpack_unpacked_destroy(&record);
+	msgpack_sbuffer_destroy(&sbuf);
+	char line[256];
+	rewind(file);
+	assert(fgets(line, sizeof(line), file) != NULL);
+	assert(strstr(line, LOGDICT_TEST_ORIGIN ": text") != NULL);
+	assert(fgets(line, sizeof(line), file) == NULL);
+	fclose(file);
+
+	// each segment file repeats the dictionary, so it can be read on its own
+	char filename[FILENAME_MAX];
+	unsigned int index;
+	for (index = 0; index < 8; index++) {
+		logfile_segment_name(filename, sizeof(filename), LOGDICT_TEST_BASENAME, index);
+		remove(filename);
+	}
+	log_file(LOGDICT_TEST_BASENAME, 4096, 0);
+	int i;
+	for (i = 0; i < 200; i++)
+		log_info(LOGDICT_TEST_ORIGIN, "logdict message #%d", i);
+	log_shutdown();
+	log_dict_enable(false);
+	log_stdio("stdout");
+
+	logdict_file_test_t file_test = {.resolved = true};
+	logfile_segment_name(filename, sizeof(filename), LOGDICT_TEST_BASENAME, 2);
+	int count = logfile_read(filename, logdict_file_callback, &file_test);
+	assert(count > 0 && (size_t)count == file_test.messages + file_test.records);
+	assert(file_test.records == log_dict_count());
+	assert(file_test.messages > 0 && file_test.resolved);
+	for (index = 0; index < 8; index++) {
+		logfile_segment_name(filename, sizeof(filename), LOGDICT_TEST_BASENAME, index);
+		remove(filename);
+	}
+
+	// with a full queue, the dispatch thread delivers dictionary records itself
+	log_shutdown();
+	log_dict_enable(true);
+	bool state[2] = {false, false};
+	uint32_t count_before = log_dict_count();
+	logdict_test_t async_test = {.last_record = count_before};
+	log_register_backend(logdict_test_callback, NULL, &async_test);
+	log_register_backend(logdict_logging_callback, NULL, state);
+	log_async_start(4, LOG_OVERFLOW_DROP);
+	log_info(LOGDICT_TEST_ORIGIN, "from the test");
+	while (!ATOMIC_LOAD(&state[1])) Sleep(1);
+	log_async_stop();
+	assert(log_dict_count() == count_before + 16);
+	assert(async_test.records == 16 && !async_test.unknown_id);
+	log_shutdown();
+	log_dict_enable(false);
+	log_stdio("stdout");
+}
@@ -0,0 +1,114 @@
+/*
+ * test_logfile.c
+ * tests for the binary (mmap'ed segment file) logging backend
+ */
+
+#include "logfile.h"
+#include "strutils.h"
+#include "utils.h"
+
+#define LOGFILE_TEST_BASENAME	"test_logfile"
+#define LOGFILE_TEST_MESSAGES	500
+#define LOGFILE_TEST_SEGMENTS	3
+
+// collects the message numbers from segment files
+typedef struct {
+	int count;
+	int first, last;
+	bool consecutive;
+	size_t oversized;
+} logfile_test_t;
+
+static void logfile_test_callback(msgpack_object *msg, void *userptr) {
+	logfile_test_t *test = userptr;
+	msgpack_object_str *text = &msg->via.array.ptr[5].via.str;
+	int number = -1;
+
+	if (text->size > 4096) {
+		test->oversized = text->size;
+		return;
+	}
+	assert(msg->via.array.ptr[0].via.u64 == LOG_LEVEL_INFO);
+	sscanf(text->ptr, "logfile message #%d", &number);
+	if (test->count++ == 0)
+		test->first = number;
+	else if (number != test->last + 1)
+		test->consecutive = false;
+	test->last = number;
+}
+
+void test_logfile(void) {
+	char filename[FILENAME_MAX];
+	char *long_text = repeat_char('x', 5000);
+	logfile_test_t test = {.consecutive = true};
+	unsigned int index, last_index = 0, segments = 0;
+	int i, count;
+
+	// 4 KiB segments, so our messages will need multiple rotations
+	log_shutdown();
+	backend_list_t *backend =
+		log_file(LOGFILE_TEST_BASENAME, 4096, LOGFILE_TEST_SEGMENTS);
+	assert(backend != NULL);
+	for (i = 0; i < LOGFILE_TEST_MESSAGES; i++)
+		info("logfile message #%d", i);
+	// a message that exceeds the segment size gets a (larger) segment of its own
+	info("%s", long_text);
+	log_shutdown();
+	log_stdio("stdout");
+
+	// only the most recent segments were kept
+	for (index = 0; index < 100; index++) {
+		logfile_segment_name(filename, sizeof(filename), LOGFILE_TEST_BASENAME, index);
+		if (!file_exists(filename)) continue;
+		segments++;
+		last_index = index;
+		count = logfile_read(filename, logfile_test_callback, &test);
+		assert(count > 0);
+	}
+	assert(segments == LOGFILE_TEST_SEGMENTS);
+	assert(test.consecutive);
+	assert(test.last == LOGFILE_TEST_MESSAGES - 1);
+	assert(test.oversized == 5000);
+
+	// replay the last "regular" segment in text form, one line per message
+	FILE *text = tmpfile();
+	logfile_segment_name(filename, sizeof(filename), LOGFILE_TEST_BASENAME,
+						 last_index - 1);
+	count = logfile_replay(filename, text);
+	assert(count > 0);
+	rewind(text);
+	int lines = 0, c;
+	while ((c = getc(text)) != EOF)
+		if (c == '\n') lines++;
+	assert(lines == count);
+	fclose(text);
+
+	count = logfile_read("test_logfile.c", NULL, NULL); // (not a segment)
+	assert(count == -1);
+
+	// a corrupt header mustn't make the reader allocate (or read) arbitrary sizes
+	logfile_header_t header = {
+		.magic = LOGFILE_MAGIC, .version = LOGFILE_VERSION,
+		.header_size = sizeof(header) + 16, .capacity = sizeof(header),
+		.used = 1ULL << 40
+	};
+	logfile_segment_name(filename, sizeof(filename), LOGFILE_TEST_BASENAME, 0);
+	FILE *corrupt = fopen(filename, "wb");
+	assert(corrupt != NULL);
+	fwrite(&header, sizeof(header), 1, corrupt);
+	fclose(corrupt);
+	assert(logfile_read(filename, NULL, NULL) == -1); // (header_size > capacity)
+	header.header_size = sizeof(header);
+	header.capacity = 1ULL << 41;
+	corrupt = fopen(filename, "wb");
+	fwrite(&header, sizeof(header), 1, corrupt);
+	fclose(corrupt);
+	assert(logfile_read(filename, NULL, NULL) == -1); // (beyond the file size)
+
+	for (index = 0; index < 100; index++) {
+		logfile_segment_name(filename, sizeof(filename), LOGFILE_TEST_BASENAME, index);
+		remove(filename);
+	}
+	free(long_text);
+	info("%s: %d messages in %u segments", __func__, test.count, segments);
+}
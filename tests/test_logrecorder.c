@@ -0,0 +1,92 @@
+/*
+ * test_logrecorder.c
+ * tests for the "flight recorder" logging backend (and its Lua bindings)
+ */
+
+#include "logrecorder.h"
+
+#include "lualib.h"
+
+#include <signal.h>
+
+#define RECORDER_TEST_DUMP	"test_logrecorder.txt"
+
+// count the lines in a file
+static int recordertest_lines(const char *filename) {
+	int lines = 0, c;
+	FILE *file = fopen(filename, "r");
+	if (!file) return -1;
+	while ((c = getc(file)) != EOF)
+		if (c == '\n') lines++;
+	fclose(file);
+	return lines;
+}
+
+void test_logrecorder(void) {
+	size_t count = 0, bytes;
+	int i, result;
+
+	log_shutdown();
+	remove(RECORDER_TEST_DUMP);
+	backend_list_t *backend = log_recorder(10, 0, RECORDER_TEST_DUMP);
+	assert(backend != NULL);
+	assert(log_recorder(10, 0, NULL) == NULL); // (only a single instance)
+
+	// the recorder only keeps the most recent messages
+	for (i = 0; i < 25; i++)
+		debug("recorded message #%d", i);
+	assert(logrecorder_count(&bytes) == 10);
+	assert(bytes > 0);
+	result = logrecorder_replay(logtest_count_callback, &count);
+	assert(result == 10 && count == 10);
+
+	// a FATAL message triggers an automatic dump
+	fatal("something went wrong");
+	assert(recordertest_lines(RECORDER_TEST_DUMP) == 10);
+	// ... and so does a signal (delivered with the next message)
+	logrecorder_dump_on_signal(SIGINT);
+	raise(SIGINT);
+	signal(SIGINT, SIG_DFL);
+	assert(recordertest_lines(RECORDER_TEST_DUMP) == 10);
+	info("after signal");
+	assert(recordertest_lines(RECORDER_TEST_DUMP) == 20);
+
+	// byte limit (the size of all our messages is about the same, and the
+	// recorder memory gets rounded up to a power of two - with some overhead)
+	logrecorder_stop();
+	assert(logrecorder_count(NULL) == 0);
+	log_recorder(100, 5 * bytes / 10, NULL);
+	for (i = 0; i < 25; i++)
+		debug("recorded message #%d", i);
+	count = logrecorder_count(NULL);
+	assert(count > 0 && count < 10);
+	logrecorder_clear();
+	assert(logrecorder_count(NULL) == 0);
+
+	// Lua bindings
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	luaopen_logrecorder(L);
+	for (i = 0; i < 3; i++)
+		info("message #%d for Lua", i);
+	bool ok = luautils_dostring(L,
+		"local count, bytes = logrecorder_count_C()\n"
+		"assert(count == 3 and bytes > 0)\n"
+		"local messages = logrecorder_messages_C(2)\n"
+		"assert(#messages == 2)\n"
+		"assert(messages[2]:find('message #2 for Lua', 1, true))\n"
+		"assert(#logrecorder_messages_C() == 3)\n"
+		"assert(logrecorder_dump_C('" RECORDER_TEST_DUMP "') == 3)\n"
+		"logrecorder_stop_C()\n"
+		"assert(log_recorder_C(5))\n"
+		"logrecorder_clear_C()\n"
+		"assert(logrecorder_count_C() == 0)\n");
+	assert(ok);
+	lua_close(L);
+	assert(recordertest_lines(RECORDER_TEST_DUMP) == 23);
+
+	log_shutdown();
+	remove(RECORDER_TEST_DUMP);
+	log_stdio("stdout");
+	info("%s: ok", __func__);
+}
@@ -0,0 +1,163 @@
+/*
+ * test_logshm.c
+ * tests for the shared memory log transport (logshm.c)
+ */
+
+#include "logdict.h"
+#include "logshm.h"
+
+#define LOGSHM_TEST_NAME		"lcfr_test_logshm"
+#define LOGSHM_TEST_PRODUCERS	4
+#define LOGSHM_TEST_RECORDS		20000
+
+// consumer state
+typedef struct {
+	logshm_t *shm;
+	bool stop;						// (set by the main thread)
+	uint32_t next[LOGSHM_TEST_PRODUCERS]; // expected sequence numbers
+	size_t records, errors;
+	size_t messages, unresolved;	// log messages (from log_shm)
+	log_dict_reader_t dict;
+} logshm_test_t;
+
+// a test record: producer index and sequence number, followed by filler
+typedef struct {
+	uint32_t producer, seq;
+	char filler[200];
+} logshm_test_record_t;
+
+static void logshm_test_callback(const char *data, size_t size, void *userptr) {
+	logshm_test_t *t = userptr;
+	logshm_test_record_t record;
+	if (size < 8 || size > sizeof(record)) {
+		t->errors++;
+		return;
+	}
+	memcpy(&record, data, size);
+	if (record.producer >= LOGSHM_TEST_PRODUCERS
+		|| record.seq != t->next[record.producer]
+		|| (size > 8 && record.filler[size - 9] != (char)record.seq))
+			t->errors++;
+	else
+		t->next[record.producer]++;
+	ATOMIC_INC(&t->records);
+}
+
+// (for the log_shm() backend) check and count log messages
+static void logshm_test_log_callback(const char *data, size_t size, void *userptr) {
+	logshm_test_t *t = userptr;
+	msgpack_unpacked msg;
+	msgpack_unpacked_init(&msg);
+	if (msgpack_unpack_next(&msg, data, size, NULL) != MSGPACK_UNPACK_SUCCESS
+		|| msg.data.type != MSGPACK_OBJECT_ARRAY
+		|| msg.data.via.array.size <= LOG_FIELD_SERIAL)
+	{
+		t->errors++;
+	} else {
+		msgpack_object *member = msg.data.via.array.ptr;
+		log_dict_resolve(&t->dict, &msg.data);
+		if (member[LOG_FIELD_LEVEL].via.u64 != LOG_LEVEL_DICTIONARY) {
+			if (member[LOG_FIELD_ORIGIN].type != MSGPACK_OBJECT_STR
+				|| member[LOG_FIELD_ORIGIN].via.str.size != 6)
+					t->unresolved++;
+			ATOMIC_INC(&t->messages);
+		}
+	}
+	msgpack_unpacked_destroy(&msg);
+}
+
+static THREAD_FUNC logshm_test_consumer(void *arg) {
+	logshm_test_t *t = arg;
+	while (!ATOMIC_LOAD(&t->stop))
+		if (logshm_wait(t->shm, 10))
+			logshm_read(t->shm, logshm_test_callback, t);
+	logshm_read(t->shm, logshm_test_callback, t);
+	return 0;
+}
+
+static THREAD_FUNC logshm_test_producer(void *arg) {
+	logshm_t *shm = ((void **)arg)[0];
+	uint32_t producer = (uintptr_t)((void **)arg)[1];
+	logshm_test_record_t record;
+	uint32_t seq = 0;
+	while (seq < LOGSHM_TEST_RECORDS) {
+		// (variable sizes, to get padding at the end of the ring)
+		size_t size = 8 + (seq * 7 + producer) % sizeof(record.filler);
+		record.producer = producer;
+		record.seq = seq;
+		if (size > 8) record.filler[size - 9] = (char)seq;
+		if (logshm_write(shm, (char *)&record, size))
+			seq++;
+		else
+			ATOMICS_YIELD(); // (ring is full, retry)
+	}
+	return 0;
+}
+
+void test_logshm(void) {
+	logshm_test_t test;
+	memset(&test, 0, sizeof(test));
+
+	// creating, opening
+	test.shm = logshm_create(LOGSHM_TEST_NAME, 16 * 1024);
+	assert(test.shm != NULL);
+	assert(logshm_create(LOGSHM_TEST_NAME, 0) == NULL); // (exists already)
+	assert(logshm_open("lcfr_test_logshm_missing") == NULL);
+	logshm_t *shm = logshm_open(LOGSHM_TEST_NAME);
+	assert(shm != NULL);
+
+	// a full ring drops messages, and never blocks the producer
+	char data[1000] = {0};
+	unsigned int i, written = 0;
+	for (i = 0; i < 100; i++)
+		if (logshm_write(shm, data, sizeof(data))) written++;
+	assert(written > 0 && written < 100);
+	assert(logshm_dropped(test.shm) == 100 - written);
+	assert(logshm_read(test.shm, logshm_test_callback, &test) == written);
+	assert(logshm_read(test.shm, logshm_test_callback, &test) == 0);
+	assert(!logshm_wait(test.shm, 1));
+	logshm_close(shm);
+
+	// multiple producers (with wraparound): all records arrive, in order
+	// (this uses a single mapping, race detectors can't see the memory
+	// accesses via different addresses as synchronized)
+	memset(&test.next, 0, sizeof(test.next));
+	test.records = test.errors = 0;
+	pthread_t consumer = thread_start(logshm_test_consumer, NULL, &test);
+	pthread_t producers[LOGSHM_TEST_PRODUCERS];
+	void *args[LOGSHM_TEST_PRODUCERS][2];
+	for (i = 0; i < LOGSHM_TEST_PRODUCERS; i++) {
+		args[i][0] = test.shm;
+		args[i][1] = (void *)(uintptr_t)i;
+		producers[i] = thread_start(logshm_test_producer, NULL, args[i]);
+	}
+	for (i = 0; i < LOGSHM_TEST_PRODUCERS; i++) thread_wait(producers[i], 10000);
+	ATOMIC_STORE(&test.stop, true);
+	thread_wait(consumer, 1000);
+	assert(test.errors == 0);
+	assert(test.records == LOGSHM_TEST_PRODUCERS * LOGSHM_TEST_RECORDS);
+
+	// the log backend, with compact encoding (needs the dictionary)
+	log_shutdown();
+	log_dict_enable(true);
+	log_dict_intern("logshm");
+	log_dict_reader_init(&test.dict);
+	test.errors = 0;
+	assert(log_shm("lcfr_test_logshm_missing") == NULL);
+	assert(log_shm(LOGSHM_TEST_NAME) != NULL);
+	for (i = 0; i < 1000; i++) {
+		log_info("logshm", "message #%u", i);
+		log_level_defer(LOG_LEVEL_INFO, "logshm", "deferred #%u", i);
+		if (i % 50 == 0) logshm_read(test.shm, logshm_test_log_callback, &test);
+	}
+	logshm_read(test.shm, logshm_test_log_callback, &test);
+	log_shutdown();
+	log_dict_enable(false);
+	assert(test.errors == 0 && test.unresolved == 0);
+	assert(test.messages == 2000);
+	log_dict_reader_done(&test.dict);
+	logshm_close(test.shm);
+
+	log_stdio("stdout");
+	info("test_logshm: %zu records, %zu log messages", test.records, test.messages);
+}
@@ -0,0 +1,262 @@
+/*
+ * test_logsocket.c
+ * tests for the socket (named pipe) logging backend, including a simple
+ * receiver that renders the messages - see logsocket_viewer()
+ */
+
+#include "logdict.h"
+#include "logsocket.h"
+#include "logstdio.h"
+
+#if _WINDOWS
+	#define LOGSOCKET_TEST_PATH	"\\\\.\\pipe\\lcfr_test_logsocket"
+#else
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <unistd.h>
+	#define LOGSOCKET_TEST_PATH	"test_logsocket.sock"
+#endif
+
+// receiver state
+typedef struct {
+#if _WINDOWS
+	HANDLE pipe;
+	bool connected;
+#else
+	int listener, conn;
+#endif
+	FILE *output;				// text output (optional)
+	msgpack_unpacker unpacker;
+	log_dict_reader_t dict;
+	bool paused, stop;			// (set by other threads)
+	bool disconnect;			// request to drop the connection
+	size_t connections, messages, dropped_reports, unresolved;
+} logsocket_viewer_t;
+
+// start listening for a connection, returns `false` on error
+static bool logsocket_viewer_listen(logsocket_viewer_t *v, const char *path) {
+	memset(v, 0, sizeof(logsocket_viewer_t));
+	msgpack_unpacker_init(&v->unpacker, MSGPACK_UNPACKER_INIT_BUFFER_SIZE);
+	log_dict_reader_init(&v->dict);
+#if _WINDOWS
+	v->pipe = CreateNamedPipeA(path, PIPE_ACCESS_INBOUND,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_NOWAIT, 1,
+			64 * 1024, 64 * 1024, 0, NULL);
+	return v->pipe != INVALID_HANDLE_VALUE;
+#else
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	v->conn = -1;
+	v->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	return v->listener >= 0
+		&& fcntl(v->listener, F_SETFL, O_NONBLOCK) == 0
+		&& bind(v->listener, (struct sockaddr *)&addr, sizeof(addr)) == 0
+		&& listen(v->listener, 1) == 0;
+#endif
+}
+
+// drop the current connection (the sender will have to reconnect)
+static void logsocket_viewer_disconnect(logsocket_viewer_t *v) {
+#if _WINDOWS
+	if (v->connected) DisconnectNamedPipe(v->pipe);
+	v->connected = false;
+#else
+	if (v->conn >= 0) close(v->conn);
+	v->conn = -1;
+#endif
+	// (a new connection starts with a clean state)
+	msgpack_unpacker_reset(&v->unpacker);
+	log_dict_reader_done(&v->dict);
+}
+
+static void logsocket_viewer_done(logsocket_viewer_t *v, const char *path) {
+	logsocket_viewer_disconnect(v);
+#if _WINDOWS
+	CloseHandle(v->pipe);
+#else
+	close(v->listener);
+	unlink(path);
+#endif
+	msgpack_unpacker_destroy(&v->unpacker);
+}
+
+// process the messages received so far
+static void logsocket_viewer_process(logsocket_viewer_t *v) {
+	msgpack_unpacked msg;
+	msgpack_unpacked_init(&msg);
+	while (msgpack_unpacker_next(&v->unpacker, &msg) == MSGPACK_UNPACK_SUCCESS) {
+		if (msg.data.type != MSGPACK_OBJECT_ARRAY
+			|| msg.data.via.array.size <= LOG_FIELD_SERIAL)
+				continue;
+		msgpack_object *member = msg.data.via.array.ptr;
+		bool interned = member[LOG_FIELD_ORIGIN].type == MSGPACK_OBJECT_POSITIVE_INTEGER;
+		log_dict_resolve(&v->dict, &msg.data);
+		if (member[LOG_FIELD_LEVEL].via.u64 == LOG_LEVEL_DICTIONARY) continue;
+
+		ATOMIC_INC(&v->messages);
+		if (interned && member[LOG_FIELD_ORIGIN].via.str.size == 0)
+			ATOMIC_INC(&v->unresolved);
+		msgpack_object_str *text = &member[LOG_FIELD_MSG].via.str;
+		if (member[LOG_FIELD_LEVEL].via.u64 == LOG_LEVEL_WARNING
+			&& member[LOG_FIELD_MSG].type == MSGPACK_OBJECT_STR && text->size > 7
+			&& memcmp(text->ptr + text->size - 7, "dropped", 7) == 0)
+				ATOMIC_INC(&v->dropped_reports);
+		if (v->output) log_text(v->output, &msg.data);
+	}
+	msgpack_unpacked_destroy(&msg);
+}
+
+// accept a connection / receive data, returns `false` if there's nothing to do
+static bool logsocket_viewer_poll(logsocket_viewer_t *v) {
+	if (ATOMIC_LOAD(&v->paused)) return false;
+	if (ATOMIC_LOAD(&v->disconnect)) {
+		logsocket_viewer_disconnect(v);
+		ATOMIC_STORE(&v->disconnect, false);
+	}
+	if (!msgpack_unpacker_reserve_buffer(&v->unpacker, 64 * 1024)) return false;
+	char *buffer = msgpack_unpacker_buffer(&v->unpacker);
+	size_t capacity = msgpack_unpacker_buffer_capacity(&v->unpacker);
+#if _WINDOWS
+	if (!v->connected) {
+		if (!ConnectNamedPipe(v->pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED)
+			return false;
+		v->connected = true;
+		ATOMIC_INC(&v->connections);
+	}
+	DWORD count;
+	if (!ReadFile(v->pipe, buffer, capacity, &count, NULL)) {
+		if (GetLastError() != ERROR_NO_DATA)
+			logsocket_viewer_disconnect(v);
+		return false;
+	}
+#else
+	if (v->conn < 0) {
+		v->conn = accept(v->listener, NULL, NULL);
+		if (v->conn < 0) return false;
+		fcntl(v->conn, F_SETFL, O_NONBLOCK);
+		ATOMIC_INC(&v->connections);
+	}
+	ssize_t count = recv(v->conn, buffer, capacity, 0);
+	if (count <= 0) {
+		if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			logsocket_viewer_disconnect(v);
+		return false;
+	}
+#endif
+	msgpack_unpacker_buffer_consumed(&v->unpacker, count);
+	logsocket_viewer_process(v);
+	return count > 0;
+}
+
+static THREAD_FUNC logsocket_viewer_thread(void *arg) {
+	logsocket_viewer_t *v = arg;
+	while (!ATOMIC_LOAD(&v->stop))
+		if (!logsocket_viewer_poll(v)) Sleep(1);
+	return 0;
+}
+
+/** A simple log viewer: receive messages from log_socket(), and print them.
+(This is what `sandbox --viewer=<path>` does.)
+@returns non-zero on error
+*/
+int logsocket_viewer(const char *path) {
+	logsocket_viewer_t viewer;
+	if (!logsocket_viewer_listen(&viewer, path)) {
+		fprintf(stderr, "can't listen on %s\n", path);
+		return 1;
+	}
+	viewer.output = stdout;
+	printf("waiting for log messages on %s\n", path);
+	fflush(stdout);
+	logsocket_viewer_thread(&viewer); // (runs until the process is terminated)
+	logsocket_viewer_done(&viewer, path);
+	return 0;
+}
+
+// wait until the viewer has received a number of messages (up to 5 seconds)
+// (this doesn't call log_flush(), the timer of logbatch.c takes care of that)
+static bool logsocket_test_wait(size_t *counter, size_t count) {
+	int i;
+	for (i = 0; i < 500; i++) {
+		if (ATOMIC_LOAD(counter) >= count) return true;
+		Sleep(10);
+	}
+	return false;
+}
+
+void test_logsocket(void) {
+	logsocket_viewer_t viewer;
+	unsigned int i;
+
+	log_shutdown();
+	// no receiver yet: this works, but won't connect
+#if !_WINDOWS
+	unlink(LOGSOCKET_TEST_PATH);
+#endif
+	assert(log_socket(LOGSOCKET_TEST_PATH, 0) != NULL);
+	info("test_logsocket: nobody is listening");
+	log_shutdown();
+
+	bool ok = logsocket_viewer_listen(&viewer, LOGSOCKET_TEST_PATH);
+	assert(ok);
+	viewer.output = tmpfile();
+	pthread_t thread = thread_start(logsocket_viewer_thread, NULL, &viewer);
+
+	// regular messages, with compact encoding and deferred formatting
+	log_dict_enable(true);
+	assert(log_socket(LOGSOCKET_TEST_PATH, 64 * 1024) != NULL);
+	for (i = 0; i < 1000; i++) {
+		log_info("logsocket", "message #%u", i);
+		log_level_defer(LOG_LEVEL_INFO, "logsocket", "deferred #%u", i);
+	}
+	assert(logsocket_test_wait(&viewer.messages, 2000));
+	assert(ATOMIC_LOAD(&viewer.connections) == 1);
+
+	// a stalled receiver must not block the sender
+	size_t count = ATOMIC_LOAD(&viewer.messages);
+	ATOMIC_STORE(&viewer.paused, true);
+	double start = get_elapsed();
+	for (i = 0; i < 50000; i++)
+		log_info("logsocket", "while the viewer is paused #%u", i);
+	double elapsed = get_elapsed() - start;
+	assert(elapsed < 5);
+	ATOMIC_STORE(&viewer.paused, false);
+	assert(logsocket_test_wait(&viewer.dropped_reports, 1));
+	assert(ATOMIC_LOAD(&viewer.messages) > count);
+
+	// the sender reconnects (and repeats the dictionary)
+	ATOMIC_STORE(&viewer.disconnect, true);
+	while (ATOMIC_LOAD(&viewer.disconnect)) Sleep(1);
+	count = ATOMIC_LOAD(&viewer.messages);
+	log_info("logsocket", "sent to a closed connection");
+	log_info("logsocket", "after reconnecting");
+	assert(logsocket_test_wait(&viewer.messages, count + 1));
+	assert(ATOMIC_LOAD(&viewer.connections) == 2);
+	log_shutdown();
+	log_dict_enable(false);
+
+	ATOMIC_STORE(&viewer.stop, true);
+	thread_wait(thread, 1000);
+	assert(viewer.unresolved == 0);
+
+	// check the text output
+	char line[256];
+	bool first = false, deferred = false, reconnected = false;
+	rewind(viewer.output);
+	while (fgets(line, sizeof(line), viewer.output)) {
+		if (strstr(line, "logsocket: message #0\n")) first = true;
+		if (strstr(line, "logsocket: deferred #999\n")) deferred = true;
+		if (strstr(line, "logsocket: after reconnecting\n")) reconnected = true;
+	}
+	assert(first && deferred && reconnected);
+	fclose(viewer.output);
+	logsocket_viewer_done(&viewer, LOGSOCKET_TEST_PATH);
+	log_stdio("stdout");
+	info("test_logsocket: %zu messages received, %zu reports of dropped messages",
+		 viewer.messages, viewer.dropped_reports);
+}
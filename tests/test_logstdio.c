@@ -0,0 +1,155 @@
+/*
+ * test_logstdio.c
+ * tests for the stdio (text) logging backend
+ */
+
+#include "logstdio.h"
+#include "strutils.h"
+
+#define LOGSTDIO_TEST_FILE	"test_logstdio.log"
+
+// renders each message twice: streaming (log_text_raw) and unpacked (log_text)
+typedef struct {
+	FILE *raw, *unpacked;
+	size_t count;
+} logstdio_test_t;
+
+static void logstdio_test_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	logstdio_test_t *test = userptr;
+	msgpack_unpacked msg;
+	bool ok = log_text_raw(test->raw, logmsg->data, logmsg->size);
+	assert(ok);
+	msgpack_unpacked_init(&msg);
+	if (msgpack_unpack_next(&msg, logmsg->data, logmsg->size, NULL)
+			== MSGPACK_UNPACK_SUCCESS)
+		log_text(test->unpacked, &msg.data);
+	msgpack_unpacked_destroy(&msg);
+	test->count++;
+}
+
+// retrieve the current size of a file
+static long logstdio_test_size(const char *filename) {
+	FILE *file = fopen(filename, "rb");
+	if (!file) return -1;
+	fseek(file, 0, SEEK_END);
+	long result = ftell(file);
+	fclose(file);
+	return result;
+}
+
+void test_logstdio(void) {
+	logstdio_test_t test = {tmpfile(), tmpfile(), 0};
+	char *long_text = repeat_char('y', 1500);
+
+	// an attachment that covers (most) MessagePack types
+	msgpack_sbuffer sbuf;
+	msgpack_sbuffer_init(&sbuf);
+	msgpack_packer pk;
+	msgpack_packer_init(&pk, &sbuf, msgpack_sbuffer_write);
+	msgpack_pack_map(&pk, 3);
+	msgpack_pack_literal(&pk, "numbers");
+	msgpack_pack_array(&pk, 6);
+	msgpack_pack_int(&pk, 42);
+	msgpack_pack_int(&pk, -7);
+	msgpack_pack_int64(&pk, -5000000000LL);
+	msgpack_pack_uint64(&pk, 18000000000000000000ULL);
+	msgpack_pack_double(&pk, 3.25);
+	msgpack_pack_float(&pk, -0.5);
+	msgpack_pack_literal(&pk, "flags");
+	msgpack_pack_array(&pk, 3);
+	msgpack_pack_true(&pk);
+	msgpack_pack_false(&pk);
+	msgpack_pack_nil(&pk);
+	msgpack_pack_int(&pk, 1);
+	msgpack_pack_bin(&pk, 3);
+	msgpack_pack_bin_body(&pk, "bin", 3);
+	msgpack_zone zone;
+	msgpack_zone_init(&zone, 1024);
+	msgpack_object attachment;
+	msgpack_unpack(sbuf.data, sbuf.size, NULL, &zone, &attachment);
+
+	// the streaming formatter produces the same output as log_text()
+	log_shutdown();
+	log_register_backend(logstdio_test_callback, NULL, &test);
+	info("a regular message");
+	attach_info(&attachment, "a message with an attachment");
+	log_separator("test");
+	log_check("test", "logstdio");
+	log_check("test", "logstdio");
+	log_scratch("test", "key", "value");
+	warn("%s", long_text); // (exceeds the initial line buffer)
+	log_shutdown();
+	log_stdio("stdout");
+
+	assert(test.count == 7);
+	long size = ftell(test.raw);
+	assert(size > 1500 && size == ftell(test.unpacked));
+	char *raw = malloc(size), *unpacked = malloc(size);
+	rewind(test.raw);
+	rewind(test.unpacked);
+	size_t n = fread(raw, 1, size, test.raw);
+	assert(n == (size_t)size);
+	n = fread(unpacked, 1, size, test.unpacked);
+	assert(n == (size_t)size);
+	assert(memcmp(raw, unpacked, size) == 0);
+	free(raw);
+	free(unpacked);
+	fclose(test.raw);
+	fclose(test.unpacked);
+
+	// malformed data gets rejected
+	bool ok = log_text_raw(stdout, sbuf.data, sbuf.size); // (not a log message)
+	assert(!ok);
+	ok = log_text_raw(stdout, sbuf.data, 5); // (truncated)
+	assert(!ok);
+	// version 1 messages (8 elements) are still accepted
+	msgpack_sbuffer_clear(&sbuf);
+	msgpack_pack_array(&pk, 8);
+	msgpack_pack_int(&pk, LOG_LEVEL_INFO);
+	msgpack_pack_uint32(&pk, 0);
+	msgpack_pack_double(&pk, 0);
+	msgpack_pack_nil(&pk);
+	msgpack_pack_literal(&pk, "test");
+	msgpack_pack_literal(&pk, "a version 1 message");
+	msgpack_pack_nil(&pk);
+	msgpack_pack_uint32(&pk, 1);
+	ok = log_text_raw(stdout, sbuf.data, sbuf.size);
+	assert(ok);
+	msgpack_zone_destroy(&zone);
+	msgpack_sbuffer_destroy(&sbuf);
+
+	// flush modes
+	remove(LOGSTDIO_TEST_FILE);
+	backend_list_t *backend = log_stdio(LOGSTDIO_TEST_FILE);
+	assert(backend != NULL);
+	ok = log_stdio_set_flush(backend, LOG_FLUSH_LEVEL, 0);
+	assert(ok);
+	info("buffered");
+	assert(logstdio_test_size(LOGSTDIO_TEST_FILE) == 0);
+	warn("flushed");
+	size = logstdio_test_size(LOGSTDIO_TEST_FILE);
+	assert(size > 0);
+	log_stdio_set_flush(backend, LOG_FLUSH_LINE, 0);
+	info("flushed");
+	assert(logstdio_test_size(LOGSTDIO_TEST_FILE) > size);
+	log_stdio_set_flush(backend, LOG_FLUSH_LEVEL, 0);
+	size = logstdio_test_size(LOGSTDIO_TEST_FILE);
+	info("buffered");
+	assert(logstdio_test_size(LOGSTDIO_TEST_FILE) == size);
+	log_flush();
+	assert(logstdio_test_size(LOGSTDIO_TEST_FILE) > size);
+	ok = log_stdio_set_flush(log_register_backend(logstdio_test_callback,
+			NULL, NULL), LOG_FLUSH_LINE, 0);
+	assert(!ok); // (not a stdio backend)
+	log_unregister_backend(logstdio_test_callback, NULL);
+	ok = log_stdio("/nonexistent/directory/file.log") == NULL;
+	assert(ok);
+	log_shutdown();
+	ok = log_stdio_set_flush(backend, LOG_FLUSH_LINE, 0);
+	assert(!ok); // (not registered anymore)
+	log_stdio("stdout");
+	remove(LOGSTDIO_TEST_FILE);
+	free(long_text);
+}
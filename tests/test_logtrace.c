@@ -0,0 +1,119 @@
+/*
+ * test_logtrace.c
+ * tests for the trace (Chrome Trace Event Format) exporter
+ */
+
+#include "logtrace.h"
+
+#define LOGTRACE_TEST_FILE		"test_logtrace.json"
+#define LOGTRACE_TEST_BASENAME	"test_logtrace"
+#define LOGTRACE_TEST_THREADS	2
+
+static THREAD_FUNC logtrace_test_thread(void *arg) {
+	log_enter("test", "outer");
+	log_enter("test", "inner \"quoted\"");
+	log_check("test", "logtrace");
+	log_leave("test", "inner");
+	log_leave("test", "outer");
+	thread_exit(0);
+}
+
+// count the occurrences of a substring
+static int logtrace_test_count(const char *text, const char *substr) {
+	int result = 0;
+	while ((text = strstr(text, substr))) {
+		result++;
+		text += strlen(substr);
+	}
+	return result;
+}
+
+// read the contents of a file (result needs to be free()d)
+static char *logtrace_test_read(FILE *file) {
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	char *result = malloc(size + 1);
+	rewind(file);
+	size_t n = fread(result, 1, size, file);
+	assert(n == (size_t)size);
+	result[size] = '\0';
+	return result;
+}
+
+// verify the JSON output of the two threads
+static void logtrace_test_verify(const char *json) {
+	assert(json[0] == '[');
+	assert(strcmp(json + strlen(json) - 2, "]\n") == 0);
+	assert(logtrace_test_count(json, "\"ph\":\"B\"") == 2 * LOGTRACE_TEST_THREADS);
+	assert(logtrace_test_count(json, "\"ph\":\"E\"") == 2 * LOGTRACE_TEST_THREADS);
+	assert(logtrace_test_count(json, "\"args\":{\"pass\":") == LOGTRACE_TEST_THREADS);
+	assert(logtrace_test_count(json, "inner \\\"quoted\\\"") == LOGTRACE_TEST_THREADS);
+
+	// each thread gets a track of its own
+	const char *first = strstr(json, "\"tid\":");
+	assert(first != NULL);
+	unsigned int tid, other;
+	sscanf(first, "\"tid\":%u", &tid);
+	const char *pos = first;
+	bool distinct = false;
+	while ((pos = strstr(pos + 1, "\"tid\":"))) {
+		sscanf(pos, "\"tid\":%u", &other);
+		if (other != tid) distinct = true;
+	}
+	assert(distinct);
+}
+
+void test_logtrace(void) {
+	pthread_t threads[LOGTRACE_TEST_THREADS];
+	int i;
+
+	// streaming backend
+	log_shutdown();
+	remove(LOGTRACE_TEST_FILE);
+	backend_list_t *backend = log_trace(LOGTRACE_TEST_FILE);
+	assert(backend != NULL);
+	log_backend_set_threshold(backend, LOG_LEVEL_CHECKPOINT);
+	for (i = 0; i < LOGTRACE_TEST_THREADS; i++)
+		threads[i] = thread_start(logtrace_test_thread, NULL, NULL);
+	for (i = 0; i < LOGTRACE_TEST_THREADS; i++)
+		thread_wait(threads[i], 10000);
+	info("not part of the trace");
+	log_shutdown();
+	log_stdio("stdout");
+
+	FILE *file = fopen(LOGTRACE_TEST_FILE, "r");
+	assert(file != NULL);
+	char *json = logtrace_test_read(file);
+	fclose(file);
+	logtrace_test_verify(json);
+	assert(strstr(json, "not part of the trace") == NULL);
+	free(json);
+	remove(LOGTRACE_TEST_FILE);
+
+	// offline conversion of a segment file
+	char filename[FILENAME_MAX];
+	logfile_segment_name(filename, sizeof(filename), LOGTRACE_TEST_BASENAME, 0);
+	remove(filename);
+	log_shutdown();
+	log_file(LOGTRACE_TEST_BASENAME, 0, 1);
+	for (i = 0; i < LOGTRACE_TEST_THREADS; i++)
+		threads[i] = thread_start(logtrace_test_thread, NULL, NULL);
+	for (i = 0; i < LOGTRACE_TEST_THREADS; i++)
+		thread_wait(threads[i], 10000);
+	log_shutdown();
+	log_stdio("stdout");
+
+	file = tmpfile();
+	int count = logtrace_convert(filename, file);
+	assert(count == 5 * LOGTRACE_TEST_THREADS);
+	json = logtrace_test_read(file);
+	fclose(file);
+	logtrace_test_verify(json);
+	free(json);
+	remove(filename);
+
+	file = tmpfile();
+	count = logtrace_convert("test_logtrace.c", file); // (not a segment)
+	assert(count < 0);
+	fclose(file);
+}
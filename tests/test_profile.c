@@ -0,0 +1,122 @@
+/*
+ * test_profile.c
+ * tests for the profiling zones
+ */
+
+#include "profile.h"
+
+#define PROFILE_TEST_CALLS		1000
+#define PROFILE_TEST_THREADS	4
+
+// some busy work, with a profiling scope
+static void profiletest_work(int n) {
+	PROFILE_SCOPE("profiletest_work");
+	volatile unsigned int sink = 0;
+	int i;
+	for (i = 0; i < n; i++) sink += i;
+}
+
+static THREAD_FUNC profiletest_thread(void *arg) {
+	int i;
+	for (i = 0; i < PROFILE_TEST_CALLS; i++) profiletest_work(i % 10);
+#if _WINDOWS
+	profile_flush(); // (elsewhere, the buffer gets merged on thread exit)
+#endif
+	thread_exit(0);
+}
+
+// backend that checks summary messages (userptr = number of zones seen)
+static void profiletest_callback(msgpack_sbuffer *logmsg, LOG_LEVEL level,
+		void *userptr)
+{
+	msgpack_unpacked msg;
+	msgpack_unpacked_init(&msg);
+	if (msgpack_unpack_next(&msg, logmsg->data, logmsg->size, NULL)
+			== MSGPACK_UNPACK_SUCCESS)
+	{
+		msgpack_object *attachment = &msg.data.via.array.ptr[6];
+		assert(attachment->type == MSGPACK_OBJECT_ARRAY);
+		*(size_t *)userptr += attachment->via.array.size;
+		if (attachment->via.array.size > 0) {
+			msgpack_object *zone = &attachment->via.array.ptr[0];
+			assert(zone->type == MSGPACK_OBJECT_MAP && zone->via.map.size == 6);
+		}
+	}
+	msgpack_unpacked_destroy(&msg);
+}
+
+void test_profile(void) {
+	profile_stats_t stats;
+	uint64_t histogram = 0;
+	size_t zones = 0;
+	int i;
+
+	profile_reset();
+	bool ok = profile_get_stats("profiletest_work", &stats);
+	assert(!ok); // (zone not used yet)
+
+	for (i = 0; i < PROFILE_TEST_CALLS; i++) profiletest_work(100);
+	ok = profile_get_stats("profiletest_work", &stats);
+	assert(ok && stats.count == PROFILE_TEST_CALLS);
+	assert(stats.min_ns <= stats.max_ns && stats.max_ns <= stats.total_ns);
+	assert(stats.total_ns >= stats.count * stats.min_ns);
+	for (i = 0; i < PROFILE_BUCKETS; i++) histogram += stats.histogram[i];
+	assert(histogram == stats.count);
+
+	// explicit begin / end
+	PROFILE_BEGIN(outer, "profiletest_outer");
+	profiletest_work(10);
+	PROFILE_END(outer);
+	profile_get_stats("profiletest_outer", &stats);
+	assert(stats.count == 1);
+
+	// multiple threads
+	profile_reset();
+	pthread_t threads[PROFILE_TEST_THREADS];
+	for (i = 0; i < PROFILE_TEST_THREADS; i++)
+		threads[i] = thread_start(profiletest_thread, NULL, NULL);
+	for (i = 0; i < PROFILE_TEST_THREADS; i++)
+		thread_wait(threads[i], 10000);
+	profile_get_stats("profiletest_work", &stats);
+	assert(stats.count == PROFILE_TEST_THREADS * PROFILE_TEST_CALLS);
+
+	// summary (as a log message attachment), resetting the statistics
+	log_shutdown();
+	log_register_backend(profiletest_callback, NULL, &zones);
+	int count = profile_summary(true);
+	assert(count == 1 && zones == 1);
+	count = profile_summary(true);
+	assert(count == 0 && zones == 1);
+	profile_get_stats("profiletest_work", &stats);
+	assert(stats.count == 0);
+
+	// automatic summary
+	profile_configure(1, LOG_LEVEL_INFO);
+	Sleep(110); // (beyond the flush interval)
+	profiletest_work(1);
+	assert(zones == 2);
+	profile_configure(0, LOG_LEVEL_INFO);
+	log_shutdown();
+	log_stdio("stdout");
+
+	// Lua bindings
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	luaopen_profile(L);
+	ok = luautils_dostring(L,
+		"local zone = profile_zone_C('lua zone')\n"
+		"assert(zone and profile_zone_C('lua zone') == zone)\n"
+		"for i = 1, 10 do\n"
+		"	local t = profile_begin_C()\n"
+		"	local x = 0; for j = 1, 1000 do x = x + j end\n"
+		"	profile_end_C(zone, t)\n"
+		"end\n"
+		"local stats = profile_stats_C('lua zone')\n"
+		"assert(stats.count == 10 and stats.min_ns <= stats.max_ns)\n"
+		"assert(#stats.histogram == 32)\n"
+		"assert(profile_stats_C('no such zone') == nil)\n"
+		"profile_end_C(12345, 0) -- (invalid zone, ignored)\n");
+	assert(ok);
+	lua_close(L);
+	profile_reset();
+}
@@ -0,0 +1,114 @@
+/*
+ * test_rescache.c
+ * tests for the (compiled) resource cache, see rescache.c
+ */
+
+#include "rescache.h"
+#include "symbols.h"
+#include "utils.h"
+
+// a minimal gzip "resource": the script as a stored (uncompressed) deflate block
+static size_t rescache_test_gzip(char *buffer, const char *script, uint16_t len) {
+	static const char header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3 };
+	memcpy(buffer, header, sizeof(header));
+	buffer[10] = 1; // final block, stored
+	buffer[11] = len & 0xFF;
+	buffer[12] = len >> 8;
+	buffer[13] = ~len & 0xFF;
+	buffer[14] = ~len >> 8;
+	memcpy(buffer + 15, script, len);
+	memset(buffer + 15 + len, 0, 8); // (CRC32 and size, not checked)
+	return 15 + len + 8;
+}
+
+// load and run a resource in a new Lua state, returns the (integer) result
+static int rescache_test_run(const char *data, size_t len, const char *name) {
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	int result = -1;
+	if (load_decompressed_buffer(L, data, len, name) == 0
+		&& lua_pcall(L, 0, 1, 0) == 0)
+			result = lua_tointeger(L, -1);
+	else
+		error("rescache_test_run(%s): %s", name, lua_tostring(L, -1));
+	lua_close(L);
+	return result;
+}
+
+void test_rescache(void) {
+	static const char plain[] = "local t = {} for i = 1, 10 do t[i] = i end return #t";
+	char gzipped[256];
+	size_t gzipped_len = rescache_test_gzip(gzipped, "return 6 * 7", 12);
+	rescache_stats_t stats;
+
+	rescache_clear();
+	assert(rescache_test_run(gzipped, gzipped_len, "gzipped.lua") == 42);
+	assert(rescache_test_run(plain, sizeof(plain) - 1, "plain.lua") == 10);
+	rescache_get_stats(&stats);
+	assert(stats.misses == 2 && stats.hits == 0 && stats.entries == 2);
+
+	// more Lua states, without inflating (or parsing) again
+	int i;
+	for (i = 0; i < 3; i++) {
+		assert(rescache_test_run(gzipped, gzipped_len, "gzipped.lua") == 42);
+		assert(rescache_test_run(plain, sizeof(plain) - 1, "plain.lua") == 10);
+	}
+	rescache_get_stats(&stats);
+	assert(stats.misses == 2 && stats.hits == 6 && stats.entries == 2);
+
+	// the chunk name survives (bytecode includes debug info)
+	static const char failing[] = "\nerror('oops')";
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	for (i = 0; i < 2; i++) {
+		assert(load_decompressed_buffer(L, failing, sizeof(failing) - 1, "failing.lua") == 0);
+		assert(lua_pcall(L, 0, 0, 0) != 0);
+		assert(strcmp(lua_tostring(L, -1), "failing.lua:2: oops") == 0);
+		lua_pop(L, 1);
+	}
+	lua_close(L);
+
+	// limit (evicts the least recently used entries)
+	rescache_get_stats(&stats);
+	rescache_set_limit(stats.bytes - 1);
+	rescache_get_stats(&stats);
+	assert(stats.entries == 2 && stats.evictions == 1);
+	assert(rescache_test_run(gzipped, gzipped_len, "gzipped.lua") == 42);
+	rescache_get_stats(&stats);
+	assert(stats.entries == 2 && stats.evictions == 2 && stats.misses == 4);
+
+	// disabled cache
+	rescache_set_limit(0);
+	assert(rescache_test_run(plain, sizeof(plain) - 1, "plain.lua") == 10);
+	rescache_get_stats(&stats);
+	assert(stats.entries == 0 && stats.bytes == 0);
+
+	rescache_set_limit(RESCACHE_LIMIT);
+
+	// stripped bytecode (see objwrap.lua), plain and gzipped
+	char bytecode[256];
+	size_t bytecode_len;
+	L = luaL_newstate();
+	luaL_openlibs(L);
+	int failed = luaL_dostring(L, "return string.dump(loadstring('return 6 * 7'), true)");
+	const char *dump = lua_tolstring(L, -1, &bytecode_len);
+	assert(!failed && dump && bytecode_len < sizeof(bytecode)
+		   && is_lua_bytecode(dump, bytecode_len));
+	assert(!is_lua_bytecode(dump, 2)); // (too short for the signature)
+	memcpy(bytecode, dump, bytecode_len);
+	lua_close(L);
+	rescache_stats_t before;
+	rescache_get_stats(&before);
+	assert(rescache_test_run(bytecode, bytecode_len, "bytecode.lua") == 42);
+	rescache_get_stats(&stats);
+	assert(stats.hits == before.hits && stats.misses == before.misses); // (not cached)
+	char gzipped_bc[300];
+	size_t gzipped_bc_len = rescache_test_gzip(gzipped_bc, bytecode, bytecode_len);
+	for (i = 0; i < 2; i++)
+		assert(rescache_test_run(gzipped_bc, gzipped_bc_len, "bytecode.lua") == 42);
+	rescache_get_stats(&stats);
+	assert(stats.hits == before.hits + 1 && stats.misses == before.misses + 1);
+
+	rescache_clear();
+	info("test_rescache: ok");
+}
@@ -0,0 +1,166 @@
+/*
+ * test_resources.c
+ * tests for the embedded resource index, see resources.c
+ */
+
+#include "codec.h"
+#include "rescache.h"
+#include "resources.h"
+#include "symbols.h"
+#include "utils.h"
+
+static const char resource_banner[] = "return \"banner\"";
+static const char resource_test[] = "return 40 + 2";
+
+// an index with the same layout that objwrap.lua generates (resindex.c)
+static const resource_t resources_test_table[] = {
+	{ "core/banner.lua", "core_banner_lua", resource_banner,
+		sizeof(resource_banner) - 1, 0, 0x00000000 }, // (bad checksum)
+	{ "core/test.lua", "core_test_lua", resource_test,
+		sizeof(resource_test) - 1, 0, 0xe544076e },
+	{ NULL }
+};
+static const resource_index_t resources_test_index = { 2, resources_test_table };
+
+// a large script, gzipped: "local x = 0", 20000 lines "x = x + 1", "return x"
+// (that's about 200 KB, i.e. much more than the decompression window)
+static const char resource_large_gz[] = {
+	0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0xFF, 0xED, 0xC6, 0xB1, 0x09, 0x80, 0x40,
+	0x14, 0x05, 0xB0, 0xFE, 0xA6, 0x78, 0xBD, 0x8D, 0x0E, 0xE0, 0x30, 0x22, 0x76, 0x87, 0xC2, 0xA1,
+	0xF0, 0xC7, 0x17, 0x37, 0x70, 0x80, 0x34, 0x21, 0xFD, 0xDA, 0xB7, 0x9E, 0xCA, 0x9A, 0xB9, 0x7D,
+	0x56, 0xA6, 0x2C, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0xF6, 0x7B, 0xE3, 0xB8, 0x9F, 0x71, 0xA6, 0xDA, 0x0B, 0x1E,
+	0x7E, 0x0A, 0x4F, 0x55, 0x0D, 0x03, 0x00,
+};
+#define RESOURCE_LARGE_SIZE	200021
+
+// streaming decompression, and loading resources through it
+static void test_resources_stream(void) {
+	gzip_stream_t *stream = gzip_stream_open(resource_large_gz, sizeof(resource_large_gz));
+	assert(stream != NULL);
+	const char *chunk;
+	size_t size, total = 0, chunks = 0;
+	while ((chunk = gzip_stream_read(stream, &size))) {
+		assert(size > 0 && size <= 32768);
+		assert(total > 0 || memcmp(chunk, "local x = 0\n", 12) == 0);
+		total += size;
+		chunks++;
+	}
+	assert(gzip_stream_done(stream));
+	assert(total == RESOURCE_LARGE_SIZE && chunks > 1);
+	gzip_stream_close(stream);
+
+	// truncated data
+	stream = gzip_stream_open(resource_large_gz, sizeof(resource_large_gz) / 2);
+	assert(stream != NULL);
+	while (gzip_stream_read(stream, &size)) continue;
+	assert(!gzip_stream_done(stream));
+	gzip_stream_close(stream);
+
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	luaopen_symbols(L);
+	rescache_set_limit(0); // (make sure this doesn't come from the cache)
+	assert(load_decompressed_buffer(L, resource_large_gz, sizeof(resource_large_gz),
+			"large.lua") == 0);
+	assert(lua_pcall(L, 0, 1, 0) == 0 && lua_tointeger(L, -1) == 20000);
+	rescache_set_limit(RESCACHE_LIMIT);
+	lua_close(L);
+}
+
+// LZ4-compressed 'return "abababababababababababab"', see objwrap.lua: ten
+// literals, an (overlapping) match of 18 bytes at offset 2, then five literals
+static const char resource_lz4[] =
+	"\x1BLZ4!\0\0\0\xAEreturn \"ab\x02\0Pabab\"";
+#define RESOURCE_LZ4_SCRIPT	"return \"abababababababababababab\""
+
+static void test_resources_codecs(void) {
+	const size_t len = sizeof(resource_lz4) - 1;
+	char output[64], corrupt[sizeof(resource_lz4)];
+	size_t size;
+
+	assert(codec_find(resource_lz4, len) == &codec_lz4);
+	assert(codec_find(resource_large_gz, sizeof(resource_large_gz)) == &codec_gzip);
+	assert(codec_find(resource_test, strlen(resource_test)) == NULL);
+	assert(codec_lz4.size(resource_lz4, len) == strlen(RESOURCE_LZ4_SCRIPT));
+	assert(codec_gzip.size(resource_large_gz, sizeof(resource_large_gz)) == RESOURCE_LARGE_SIZE);
+
+	char *script = codec_decompress(&codec_lz4, resource_lz4, len, &size);
+	assert(script && size == strlen(RESOURCE_LZ4_SCRIPT));
+	assert(memcmp(script, RESOURCE_LZ4_SCRIPT, size) == 0);
+	free(script);
+	script = codec_decompress(&codec_gzip, resource_large_gz, sizeof(resource_large_gz), &size);
+	assert(script && size == RESOURCE_LARGE_SIZE);
+	assert(memcmp(script + size - 9, "return x\n", 9) == 0);
+	free(script);
+
+	// corrupt data mustn't get out of bounds
+	assert(!lz4_decompress(resource_lz4, len - 1, output, strlen(RESOURCE_LZ4_SCRIPT))); // (truncated)
+	assert(!lz4_decompress(resource_lz4, len, output, 32)); // (wrong size)
+	memcpy(corrupt, resource_lz4, len);
+	corrupt[19] = 20; // (offset before the start of the output)
+	assert(!lz4_decompress(corrupt, len, output, strlen(RESOURCE_LZ4_SCRIPT)));
+	memcpy(corrupt, resource_lz4, len);
+	corrupt[8] = 0xAF; // (match too long)
+	assert(!lz4_decompress(corrupt, len, output, strlen(RESOURCE_LZ4_SCRIPT)));
+
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	luaopen_symbols(L);
+	assert(load_decompressed_buffer(L, resource_lz4, len, "lz4.lua") == 0);
+	assert(lua_pcall(L, 0, 1, 0) == 0);
+	assert(strcmp(lua_tostring(L, -1), "abababababababababababab") == 0);
+	lua_close(L);
+}
+
+void test_resources(void) {
+	const resource_index_t *index = &resources_test_index;
+	const resource_t *res = resource_lookup(index, "core/test.lua");
+	assert(res == &resources_test_table[1]);
+	assert(resource_lookup(index, "core\\test.lua") == res);
+	assert(resource_lookup(index, "core/banner.lua") == &resources_test_table[0]);
+	assert(resource_lookup(index, "core/missing.lua") == NULL);
+	assert(resource_lookup(index, "") == NULL);
+	assert(resource_verify(res));
+	assert(!resource_verify(&resources_test_table[0]));
+	assert(resource_checksum("", 0) == 0x811C9DC5);
+
+	// (the sandbox doesn't link a generated index, so this one is empty)
+	assert(resource_find("core/test.lua") == NULL);
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	luaopen_symbols(L);
+	int failed = luaL_dostring(L,
+		"local count = 0\n"
+		"for name, info in dll_resources_C() do count = count + 1 end\n"
+		"return count");
+	assert(!failed && lua_tointeger(L, -1) == (lua_Integer)lcfr_resource_index.count);
+	lua_close(L);
+
+	test_resources_stream();
+	test_resources_codecs();
+	info("test_resources: ok");
+}
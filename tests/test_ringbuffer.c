@@ -0,0 +1,207 @@
+/*
+ * test_ringbuffer.c
+ * tests for the byte ring buffer and the SPSC ring buffer
+ */
+
+#include "ringbuffer.h"
+#include "timing.h"
+
+// push a record consisting of `size` copies of the character `c`
+static void *ringtest_push(bytering_t *rb, char c, size_t size) {
+	char buffer[64];
+	memset(buffer, c, size);
+	return bytering_push(rb, buffer, size);
+}
+
+// check that a record has the expected size and contents
+static bool ringtest_check(const char *record, size_t size, char c,
+		size_t expected)
+{
+	size_t i;
+	if (!record || size != expected) return false;
+	for (i = 0; i < size; i++)
+		if (record[i] != c) return false;
+	return true;
+}
+
+void test_ringbuffer(void) {
+	bytering_t rb;
+	size_t size, i;
+	char *record;
+
+	bool ok = bytering_init(&rb, 100);
+	assert(ok && rb.capacity == 128); // (rounded up to a power of two)
+	assert(bytering_tail(&rb, NULL) == NULL && bytering_head(&rb, NULL) == NULL);
+	assert(bytering_next(&rb, NULL, NULL) == NULL);
+
+	// records of 24 bytes occupy 32 bytes each (with header), four fit
+	for (i = 0; i < 4; i++)
+		ringtest_push(&rb, 'a' + i, 24);
+	assert(rb.count == 4);
+	record = bytering_tail(&rb, &size);
+	assert(ringtest_check(record, size, 'a', 24));
+	record = bytering_head(&rb, &size);
+	assert(ringtest_check(record, size, 'd', 24));
+	record = bytering_element(&rb, 2, &size);
+	assert(ringtest_check(record, size, 'c', 24));
+	assert(bytering_element(&rb, 4, NULL) == NULL);
+
+	// the next record overwrites the oldest one
+	ringtest_push(&rb, 'e', 24);
+	assert(rb.count == 4);
+	record = bytering_tail(&rb, &size);
+	assert(ringtest_check(record, size, 'b', 24));
+
+	ringtest_push(&rb, 'f', 24);
+	ringtest_push(&rb, 'g', 24);
+	assert(rb.count == 4);
+
+	// a record that doesn't fit at the end of the region wraps to the start
+	// (padding the remaining space), discarding as many records as needed
+	ringtest_push(&rb, 'h', 40);
+	assert(rb.count == 2);
+	record = bytering_tail(&rb, &size);
+	assert(ringtest_check(record, size, 'g', 24));
+	record = bytering_head(&rb, &size);
+	assert(ringtest_check(record, size, 'h', 40));
+	assert(record == rb.data + 8); // (at the start of the memory region)
+	ringtest_push(&rb, 'i', 1);
+	assert(rb.count == 3);
+
+	// iterate records from tail to head (across the padding)
+	static const char expected[] = "ghi";
+	static const size_t sizes[] = {24, 40, 1};
+	i = 0;
+	record = NULL;
+	while ((record = bytering_next(&rb, record, &size))) {
+		assert(i < 3 && ringtest_check(record, size, expected[i], sizes[i]));
+		i++;
+	}
+	assert(i == 3);
+
+	// a copy has the same records (and needs the same capacity)
+	bytering_t copy;
+	ok = bytering_init(&copy, 128);
+	assert(ok);
+	ok = bytering_copy(&copy, &rb);
+	assert(ok && copy.count == 3);
+	i = 0;
+	record = NULL;
+	while ((record = bytering_next(&copy, record, &size))) {
+		assert(i < 3 && ringtest_check(record, size, expected[i], sizes[i]));
+		i++;
+	}
+	assert(i == 3);
+	bytering_done(&copy);
+	ok = bytering_init(&copy, 256);
+	assert(ok && !bytering_copy(&copy, &rb));
+	bytering_done(&copy);
+
+	// pop until empty
+	bytering_pop(&rb);
+	record = bytering_tail(&rb, &size);
+	assert(ringtest_check(record, size, 'h', 40));
+	record = bytering_element(&rb, 1, &size);
+	assert(ringtest_check(record, size, 'i', 1));
+	bytering_pop(&rb);
+	bytering_pop(&rb);
+	assert(rb.count == 0 && bytering_tail(&rb, NULL) == NULL);
+	bytering_pop(&rb); // (no-op)
+
+	// oversized records get rejected, a record may use all of the memory
+	assert(bytering_push(&rb, NULL, 128) == NULL);
+	ringtest_push(&rb, 'i', 8);
+	record = bytering_push(&rb, NULL, 120); // (reserve only)
+	assert(record != NULL && rb.count == 1);
+	memset(record, 'j', 120);
+	record = bytering_head(&rb, &size);
+	assert(ringtest_check(record, size, 'j', 120));
+
+	// many records of varying size
+	bytering_clear(&rb);
+	assert(rb.count == 0);
+	for (i = 0; i < 1000; i++) {
+		record = ringtest_push(&rb, 'A' + i % 26, i % 50);
+		assert(record != NULL);
+		record = bytering_head(&rb, &size);
+		assert(ringtest_check(record, size, 'A' + i % 26, i % 50));
+	}
+	// (iteration has to be consistent with the record count)
+	i = 0;
+	record = NULL;
+	while ((record = bytering_next(&rb, record, &size))) {
+		assert(size < 50 && ringtest_check(record, size, size ? record[0] : 0, size));
+		i++;
+	}
+	assert(i == rb.count && i > 0);
+	bytering_done(&rb);
+	assert(rb.data == NULL && rb.capacity == 0);
+}
+
+#define SPSCTEST_COUNT	100000
+
+// producer thread, pushes the numbers 1..SPSCTEST_COUNT (as pointers)
+static THREAD_FUNC spsctest_producer(void *arg) {
+	spscring_t *rb = arg;
+	void *batch[7];
+	size_t i, n, value = 1;
+	while (value <= SPSCTEST_COUNT) {
+		if (value % 3) { // (mix single and batch pushes)
+			while (!spscring_push(rb, (void *)value)) ATOMICS_YIELD();
+			value++;
+			continue;
+		}
+		for (n = 0; n < 7 && value + n <= SPSCTEST_COUNT; n++)
+			batch[n] = (void *)(value + n);
+		for (i = 0; i < n; i += spscring_push_batch(rb, batch + i, n - i))
+			ATOMICS_YIELD();
+		value += n;
+		if (value % 1000 < 7) Sleep(1); // (make the consumer block)
+	}
+	thread_exit(0);
+}
+
+void test_spscring(void) {
+	spscring_t rb;
+	void *batch[16];
+	size_t i, n, expected = 1;
+
+	bool ok = spscring_init(&rb, 100, NULL);
+	assert(ok && rb.mask == 127);
+	assert(spscring_pop(&rb) == NULL && spscring_count(&rb) == 0);
+	ok = spscring_wait(&rb, 1);
+	assert(!ok); // (timeout)
+
+	// single-threaded: fill up, the buffer doesn't overwrite elements
+	for (i = 1; i <= 128; i++) {
+		ok = spscring_push(&rb, (void *)i);
+		assert(ok);
+	}
+	ok = spscring_push(&rb, (void *)i);
+	assert(!ok && spscring_count(&rb) == 128);
+	n = spscring_push_batch(&rb, batch, 16);
+	assert(n == 0);
+	n = spscring_pop_batch(&rb, batch, 16);
+	assert(n == 16 && batch[0] == (void *)1 && batch[15] == (void *)16);
+	n = spscring_push_batch(&rb, batch, 16);
+	assert(n == 16 && spscring_count(&rb) == 128);
+	for (i = 17; i <= 128; i++) {
+		void *element = spscring_pop(&rb);
+		assert(element == (void *)i);
+	}
+	ok = spscring_wait(&rb, 0);
+	assert(ok);
+	n = spscring_pop_batch(&rb, batch, 16);
+	assert(n == 16 && batch[0] == (void *)1 && spscring_count(&rb) == 0);
+
+	// producer and consumer threads
+	pthread_t producer = thread_start(spsctest_producer, NULL, &rb);
+	while (expected <= SPSCTEST_COUNT && spscring_wait(&rb, 5000)) {
+		n = spscring_pop_batch(&rb, batch, expected % 2 ? 16 : 1);
+		for (i = 0; i < n; i++, expected++)
+			assert(batch[i] == (void *)expected); // (order must be kept)
+	}
+	assert(expected == SPSCTEST_COUNT + 1);
+	thread_wait(producer, 10000);
+	spscring_done(&rb);
+}